@@ -285,6 +285,13 @@ static ALWAYS_INLINE uint64_t rdtsc(void) {
     return ((uint64_t)hi << 32) | lo;
 }
 
+/* Nominal TSC rate used for time keeping (the TSC is not calibrated) */
+#define TSC_PER_US          2000ULL
+
+static ALWAYS_INLINE uint64_t rdtsc_us(void) {
+    return rdtsc() / TSC_PER_US;
+}
+
 /* ============================================================================
  * GDT / IDT Structures
  * ============================================================================ */
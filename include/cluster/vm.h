@@ -10,6 +10,10 @@
 #include <lib/types.h>
 #include <cluster/node.h>
 #include <vmm/vcpu.h>
+#include <vmm/ept.h>
+#include <net/ratelimit.h>
+
+struct virtio_net;
 
 /* ============================================================================
  * VM Constants
@@ -68,6 +72,10 @@ typedef struct vm_nic_config {
     uint32_t type;
     uint32_t vlan;
     bool enabled;
+    
+    /* QoS, as seen from the guest */
+    net_rate_config_t tx_limit;
+    net_rate_config_t rx_limit;
 } vm_nic_config_t;
 
 typedef struct vm_config {
@@ -164,6 +172,10 @@ typedef struct virtual_machine {
     vcpu_t *vcpus[VM_MAX_VCPUS];
     uint32_t vcpu_count;
     
+    /* Guest address space and the devices backing config.nics, while running */
+    ept_context_t *ept;
+    struct virtio_net *nic_devs[VM_MAX_NICS];
+    
     /* Host node */
     cluster_node_t *host_node;
     uint32_t host_node_id;
@@ -270,6 +282,22 @@ const char *vm_get_state_string(uint32_t state);
  */
 void virt_vm_update_stats(virtual_machine_t *vm);
 
+/**
+ * virt_vm_set_nic_limit - Set the rate limits of a NIC
+ * @vm: VM
+ * @nic: NIC index
+ * @tx: Guest transmit limit, or NULL for unlimited
+ * @rx: Guest receive limit, or NULL for unlimited
+ * 
+ * Stored in the configuration and applied at once if the NIC's device
+ * is attached; a NIC attached later, on VM start, picks them up.
+ * 
+ * Returns 0 on success, -1 if the NIC does not exist
+ */
+int virt_vm_set_nic_limit(virtual_machine_t *vm, uint32_t nic,
+                          const net_rate_config_t *tx,
+                          const net_rate_config_t *rx);
+
 /* ============================================================================
  * Migration API
  * ============================================================================ */
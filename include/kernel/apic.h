@@ -78,6 +78,7 @@ void lapic_send_init(uint32_t dest);
 void lapic_send_startup(uint32_t dest, uint8_t vector);
 void lapic_timer_init(uint8_t vector, bool periodic);
 void lapic_timer_set(uint32_t count);
+bool lapic_timer_active(void);      /* Periodic tick on this CPU: hlt wakes */
 uint32_t lapic_read(uint32_t reg);
 void lapic_write(uint32_t reg, uint32_t value);
 
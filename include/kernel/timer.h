@@ -0,0 +1,60 @@
+/*
+ * PureVisor - Host Timer Header
+ * 
+ * One-shot deferred callbacks, run from the VM exit path and idle loop
+ */
+
+#ifndef _PUREVISOR_TIMER_H
+#define _PUREVISOR_TIMER_H
+
+#include <lib/types.h>
+
+/* ============================================================================
+ * Structures
+ * ============================================================================ */
+
+typedef void (*ktimer_fn_t)(void *ctx);
+
+typedef struct ktimer {
+    uint64_t expires;           /* Deadline (rdtsc_us) */
+    ktimer_fn_t fn;
+    void *ctx;
+    bool armed;
+    struct ktimer *next;        /* Pending list, sorted by deadline */
+} ktimer_t;
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+/**
+ * ktimer_init - Initialize a timer
+ * @timer: Timer
+ * @fn: Callback, invoked without locks held
+ * @ctx: Callback argument
+ */
+void ktimer_init(ktimer_t *timer, ktimer_fn_t fn, void *ctx);
+
+/**
+ * ktimer_arm - Arm or re-arm a timer
+ * @timer: Timer
+ * @delay_us: Microseconds from now
+ */
+void ktimer_arm(ktimer_t *timer, uint64_t delay_us);
+
+/**
+ * ktimer_cancel - Disarm a timer if it is pending
+ * @timer: Timer
+ */
+void ktimer_cancel(ktimer_t *timer);
+
+/**
+ * ktimer_run - Run expired timers
+ * 
+ * Called on every VM exit, from the idle loop and by synchronous block
+ * waiters; the resolution of a timer is therefore bounded by how often
+ * the host gets control.
+ */
+void ktimer_run(void);
+
+#endif /* _PUREVISOR_TIMER_H */
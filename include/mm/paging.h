@@ -160,6 +160,16 @@ static inline void paging_flush_tlb_all(void)
     __asm__ __volatile__("mov %0, %%cr3" :: "r"(cr3));
 }
 
+/**
+ * paging_map_io - Map device registers into the kernel
+ * @phys: Physical address, need not be page aligned
+ * @size: Bytes to map
+ * 
+ * Uncached, in a window reserved for device mappings; never unmapped.
+ * Returns the virtual address of @phys, or NULL on failure
+ */
+void *paging_map_io(phys_addr_t phys, size_t size);
+
 /**
  * paging_get_kernel_context - Get kernel VM context
  */
@@ -0,0 +1,95 @@
+/*
+ * PureVisor - Flow Classification Header
+ * 
+ * Header dissection and Toeplitz (RSS) flow hashing
+ */
+
+#ifndef _PUREVISOR_NET_FLOW_H
+#define _PUREVISOR_NET_FLOW_H
+
+#include <lib/types.h>
+
+/* ============================================================================
+ * RSS Constants
+ * ============================================================================ */
+
+#define NET_RSS_KEY_SIZE        40
+#define NET_RSS_INDIR_SIZE      128
+
+/* Hash types (values match the virtio-net RSS hash type bits) */
+#define NET_RSS_HASH_IPV4       BIT(0)
+#define NET_RSS_HASH_TCPV4      BIT(1)
+#define NET_RSS_HASH_UDPV4      BIT(2)
+#define NET_RSS_HASH_IPV6       BIT(3)
+#define NET_RSS_HASH_TCPV6      BIT(4)
+#define NET_RSS_HASH_UDPV6      BIT(5)
+
+#define NET_RSS_HASH_ALL        (NET_RSS_HASH_IPV4 | NET_RSS_HASH_TCPV4 | \
+                                 NET_RSS_HASH_UDPV4 | NET_RSS_HASH_IPV6 | \
+                                 NET_RSS_HASH_TCPV6 | NET_RSS_HASH_UDPV6)
+
+/* Bytes of a frame needed to classify it (Ethernet + VLANs + IPv6 + ports) */
+#define NET_FLOW_PARSE_LEN      128
+
+/* Default Toeplitz key from the Microsoft RSS specification */
+extern const uint8_t net_rss_default_key[NET_RSS_KEY_SIZE];
+
+/* ============================================================================
+ * Flow Keys
+ * ============================================================================ */
+
+typedef struct net_flow_keys {
+    uint16_t l3_proto;          /* ETH_P_IP, ETH_P_IPV6 or 0 */
+    uint8_t l4_proto;           /* IPPROTO_* or 0 */
+    uint8_t addr_len;           /* 4 or 16 */
+    uint16_t l3_off;            /* Network header offset */
+    uint16_t l4_off;            /* Transport header offset, 0 if none */
+    uint16_t vlan;              /* Outer VLAN ID, 0 if untagged */
+    uint16_t sport;             /* Network byte order */
+    uint16_t dport;
+    uint8_t src[16];
+    uint8_t dst[16];
+} net_flow_keys_t;
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+/**
+ * net_flow_dissect - Extract the flow keys of an Ethernet frame
+ * @frame: Start of the Ethernet header
+ * @len: Bytes available (NET_FLOW_PARSE_LEN is enough)
+ * @keys: Output keys
+ * 
+ * Returns true for IPv4/IPv6 frames, false otherwise
+ */
+bool net_flow_dissect(const uint8_t *frame, size_t len, net_flow_keys_t *keys);
+
+/**
+ * net_flow_reverse - Swap source and destination of a flow
+ * @keys: Flow keys
+ * 
+ * Used to key transmitted frames by the direction they are received in.
+ */
+void net_flow_reverse(net_flow_keys_t *keys);
+
+/**
+ * net_toeplitz_hash - Compute a Toeplitz hash
+ * @key: Secret key, at least @len + 4 bytes
+ * @data: Hash input
+ * @len: Input length
+ */
+uint32_t net_toeplitz_hash(const uint8_t *key, const uint8_t *data, size_t len);
+
+/**
+ * net_flow_hash - RSS hash of a dissected flow
+ * @keys: Flow keys
+ * @key: NET_RSS_KEY_SIZE Toeplitz key
+ * @hash_types: Enabled NET_RSS_HASH_* types
+ * 
+ * Returns the hash, or 0 if no enabled type applies
+ */
+uint32_t net_flow_hash(const net_flow_keys_t *keys, const uint8_t *key,
+                       uint32_t hash_types);
+
+#endif /* _PUREVISOR_NET_FLOW_H */
@@ -0,0 +1,86 @@
+/*
+ * PureVisor - Network Offload Header
+ * 
+ * Software checksum and TCP segmentation for receivers without offloads
+ */
+
+#ifndef _PUREVISOR_NET_OFFLOAD_H
+#define _PUREVISOR_NET_OFFLOAD_H
+
+#include <lib/types.h>
+#include <net/pktbuf.h>
+
+/* Receiver capabilities */
+#define NET_CAP_CSUM            BIT(0)      /* Accepts partial checksums */
+#define NET_CAP_TSO4            BIT(1)      /* Accepts TCPv4 super-frames */
+#define NET_CAP_TSO6            BIT(2)      /* Accepts TCPv6 super-frames */
+
+/* Largest L2-L4 header a super-frame may carry */
+#define NET_GSO_HDR_MAX         192
+
+/* ============================================================================
+ * Checksum Helpers
+ * ============================================================================ */
+
+/**
+ * net_csum_add - Add bytes to a one's complement sum
+ * @sum: Running sum
+ * @data: Bytes, summed as big-endian 16-bit words
+ * @len: Length (must be even except for the last call)
+ */
+uint64_t net_csum_add(uint64_t sum, const void *data, size_t len);
+
+/**
+ * net_csum_pkt - One's complement sum over a packet range
+ * @pb: Packet head
+ * @offset: Start offset
+ * @len: Bytes to sum
+ * @sum: Initial sum
+ */
+uint64_t net_csum_pkt(const pktbuf_t *pb, size_t offset, size_t len, uint64_t sum);
+
+/**
+ * net_csum_fold - Fold a sum to 16 bits (not inverted)
+ */
+uint16_t net_csum_fold(uint64_t sum);
+
+/* ============================================================================
+ * Offload Resolution
+ * ============================================================================ */
+
+/**
+ * net_csum_resolve - Complete a partial checksum in software
+ * @pb: Packet; the caller's reference is consumed
+ * 
+ * The checksum is written to a private copy of the headers; the payload
+ * is still shared with @pb.
+ * 
+ * Returns the completed packet or NULL on failure
+ */
+pktbuf_t *net_csum_resolve(pktbuf_t *pb);
+
+/**
+ * net_gso_segment - Split a TCP super-frame into MSS-sized frames
+ * @pb: Super-frame; the caller's reference is consumed
+ * @out: Queue receiving the segments, checksums complete
+ * 
+ * Segments carry copied headers and reference @pb's payload.
+ * 
+ * Returns number of segments or -1 on failure
+ */
+int net_gso_segment(pktbuf_t *pb, pktbuf_queue_t *out);
+
+/**
+ * net_offload_resolve - Adapt a frame to what its receiver accepts
+ * @pb: Frame; the caller's reference is consumed
+ * @caps: NET_CAP_* of the receiver
+ * @out: Queue receiving the frame(s) to deliver
+ * 
+ * Frames the receiver can take are passed through unchanged, so
+ * super-frames stay whole until they reach a receiver without GSO.
+ * 
+ * Returns number of frames queued or -1 if the frame was dropped
+ */
+int net_offload_resolve(pktbuf_t *pb, uint32_t caps, pktbuf_queue_t *out);
+
+#endif /* _PUREVISOR_NET_OFFLOAD_H */
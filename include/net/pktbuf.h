@@ -0,0 +1,214 @@
+/*
+ * PureVisor - Packet Buffer Pool Header
+ * 
+ * Fixed-size, cache-aligned packet buffers (mbuf-style) with per-CPU
+ * caches, reference counting and segment chaining
+ */
+
+#ifndef _PUREVISOR_NET_PKTBUF_H
+#define _PUREVISOR_NET_PKTBUF_H
+
+#include <lib/types.h>
+
+/* ============================================================================
+ * Pool Constants
+ * ============================================================================ */
+
+#define PKTBUF_SIZE             2048        /* Data buffer per segment */
+#define PKTBUF_HEADROOM         64          /* Reserved for encapsulation */
+#define PKTBUF_DATA_SIZE        (PKTBUF_SIZE - PKTBUF_HEADROOM)
+
+#define PKTBUF_POOL_ORDER       10          /* 2^10 pages = 4MB of data */
+#define PKTBUF_POOL_COUNT       ((PAGE_SIZE << PKTBUF_POOL_ORDER) / PKTBUF_SIZE)
+
+#define PKTBUF_CACHE_SIZE       64          /* Per-CPU cache capacity */
+#define PKTBUF_CACHE_BATCH      32          /* Refill/flush batch */
+
+/* Segment flags */
+#define PKTBUF_F_EXTERNAL       BIT(0)      /* Data lives outside the pool */
+
+/* ============================================================================
+ * Packet Buffer
+ * ============================================================================ */
+
+typedef void (*pktbuf_destructor_t)(void *ctx, int status);
+
+/* Offload flags */
+#define PKTBUF_OL_CSUM_PARTIAL  BIT(0)      /* L4 checksum left to the receiver */
+#define PKTBUF_OL_CSUM_VALID    BIT(1)      /* Checksums already verified */
+
+/* Segmentation types */
+#define PKTBUF_GSO_NONE         0
+#define PKTBUF_GSO_TCPV4        1
+#define PKTBUF_GSO_TCPV6        2
+
+/*
+ * Offload state of a frame (head only). A partial checksum holds the
+ * pseudo-header sum at csum_start + csum_offset; the one's complement
+ * of the sum from csum_start to the end still has to be stored there.
+ */
+typedef struct pktbuf_offload {
+    uint8_t flags;              /* PKTBUF_OL_* */
+    uint8_t gso_type;           /* PKTBUF_GSO_* */
+    uint16_t gso_size;          /* Payload bytes per segment (MSS) */
+    uint16_t hdr_len;           /* L2-L4 header length, hint only */
+    uint16_t csum_start;
+    uint16_t csum_offset;
+} pktbuf_offload_t;
+
+typedef struct pktbuf {
+    /* Linkage */
+    struct pktbuf *next;        /* Next segment of this packet */
+    struct pktbuf *nextpkt;     /* Next packet in a queue (head only) */
+    
+    /* Segment data */
+    uint8_t *data;              /* Start of valid data */
+    uint32_t len;               /* Valid bytes in this segment */
+    uint16_t flags;             /* PKTBUF_F_* */
+    uint16_t index;             /* Slot in the pool */
+    
+    /* Packet state (head only) */
+    uint32_t pkt_len;           /* Total bytes across the chain */
+    volatile uint32_t refcnt;
+    int status;                 /* Passed to the destructor */
+    pktbuf_destructor_t destructor;
+    void *destructor_ctx;
+    
+    /* Packet metadata (head only, second cache line) */
+    pktbuf_offload_t ol ALIGNED(64);
+} ALIGNED(64) pktbuf_t;
+
+/* Pool statistics */
+typedef struct pktbuf_stats {
+    uint32_t total;
+    uint32_t free;              /* In the global pool (excl. CPU caches) */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t alloc_failures;
+} pktbuf_stats_t;
+
+/* ============================================================================
+ * Pool API
+ * ============================================================================ */
+
+/**
+ * pktbuf_init - Initialize the packet buffer pool
+ */
+int pktbuf_init(void);
+
+/**
+ * pktbuf_alloc - Allocate a single-segment packet
+ * 
+ * Returns an empty packet with PKTBUF_HEADROOM reserved, or NULL
+ */
+pktbuf_t *pktbuf_alloc(void);
+
+/**
+ * pktbuf_alloc_ext - Allocate a segment referencing external memory
+ * @addr: Data address (not owned by the pool)
+ * @len: Data length
+ */
+pktbuf_t *pktbuf_alloc_ext(void *addr, uint32_t len);
+
+/**
+ * pktbuf_alloc_copy - Allocate a (chained) packet holding a copy of @data
+ * @data: Source data
+ * @len: Length, may exceed a single segment
+ */
+pktbuf_t *pktbuf_alloc_copy(const void *data, size_t len);
+
+/**
+ * pktbuf_ref - Take another reference to a packet
+ * @pb: Packet head
+ * 
+ * Shared packets are read-only; used for broadcast fan-out.
+ */
+pktbuf_t *pktbuf_ref(pktbuf_t *pb);
+
+/**
+ * pktbuf_free - Drop a reference; frees the whole chain on the last one
+ * @pb: Packet head
+ */
+void pktbuf_free(pktbuf_t *pb);
+
+/**
+ * pktbuf_cat - Append segment chain @tail to packet @head
+ */
+void pktbuf_cat(pktbuf_t *head, pktbuf_t *tail);
+
+/**
+ * pktbuf_attach_ref - Append a zero-copy view of another packet
+ * @head: Packet to extend; must not have a destructor
+ * @src: Packet whose bytes are referenced
+ * @offset: Byte offset within @src
+ * @len: Bytes to reference
+ * 
+ * Takes a reference on @src that is dropped when @head is freed; a
+ * successful delivery of @head (status 0) marks @src delivered too.
+ * 
+ * Returns 0, or -1 with @head unchanged
+ */
+int pktbuf_attach_ref(pktbuf_t *head, pktbuf_t *src, size_t offset, size_t len);
+
+/**
+ * pktbuf_set_destructor - Call @fn(@ctx, status) when the packet is freed
+ */
+void pktbuf_set_destructor(pktbuf_t *pb, pktbuf_destructor_t fn, void *ctx);
+
+/**
+ * pktbuf_copy_out - Copy packet bytes to a flat buffer
+ * @pb: Packet head
+ * @offset: Byte offset within the packet
+ * @dst: Destination
+ * @len: Max bytes to copy
+ * 
+ * Returns bytes copied
+ */
+size_t pktbuf_copy_out(const pktbuf_t *pb, size_t offset, void *dst, size_t len);
+
+/**
+ * pktbuf_get_stats - Get pool statistics
+ */
+void pktbuf_get_stats(pktbuf_stats_t *stats);
+
+/* ============================================================================
+ * Queue Helpers
+ * ============================================================================ */
+
+typedef struct pktbuf_queue {
+    pktbuf_t *head;
+    pktbuf_t *tail;
+    uint32_t count;
+} pktbuf_queue_t;
+
+static inline void pktq_init(pktbuf_queue_t *q)
+{
+    q->head = q->tail = NULL;
+    q->count = 0;
+}
+
+static inline void pktq_push(pktbuf_queue_t *q, pktbuf_t *pb)
+{
+    pb->nextpkt = NULL;
+    if (q->tail) {
+        q->tail->nextpkt = pb;
+    } else {
+        q->head = pb;
+    }
+    q->tail = pb;
+    q->count++;
+}
+
+static inline pktbuf_t *pktq_pop(pktbuf_queue_t *q)
+{
+    pktbuf_t *pb = q->head;
+    if (pb) {
+        q->head = pb->nextpkt;
+        if (!q->head) q->tail = NULL;
+        q->count--;
+        pb->nextpkt = NULL;
+    }
+    return pb;
+}
+
+#endif /* _PUREVISOR_NET_PKTBUF_H */
@@ -0,0 +1,127 @@
+/*
+ * PureVisor - Network Protocol Definitions
+ * 
+ * On-wire Ethernet, IPv4/IPv6, TCP and UDP headers (network byte order)
+ */
+
+#ifndef _PUREVISOR_NET_PROTO_H
+#define _PUREVISOR_NET_PROTO_H
+
+#include <lib/types.h>
+
+/* ============================================================================
+ * Byte Order
+ * ============================================================================ */
+
+static inline uint16_t ntohs(uint16_t v)
+{
+    return (uint16_t)((v >> 8) | (v << 8));
+}
+
+static inline uint32_t ntohl(uint32_t v)
+{
+    return __builtin_bswap32(v);
+}
+
+#define htons(v)                ntohs(v)
+#define htonl(v)                ntohl(v)
+
+/* ============================================================================
+ * Ethernet
+ * ============================================================================ */
+
+#define ETH_ALEN                6
+#define ETH_HLEN                14
+#define ETH_VLAN_HLEN           4
+#define ETH_MTU                 1500
+#define ETH_FRAME_MAX           (ETH_HLEN + ETH_MTU)
+
+#define ETH_P_IP                0x0800
+#define ETH_P_ARP               0x0806
+#define ETH_P_8021Q             0x8100
+#define ETH_P_8021AD            0x88A8
+#define ETH_P_IPV6              0x86DD
+
+typedef struct PACKED {
+    uint8_t dst[ETH_ALEN];
+    uint8_t src[ETH_ALEN];
+    uint16_t type;
+} eth_hdr_t;
+
+typedef struct PACKED {
+    uint16_t tci;               /* PCP(3) DEI(1) VID(12) */
+    uint16_t type;              /* Encapsulated ethertype */
+} vlan_hdr_t;
+
+#define VLAN_VID_MASK           0x0FFF
+
+static inline bool eth_is_multicast(const uint8_t *mac)
+{
+    return mac[0] & 1;          /* Includes broadcast */
+}
+
+/* ============================================================================
+ * IPv4 / IPv6
+ * ============================================================================ */
+
+#define IPPROTO_TCP             6
+#define IPPROTO_UDP             17
+
+#define IP_MF                   0x2000
+#define IP_OFFSET               0x1FFF
+
+typedef struct PACKED {
+    uint8_t ver_ihl;            /* Version(4) IHL(4) */
+    uint8_t tos;
+    uint16_t tot_len;
+    uint16_t id;
+    uint16_t frag_off;
+    uint8_t ttl;
+    uint8_t protocol;
+    uint16_t check;
+    uint32_t saddr;
+    uint32_t daddr;
+} ipv4_hdr_t;
+
+typedef struct PACKED {
+    uint32_t ver_tc_flow;       /* Version(4) TC(8) Flow label(20) */
+    uint16_t payload_len;
+    uint8_t nexthdr;
+    uint8_t hop_limit;
+    uint8_t saddr[16];
+    uint8_t daddr[16];
+} ipv6_hdr_t;
+
+/* ============================================================================
+ * TCP / UDP
+ * ============================================================================ */
+
+#define TCP_FLAG_FIN            0x01
+#define TCP_FLAG_SYN            0x02
+#define TCP_FLAG_RST            0x04
+#define TCP_FLAG_PSH            0x08
+#define TCP_FLAG_ACK            0x10
+#define TCP_FLAG_URG            0x20
+#define TCP_FLAG_ECE            0x40
+#define TCP_FLAG_CWR            0x80
+
+typedef struct PACKED {
+    uint16_t source;
+    uint16_t dest;
+    uint32_t seq;
+    uint32_t ack_seq;
+    uint8_t doff;               /* Data offset(4) Reserved(4) */
+    uint8_t flags;
+    uint16_t window;
+    uint16_t check;
+    uint16_t urg_ptr;
+} tcp_hdr_t;
+
+typedef struct PACKED {
+    uint16_t source;
+    uint16_t dest;
+    uint16_t len;
+    uint16_t check;
+} udp_hdr_t;
+
+#endif /* _PUREVISOR_NET_PROTO_H */
@@ -0,0 +1,86 @@
+/*
+ * PureVisor - Network Rate Limiting Header
+ * 
+ * Token buckets limiting bytes and packets per second
+ */
+
+#ifndef _PUREVISOR_NET_RATELIMIT_H
+#define _PUREVISOR_NET_RATELIMIT_H
+
+#include <lib/types.h>
+
+/* ============================================================================
+ * Structures
+ * ============================================================================ */
+
+/* Limit as configured; a rate of 0 means unlimited */
+typedef struct net_rate_config {
+    uint64_t bytes_per_sec;
+    uint64_t burst_bytes;       /* 0 = NET_RATE_BURST_US worth of rate */
+    uint32_t pkts_per_sec;
+    uint32_t burst_pkts;        /* 0 = NET_RATE_BURST_US worth of rate */
+} net_rate_config_t;
+
+#define NET_RATE_BURST_US       10000       /* Default burst: 10 ms */
+
+/*
+ * Tokens are kept in units of 1/1000000 so that a microsecond of rate
+ * is a whole number. A bucket may go into debt: a frame is admitted
+ * whenever the bucket is not negative and then charged in full, so
+ * frames larger than the burst still pass at the configured rate.
+ */
+typedef struct net_tbucket {
+    uint64_t rate;              /* Tokens per second, 0 = unlimited */
+    int64_t depth;              /* Scaled */
+    int64_t tokens;             /* Scaled */
+} net_tbucket_t;
+
+typedef struct net_ratelimit {
+    net_tbucket_t bytes;
+    net_tbucket_t pkts;
+    uint64_t last_us;
+    
+    /* Statistics */
+    uint64_t throttled;         /* Times traffic was held back */
+} net_ratelimit_t;
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+/**
+ * net_ratelimit_init - Configure a limiter
+ * @rl: Limiter
+ * @cfg: Limit, or NULL for unlimited
+ * @share: Number of limiters splitting @cfg evenly (at least 1)
+ * 
+ * Buckets start full.
+ */
+void net_ratelimit_init(net_ratelimit_t *rl, const net_rate_config_t *cfg,
+                        uint32_t share);
+
+/**
+ * net_ratelimit_enabled - Whether any limit is configured
+ */
+static inline bool net_ratelimit_enabled(const net_ratelimit_t *rl)
+{
+    return rl->bytes.rate != 0 || rl->pkts.rate != 0;
+}
+
+/**
+ * net_ratelimit_wait - Refill and check for tokens
+ * @rl: Limiter
+ * @now_us: Current time
+ * 
+ * Returns 0 if a frame may be sent, else microseconds until it may
+ */
+uint64_t net_ratelimit_wait(net_ratelimit_t *rl, uint64_t now_us);
+
+/**
+ * net_ratelimit_charge - Account for a frame that was sent
+ * @rl: Limiter
+ * @bytes: Frame length
+ */
+void net_ratelimit_charge(net_ratelimit_t *rl, size_t bytes);
+
+#endif /* _PUREVISOR_NET_RATELIMIT_H */
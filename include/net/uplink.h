@@ -0,0 +1,188 @@
+/*
+ * PureVisor - Cluster Uplink Header
+ * 
+ * Driver for a virtio-net device provided by the platform we run on,
+ * carrying cluster traffic off the host
+ */
+
+#ifndef _PUREVISOR_NET_UPLINK_H
+#define _PUREVISOR_NET_UPLINK_H
+
+#include <lib/types.h>
+#include <net/pktbuf.h>
+#include <kernel/smp.h>
+#include <virtio/virtio_net.h>
+
+/* ============================================================================
+ * Constants
+ * ============================================================================ */
+
+#define UPLINK_MAX_QUEUE_PAIRS  4
+#define UPLINK_RING_SIZE        256     /* Upper bound, the device may offer less */
+#define UPLINK_POLL_BUDGET      64      /* RX frames per queue per poll */
+#define UPLINK_TX_SLOT_SIZE     256     /* Per-descriptor header/copy buffer */
+#define UPLINK_TX_COPYBREAK     (UPLINK_TX_SLOT_SIZE - sizeof(virtio_net_hdr_t))
+
+/* Register regions of a modern virtio-pci device */
+#define UPLINK_REGION_COMMON    0
+#define UPLINK_REGION_ISR       1
+#define UPLINK_REGION_DEVICE    2
+#define UPLINK_REGION_NOTIFY    3
+#define UPLINK_REGIONS          4
+
+/* ============================================================================
+ * Structures
+ * ============================================================================ */
+
+/*
+ * Register access. uplink_probe() supplies memory-mapped accessors for
+ * a physical device; anything else presenting the virtio-pci register
+ * layout can be driven by passing its own. With @ctx NULL the accessors
+ * are handed the uplink's copy of @regions instead.
+ */
+typedef struct uplink_io {
+    uint32_t (*read)(void *ctx, uint32_t region, uint32_t offset, int size);
+    void (*write)(void *ctx, uint32_t region, uint32_t offset, int size,
+                  uint32_t value);
+    void *ctx;
+    uint32_t notify_mult;       /* notify_off_multiplier */
+    volatile uint8_t *regions[UPLINK_REGIONS];
+} uplink_io_t;
+
+/* Driver side of a split virtqueue */
+typedef struct uplink_ring {
+    uint16_t index;
+    uint16_t num;
+    uint32_t notify_off;        /* Byte offset in the notify region */
+    
+    virtq_desc_t *desc;
+    virtq_avail_t *avail;
+    virtq_used_t *used;
+    phys_addr_t phys;
+    
+    uint16_t free_head;         /* Free descriptors, linked through next */
+    uint16_t num_free;
+    uint16_t avail_idx;         /* Shadow of avail->idx */
+    uint16_t last_used;
+    uint16_t unkicked;          /* Published since the last notify */
+    
+    pktbuf_t **cookie;          /* Frame by chain head */
+} uplink_ring_t;
+
+typedef struct uplink_queue {
+    uplink_ring_t rx;
+    uplink_ring_t tx;
+    uint8_t *tx_slots;          /* UPLINK_TX_SLOT_SIZE per descriptor */
+    spinlock_t rx_lock;
+    spinlock_t tx_lock;
+    
+    /* Statistics */
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_drops;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_drops;
+    uint64_t kicks;
+} uplink_queue_t;
+
+/* Raw receive hook; takes ownership of @pb */
+typedef void (*uplink_rx_fn_t)(void *ctx, pktbuf_t *pb);
+
+typedef struct uplink {
+    uplink_io_t io;
+    uint64_t features;
+    uint32_t caps;              /* NET_CAP_* the device accepts on TX */
+    uint8_t mac[6];
+    
+    uplink_queue_t queues[UPLINK_MAX_QUEUE_PAIRS];
+    uint16_t queue_pairs;
+    uplink_ring_t ctrl;
+    uint8_t *ctrl_buf;          /* Command, then the ack byte */
+    bool has_ctrl;
+    
+    /* Receivers: the raw hook if set, else the backend's RX queue */
+    uplink_rx_fn_t rx_fn;
+    void *rx_ctx;
+    net_backend_t *backend;
+    pktbuf_queue_t backend_tx;  /* Frames awaiting the next tx_flush */
+    
+    /* Physical device, if probed */
+    uint8_t bus, device, function;
+    volatile uint8_t *regions[UPLINK_REGIONS];
+} uplink_t;
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+/**
+ * uplink_probe - Find and start the platform's virtio-net device
+ * 
+ * Returns the uplink, or NULL if there is no usable device
+ */
+uplink_t *uplink_probe(void);
+
+/**
+ * uplink_create - Start a virtio-net device through @io
+ * @io: Register accessors, copied
+ * @max_pairs: Queue pairs to use at most
+ */
+uplink_t *uplink_create(const uplink_io_t *io, uint16_t max_pairs);
+
+/**
+ * uplink_destroy - Reset the device and free the uplink
+ * @up: Uplink
+ */
+void uplink_destroy(uplink_t *up);
+
+/**
+ * uplink_xmit_burst - Send frames, notifying the device once
+ * @up: Uplink
+ * @q: Frames; emptied. Frames that do not fit the ring are dropped.
+ * 
+ * Returns number of frames queued to the device
+ */
+uint32_t uplink_xmit_burst(uplink_t *up, pktbuf_queue_t *q);
+
+/**
+ * uplink_xmit - Send one frame
+ * @up: Uplink
+ * @pb: Frame; the reference is consumed
+ */
+int uplink_xmit(uplink_t *up, pktbuf_t *pb);
+
+/**
+ * uplink_send - Send a copy of a frame
+ * @up: Uplink
+ * @frame: Ethernet frame
+ * @len: Frame length
+ */
+int uplink_send(uplink_t *up, const void *frame, size_t len);
+
+/**
+ * uplink_set_rx_handler - Take received frames directly
+ * @up: Uplink
+ * @fn: Handler, or NULL to deliver to the backend again
+ * @ctx: Handler argument
+ */
+void uplink_set_rx_handler(uplink_t *up, uplink_rx_fn_t fn, void *ctx);
+
+/**
+ * uplink_poll - Reap completions and receive frames
+ * @up: Uplink
+ * @budget: Frames per RX queue
+ * 
+ * Queues busy on another CPU are skipped. Returns frames received.
+ */
+uint32_t uplink_poll(uplink_t *up, uint32_t budget);
+
+/**
+ * uplink_backend - The uplink as a network backend
+ * @up: Uplink
+ * 
+ * Created on first use and owned by the uplink.
+ */
+net_backend_t *uplink_backend(uplink_t *up);
+
+#endif /* _PUREVISOR_NET_UPLINK_H */
@@ -0,0 +1,137 @@
+/*
+ * PureVisor - Virtual Switch Header
+ *
+ * Learning L2 switch connecting virtual NICs, with per-port VLANs
+ */
+
+#ifndef _PUREVISOR_NET_VSWITCH_H
+#define _PUREVISOR_NET_VSWITCH_H
+
+#include <lib/types.h>
+#include <net/pktbuf.h>
+#include <virtio/virtio_net.h>
+
+struct vm_nic_config;
+
+/* ============================================================================
+ * Constants
+ * ============================================================================ */
+
+#define VSWITCH_MAX             8           /* Switches */
+#define VSWITCH_MAX_PORTS       32
+#define VSWITCH_NAME_MAX        32
+
+#define VSWITCH_FDB_BUCKETS     128         /* Forwarding database sets */
+#define VSWITCH_FDB_WAYS        4           /* Entries per set */
+#define VSWITCH_FDB_AGE_SEC     300         /* 802.1D default ageing time */
+
+#define VSWITCH_BURST           32          /* Frames per port per pass */
+#define VSWITCH_PORT_QUEUE      256         /* Pending ingress frames */
+
+#define VSWITCH_PORT_NONE       0xFFFF
+
+/* ============================================================================
+ * Structures
+ * ============================================================================ */
+
+struct vswitch;
+
+typedef struct vswitch_port {
+    struct vswitch *sw;
+    uint16_t index;
+    net_backend_t *be;          /* Backend attached to the VM's NIC */
+
+    /* VLAN: access ports carry @vlan untagged; trunks carry every VLAN
+     * tagged except the native @vlan */
+    uint16_t vlan;
+    bool trunk;
+
+    /* Frames sent by the VM, awaiting forwarding */
+    pktbuf_queue_t ingress;
+
+    /* Statistics */
+    uint64_t rx_frames;         /* From the VM */
+    uint64_t tx_frames;         /* To the VM */
+    uint64_t drops;
+} vswitch_port_t;
+
+/* Forwarding database entry */
+typedef struct vswitch_fdb_entry {
+    uint8_t mac[6];
+    uint16_t vlan;
+    uint16_t port;              /* VSWITCH_PORT_NONE if unused */
+    uint32_t last_seen;         /* Seconds */
+} vswitch_fdb_entry_t;
+
+typedef struct vswitch {
+    char name[VSWITCH_NAME_MAX];
+
+    vswitch_port_t *ports[VSWITCH_MAX_PORTS];
+    uint32_t port_count;
+
+    vswitch_fdb_entry_t fdb[VSWITCH_FDB_BUCKETS][VSWITCH_FDB_WAYS];
+
+    bool forwarding;            /* Re-entrancy guard */
+
+    /* Statistics */
+    uint64_t forwarded;
+    uint64_t flooded;
+    uint64_t dropped;
+} vswitch_t;
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+/**
+ * vswitch_create - Create a virtual switch
+ * @name: Network name (matches vm_nic_config_t.network)
+ *
+ * Returns switch or NULL on failure
+ */
+vswitch_t *vswitch_create(const char *name);
+
+/**
+ * vswitch_destroy - Destroy a switch and all of its ports
+ * @sw: Switch
+ */
+void vswitch_destroy(vswitch_t *sw);
+
+/**
+ * vswitch_find - Look up a switch by name
+ * @name: Network name
+ */
+vswitch_t *vswitch_find(const char *name);
+
+/**
+ * vswitch_port_create - Add a port and return its backend
+ * @sw: Switch
+ * @mac: MAC address reported by the backend
+ * @vlan: Access VLAN, or native VLAN of a trunk (0 = untagged)
+ * @trunk: Carry all VLANs tagged
+ *
+ * The backend is removed from the switch by net_backend_destroy().
+ *
+ * Returns backend or NULL on failure
+ */
+net_backend_t *vswitch_port_create(vswitch_t *sw, const uint8_t mac[6],
+                                   uint16_t vlan, bool trunk);
+
+/**
+ * vswitch_connect_nic - Attach a VM NIC to the switch of its network
+ * @nic: NIC configuration; the switch is created on first use
+ *
+ * Returns an access-port backend on VLAN nic->vlan, or NULL
+ */
+net_backend_t *vswitch_connect_nic(const struct vm_nic_config *nic);
+
+/**
+ * vswitch_forward - Forward pending ingress frames
+ * @sw: Switch
+ *
+ * Ports are served round-robin, VSWITCH_BURST frames at a time; frames
+ * for each destination are delivered as one burst per pass.
+ */
+void vswitch_forward(vswitch_t *sw);
+
+#endif /* _PUREVISOR_NET_VSWITCH_H */
@@ -240,6 +240,19 @@ int pci_config_read(uint8_t bus, uint8_t device, uint8_t function,
 int pci_config_write(uint8_t bus, uint8_t device, uint8_t function,
                      uint8_t offset, int size, uint32_t value);
 
+/**
+ * pci_config_write_default - Standard config space write semantics
+ * @dev: Device
+ * @offset: Register offset
+ * @size: 1, 2, or 4 bytes
+ * @value: Value to write
+ * 
+ * Honours read-only and W1C registers and BAR sizing; for devices
+ * that override config_write but keep the standard header.
+ */
+void pci_config_write_default(pci_device_t *dev, uint8_t offset,
+                              int size, uint32_t value);
+
 /**
  * pci_handle_io - Handle PCI I/O port access
  * @port: I/O port (0xCF8 or 0xCFC)
@@ -272,4 +285,33 @@ void pci_setup_bar(pci_device_t *dev, int bar, uint64_t base,
 void pci_add_capability(pci_device_t *dev, uint8_t cap_id, 
                         uint8_t offset, uint8_t size);
 
+/* ============================================================================
+ * Host Bus Access
+ * ============================================================================ */
+
+/**
+ * pci_host_read - Read the config space of a physical PCI function
+ * @bus, device, function: PCI address
+ * @offset: Register offset, naturally aligned for @size
+ * @size: 1, 2, or 4 bytes
+ * 
+ * Returns 0xFFFFFFFF (truncated to @size) if nothing responds
+ */
+uint32_t pci_host_read(uint8_t bus, uint8_t device, uint8_t function,
+                       uint8_t offset, int size);
+
+/**
+ * pci_host_write - Write the config space of a physical PCI function
+ */
+void pci_host_write(uint8_t bus, uint8_t device, uint8_t function,
+                    uint8_t offset, int size, uint32_t value);
+
+/**
+ * pci_host_bar - Base address of a physical memory BAR
+ * @bar: BAR index; a 64-bit BAR also consumes @bar + 1
+ * 
+ * Returns the physical base, or 0 for I/O or unassigned BARs
+ */
+uint64_t pci_host_bar(uint8_t bus, uint8_t device, uint8_t function, int bar);
+
 #endif /* _PUREVISOR_PCI_H */
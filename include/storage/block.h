@@ -8,6 +8,7 @@
 #define _PUREVISOR_STORAGE_BLOCK_H
 
 #include <lib/types.h>
+#include <kernel/smp.h>
 
 /* ============================================================================
  * Block Storage Constants
@@ -20,6 +21,27 @@
 #define BLOCK_MAX_NAME          64
 #define BLOCK_MAX_UUID          37  /* UUID string + null */
 
+#define BLOCK_DEFAULT_QUEUE_DEPTH   32  /* Requests in flight per hardware queue */
+#define BLOCK_MAX_HW_QUEUES     8
+#define BLOCK_WAIT_SPIN         1000    /* Polls before a waiter may halt */
+#define BLOCK_DEFAULT_MAX_IO    (128 * KB)  /* Largest merged request */
+#define BLOCK_MERGE_MAX_SEGS    32      /* Segments in a merged request */
+#define BLOCK_MERGE_POOL_COUNT  256     /* Merged requests in flight at once */
+#define BLOCK_PLUG_MAX          32      /* Requests held by a plug */
+
+#define BLOCK_REQ_POOL_ORDER    5       /* 2^5 pages of preallocated requests */
+#define BLOCK_REQ_POOL_COUNT    1024
+#define BLOCK_REQ_RESERVE       64      /* Pool requests kept for heap failure */
+#define BLOCK_REQ_CACHE_SIZE    32      /* Per-CPU cache capacity */
+#define BLOCK_REQ_CACHE_BATCH   16      /* Refill/flush batch */
+
+/* Latency histograms: bucket n counts [2^n, 2^(n+1)) us, the last open */
+#define BLOCK_LAT_BUCKETS       24
+#define BLOCK_LAT_READ          0
+#define BLOCK_LAT_WRITE         1
+#define BLOCK_LAT_OTHER         2
+#define BLOCK_LAT_TYPES         3
+
 #define BLOCK_OP_READ           0
 #define BLOCK_OP_WRITE          1
 #define BLOCK_OP_FLUSH          2
@@ -30,6 +52,8 @@
 #define BLOCK_REQ_FUA           BIT(0)  /* Force Unit Access */
 #define BLOCK_REQ_PREFLUSH      BIT(1)  /* Pre-flush */
 #define BLOCK_REQ_SYNC          BIT(2)  /* Synchronous */
+#define BLOCK_REQ_MERGED        BIT(3)  /* Carries merged requests (block layer) */
+#define BLOCK_REQ_QOS           BIT(4)  /* Admitted by QoS (block layer) */
 
 /* ============================================================================
  * Block Request
@@ -37,40 +61,135 @@
 
 typedef void (*block_completion_t)(void *ctx, int status);
 
+/* One segment of a vectored request */
+typedef struct block_iovec {
+    void *base;
+    uint32_t len;
+} block_iovec_t;
+
+struct block_device;
+struct block_qos;
+
 typedef struct block_request {
     /* Operation */
     uint8_t op;
     uint8_t flags;
-    uint16_t reserved;
+    uint8_t cpu;            /* Submitting CPU, where completion runs */
+    uint8_t hwq;            /* Hardware queue */
+    uint16_t slot;          /* Request pool slot + 1, 0 if not pooled */
     
     /* Location */
     uint64_t offset;        /* Byte offset */
     uint32_t length;        /* Length in bytes */
     
-    /* Data */
+    /* Data: iov[iov_count] totalling length, or buffer alone */
     void *buffer;
+    const block_iovec_t *iov;
+    uint32_t iov_count;
+    block_iovec_t iov_single;   /* Set by the block layer for buffer */
     
     /* Completion */
     block_completion_t completion;
     void *completion_ctx;
     int status;
+    uint64_t submit_us;     /* Accepted by the block layer */
+    uint64_t issue_us;      /* Handed to the backend, if timed */
     
     /* Queue linkage */
+    struct block_device *dev;   /* Set on submission */
     struct block_request *next;
 } block_request_t;
 
+/* Request pool statistics */
+typedef struct block_req_stats {
+    uint32_t total;
+    uint32_t free;              /* In the global pool (excl. CPU caches) */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t heap_allocs;       /* Pool empty, served by the heap */
+    uint64_t reserve_allocs;    /* Heap failed too, served by the reserve */
+    uint64_t alloc_failures;
+} block_req_stats_t;
+
 /* ============================================================================
  * Block Device
  * ============================================================================ */
 
 typedef struct block_device block_device_t;
 
+/*
+ * Per-CPU software queue. Only its CPU pushes, lock-free; the hardware
+ * queue it maps to takes the whole list when it needs work.
+ */
+typedef struct block_sw_queue {
+    block_request_t *volatile pending;  /* Newest first */
+    uint64_t submitted;
+} block_sw_queue_t;
+
+/* Submission to completion latency of one op type, log scale */
+typedef struct block_latency {
+    uint64_t buckets[BLOCK_LAT_BUCKETS];    /* Bucket 0 also holds 0 us */
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+} block_latency_t;
+
+/* Backend queue; the CPUs mapped to it share its lock only to dispatch */
+typedef struct block_hw_queue {
+    block_request_t *head;      /* In submission order */
+    block_request_t *tail;
+    uint32_t queued;
+    uint32_t inflight;
+    bool dispatching;           /* A dispatch loop owns the queue */
+    spinlock_t lock;
+    
+    /* Statistics */
+    uint64_t read_ops;
+    uint64_t write_ops;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t errors;
+    uint64_t merges;            /* Requests that shared a backend request */
+    block_latency_t latency[BLOCK_LAT_TYPES];
+    
+    /* Depth (queued + in flight) seen by each arriving request */
+    uint64_t depth_sum;
+    uint64_t depth_samples;
+    uint32_t depth_max;
+} block_hw_queue_t;
+
+typedef struct block_stats {
+    uint64_t read_ops;
+    uint64_t write_ops;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t errors;
+    uint64_t merges;
+    uint32_t queued;
+    uint32_t inflight;
+    block_latency_t latency[BLOCK_LAT_TYPES];
+    uint64_t depth_sum;
+    uint64_t depth_samples;
+    uint32_t depth_max;         /* Of any one hardware queue */
+} block_stats_t;
+
+/*
+ * Backends always see the request data as req->iov; use the
+ * block_iov_* helpers to move it.
+ * 
+ * submit() either accepts the request and later reports it exactly once
+ * through block_complete(), possibly before returning, or returns an
+ * error without completing it. It is called concurrently for different
+ * hardware queues (req->hwq). poll() is optional: a backend without
+ * interrupts reaps its finished requests there.
+ */
 typedef struct block_ops {
     int (*open)(block_device_t *dev);
     void (*close)(block_device_t *dev);
     int (*submit)(block_device_t *dev, block_request_t *req);
     int (*flush)(block_device_t *dev);
     int (*get_info)(block_device_t *dev);
+    void (*poll)(block_device_t *dev);
 } block_ops_t;
 
 struct block_device {
@@ -88,22 +207,24 @@ struct block_device {
     bool readonly;
     bool removable;
     bool online;
+    uint32_t users;         /* Backends holding it, see blk_backend_create_device() */
     
     /* Operations */
     const block_ops_t *ops;
     
-    /* Statistics */
-    uint64_t read_ops;
-    uint64_t write_ops;
-    uint64_t read_bytes;
-    uint64_t write_bytes;
-    uint64_t errors;
+    /* Request queues: CPU n submits to sw_queues[n], which feeds hw_queues[n % nr] */
+    block_hw_queue_t hw_queues[BLOCK_MAX_HW_QUEUES];
+    uint32_t nr_hw_queues;      /* Set by the backend, default 1 */
+    uint32_t max_queue_depth;   /* Per hardware queue */
+    block_sw_queue_t *sw_queues;
+    uint32_t nr_sw_queues;
+    
+    /* Merging limits, set by the backend */
+    uint32_t max_io_size;       /* Default BLOCK_DEFAULT_MAX_IO */
+    uint64_t io_boundary;       /* Merges never cross a multiple, 0 = none */
     
-    /* Request queue */
-    block_request_t *queue_head;
-    block_request_t *queue_tail;
-    uint32_t queue_depth;
-    uint32_t max_queue_depth;
+    /* I/O scheduling, see storage/qos.h */
+    struct block_qos *qos;
     
     /* Private data */
     void *priv;
@@ -112,6 +233,16 @@ struct block_device {
     struct block_device *next;
 };
 
+/*
+ * Submission batch. While a plug is active on a CPU, its submissions are
+ * held and merged, then queued together when the plug is finished.
+ */
+typedef struct block_plug {
+    block_request_t *head;
+    block_request_t *tail;
+    uint32_t count;
+} block_plug_t;
+
 /* ============================================================================
  * Block Layer API
  * ============================================================================ */
@@ -143,6 +274,9 @@ block_device_t *block_find_by_uuid(const char *uuid);
 
 /**
  * block_read - Synchronous read
+ * 
+ * Waits by polling the device and running completions, halting between
+ * polls once the request has been outstanding for a while.
  */
 int block_read(block_device_t *dev, uint64_t offset, void *buf, uint32_t len);
 
@@ -151,6 +285,26 @@ int block_read(block_device_t *dev, uint64_t offset, void *buf, uint32_t len);
  */
 int block_write(block_device_t *dev, uint64_t offset, const void *buf, uint32_t len);
 
+/**
+ * block_readv - Synchronous vectored read
+ * @dev: Device
+ * @offset: Byte offset
+ * @iov: Segments, filled in order
+ * @count: Number of segments
+ */
+int block_readv(block_device_t *dev, uint64_t offset,
+                const block_iovec_t *iov, uint32_t count);
+
+/**
+ * block_writev - Synchronous vectored write
+ * @dev: Device
+ * @offset: Byte offset
+ * @iov: Segments, written in order
+ * @count: Number of segments
+ */
+int block_writev(block_device_t *dev, uint64_t offset,
+                 const block_iovec_t *iov, uint32_t count);
+
 /**
  * block_flush - Flush device
  */
@@ -158,11 +312,98 @@ int block_flush(block_device_t *dev);
 
 /**
  * block_submit_async - Submit async request
+ * @dev: Target device
+ * @req: Request; owned by the block layer until its completion runs
+ * 
+ * The request is dispatched at once if the device has a free queue
+ * slot, else queued in order. Returns 0 if accepted, -1 if rejected,
+ * in which case the completion is not called.
  */
 int block_submit_async(block_device_t *dev, block_request_t *req);
 
 /**
- * block_alloc_request - Allocate a request
+ * block_submit_wait - Submit a request and wait for it
+ * @dev: Target device
+ * @req: Request; its completion callback is replaced
+ * 
+ * Returns the request status
+ */
+int block_submit_wait(block_device_t *dev, block_request_t *req);
+
+/**
+ * block_start_plug - Start batching this CPU's submissions
+ * @plug: Plug, usually on the caller's stack
+ * 
+ * Adjacent requests submitted until block_finish_plug() reach the
+ * backend as one, up to the device's max_io_size. Nested plugs join the
+ * outer one. Waiting for a request flushes the plug first.
+ */
+void block_start_plug(block_plug_t *plug);
+
+/**
+ * block_finish_plug - Queue the requests held by a plug
+ * @plug: Plug passed to block_start_plug()
+ */
+void block_finish_plug(block_plug_t *plug);
+
+/**
+ * block_complete - Report a finished request
+ * @req: Request passed to the backend's submit()
+ * @status: 0 or a negative error
+ * 
+ * Called by backends, from any CPU. Frees the request's queue slot and
+ * queues its completion callback on the submitting CPU, running it at
+ * once if that is the current one.
+ */
+void block_complete(block_request_t *req, int status);
+
+/**
+ * block_run_completions - Run this CPU's queued completion callbacks
+ * 
+ * Returns the number of callbacks run
+ */
+uint32_t block_run_completions(void);
+
+/**
+ * block_poll - Reap finished requests of a polled device
+ * @dev: Device
+ */
+void block_poll(block_device_t *dev);
+
+/**
+ * block_latency_percentile - Latency below which a share of requests fell
+ * @lat: Histogram
+ * @permille: Share, e.g. 990 for the 99th percentile
+ * 
+ * Returns the upper bound in microseconds of the bucket holding the
+ * percentile, capped at the largest latency seen; 0 if empty.
+ */
+uint64_t block_latency_percentile(const block_latency_t *lat, uint32_t permille);
+
+/**
+ * block_kick - Restart dispatch on every hardware queue
+ * @dev: Device
+ */
+void block_kick(block_device_t *dev);
+
+/**
+ * block_get_stats - Sum the per-queue statistics of a device
+ * @dev: Device
+ * @stats: Output
+ */
+void block_get_stats(block_device_t *dev, block_stats_t *stats);
+
+/**
+ * block_hw_queues_per_cpu - Hardware queue count for a backend without
+ * shared state between requests: one per CPU, up to the maximum
+ */
+uint32_t block_hw_queues_per_cpu(void);
+
+/**
+ * block_alloc_request - Allocate a zeroed request
+ * 
+ * Served from this CPU's cache of the preallocated pool. Once the pool
+ * runs dry the heap is used, and if that fails the pool's reserve.
  */
 block_request_t *block_alloc_request(void);
 
@@ -171,6 +412,57 @@ block_request_t *block_alloc_request(void);
  */
 void block_free_request(block_request_t *req);
 
+/**
+ * block_get_request_stats - Get request pool statistics
+ */
+void block_get_request_stats(block_req_stats_t *stats);
+
+/**
+ * block_iov_length - Total length of a segment list
+ */
+uint64_t block_iov_length(const block_iovec_t *iov, uint32_t count);
+
+/**
+ * block_iov_copy_to - Copy into a request's data
+ * @req: Request
+ * @offset: Offset within the request data
+ * @src: Source
+ * @len: Bytes to copy
+ */
+void block_iov_copy_to(const block_request_t *req, uint64_t offset,
+                       const void *src, size_t len);
+
+/**
+ * block_iov_copy_from - Copy out of a request's data
+ * @req: Request
+ * @offset: Offset within the request data
+ * @dst: Destination
+ * @len: Bytes to copy
+ */
+void block_iov_copy_from(const block_request_t *req, uint64_t offset,
+                         void *dst, size_t len);
+
+/**
+ * block_iov_zero - Zero part of a request's data
+ * @req: Request
+ * @offset: Offset within the request data
+ * @len: Bytes to zero
+ */
+void block_iov_zero(const block_request_t *req, uint64_t offset, size_t len);
+
+/**
+ * block_iov_slice - Describe part of a request's data
+ * @req: Request
+ * @offset: Offset within the request data
+ * @len: Bytes to describe
+ * @out: Segments, room for req->iov_count
+ * 
+ * Returns the number of segments stored in @out, which point into the
+ * request's own buffers.
+ */
+uint32_t block_iov_slice(const block_request_t *req, uint64_t offset,
+                         uint64_t len, block_iovec_t *out);
+
 /**
  * block_generate_uuid - Generate a UUID string
  */
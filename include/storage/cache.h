@@ -0,0 +1,155 @@
+/*
+ * PureVisor - Block Buffer Cache Header
+ * 
+ * Page cache stacked in front of a block device, with read-ahead and
+ * optional write-back
+ */
+
+#ifndef _PUREVISOR_STORAGE_CACHE_H
+#define _PUREVISOR_STORAGE_CACHE_H
+
+#include <lib/types.h>
+#include <storage/block.h>
+#include <kernel/smp.h>
+#include <kernel/timer.h>
+
+/* ============================================================================
+ * Constants
+ * ============================================================================ */
+
+#define BLOCK_CACHE_PAGE            PAGE_SIZE
+#define BLOCK_CACHE_DEFAULT_SIZE    (16 * MB)
+#define BLOCK_CACHE_STREAMS         8       /* Sequential readers tracked */
+#define BLOCK_CACHE_RA_MIN          4       /* First read-ahead window, pages */
+#define BLOCK_CACHE_RA_MAX          32      /* Largest read-ahead window, pages */
+#define BLOCK_CACHE_WB_RUN          32      /* Largest write-back request, pages */
+#define BLOCK_CACHE_WB_DELAY_US     100000  /* Dirty pages are written back after this */
+
+/* Page states */
+#define BLOCK_CACHE_FREE            0
+#define BLOCK_CACHE_VALID           1
+#define BLOCK_CACHE_READING         2       /* Read-ahead in flight */
+
+/* ============================================================================
+ * Structures
+ * ============================================================================ */
+
+typedef struct block_cache_config {
+    uint64_t max_bytes;         /* Page memory, 0 = BLOCK_CACHE_DEFAULT_SIZE */
+    uint32_t readahead_max;     /* Window in pages, 0 = BLOCK_CACHE_RA_MAX */
+    bool no_readahead;
+    bool writeback;             /* Complete writes once cached */
+    uint64_t dirty_max;         /* Dirty page memory, 0 = half of max_bytes */
+} block_cache_config_t;
+
+typedef struct block_cache_page {
+    uint64_t index;             /* Device offset / BLOCK_CACHE_PAGE */
+    uint8_t *data;
+    uint8_t state;
+    bool referenced;            /* CLOCK second chance */
+    bool stale;                 /* Written while READING, dropped when filled */
+    bool readahead;             /* Read ahead and not used yet */
+    bool dirty;                 /* Newer than the lower device */
+    bool writing;               /* Write-back in flight */
+    uint64_t gen;               /* Flush generation when it became dirty */
+    struct block_cache_page *hnext;
+} block_cache_page_t;
+
+/* A sequential reader: reads that start where the last one ended */
+typedef struct block_cache_stream {
+    uint64_t next;              /* Offset the stream continues at */
+    uint64_t ra_end;            /* Read ahead up to here */
+    uint32_t window;            /* Next read-ahead, pages */
+    uint32_t last_used;
+} block_cache_stream_t;
+
+/*
+ * Reads are served from cached pages when every page they touch is
+ * there; otherwise they go to the lower device as they are, and the
+ * pages they fully cover are cached on completion. Writes go through to
+ * the lower device and invalidate what they touch, both when issued and
+ * when done, so no read racing with them can leave old data behind.
+ * 
+ * In write-back mode, writes that fill whole pages or land on cached
+ * ones complete once copied in. Dirty pages are written back in device
+ * order, in runs of contiguous pages, once BLOCK_CACHE_WB_DELAY_US has
+ * passed or half of dirty_max is used up; writers wait while all of it
+ * is. Whatever would go around dirty pages to the lower device - FUA
+ * and partial-page writes, discards, reads missing part of a range -
+ * waits until the pages it touches are written back. A flush waits for
+ * every page dirtied before it and then flushes the lower device.
+ */
+typedef struct block_cache {
+    block_device_t blkdev;      /* Front device */
+    block_device_t *lower;
+    block_cache_config_t config;
+    
+    /* Pages, evicted in CLOCK order */
+    block_cache_page_t *pages;
+    uint32_t nr_pages;
+    uint32_t clock_hand;
+    block_cache_page_t **hash;
+    uint32_t hash_mask;
+    
+    block_cache_stream_t streams[BLOCK_CACHE_STREAMS];
+    uint32_t stream_tick;
+    
+    /* Write-back */
+    uint32_t dirty_max;         /* Pages */
+    uint32_t nr_dirty;
+    uint32_t nr_writing;
+    uint64_t flush_gen;
+    int wb_error;               /* Reported by the next flush */
+    bool wb_armed;
+    ktimer_t wb_timer;
+    block_cache_page_t **wb_sort;
+    
+    struct cache_io *pending;   /* Waiting for read-ahead or write-back */
+    struct cache_io *pending_tail;
+    uint64_t write_seq;         /* Bumped as writes start and finish */
+    spinlock_t lock;
+    
+    /* Statistics */
+    uint64_t hits;              /* Pages */
+    uint64_t misses;            /* Pages */
+    uint64_t readahead_pages;
+    uint64_t readahead_hits;
+    uint64_t evictions;
+    uint64_t waits;             /* Requests held back */
+    uint64_t write_hits;        /* Writes completed in the cache */
+    uint64_t writeback_pages;
+    uint64_t writeback_ios;
+    uint64_t throttled;         /* Writes held back by dirty_max */
+    uint64_t flushes;
+} block_cache_t;
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+/**
+ * block_cache_create - Put a buffer cache in front of a device
+ * @lower: Cached device
+ * @cfg: Configuration, or NULL for defaults
+ * 
+ * Returns the cache, whose blkdev is registered and should be used in
+ * place of @lower from then on; NULL on failure.
+ */
+block_cache_t *block_cache_create(block_device_t *lower,
+                                  const block_cache_config_t *cfg);
+
+/**
+ * block_cache_destroy - Remove a buffer cache
+ * @cache: Cache, with no requests in flight
+ * 
+ * Dirty pages are written back first.
+ */
+void block_cache_destroy(block_cache_t *cache);
+
+/**
+ * block_cache_drop - Forget every clean cached page
+ * @cache: Cache
+ */
+void block_cache_drop(block_cache_t *cache);
+
+#endif /* _PUREVISOR_STORAGE_CACHE_H */
@@ -0,0 +1,37 @@
+/*
+ * PureVisor - Memory Block Device Header
+ * 
+ * Sparse RAM-backed block device
+ */
+
+#ifndef _PUREVISOR_STORAGE_MEMBLK_H
+#define _PUREVISOR_STORAGE_MEMBLK_H
+
+#include <lib/types.h>
+#include <storage/block.h>
+
+/**
+ * mem_block_create - Create a RAM disk
+ * @name: Device name
+ * @size: Size in bytes, rounded up to whole pages
+ * 
+ * Pages are allocated as they are first written; the rest read as
+ * zero. Discards and write-zeroes of whole pages free them again.
+ */
+block_device_t *mem_block_create(const char *name, uint64_t size);
+
+/**
+ * mem_block_destroy - Free a RAM disk and its contents
+ * @dev: Device from mem_block_create(), unregistered
+ */
+void mem_block_destroy(block_device_t *dev);
+
+/**
+ * mem_block_used - Memory holding data
+ * @dev: Device from mem_block_create()
+ * 
+ * Returns the bytes of data pages allocated, not counting tree nodes.
+ */
+uint64_t mem_block_used(block_device_t *dev);
+
+#endif /* _PUREVISOR_STORAGE_MEMBLK_H */
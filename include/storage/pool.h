@@ -9,6 +9,9 @@
 
 #include <lib/types.h>
 #include <storage/block.h>
+#include <storage/cache.h>
+#include <kernel/timer.h>
+#include <kernel/smp.h>
 
 /* ============================================================================
  * Pool Constants
@@ -20,6 +23,10 @@
 
 #define POOL_EXTENT_SIZE        (4 * MB)    /* 4MB extents */
 #define POOL_MAX_EXTENTS        65536       /* 256GB max per pool */
+#define POOL_MAP_WORDS          (POOL_MAX_EXTENTS / 64)
+#define POOL_SUMMARY_WORDS      (POOL_MAP_WORDS / 64)
+#define POOL_STRIPE_UNIT_MIN    (4 * KB)
+#define POOL_STRIPE_UNIT_DEFAULT (64 * KB)
 
 /* Pool states */
 #define POOL_STATE_OFFLINE      0
@@ -27,6 +34,11 @@
 #define POOL_STATE_ONLINE       2
 #define POOL_STATE_REBUILDING   3
 
+/* Read policies, for volumes with replicas */
+#define POOL_READ_BALANCE       0   /* Least loaded in-sync copy */
+#define POOL_READ_PRIMARY       1   /* First in-sync copy */
+#define POOL_HEDGE_MAX          (64 * KB)   /* Larger reads are never hedged */
+
 /* Replication modes */
 #define POOL_REPL_NONE          0   /* No replication */
 #define POOL_REPL_MIRROR        1   /* Mirroring (2 copies) */
@@ -41,6 +53,11 @@
 #define EXTENT_ALLOCATED        1
 #define EXTENT_RESERVED         2
 
+/* Copy states */
+#define EXTENT_IN_SYNC          0
+#define EXTENT_STALE            1   /* Missed a write */
+#define EXTENT_RESYNCING        2   /* Being rewritten; written, not read */
+
 typedef struct extent_info {
     uint32_t state;
     uint32_t volume_id;         /* Owning volume */
@@ -49,6 +66,10 @@ typedef struct extent_info {
     uint64_t device_offset;     /* Offset on device */
     uint32_t replica_count;     /* Number of replicas */
     uint32_t replica_extents[3];/* Replica extent IDs */
+    uint32_t stale;             /* Copy state; see volume_resync() */
+    uint32_t writes;            /* Volume writes to its copies in flight */
+    uint32_t write_seq;         /* Volume writes to its copies begun */
+    uint32_t lagging;           /* Writes completed without this copy */
 } extent_info_t;
 
 /* ============================================================================
@@ -66,6 +87,9 @@ typedef struct storage_volume {
     
     /* Properties */
     uint32_t replication;       /* Replication mode */
+    uint32_t write_quorum;      /* Copies a write waits for, 0 = all */
+    uint32_t read_policy;
+    uint32_t hedge_us;          /* Read another copy after this, 0 = never */
     bool thin_provisioned;
     bool online;
     
@@ -73,11 +97,33 @@ typedef struct storage_volume {
     uint32_t *extent_map;       /* extent_map[vol_extent] = pool_extent */
     uint32_t num_extents;
     
+    /*
+     * Striping: each run of stripe_width volume extents is a stripe
+     * group, laid out stripe_unit by stripe_unit across its extents in
+     * turn. Volume extent i lives on device (stripe_start + i) modulo
+     * the device count when there is room there. Unstriped volumes
+     * have a width of 1 and a unit of POOL_EXTENT_SIZE.
+     */
+    uint32_t stripe_width;
+    uint32_t stripe_unit;
+    uint32_t stripe_start;
+    
+    /* Reads of replicated extents */
+    uint32_t read_rotor;        /* Breaks ties between copies */
+    struct volume_read *hedging;    /* Waiting for hedge_us, oldest first */
+    struct volume_read *hedging_tail;
+    struct volume_read *parked;     /* Waiting for a copy to stop lagging */
+    spinlock_t hedge_lock;          /* Also guards parked */
+    ktimer_t hedge_timer;
+    uint64_t hedged;            /* Reads sent to a second copy */
+    uint64_t hedge_wins;        /* ... that it answered first */
+    
     /* Parent pool */
     struct storage_pool *pool;
     
     /* Block device interface */
     block_device_t blkdev;
+    block_cache_t *cache;       /* In front of blkdev, if any */
     
     /* List */
     struct storage_volume *next;
@@ -103,12 +149,27 @@ typedef struct storage_pool {
     /* Physical devices */
     block_device_t *devices[POOL_MAX_DEVICES];
     uint32_t device_count;
+    uint32_t device_reads[POOL_MAX_DEVICES];    /* Volume reads in flight */
+    uint32_t device_read_us[POOL_MAX_DEVICES];  /* Moving average latency */
     
     /* Extent management */
     extent_info_t *extents;
     uint32_t total_extents;
     uint32_t free_extents;
     uint32_t next_extent;
+    spinlock_t lock;            /* Allocation from the I/O path */
+    
+    /*
+     * Free extents: a bit per extent, a summary bit per map word with
+     * any set, and a top word over the summary, so the next free extent
+     * is three bit scans away. Extent 0 is never free: it stands for
+     * "unallocated" in volume extent maps.
+     */
+    uint64_t free_map[POOL_MAP_WORDS];
+    uint64_t free_summary[POOL_SUMMARY_WORDS];
+    uint64_t free_top;
+    uint32_t device_first[POOL_MAX_DEVICES];    /* First extent of each device */
+    uint32_t device_free[POOL_MAX_DEVICES];
     
     /* Volumes */
     storage_volume_t *volumes;
@@ -123,6 +184,7 @@ typedef struct storage_pool {
     uint64_t write_ops;
     uint64_t read_bytes;
     uint64_t write_bytes;
+    uint32_t stale_extents;     /* Replicas waiting for resync */
     
     /* List */
     struct storage_pool *next;
@@ -177,6 +239,25 @@ int pool_get_status(storage_pool_t *pool);
 storage_volume_t *volume_create(storage_pool_t *pool, const char *name,
                                  uint64_t size, uint32_t replication, bool thin);
 
+/**
+ * volume_create_striped - Create a volume striped across pool devices
+ * @pool: Parent pool
+ * @name: Volume name
+ * @size: Size in bytes, rounded up to whole stripe groups
+ * @replication: Replication mode
+ * @thin: Thin provisioning
+ * @stripe_width: Devices to stripe across, at most the pool's device count
+ * @stripe_unit: Bytes per device before moving to the next, a power of
+ *               two from POOL_STRIPE_UNIT_MIN to POOL_EXTENT_SIZE; 0 for
+ *               POOL_STRIPE_UNIT_DEFAULT
+ * 
+ * A width of 1 is the same as volume_create().
+ */
+storage_volume_t *volume_create_striped(storage_pool_t *pool, const char *name,
+                                        uint64_t size, uint32_t replication,
+                                        bool thin, uint32_t stripe_width,
+                                        uint32_t stripe_unit);
+
 /**
  * volume_destroy - Destroy a volume
  */
@@ -194,9 +275,71 @@ storage_volume_t *volume_snapshot(storage_volume_t *vol, const char *name);
 
 /**
  * volume_get_block_device - Get block device for volume
+ * 
+ * Returns the cache's device when the volume has a cache.
  */
 block_device_t *volume_get_block_device(storage_volume_t *vol);
 
+/**
+ * volume_is_attached - Whether a backend holds the volume's block device
+ * 
+ * Backends keep the device volume_get_block_device() returned when they
+ * were created, so it cannot change under them.
+ */
+bool volume_is_attached(storage_volume_t *vol);
+
+/**
+ * volume_set_cache - Put a buffer cache in front of a volume
+ * @vol: Volume, with no I/O in flight
+ * @cfg: Cache configuration, or NULL to remove the cache
+ * 
+ * A cache already there is written back and replaced. Refused while the
+ * volume is attached. Returns 0 on success.
+ */
+int volume_set_cache(storage_volume_t *vol, const block_cache_config_t *cfg);
+
+/**
+ * volume_set_write_quorum - Choose how many copies a write waits for
+ * @vol: Volume
+ * @quorum: 1 to the number of copies, or 0 for all of them
+ * 
+ * Writes go to every in-sync copy at once and complete as soon as
+ * @quorum of them have; a write fails once that can no longer happen.
+ * Until the others catch up, reads go to the copies that have it; a
+ * read finding every copy behind some write waits for one to catch up.
+ * Copies that fail a write that others took are marked stale: reads
+ * avoid them and writes skip them until volume_resync(). Returns 0 on
+ * success.
+ */
+int volume_set_write_quorum(storage_volume_t *vol, uint32_t quorum);
+
+/**
+ * volume_set_read_policy - Choose where reads of replicated extents go
+ * @vol: Volume
+ * @policy: POOL_READ_BALANCE or POOL_READ_PRIMARY
+ * @hedge_us: Microseconds after which a read of at most POOL_HEDGE_MAX
+ *            bytes is also sent to another copy, 0 for never
+ * 
+ * Only in-sync copies are read. Balanced reads go to the copy whose
+ * device has the fewest volume reads in flight, weighed by its recent
+ * read latency. A hedged read completes with whichever copy answers
+ * first, and a read that fails is retried on another copy. Returns 0
+ * on success.
+ */
+int volume_set_read_policy(storage_volume_t *vol, uint32_t policy,
+                           uint32_t hedge_us);
+
+/**
+ * volume_resync - Bring stale copies back in sync
+ * @vol: Volume
+ * 
+ * Each stale copy is rewritten from an in-sync one while writes go on.
+ * They reach the copy being rewritten as well, and a chunk copied while
+ * one was in flight is copied again, so the copy is back in sync once
+ * it is through. Returns the number of copies still stale.
+ */
+int volume_resync(storage_volume_t *vol);
+
 /* ============================================================================
  * Extent API
  * ============================================================================ */
@@ -206,6 +349,39 @@ block_device_t *volume_get_block_device(storage_volume_t *vol);
  */
 int pool_alloc_extent(storage_pool_t *pool, uint32_t *extent_id);
 
+/**
+ * pool_alloc_extent_hint - Allocate an extent near a given one
+ * @pool: Pool
+ * @hint: Extent to try first; the search goes up from there and wraps
+ * @extent_id: Allocated extent
+ */
+int pool_alloc_extent_hint(storage_pool_t *pool, uint32_t hint,
+                           uint32_t *extent_id);
+
+/**
+ * pool_alloc_extent_run - Allocate extents contiguous on one device
+ * @pool: Pool
+ * @count: Number of extents
+ * @hint: Where to start looking
+ * @first: First extent of the run
+ * 
+ * Returns -1 if no run of @count free extents exists.
+ */
+int pool_alloc_extent_run(storage_pool_t *pool, uint32_t count, uint32_t hint,
+                          uint32_t *first);
+
+/**
+ * pool_alloc_extent_on - Allocate an extent on a given device
+ * @pool: Pool
+ * @dev_idx: Index into pool->devices
+ * @hint: Extent to try first, if it is on that device
+ * @extent_id: Allocated extent
+ * 
+ * Returns -1 if the device has no free extent.
+ */
+int pool_alloc_extent_on(storage_pool_t *pool, uint32_t dev_idx, uint32_t hint,
+                         uint32_t *extent_id);
+
 /**
  * pool_free_extent - Free an extent
  */
@@ -213,6 +389,9 @@ void pool_free_extent(storage_pool_t *pool, uint32_t extent_id);
 
 /**
  * pool_alloc_replicated_extent - Allocate extent with replicas
+ * 
+ * Each replica goes to a device not holding a copy yet, if there is
+ * one, preferring the device with the most free extents.
  */
 int pool_alloc_replicated_extent(storage_pool_t *pool, uint32_t replication,
                                   uint32_t *extent_ids);
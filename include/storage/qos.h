@@ -0,0 +1,117 @@
+/*
+ * PureVisor - Block I/O QoS Header
+ * 
+ * Per-device token buckets, weights and latency targets, applied as
+ * requests leave the hardware queues
+ */
+
+#ifndef _PUREVISOR_STORAGE_QOS_H
+#define _PUREVISOR_STORAGE_QOS_H
+
+#include <lib/types.h>
+#include <storage/block.h>
+#include <net/ratelimit.h>
+#include <kernel/timer.h>
+#include <kernel/smp.h>
+
+/* ============================================================================
+ * Constants
+ * ============================================================================ */
+
+#define BLOCK_QOS_WEIGHT_DEFAULT    100
+#define BLOCK_QOS_WEIGHT_MAX        1000
+#define BLOCK_QOS_WINDOW_US         50000   /* Latency targets are checked this often */
+
+/* ============================================================================
+ * Structures
+ * ============================================================================ */
+
+/*
+ * Limits as configured; rates of 0 are unlimited. The packet fields of
+ * a rate count I/Os: pkts_per_sec is the IOPS limit.
+ */
+typedef struct block_qos_config {
+    net_rate_config_t read;
+    net_rate_config_t write;    /* Everything but reads */
+    uint32_t weight;            /* 1..BLOCK_QOS_WEIGHT_MAX, 0 = default */
+    uint32_t latency_target_us; /* Average completion latency, 0 = none */
+} block_qos_config_t;
+
+/*
+ * Latency is measured from dispatch to completion, so time spent held
+ * back here does not count. Once per window, every device with QoS is
+ * checked: while one misses its target, the in-flight depth of each
+ * device of lower weight is halved per window, and it doubles back
+ * once no target is missed.
+ */
+typedef struct block_qos {
+    block_qos_config_t config;
+    block_device_t *dev;
+    net_ratelimit_t read_limit;
+    net_ratelimit_t write_limit;
+    uint32_t inflight;
+    uint32_t depth_limit;       /* 0 = not throttled */
+    bool depth_wait;            /* Dispatch held back by depth_limit */
+    spinlock_t lock;
+    ktimer_t timer;             /* Restarts dispatch */
+    
+    /* Current window */
+    uint64_t lat_sum_us;
+    uint32_t lat_count;
+    uint32_t latency_us;        /* Average over the last window */
+    
+    /* Statistics */
+    uint64_t throttled;         /* Times dispatch was held back */
+    uint64_t missed;            /* Windows over the latency target */
+    
+    struct block_qos *next;
+} block_qos_t;
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+/**
+ * block_qos_set - Configure QoS for a device
+ * @dev: Device
+ * @cfg: Limits, or NULL for none
+ * 
+ * Buckets start full; requests already waiting are dispatched under the
+ * new limits at once. Returns 0 on success.
+ */
+int block_qos_set(block_device_t *dev, const block_qos_config_t *cfg);
+
+/**
+ * block_qos_remove - Free a device's QoS state
+ * @dev: Device, with no requests in flight
+ */
+void block_qos_remove(block_device_t *dev);
+
+/**
+ * block_qos_admit - Decide whether a request may be dispatched
+ * @qos: Device QoS
+ * @req: Next request of a hardware queue
+ * 
+ * Called by the block layer. Charges the request and returns true, or
+ * returns false and arranges for dispatch to be restarted later.
+ */
+bool block_qos_admit(block_qos_t *qos, block_request_t *req);
+
+/**
+ * block_qos_done - Account for a completed request
+ * @qos: Device QoS
+ * @req: Request admitted by block_qos_admit()
+ * 
+ * Called by the block layer. Returns true if dispatch should be
+ * restarted on every hardware queue.
+ */
+bool block_qos_done(block_qos_t *qos, block_request_t *req);
+
+/**
+ * block_qos_evaluate - Close the current latency window
+ * 
+ * Completions do this every BLOCK_QOS_WINDOW_US.
+ */
+void block_qos_evaluate(void);
+
+#endif /* _PUREVISOR_STORAGE_QOS_H */
@@ -25,6 +25,9 @@ void test_vmx_suite(void);
 /* Storage Tests */
 void test_storage_suite(void);
 
+/* Network Tests */
+void test_net_suite(void);
+
 /* Cluster Tests */
 void test_cluster_suite(void);
 
@@ -9,6 +9,8 @@
 
 #include <lib/types.h>
 #include <pci/pci.h>
+#include <kernel/timer.h>
+#include <vmm/ept.h>
 
 /* ============================================================================
  * Virtio PCI Vendor/Device IDs
@@ -84,6 +86,69 @@
 #define VIRTIO_PCI_CAP_DEVICE_CFG   4
 #define VIRTIO_PCI_CAP_PCI_CFG      5
 
+/*
+ * Modern layout: one memory BAR split into page-sized regions. The
+ * notify region has a page to itself so that it can be trapped through
+ * the EPT without catching accesses to the other registers; each queue
+ * gets its own doorbell address, so the address alone names the queue.
+ */
+#define VIRTIO_PCI_MODERN_BAR       4
+#define VIRTIO_PCI_MODERN_SIZE      0x4000
+#define VIRTIO_PCI_COMMON_OFFSET    0x0000
+#define VIRTIO_PCI_ISR_OFFSET       0x1000
+#define VIRTIO_PCI_DEVICE_OFFSET    0x2000
+#define VIRTIO_PCI_NOTIFY_OFFSET    0x3000
+#define VIRTIO_PCI_REGION_SIZE      0x1000
+#define VIRTIO_PCI_NOTIFY_MULTIPLIER 4
+
+/* Guest physical window the modern BARs are placed in */
+#define VIRTIO_PCI_MMIO_BASE        0xFE000000ULL
+#define VIRTIO_PCI_MMIO_SLOTS       64
+
+/* Vendor capabilities, starting at the first non-header config byte */
+#define VIRTIO_PCI_CAP_BASE         0x40
+#define VIRTIO_PCI_CAPS_SIZE        0x44
+
+typedef struct PACKED {
+    uint8_t cap_vndr;       /* PCI_CAP_VENDOR */
+    uint8_t cap_next;
+    uint8_t cap_len;
+    uint8_t cfg_type;       /* VIRTIO_PCI_CAP_* */
+    uint8_t bar;
+    uint8_t id;
+    uint8_t padding[2];
+    uint32_t offset;        /* Within the BAR */
+    uint32_t length;
+} virtio_pci_cap_t;
+
+typedef struct PACKED {
+    virtio_pci_cap_t cap;
+    uint32_t notify_off_multiplier;
+} virtio_pci_notify_cap_t;
+
+/* Common configuration structure offsets */
+#define VIRTIO_PCI_COMMON_DFSELECT  0x00
+#define VIRTIO_PCI_COMMON_DF        0x04
+#define VIRTIO_PCI_COMMON_GFSELECT  0x08
+#define VIRTIO_PCI_COMMON_GF        0x0C
+#define VIRTIO_PCI_COMMON_MSIX      0x10
+#define VIRTIO_PCI_COMMON_NUMQ      0x12
+#define VIRTIO_PCI_COMMON_STATUS    0x14
+#define VIRTIO_PCI_COMMON_CFGGEN    0x15
+#define VIRTIO_PCI_COMMON_Q_SELECT  0x16
+#define VIRTIO_PCI_COMMON_Q_SIZE    0x18
+#define VIRTIO_PCI_COMMON_Q_MSIX    0x1A
+#define VIRTIO_PCI_COMMON_Q_ENABLE  0x1C
+#define VIRTIO_PCI_COMMON_Q_NOFF    0x1E
+#define VIRTIO_PCI_COMMON_Q_DESCLO  0x20
+#define VIRTIO_PCI_COMMON_Q_DESCHI  0x24
+#define VIRTIO_PCI_COMMON_Q_AVAILLO 0x28
+#define VIRTIO_PCI_COMMON_Q_AVAILHI 0x2C
+#define VIRTIO_PCI_COMMON_Q_USEDLO  0x30
+#define VIRTIO_PCI_COMMON_Q_USEDHI  0x34
+
+#define VIRTIO_MSI_NO_VECTOR        0xFFFF
+
 /* ============================================================================
  * Virtqueue Structures
  * ============================================================================ */
@@ -127,6 +192,29 @@ typedef struct PACKED {
     /* uint16_t avail_event; at end if EVENT_IDX */
 } virtq_used_t;
 
+/* ============================================================================
+ * Interrupt Coalescing
+ * ============================================================================ */
+
+#define VIRTQ_COALESCE_WINDOW_US    10000   /* Adaptive rate sampling period */
+
+typedef struct virtq_coalesce {
+    /* Parameters; max_usecs == 0 signals every completion at once */
+    uint32_t max_frames;        /* Completions per interrupt, 0 = no limit */
+    uint32_t max_usecs;         /* Longest a completion waits */
+    bool adaptive;              /* Derive both from the completion rate */
+    
+    /* State */
+    uint32_t pending;           /* Completions not yet signalled */
+    ktimer_t timer;             /* Signals after max_usecs */
+    uint64_t window_start;
+    uint32_t window_count;
+    
+    /* Statistics */
+    uint64_t completions;
+    uint64_t interrupts;
+} virtq_coalesce_t;
+
 /* ============================================================================
  * Virtqueue Structure
  * ============================================================================ */
@@ -151,11 +239,16 @@ typedef struct virtqueue {
     /* Shadow indices */
     uint16_t last_avail_idx;
     uint16_t last_used_idx;
+    uint16_t signalled_used;    /* used->idx at the last interrupt check */
     
     /* Notification */
     uint16_t notify_offset;
     bool notification_pending;
     
+    /* Interrupts to the guest */
+    struct virtio_device *dev;
+    virtq_coalesce_t coalesce;
+    
     /* Interrupt injection callback */
     void (*interrupt)(struct virtqueue *vq);
     void *interrupt_data;
@@ -165,7 +258,7 @@ typedef struct virtqueue {
  * Virtio Device Structure
  * ============================================================================ */
 
-#define VIRTIO_MAX_QUEUES   8
+#define VIRTIO_MAX_QUEUES   17      /* 8 virtio-net queue pairs + control */
 
 typedef struct virtio_device {
     /* PCI device */
@@ -182,6 +275,8 @@ typedef struct virtio_device {
     uint64_t host_features;
     uint64_t guest_features;
     bool features_ok;
+    uint32_t host_features_sel;     /* Modern: 32-bit window selects */
+    uint32_t guest_features_sel;
     
     /* Queues */
     virtqueue_t queues[VIRTIO_MAX_QUEUES];
@@ -192,6 +287,12 @@ typedef struct virtio_device {
     uint8_t *config;
     size_t config_size;
     
+    /* Modern transport */
+    uint8_t caps[VIRTIO_PCI_CAPS_SIZE];
+    int mmio_slot;                  /* -1 = legacy only */
+    ept_context_t *guest;           /* Owner's address space, NULL = none */
+    phys_addr_t doorbell;           /* Registered notify region, 0 = none */
+    
     /* Callbacks */
     int (*queue_notify)(struct virtio_device *dev, uint16_t queue);
     int (*config_write)(struct virtio_device *dev, uint32_t offset,
@@ -246,12 +347,46 @@ int virtq_get_desc(virtqueue_t *vq, uint16_t index, virtq_desc_t *desc);
  */
 void virtq_push(virtqueue_t *vq, uint16_t head, uint32_t len);
 
+/**
+ * virtq_unpop - Return popped chains to the available ring
+ * @vq: Virtqueue
+ * @count: Chains to give back (most recent first)
+ */
+void virtq_unpop(virtqueue_t *vq, uint16_t count);
+
+/**
+ * virtq_fill - Write a used element without publishing it
+ * @vq: Virtqueue
+ * @head: Descriptor chain head
+ * @len: Bytes written
+ * @offset: Position after the current used index
+ */
+void virtq_fill(virtqueue_t *vq, uint16_t head, uint32_t len, uint16_t offset);
+
+/**
+ * virtq_flush - Publish filled used elements to the guest
+ * @vq: Virtqueue
+ * @count: Elements written with virtq_fill()
+ */
+void virtq_flush(virtqueue_t *vq, uint16_t count);
+
 /**
  * virtq_notify - Check if guest should be notified
  * @vq: Virtqueue
  */
 bool virtq_should_notify(virtqueue_t *vq);
 
+/**
+ * virtq_interrupt - Signal new used entries to the guest
+ * @vq: Virtqueue
+ * @count: Completions just added to the used ring
+ * 
+ * With coalescing configured the interrupt is held back until
+ * max_frames completions are pending or the oldest has waited
+ * max_usecs, whichever comes first.
+ */
+void virtq_interrupt(virtqueue_t *vq, uint32_t count);
+
 /**
  * virtq_enable_notify - Enable notifications from guest
  * @vq: Virtqueue
@@ -275,6 +410,26 @@ void virtq_disable_notify(virtqueue_t *vq);
  */
 int virtio_pci_init(virtio_device_t *dev, uint16_t type);
 
+/**
+ * virtio_pci_destroy - Detach a virtio device from the PCI bus
+ * @dev: Device
+ * 
+ * Removes its notify doorbell and releases its MMIO window.
+ */
+void virtio_pci_destroy(virtio_device_t *dev);
+
+/**
+ * virtio_pci_attach - Bind a device to the guest that owns it
+ * @dev: Device
+ * @guest: That guest's EPT, attached with mmio_doorbell_attach(), or NULL
+ * 
+ * The notify doorbell is trapped in @guest alone. Its exits service
+ * that page of the modern BAR but not the registers beside it, so a
+ * bound device offers no modern capabilities: the guest's driver stays
+ * on the legacy I/O BAR.
+ */
+void virtio_pci_attach(virtio_device_t *dev, ept_context_t *guest);
+
 /**
  * virtio_add_queue - Add a virtqueue to device
  * @dev: Device
@@ -283,6 +438,26 @@ int virtio_pci_init(virtio_device_t *dev, uint16_t type);
  */
 virtqueue_t *virtio_add_queue(virtio_device_t *dev, uint16_t size);
 
+/**
+ * virtio_set_coalesce - Set interrupt coalescing of a queue
+ * @dev: Device
+ * @queue: Queue index
+ * @max_frames: Completions per interrupt, 0 = bounded by time only
+ * @max_usecs: Longest a completion may wait, 0 = no coalescing
+ * @adaptive: Ignore the limits above and follow the completion rate:
+ *            no coalescing at low rates, deeper batches at high ones
+ */
+void virtio_set_coalesce(virtio_device_t *dev, uint16_t queue,
+                         uint32_t max_frames, uint32_t max_usecs, bool adaptive);
+
+/**
+ * virtio_flush_interrupts - Signal all held-back completions
+ * @dev: Device
+ * 
+ * Also stops the coalescing timers; call before freeing the device.
+ */
+void virtio_flush_interrupts(virtio_device_t *dev);
+
 /**
  * virtio_set_config - Set device configuration
  * @dev: Device
@@ -297,6 +472,15 @@ void virtio_set_config(virtio_device_t *dev, void *config, size_t size);
  */
 void virtio_notify_config(virtio_device_t *dev);
 
+/**
+ * virtio_pci_notify - Service a doorbell write
+ * @dev: Device
+ * @offset: Offset within the notify region
+ * 
+ * Shared by the trapped doorbell page and the generic BAR path.
+ */
+void virtio_pci_notify(virtio_device_t *dev, uint64_t offset);
+
 /**
  * virtio_pci_read - Handle BAR read
  * @dev: Device
@@ -9,6 +9,7 @@
 
 #include <lib/types.h>
 #include <virtio/virtio.h>
+#include <storage/block.h>
 
 /* ============================================================================
  * Virtio Block Feature Bits
@@ -44,6 +45,8 @@
 #define VIRTIO_BLK_S_IOERR          1
 #define VIRTIO_BLK_S_UNSUPP         2
 
+#define VIRTIO_BLK_SEG_MAX          128 /* Data segments per request */
+
 /* ============================================================================
  * Virtio Block Configuration
  * ============================================================================ */
@@ -95,7 +98,8 @@ typedef struct blk_backend {
     enum {
         BLK_BACKEND_MEMORY,     /* RAM disk */
         BLK_BACKEND_FILE,       /* File-backed */
-        BLK_BACKEND_RAW         /* Raw device */
+        BLK_BACKEND_RAW,        /* Raw device */
+        BLK_BACKEND_DEVICE      /* Block layer device */
     } type;
     
     /* Disk properties */
@@ -113,6 +117,10 @@ typedef struct blk_backend {
     int (*write)(struct blk_backend *be, uint64_t offset,
                  const void *buf, size_t len);
     int (*flush)(struct blk_backend *be);
+    
+    /* Optional: a whole request's segments at once */
+    int (*rw_iov)(struct blk_backend *be, bool write, uint64_t offset,
+                  const block_iovec_t *iov, uint32_t count);
 } blk_backend_t;
 
 /* ============================================================================
@@ -123,6 +131,7 @@ typedef struct virtio_blk {
     virtio_device_t dev;
     virtio_blk_config_t config;
     blk_backend_t *backend;
+    block_iovec_t iov[VIRTIO_BLK_SEG_MAX];  /* Guest segments of the current request */
 } virtio_blk_t;
 
 /* ============================================================================
@@ -149,6 +158,15 @@ void virtio_blk_destroy(virtio_blk_t *blk);
  */
 blk_backend_t *blk_backend_create_memory(uint64_t size);
 
+/**
+ * blk_backend_create_device - Back a virtio-blk device with a block device
+ * @dev: Block layer device, e.g. a pool volume
+ * 
+ * Guest scatter-gather lists are passed to @dev without bouncing. @dev
+ * counts the backend among its users until blk_backend_destroy().
+ */
+blk_backend_t *blk_backend_create_device(block_device_t *dev);
+
 /**
  * blk_backend_destroy - Destroy block backend
  * @be: Backend to destroy
@@ -9,6 +9,10 @@
 
 #include <lib/types.h>
 #include <virtio/virtio.h>
+#include <net/pktbuf.h>
+#include <net/flow.h>
+#include <net/ratelimit.h>
+#include <kernel/timer.h>
 
 /* ============================================================================
  * Virtio Net Feature Bits
@@ -35,6 +39,8 @@
 #define VIRTIO_NET_F_GUEST_ANNOUNCE     21
 #define VIRTIO_NET_F_MQ                 22
 #define VIRTIO_NET_F_CTRL_MAC_ADDR      23
+#define VIRTIO_NET_F_HASH_REPORT        57
+#define VIRTIO_NET_F_RSS                60
 #define VIRTIO_NET_F_SPEED_DUPLEX       63
 
 /* ============================================================================
@@ -61,6 +67,9 @@ typedef struct PACKED {
     uint16_t num_buffers;   /* If VIRTIO_NET_F_MRG_RXBUF */
 } virtio_net_hdr_t;
 
+/* Legacy header length when neither MRG_RXBUF nor VERSION_1 is negotiated */
+#define VIRTIO_NET_HDR_LEGACY_LEN   10
+
 /* ============================================================================
  * Virtio Net Configuration
  * ============================================================================ */
@@ -75,39 +84,95 @@ typedef struct PACKED {
     uint16_t mtu;
     uint32_t speed;             /* In Mbps */
     uint8_t duplex;
+    uint8_t rss_max_key_size;
+    uint16_t rss_max_indirection_table_length;
+    uint32_t supported_hash_types;
 } virtio_net_config_t;
 
+/* ============================================================================
+ * Control Virtqueue
+ * ============================================================================ */
+
+#define VIRTIO_NET_OK                   0
+#define VIRTIO_NET_ERR                  1
+
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG   1
+
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN 1
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX 0x8000
+
+/* Command layout: header, command data, then a device-writable ack byte */
+typedef struct PACKED {
+    uint8_t class;
+    uint8_t cmd;
+} virtio_net_ctrl_hdr_t;
+
+/* VIRTIO_NET_CTRL_MQ_RSS_CONFIG, fixed part before indirection_table[] */
+typedef struct PACKED {
+    uint32_t hash_types;
+    uint16_t indirection_table_mask;
+    uint16_t unclassified_queue;
+    /* uint16_t indirection_table[mask + 1]; */
+    /* uint16_t max_tx_vq; uint8_t hash_key_length; hash_key_data[]; */
+} virtio_net_rss_config_t;
+
 /* ============================================================================
  * Network Backend
  * ============================================================================ */
 
 #define NET_PACKET_MAX_SIZE     65536
 #define NET_RX_RING_SIZE        256
+#define NET_SG_MAX              32      /* Max fragments per frame */
+#define NET_FLOW_TABLE_SIZE     256     /* Learned flow -> queue entries */
+
+/* Frame fragment (guest or backend memory, mapped in the host) */
+typedef struct net_sg {
+    void *addr;
+    uint32_t len;
+} net_sg_t;
 
-typedef struct net_packet {
-    uint8_t data[NET_PACKET_MAX_SIZE];
-    size_t len;
-    struct net_packet *next;
-} net_packet_t;
+/*
+ * TX completion callback. Invoked exactly once by the backend when it
+ * no longer references the fragments passed to transmit().
+ */
+typedef void (*net_tx_done_t)(void *ctx, int status);
 
 typedef struct net_backend {
     /* Backend type */
     enum {
         NET_BACKEND_LOOPBACK,   /* Loopback (for testing) */
         NET_BACKEND_TAP,        /* TAP device */
-        NET_BACKEND_USER        /* User-space networking */
+        NET_BACKEND_USER,       /* User-space networking */
+        NET_BACKEND_VSWITCH,    /* Port of an in-hypervisor switch */
+        NET_BACKEND_UPLINK      /* Physical uplink NIC */
     } type;
     
     /* MAC address */
     uint8_t mac[6];
     
-    /* RX packet queue */
-    net_packet_t *rx_head;
-    net_packet_t *rx_tail;
-    uint32_t rx_count;
+    /* RX packet queue (pool buffers, possibly referencing peer memory) */
+    pktbuf_queue_t rx_queue;
+    
+    /*
+     * TX callback. On success (0) the backend owns @sg until it calls
+     * @done; on failure @done is never called and the caller keeps it.
+     * @ol describes pending offloads (NULL if none); the frame may be a
+     * TCP super-frame with a partial checksum.
+     */
+    int (*transmit)(struct net_backend *be, const net_sg_t *sg, uint32_t nsg,
+                    const pktbuf_offload_t *ol, net_tx_done_t done, void *ctx);
+    
+    /* End of a TX burst: frames handed to transmit() may be processed */
+    void (*tx_flush)(struct net_backend *be);
     
-    /* TX callback */
-    int (*transmit)(struct net_backend *be, const void *data, size_t len);
+    /* Called by net_backend_destroy() before the backend is freed */
+    void (*release)(struct net_backend *be);
+    
+    /* RX notification to the attached frontend */
+    void (*rx_notify)(struct net_backend *be);
+    void *frontend;
     
     /* Backend-specific data */
     void *priv;
@@ -117,15 +182,81 @@ typedef struct net_backend {
  * Virtio Net Device
  * ============================================================================ */
 
+#define VIRTIO_NET_MAX_QUEUE_PAIRS  ((VIRTIO_MAX_QUEUES - 1) / 2)
+
+/* In-flight TX chain, indexed by descriptor head */
+struct virtio_net_tx_slot {
+    struct virtio_net_tx_slots *owner;
+    uint16_t head;
+    uint32_t len;
+};
+
+/*
+ * A queue's TX slots. Frames a peer still holds when the device is reset
+ * or destroyed keep theirs: the block is orphaned and freed by the last
+ * of their completions, which no longer return chains to the guest.
+ */
+typedef struct virtio_net_tx_slots {
+    struct virtio_net *net;
+    uint16_t queue;
+    uint32_t orphaned;          /* Completions still due, once orphaned */
+    struct virtio_net_tx_slot slot[VIRTQ_MAX_SIZE];
+} virtio_net_tx_slots_t;
+
+/* One RX/TX queue pair, serviced by the vCPU that owns it */
+typedef struct virtio_net_queue {
+    virtqueue_t *rx_vq;
+    virtqueue_t *tx_vq;
+    
+    /* Frames steered to this queue, awaiting guest buffers */
+    pktbuf_queue_t backlog;
+    
+    virtio_net_tx_slots_t *tx_slots;
+    uint32_t tx_inflight;
+    
+    /* QoS: over-limit TX stays in the guest ring, RX in the backlog */
+    struct virtio_net *net;
+    uint16_t index;
+    net_ratelimit_t tx_limit;
+    net_ratelimit_t rx_limit;
+    ktimer_t tx_timer;
+    ktimer_t rx_timer;
+    
+    /* Statistics */
+    uint64_t rx_packets;
+    uint64_t tx_packets;
+    uint64_t rx_dropped;
+} virtio_net_queue_t;
+
 typedef struct virtio_net {
     virtio_device_t dev;
     virtio_net_config_t config;
     net_backend_t *backend;
     
-    /* Queues */
-    virtqueue_t *rx_vq;
-    virtqueue_t *tx_vq;
-    virtqueue_t *ctrl_vq;
+    /* Queue pairs (vq 2n = RX n, vq 2n+1 = TX n), control queue follows */
+    virtio_net_queue_t queues[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    uint16_t max_queue_pairs;
+    uint16_t curr_queue_pairs;
+    
+    /* Receive steering */
+    struct {
+        bool guest_configured;  /* Set through RSS_CONFIG */
+        uint32_t hash_types;
+        uint16_t indir_mask;
+        uint16_t unclassified;
+        uint16_t indir[NET_RSS_INDIR_SIZE];
+        uint8_t key[NET_RSS_KEY_SIZE];
+    } rss;
+    
+    /* Flow hash -> TX queue of the sending vCPU, learned on transmit */
+    struct {
+        uint32_t hash;
+        uint16_t queue;         /* Queue + 1, 0 if unused */
+    } flows[NET_FLOW_TABLE_SIZE];
+    
+    /* Per-device limits, shared evenly by the active queue pairs */
+    net_rate_config_t tx_rate;
+    net_rate_config_t rx_rate;
     
     /* Statistics */
     uint64_t rx_packets;
@@ -146,12 +277,42 @@ typedef struct virtio_net {
  */
 virtio_net_t *virtio_net_create(net_backend_t *backend);
 
+/**
+ * virtio_net_create_mq - Create a multi-queue virtio network device
+ * @backend: Network backend to use
+ * @queue_pairs: RX/TX queue pairs to offer (1..VIRTIO_NET_MAX_QUEUE_PAIRS)
+ * 
+ * The guest starts on one pair and enables the rest through the control
+ * queue. Received frames are steered to the pair whose TX queue last
+ * carried the flow, falling back to the RSS indirection table.
+ * 
+ * Returns virtio_net device or NULL on failure
+ */
+virtio_net_t *virtio_net_create_mq(net_backend_t *backend, uint16_t queue_pairs);
+
 /**
  * virtio_net_destroy - Destroy a virtio network device
  * @net: Device to destroy
+ * 
+ * Frames it transmitted may outlive it in a peer's queues; their
+ * completions are absorbed. Destroying the backend first, as a VM
+ * does, lets those still in the backend complete normally.
  */
 void virtio_net_destroy(virtio_net_t *net);
 
+/**
+ * virtio_net_set_rate_limit - Limit guest transmit and receive rates
+ * @net: Device
+ * @tx: Transmit limit, or NULL for unlimited
+ * @rx: Receive limit, or NULL for unlimited
+ * 
+ * Over-limit transmits are left in the guest's ring until tokens are
+ * available, which back-pressures the guest instead of dropping.
+ * Over-limit receives wait in the queue backlog.
+ */
+void virtio_net_set_rate_limit(virtio_net_t *net, const net_rate_config_t *tx,
+                               const net_rate_config_t *rx);
+
 /**
  * virtio_net_receive - Queue a received packet
  * @net: Device
@@ -165,9 +326,41 @@ int virtio_net_receive(virtio_net_t *net, const void *data, size_t len);
  */
 net_backend_t *net_backend_create_loopback(void);
 
+/**
+ * net_backend_rx_enqueue - Queue a frame for delivery to the frontend
+ * @be: Backend
+ * @pb: Frame; the queue takes over the caller's reference
+ * 
+ * Returns 0 or -1 if the queue is full (the frame is freed)
+ */
+int net_backend_rx_enqueue(net_backend_t *be, pktbuf_t *pb);
+
+/**
+ * net_backend_rx_enqueue_burst - Queue several frames, notify once
+ * @be: Backend
+ * @q: Frames; the queue is emptied
+ * 
+ * Returns number of frames dropped because the queue was full
+ */
+int net_backend_rx_enqueue_burst(net_backend_t *be, pktbuf_queue_t *q);
+
+/**
+ * net_backend_attach_sg - Wrap TX fragments in a packet without copying
+ * @sg: Fragments
+ * @nsg: Fragment count
+ * @ol: Offload state to carry with the frame, or NULL
+ * @done: Completion called when the last reference is dropped
+ * @ctx: Completion context
+ */
+pktbuf_t *net_backend_attach_sg(const net_sg_t *sg, uint32_t nsg,
+                                const pktbuf_offload_t *ol,
+                                net_tx_done_t done, void *ctx);
+
 /**
  * net_backend_destroy - Destroy network backend
  * @be: Backend to destroy
+ * 
+ * An attached virtio-net device is detached and may be destroyed after.
  */
 void net_backend_destroy(net_backend_t *be);
 
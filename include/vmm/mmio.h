@@ -0,0 +1,91 @@
+/*
+ * PureVisor - Fast MMIO Doorbell Header
+ * 
+ * Write-only device registers trapped through read-only EPT mappings
+ */
+
+#ifndef _PUREVISOR_MMIO_H
+#define _PUREVISOR_MMIO_H
+
+#include <lib/types.h>
+#include <vmm/ept.h>
+
+/* ============================================================================
+ * Constants
+ * ============================================================================ */
+
+#define MMIO_DOORBELL_MAX       64      /* Registered doorbell regions */
+#define MMIO_SPACE_MAX          16      /* Guest EPTs holding doorbells */
+
+/* ============================================================================
+ * Structures
+ * ============================================================================ */
+
+/*
+ * Called with the offset of the write within the region. The value
+ * written is not available: the exit carries no decoded instruction,
+ * so the address alone has to say what the write means.
+ */
+typedef void (*mmio_doorbell_fn_t)(void *ctx, uint64_t offset);
+
+typedef struct mmio_doorbell {
+    ept_context_t *space;       /* The one guest it is mapped into */
+    phys_addr_t base;           /* Page aligned */
+    uint64_t size;              /* Multiple of the page size */
+    mmio_doorbell_fn_t fn;
+    void *ctx;
+    
+    /* Statistics */
+    uint64_t hits;
+} mmio_doorbell_t;
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+/**
+ * mmio_doorbell_register - Add a doorbell region to one guest
+ * @space: EPT of the guest owning the device, attached
+ * @base: Guest physical base, page aligned
+ * @size: Region size, a multiple of the page size
+ * @fn: Handler
+ * @ctx: Handler argument
+ * 
+ * The region is mapped read-only onto a zero page in @space alone:
+ * reads return zero without an exit, writes exit with EPT_VIOLATION.
+ * Returns 0 on success, -1 if full, overlapping or not attached.
+ */
+int mmio_doorbell_register(ept_context_t *space, phys_addr_t base, uint64_t size,
+                           mmio_doorbell_fn_t fn, void *ctx);
+
+/**
+ * mmio_doorbell_unregister - Remove a doorbell region
+ * @space: Space passed to mmio_doorbell_register()
+ * @base: Base passed to mmio_doorbell_register()
+ */
+void mmio_doorbell_unregister(ept_context_t *space, phys_addr_t base);
+
+/**
+ * mmio_doorbell_attach - Prepare a guest address space for doorbells
+ * @ept: Guest EPT, as it is set up
+ */
+int mmio_doorbell_attach(ept_context_t *ept);
+
+/**
+ * mmio_doorbell_detach - Drop a guest address space and its doorbells
+ * @ept: Guest EPT, about to be destroyed
+ */
+void mmio_doorbell_detach(ept_context_t *ept);
+
+/**
+ * mmio_doorbell_dispatch - Run the handler for a trapped write
+ * @eptp: EPT pointer of the guest that wrote
+ * @gpa: Faulting guest physical address
+ * 
+ * Only stores may be passed in; a read of a doorbell is not a kick.
+ * 
+ * Returns true if @gpa belongs to one of that guest's doorbells
+ */
+bool mmio_doorbell_dispatch(uint64_t eptp, phys_addr_t gpa);
+
+#endif /* _PUREVISOR_MMIO_H */
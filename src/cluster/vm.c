@@ -7,6 +7,9 @@
 #include <lib/types.h>
 #include <lib/string.h>
 #include <cluster/vm.h>
+#include <virtio/virtio_net.h>
+#include <net/vswitch.h>
+#include <vmm/mmio.h>
 #include <mm/heap.h>
 #include <kernel/console.h>
 #include <arch/x86_64/cpu.h>
@@ -50,6 +53,71 @@ int vm_manager_init(vm_manager_t *mgr, cluster_node_t *local_node)
     return 0;
 }
 
+/* ============================================================================
+ * Devices
+ * ============================================================================ */
+
+/* Back each enabled NIC with a virtio-net port on its network's switch */
+/* Guest EPT; device doorbells are trapped in it */
+static int vm_setup_ept(virtual_machine_t *vm)
+{
+    if (vm->ept) return 0;
+    
+    vm->ept = ept_create();
+    if (!vm->ept) return -1;
+    
+    if (mmio_doorbell_attach(vm->ept) != 0) {
+        ept_destroy(vm->ept);
+        vm->ept = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void vm_teardown_ept(virtual_machine_t *vm)
+{
+    if (!vm->ept) return;
+    
+    mmio_doorbell_detach(vm->ept);
+    ept_destroy(vm->ept);
+    vm->ept = NULL;
+}
+
+static void vm_attach_nics(virtual_machine_t *vm)
+{
+    for (uint32_t i = 0; i < vm->config.nic_count && i < VM_MAX_NICS; i++) {
+        vm_nic_config_t *cfg = &vm->config.nics[i];
+        if (vm->nic_devs[i]) continue;
+        
+        net_backend_t *be = vswitch_connect_nic(cfg);
+        if (!be) continue;
+        
+        virtio_net_t *net = virtio_net_create(be);
+        if (!net) {
+            net_backend_destroy(be);
+            continue;
+        }
+        
+        /* Limits set while the VM was down take effect now */
+        virtio_net_set_rate_limit(net, &cfg->tx_limit, &cfg->rx_limit);
+        virtio_pci_attach(&net->dev, vm->ept);
+        vm->nic_devs[i] = net;
+    }
+}
+
+static void vm_detach_nics(virtual_machine_t *vm)
+{
+    for (uint32_t i = 0; i < VM_MAX_NICS; i++) {
+        virtio_net_t *net = vm->nic_devs[i];
+        if (!net) continue;
+        
+        /* The port first: our frames still in it complete while we exist */
+        net_backend_destroy(net->backend);
+        virtio_net_destroy(net);
+        vm->nic_devs[i] = NULL;
+    }
+}
+
 /* ============================================================================
  * VM Lifecycle
  * ============================================================================ */
@@ -122,6 +190,8 @@ void virt_vm_destroy(vm_manager_t *mgr, virtual_machine_t *vm)
         pp = &(*pp)->next;
     }
     
+    vm_detach_nics(vm);
+    vm_teardown_ept(vm);
     pr_info("VM: Destroyed '%s'", vm->config.name);
     kfree(vm);
 }
@@ -144,6 +214,12 @@ int virt_vm_start(vm_manager_t *mgr, virtual_machine_t *vm)
      * 4. Initialize devices
      * 5. Load boot image
      */
+    if (vm_setup_ept(vm) != 0) {
+        strncpy(vm->error_msg, "Failed to set up guest EPT", 127);
+        vm_set_state(mgr, vm, VM_STATE_ERROR);
+        return -1;
+    }
+    vm_attach_nics(vm);
     
     vm->started_time = rdtsc();
     vm_set_state(mgr, vm, VM_STATE_RUNNING);
@@ -170,6 +246,8 @@ int virt_vm_stop(vm_manager_t *mgr, virtual_machine_t *vm)
     /* For now, just force stop */
     
     vm->stopped_time = rdtsc();
+    vm_detach_nics(vm);
+    vm_teardown_ept(vm);
     vm_set_state(mgr, vm, VM_STATE_STOPPED);
     mgr->running_count--;
     
@@ -190,6 +268,8 @@ int virt_vm_force_stop(vm_manager_t *mgr, virtual_machine_t *vm)
     
     /* Force immediate stop */
     vm->stopped_time = rdtsc();
+    vm_detach_nics(vm);
+    vm_teardown_ept(vm);
     
     if (vm->state == VM_STATE_RUNNING || vm->state == VM_STATE_PAUSED) {
         mgr->running_count--;
@@ -276,6 +356,29 @@ void virt_vm_update_stats(virtual_machine_t *vm)
     vm->stats.cpu_time_ns += 1000000;  /* Placeholder */
 }
 
+int virt_vm_set_nic_limit(virtual_machine_t *vm, uint32_t nic,
+                          const net_rate_config_t *tx,
+                          const net_rate_config_t *rx)
+{
+    if (!vm || nic >= vm->config.nic_count) return -1;
+    
+    vm_nic_config_t *cfg = &vm->config.nics[nic];
+    memset(&cfg->tx_limit, 0, sizeof(cfg->tx_limit));
+    memset(&cfg->rx_limit, 0, sizeof(cfg->rx_limit));
+    if (tx) cfg->tx_limit = *tx;
+    if (rx) cfg->rx_limit = *rx;
+    
+    if (vm->nic_devs[nic]) {
+        virtio_net_set_rate_limit(vm->nic_devs[nic], &cfg->tx_limit, &cfg->rx_limit);
+    }
+    
+    pr_info("VM '%s': NIC %u limits TX %llu B/s %u pkt/s, RX %llu B/s %u pkt/s",
+            vm->config.name, nic,
+            cfg->tx_limit.bytes_per_sec, cfg->tx_limit.pkts_per_sec,
+            cfg->rx_limit.bytes_per_sec, cfg->rx_limit.pkts_per_sec);
+    return 0;
+}
+
 /* ============================================================================
  * Migration
  * ============================================================================ */
@@ -8,6 +8,7 @@
 #include <lib/string.h>
 #include <kernel/apic.h>
 #include <kernel/console.h>
+#include <kernel/smp.h>
 #include <arch/x86_64/cpu.h>
 #include <mm/pmm.h>
 
@@ -19,6 +20,10 @@ static volatile uint32_t *lapic_base = NULL;
 static volatile uint32_t *ioapic_base = NULL;
 static bool apic_initialized = false;
 
+/* Per CPU: the LAPIC timer is counting in periodic mode */
+static bool timer_periodic[MAX_CPUS];
+static bool timer_active[MAX_CPUS];
+
 /* ============================================================================
  * Local APIC Functions
  * ============================================================================ */
@@ -167,6 +172,10 @@ void lapic_timer_init(uint8_t vector, bool periodic)
     if (periodic) lvt |= TIMER_PERIODIC;
     lapic_write(LAPIC_TIMER_LVT, lvt);
     
+    uint32_t cpu = smp_get_current_cpu();
+    timer_periodic[cpu] = periodic;
+    timer_active[cpu] = false;
+    
     pr_info("LAPIC: Timer initialized (vector %u, %s)", 
             vector, periodic ? "periodic" : "one-shot");
 }
@@ -174,6 +183,14 @@ void lapic_timer_init(uint8_t vector, bool periodic)
 void lapic_timer_set(uint32_t count)
 {
     lapic_write(LAPIC_TIMER_ICR, count);
+    
+    uint32_t cpu = smp_get_current_cpu();
+    timer_active[cpu] = timer_periodic[cpu] && count != 0;
+}
+
+bool lapic_timer_active(void)
+{
+    return timer_active[smp_get_current_cpu()];
 }
 
 /* ============================================================================
@@ -10,6 +10,7 @@
 #include <kernel/console.h>
 #include <kernel/apic.h>
 #include <kernel/smp.h>
+#include <kernel/timer.h>
 #include <mm/pmm.h>
 #include <mm/paging.h>
 #include <mm/heap.h>
@@ -21,8 +22,10 @@
 #include <virtio/virtio_blk.h>
 #include <virtio/virtio_net.h>
 #include <virtio/virtio_console.h>
+#include <net/uplink.h>
 #include <storage/block.h>
 #include <storage/pool.h>
+#include <storage/memblk.h>
 #include <storage/distributed.h>
 #include <cluster/node.h>
 #include <cluster/vm.h>
@@ -376,13 +379,14 @@ static void test_virtio_subsystem(void)
     kprintf("Creating virtio-net device...\n");
     net_backend_t *net_be = net_backend_create_loopback();
     if (net_be) {
-        virtio_net_t *net = virtio_net_create(net_be);
+        virtio_net_t *net = virtio_net_create_mq(net_be, 4);
         if (net) {
             pci_register_device(&net->dev.pci);
-            kprintf("  Virtio-net: MAC=%02x:%02x:%02x:%02x:%02x:%02x\n",
+            kprintf("  Virtio-net: MAC=%02x:%02x:%02x:%02x:%02x:%02x, %u queue pairs\n",
                     net->config.mac[0], net->config.mac[1],
                     net->config.mac[2], net->config.mac[3],
-                    net->config.mac[4], net->config.mac[5]);
+                    net->config.mac[4], net->config.mac[5],
+                    net->max_queue_pairs);
         }
     }
     
@@ -402,9 +406,6 @@ static void test_virtio_subsystem(void)
  * Storage Test
  * ============================================================================ */
 
-/* External memory block device creator */
-extern block_device_t *mem_block_create(const char *name, uint64_t size);
-
 static void test_storage_subsystem(void)
 {
     kprintf("\n--- Storage Subsystem Test ---\n");
@@ -681,6 +682,9 @@ void kernel_main(uint32_t magic, void *multiboot_info)
     /* Run Cluster tests */
     test_cluster_subsystem();
     
+    /* Cluster uplink, if the platform gives us a NIC */
+    uplink_t *uplink = uplink_probe();
+    
     /* Print statistics */
     pmm_dump_stats();
     heap_dump_stats();
@@ -766,6 +770,11 @@ void kernel_main(uint32_t magic, void *multiboot_info)
     
     /* Idle loop */
     while (1) {
+        if (uplink) {
+            uplink_poll(uplink, UPLINK_POLL_BUDGET);
+        }
+        block_run_completions();
+        ktimer_run();
         hlt();
     }
 }
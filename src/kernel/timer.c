@@ -0,0 +1,101 @@
+/*
+ * PureVisor - Host Timer Implementation
+ * 
+ * A single sorted list of pending timers. Checking for expiry costs one
+ * TSC read and one compare, so it is cheap enough for every VM exit.
+ */
+
+#include <lib/types.h>
+#include <kernel/timer.h>
+#include <kernel/smp.h>
+#include <arch/x86_64/cpu.h>
+
+/* ============================================================================
+ * Global State
+ * ============================================================================ */
+
+static ktimer_t *timer_list;
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+/* Caller holds timer_lock */
+static void timer_unlink(ktimer_t *timer)
+{
+    for (ktimer_t **pp = &timer_list; *pp; pp = &(*pp)->next) {
+        if (*pp == timer) {
+            *pp = timer->next;
+            break;
+        }
+    }
+    timer->next = NULL;
+    timer->armed = false;
+}
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+void ktimer_init(ktimer_t *timer, ktimer_fn_t fn, void *ctx)
+{
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->ctx = ctx;
+    timer->armed = false;
+    timer->next = NULL;
+}
+
+void ktimer_arm(ktimer_t *timer, uint64_t delay_us)
+{
+    uint64_t expires = rdtsc_us() + delay_us;
+    
+    spinlock_acquire(&timer_lock);
+    
+    if (timer->armed) {
+        timer_unlink(timer);
+    }
+    
+    ktimer_t **pp = &timer_list;
+    while (*pp && (*pp)->expires <= expires) {
+        pp = &(*pp)->next;
+    }
+    timer->expires = expires;
+    timer->next = *pp;
+    timer->armed = true;
+    *pp = timer;
+    
+    spinlock_release(&timer_lock);
+}
+
+void ktimer_cancel(ktimer_t *timer)
+{
+    spinlock_acquire(&timer_lock);
+    if (timer->armed) {
+        timer_unlink(timer);
+    }
+    spinlock_release(&timer_lock);
+}
+
+void ktimer_run(void)
+{
+    ktimer_t *head = timer_list;
+    
+    /* Unlocked peek: the common case is nothing due */
+    if (!head || head->expires > rdtsc_us()) return;
+    
+    uint64_t now = rdtsc_us();
+    
+    while (1) {
+        spinlock_acquire(&timer_lock);
+        ktimer_t *timer = timer_list;
+        if (!timer || timer->expires > now) {
+            spinlock_release(&timer_lock);
+            break;
+        }
+        timer_list = timer->next;
+        timer->next = NULL;
+        timer->armed = false;
+        spinlock_release(&timer_lock);
+        
+        /* The callback may re-arm its timer */
+        timer->fn(timer->ctx);
+    }
+}
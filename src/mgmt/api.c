@@ -7,6 +7,7 @@
 #include <lib/types.h>
 #include <lib/string.h>
 #include <mgmt/api.h>
+#include <storage/qos.h>
 #include <mm/heap.h>
 #include <kernel/console.h>
 
@@ -175,11 +176,85 @@ int json_vm_info(virtual_machine_t *vm, char *buf, size_t size)
         vm->stats.vmexit_count);
 }
 
+static int json_latency(const block_latency_t *lat, char *buf, size_t size)
+{
+    int n = snprintf(buf, size,
+        "{"
+        "\"count\":%llu,"
+        "\"avg_us\":%llu,"
+        "\"max_us\":%llu,"
+        "\"p50_us\":%llu,"
+        "\"p99_us\":%llu,"
+        "\"p999_us\":%llu,"
+        "\"hist\":[",
+        lat->count,
+        lat->count ? lat->sum_us / lat->count : 0,
+        lat->max_us,
+        block_latency_percentile(lat, 500),
+        block_latency_percentile(lat, 990),
+        block_latency_percentile(lat, 999));
+    
+    /* Log2 microsecond buckets, up to the last one used */
+    uint32_t used = BLOCK_LAT_BUCKETS;
+    while (used > 0 && !lat->buckets[used - 1]) {
+        used--;
+    }
+    for (uint32_t i = 0; i < used && (size_t)n < size; i++) {
+        n += snprintf(buf + n, size - n, i ? ",%llu" : "%llu", lat->buckets[i]);
+    }
+    
+    if ((size_t)n < size) {
+        n += snprintf(buf + n, size - n, "]}");
+    }
+    return n;
+}
+
+static int json_block_stats(block_device_t *dev, char *buf, size_t size)
+{
+    static const char *const lat_names[BLOCK_LAT_TYPES] = { "read", "write", "other" };
+    block_stats_t st;
+    
+    block_get_stats(dev, &st);
+    
+    int n = snprintf(buf, size,
+        "{"
+        "\"inflight\":%u,"
+        "\"queued\":%u,"
+        "\"depth\":{\"avg\":%llu,\"max\":%u},"
+        "\"ops\":{\"read\":%llu,\"write\":%llu},"
+        "\"bytes\":{\"read\":%llu,\"write\":%llu},"
+        "\"errors\":%llu,"
+        "\"merges\":%llu,"
+        "\"latency\":{",
+        st.inflight,
+        st.queued,
+        st.depth_samples ? st.depth_sum / st.depth_samples : 0,
+        st.depth_max,
+        st.read_ops,
+        st.write_ops,
+        st.read_bytes,
+        st.write_bytes,
+        st.errors,
+        st.merges);
+    
+    for (uint32_t t = 0; t < BLOCK_LAT_TYPES && (size_t)n < size; t++) {
+        n += snprintf(buf + n, size - n, "%s\"%s\":", t ? "," : "", lat_names[t]);
+        if ((size_t)n < size) {
+            n += json_latency(&st.latency[t], buf + n, size - n);
+        }
+    }
+    
+    if ((size_t)n < size) {
+        n += snprintf(buf + n, size - n, "}}");
+    }
+    return n;
+}
+
 int json_pool_info(storage_pool_t *pool, char *buf, size_t size)
 {
     if (!pool || !buf) return -1;
     
-    return snprintf(buf, size,
+    int n = snprintf(buf, size,
         "{"
         "\"name\":\"%s\","
         "\"uuid\":\"%s\","
@@ -191,8 +266,8 @@ int json_pool_info(storage_pool_t *pool, char *buf, size_t size)
         "},"
         "\"devices\":%u,"
         "\"volumes\":%u,"
-        "\"extents\":{\"total\":%u,\"free\":%u}"
-        "}",
+        "\"extents\":{\"total\":%u,\"free\":%u,\"stale\":%u},"
+        "\"device_io\":[",
         pool->name,
         pool->uuid,
         pool->state,
@@ -202,14 +277,93 @@ int json_pool_info(storage_pool_t *pool, char *buf, size_t size)
         pool->device_count,
         pool->volume_count,
         pool->total_extents,
-        pool->free_extents);
+        pool->free_extents,
+        pool->stale_extents);
+    
+    for (uint32_t i = 0; i < pool->device_count && (size_t)n < size; i++) {
+        block_device_t *dev = pool->devices[i];
+        n += snprintf(buf + n, size - n,
+                      "%s{\"name\":\"%s\",\"free_extents\":%u,"
+                      "\"read_latency_us\":%u,\"io\":",
+                      i ? "," : "", dev->name, pool->device_free[i],
+                      pool->device_read_us[i]);
+        if ((size_t)n < size) {
+            n += json_block_stats(dev, buf + n, size - n);
+        }
+        if ((size_t)n < size) {
+            n += snprintf(buf + n, size - n, "}");
+        }
+    }
+    
+    if ((size_t)n < size) {
+        n += snprintf(buf + n, size - n, "]}");
+    }
+    return n;
+}
+
+static int json_qos_info(block_qos_t *qos, char *buf, size_t size)
+{
+    return snprintf(buf, size,
+        "{"
+        "\"weight\":%u,"
+        "\"latency_target_us\":%u,"
+        "\"latency_us\":%u,"
+        "\"read\":{\"bps\":%llu,\"iops\":%u},"
+        "\"write\":{\"bps\":%llu,\"iops\":%u},"
+        "\"depth_limit\":%u,"
+        "\"throttled\":%llu,"
+        "\"missed\":%llu"
+        "}",
+        qos->config.weight,
+        qos->config.latency_target_us,
+        qos->latency_us,
+        qos->config.read.bytes_per_sec,
+        qos->config.read.pkts_per_sec,
+        qos->config.write.bytes_per_sec,
+        qos->config.write.pkts_per_sec,
+        qos->depth_limit,
+        qos->throttled,
+        qos->missed);
+}
+
+static int json_cache_info(block_cache_t *cache, char *buf, size_t size)
+{
+    return snprintf(buf, size,
+        "{"
+        "\"size\":%llu,"
+        "\"writeback\":%s,"
+        "\"dirty_max\":%llu,"
+        "\"dirty_pages\":%u,"
+        "\"hits\":%llu,"
+        "\"misses\":%llu,"
+        "\"readahead_pages\":%llu,"
+        "\"readahead_hits\":%llu,"
+        "\"write_hits\":%llu,"
+        "\"writeback_pages\":%llu,"
+        "\"writeback_ios\":%llu,"
+        "\"throttled\":%llu,"
+        "\"evictions\":%llu"
+        "}",
+        cache->config.max_bytes,
+        cache->config.writeback ? "true" : "false",
+        cache->config.dirty_max,
+        cache->nr_dirty,
+        cache->hits,
+        cache->misses,
+        cache->readahead_pages,
+        cache->readahead_hits,
+        cache->write_hits,
+        cache->writeback_pages,
+        cache->writeback_ios,
+        cache->throttled,
+        cache->evictions);
 }
 
 int json_volume_info(storage_volume_t *vol, char *buf, size_t size)
 {
     if (!vol || !buf) return -1;
     
-    return snprintf(buf, size,
+    int n = snprintf(buf, size,
         "{"
         "\"name\":\"%s\","
         "\"uuid\":\"%s\","
@@ -217,15 +371,48 @@ int json_volume_info(storage_volume_t *vol, char *buf, size_t size)
         "\"allocated\":%llu,"
         "\"thin\":%s,"
         "\"online\":%s,"
-        "\"replication\":%u"
-        "}",
+        "\"replication\":%u,"
+        "\"write_quorum\":%u,"
+        "\"reads\":{\"policy\":\"%s\",\"hedge_us\":%u,"
+        "\"hedged\":%llu,\"hedge_wins\":%llu},"
+        "\"stripe\":{\"width\":%u,\"unit\":%u}",
         vol->name,
         vol->uuid,
         vol->size,
         vol->allocated,
         vol->thin_provisioned ? "true" : "false",
         vol->online ? "true" : "false",
-        vol->replication);
+        vol->replication,
+        vol->write_quorum,
+        vol->read_policy == POOL_READ_PRIMARY ? "primary" : "balance",
+        vol->hedge_us,
+        vol->hedged,
+        vol->hedge_wins,
+        vol->stripe_width,
+        vol->stripe_unit);
+    
+    if ((size_t)n < size) {
+        n += snprintf(buf + n, size - n, ",\"io\":");
+        if ((size_t)n < size) {
+            n += json_block_stats(&vol->blkdev, buf + n, size - n);
+        }
+    }
+    if (vol->blkdev.qos && (size_t)n < size) {
+        n += snprintf(buf + n, size - n, ",\"qos\":");
+        if ((size_t)n < size) {
+            n += json_qos_info(vol->blkdev.qos, buf + n, size - n);
+        }
+    }
+    if (vol->cache && (size_t)n < size) {
+        n += snprintf(buf + n, size - n, ",\"cache\":");
+        if ((size_t)n < size) {
+            n += json_cache_info(vol->cache, buf + n, size - n);
+        }
+    }
+    if ((size_t)n < size) {
+        n += snprintf(buf + n, size - n, "}");
+    }
+    return n;
 }
 
 /* ============================================================================
@@ -274,6 +461,49 @@ static void parse_path(api_request_t *req)
     strncpy(req->action, p, 63);
 }
 
+/* Look up an unsigned decimal parameter in a query like "a=1&b=2" */
+static bool query_get_u64(const char *query, const char *key, uint64_t *val)
+{
+    size_t key_len = strlen(key);
+    const char *p = query;
+    
+    while (*p) {
+        if (strncmp(p, key, key_len) == 0 && p[key_len] == '=') {
+            uint64_t v = 0;
+            for (p += key_len + 1; *p >= '0' && *p <= '9'; p++) {
+                v = v * 10 + (*p - '0');
+            }
+            *val = v;
+            return true;
+        }
+        p = strchr(p, '&');
+        if (!p) break;
+        p++;
+    }
+    return false;
+}
+
+/* @names: Keys for bytes_per_sec, burst_bytes, pkts_per_sec, burst_pkts */
+static void query_get_rate(const char *query, const char *prefix,
+                           const char *const names[4], net_rate_config_t *rate)
+{
+    uint64_t vals[4] = { 0 };
+    char key[32];
+    
+    for (int i = 0; i < 4; i++) {
+        snprintf(key, sizeof(key), "%s_%s", prefix, names[i]);
+        query_get_u64(query, key, &vals[i]);
+    }
+    
+    rate->bytes_per_sec = vals[0];
+    rate->burst_bytes = vals[1];
+    rate->pkts_per_sec = (uint32_t)vals[2];
+    rate->burst_pkts = (uint32_t)vals[3];
+}
+
+static const char *const net_rate_keys[4] = { "bps", "burst", "pps", "burst_pkts" };
+static const char *const io_rate_keys[4] = { "bps", "burst", "iops", "burst_ios" };
+
 /* ============================================================================
  * Request Handlers
  * ============================================================================ */
@@ -387,7 +617,7 @@ static int handle_vms(api_context_t *ctx, api_request_t *req,
     }
     
     if (req->method == API_METHOD_POST && req->action[0] != '\0') {
-        /* VM actions: start, stop, pause, resume */
+        /* VM actions: start, stop, pause, resume, qos */
         uint32_t id = 0;
         for (const char *s = req->id; *s >= '0' && *s <= '9'; s++) {
             id = id * 10 + (*s - '0');
@@ -398,6 +628,23 @@ static int handle_vms(api_context_t *ctx, api_request_t *req,
             return api_response_error(resp, API_STATUS_NOT_FOUND, "VM not found");
         }
         
+        if (strcmp(req->action, "qos") == 0) {
+            /* ?nic=N&tx_bps=&tx_burst=&tx_pps=&tx_burst_pkts=&rx_... (0 = unlimited) */
+            uint64_t nic = 0;
+            net_rate_config_t tx, rx;
+            
+            query_get_u64(req->query, "nic", &nic);
+            query_get_rate(req->query, "tx", net_rate_keys, &tx);
+            query_get_rate(req->query, "rx", net_rate_keys, &rx);
+            
+            if (virt_vm_set_nic_limit(vm, (uint32_t)nic, &tx, &rx) != 0) {
+                return api_response_error(resp, API_STATUS_BAD_REQUEST, "Invalid NIC");
+            }
+            json_vm_info(vm, resp->body, resp->body_capacity);
+            resp->body_len = strlen(resp->body);
+            return 0;
+        }
+        
         int ret = -1;
         if (strcmp(req->action, "start") == 0) {
             ret = virt_vm_start(ctx->vm_manager, vm);
@@ -433,6 +680,125 @@ static int handle_pools(api_context_t *ctx, api_request_t *req,
     return api_response_error(resp, API_STATUS_NOT_FOUND, "Pool not found");
 }
 
+static int handle_volumes(api_context_t *ctx, api_request_t *req,
+                          api_response_t *resp)
+{
+    if (!ctx->pool) {
+        return api_response_error(resp, API_STATUS_NOT_FOUND, "Pool not found");
+    }
+    
+    if (req->method == API_METHOD_GET && req->id[0] == '\0') {
+        /* List all volumes; entries that do not fit whole are left out */
+        static const char tail[] = "],\"truncated\":true}";
+        char *p = resp->body;
+        size_t remain = resp->body_capacity - sizeof(tail);
+        bool truncated = false;
+        
+        int n = snprintf(p, remain, "{\"volumes\":[");
+        p += n; remain -= n;
+        
+        bool first = true;
+        storage_volume_t *vol = ctx->pool->volumes;
+        while (vol) {
+            size_t sep = first ? 0 : 1;
+            n = remain > sep ? json_volume_info(vol, p + sep, remain - sep) : -1;
+            if (n < 0 || (size_t)n >= remain - sep) {
+                truncated = true;
+                break;
+            }
+            if (sep) {
+                *p = ',';
+            }
+            p += sep + n;
+            remain -= sep + n;
+            first = false;
+            vol = vol->next;
+        }
+        
+        /* The tail was reserved up front, so this always fits */
+        strcpy(p, truncated ? tail : "]}");
+        resp->body_len = strlen(resp->body);
+        return 0;
+    }
+    
+    storage_volume_t *vol = ctx->pool->volumes;
+    while (vol && strcmp(vol->name, req->id) != 0) {
+        vol = vol->next;
+    }
+    if (!vol) {
+        return api_response_error(resp, API_STATUS_NOT_FOUND, "Volume not found");
+    }
+    
+    if (req->method == API_METHOD_POST && strcmp(req->action, "qos") == 0) {
+        /* ?read_bps=&read_burst=&read_iops=&read_burst_ios=&write_...&weight=&latency_us= */
+        block_qos_config_t cfg;
+        uint64_t weight = 0, latency = 0;
+        
+        memset(&cfg, 0, sizeof(cfg));
+        query_get_rate(req->query, "read", io_rate_keys, &cfg.read);
+        query_get_rate(req->query, "write", io_rate_keys, &cfg.write);
+        query_get_u64(req->query, "weight", &weight);
+        query_get_u64(req->query, "latency_us", &latency);
+        cfg.weight = (uint32_t)MIN(weight, BLOCK_QOS_WEIGHT_MAX + 1);
+        cfg.latency_target_us = (uint32_t)MIN(latency, 0xFFFFFFFFULL);
+        
+        if (block_qos_set(&vol->blkdev, &cfg) != 0) {
+            return api_response_error(resp, API_STATUS_BAD_REQUEST, "Invalid QoS");
+        }
+    } else if (req->method == API_METHOD_POST && strcmp(req->action, "cache") == 0) {
+        /* ?size_mb=&writeback=&dirty_mb=&readahead=; size_mb=0 removes it */
+        block_cache_config_t cfg;
+        uint64_t size_mb = 0, writeback = 0, dirty_mb = 0, readahead = BLOCK_CACHE_RA_MAX;
+        
+        query_get_u64(req->query, "size_mb", &size_mb);
+        query_get_u64(req->query, "writeback", &writeback);
+        query_get_u64(req->query, "dirty_mb", &dirty_mb);
+        query_get_u64(req->query, "readahead", &readahead);
+        
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.max_bytes = MIN(size_mb, 0xFFFFFULL) * MB;
+        cfg.writeback = writeback != 0;
+        cfg.dirty_max = MIN(dirty_mb, 0xFFFFFULL) * MB;
+        cfg.readahead_max = (uint32_t)MIN(readahead, BLOCK_CACHE_RA_MAX);
+        cfg.no_readahead = readahead == 0;
+        
+        if (volume_is_attached(vol)) {
+            return api_response_error(resp, API_STATUS_CONFLICT, "Volume is attached");
+        }
+        if (volume_set_cache(vol, size_mb ? &cfg : NULL) != 0) {
+            return api_response_error(resp, API_STATUS_BAD_REQUEST, "Invalid cache");
+        }
+    } else if (req->method == API_METHOD_POST && strcmp(req->action, "quorum") == 0) {
+        /* ?writes=; 0 waits for every copy */
+        uint64_t writes = 0;
+        
+        query_get_u64(req->query, "writes", &writes);
+        if (volume_set_write_quorum(vol, (uint32_t)MIN(writes, 0xFFFFFFFFULL)) != 0) {
+            return api_response_error(resp, API_STATUS_BAD_REQUEST, "Invalid quorum");
+        }
+    } else if (req->method == API_METHOD_POST && strcmp(req->action, "reads") == 0) {
+        /* ?primary=&hedge_us=; balanced and unhedged by default */
+        uint64_t primary = 0, hedge_us = 0;
+        
+        query_get_u64(req->query, "primary", &primary);
+        query_get_u64(req->query, "hedge_us", &hedge_us);
+        if (volume_set_read_policy(vol, primary ? POOL_READ_PRIMARY : POOL_READ_BALANCE,
+                                   (uint32_t)MIN(hedge_us, 0xFFFFFFFFULL)) != 0) {
+            return api_response_error(resp, API_STATUS_BAD_REQUEST, "Invalid read policy");
+        }
+    } else if (req->method == API_METHOD_POST && strcmp(req->action, "resync") == 0) {
+        if (volume_resync(vol) < 0) {
+            return api_response_error(resp, API_STATUS_ERROR, "Resync failed");
+        }
+    } else if (req->method != API_METHOD_GET || req->action[0] != '\0') {
+        return api_response_error(resp, API_STATUS_BAD_REQUEST, "Invalid request");
+    }
+    
+    json_volume_info(vol, resp->body, resp->body_capacity);
+    resp->body_len = strlen(resp->body);
+    return 0;
+}
+
 /* ============================================================================
  * Main API Handler
  * ============================================================================ */
@@ -468,6 +834,8 @@ int api_handle_request(api_context_t *ctx, api_request_t *req,
         ret = handle_vms(ctx, req, resp);
     } else if (strcmp(req->resource, "pools") == 0) {
         ret = handle_pools(ctx, req, resp);
+    } else if (strcmp(req->resource, "volumes") == 0) {
+        ret = handle_volumes(ctx, req, resp);
     } else {
         ret = api_response_error(resp, API_STATUS_NOT_FOUND, "Resource not found");
     }
@@ -10,6 +10,7 @@
 #include <mm/pmm.h>
 #include <mm/heap.h>
 #include <kernel/console.h>
+#include <kernel/smp.h>
 #include <arch/x86_64/cpu.h>
 
 /* ============================================================================
@@ -18,6 +19,14 @@
 
 static vm_context_t kernel_context;
 static bool paging_initialized = false;
+static bool nx_enabled = false;         /* PTE_NO_EXECUTE is reserved without EFER.NXE */
+
+/* Device mappings get their own window, clear of the huge-page direct map */
+#define IOMAP_BASE          0xFFFFC00000000000ULL
+#define IOMAP_SIZE          (64 * GB)
+
+static virt_addr_t iomap_next = IOMAP_BASE;
+static spinlock_t iomap_lock = SPINLOCK_INIT;
 
 /* ============================================================================
  * Internal Functions
@@ -30,7 +39,7 @@ static uint64_t flags_to_pte(uint32_t flags)
     
     if (flags & MAP_WRITE) pte_flags |= PTE_WRITABLE;
     if (flags & MAP_USER) pte_flags |= PTE_USER;
-    if (!(flags & MAP_EXEC)) pte_flags |= PTE_NO_EXECUTE;
+    if (!(flags & MAP_EXEC) && nx_enabled) pte_flags |= PTE_NO_EXECUTE;
     if (flags & MAP_NOCACHE) pte_flags |= PTE_CACHE_DISABLE;
     
     return pte_flags;
@@ -121,6 +130,7 @@ void paging_init(void)
     kernel_context.pml4_phys = read_cr3() & PTE_ADDR_MASK;
     kernel_context.pml4 = (pml4_t)phys_to_virt(kernel_context.pml4_phys);
     kernel_context.flags = 0;
+    nx_enabled = (rdmsr(MSR_IA32_EFER) & EFER_NXE) != 0;
     
     paging_initialized = true;
     
@@ -307,3 +317,23 @@ vm_context_t *paging_get_kernel_context(void)
 {
     return &kernel_context;
 }
+
+void *paging_map_io(phys_addr_t phys, size_t size)
+{
+    phys_addr_t start = ALIGN_DOWN(phys, PAGE_SIZE);
+    size_t len = ALIGN_UP(phys + size, PAGE_SIZE) - start;
+    
+    spinlock_acquire(&iomap_lock);
+    virt_addr_t virt = iomap_next;
+    if (virt + len > IOMAP_BASE + IOMAP_SIZE) {
+        spinlock_release(&iomap_lock);
+        return NULL;
+    }
+    iomap_next += len;
+    spinlock_release(&iomap_lock);
+    
+    if (paging_map(NULL, virt, start, len, MAP_WRITE | MAP_NOCACHE) != 0) {
+        return NULL;
+    }
+    return (void *)(virt + (phys - start));
+}
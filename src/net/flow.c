@@ -0,0 +1,159 @@
+/*
+ * PureVisor - Flow Classification Implementation
+ * 
+ * Header dissection and Toeplitz (RSS) flow hashing
+ */
+
+#include <lib/types.h>
+#include <lib/string.h>
+#include <net/flow.h>
+#include <net/proto.h>
+
+const uint8_t net_rss_default_key[NET_RSS_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/* ============================================================================
+ * Dissection
+ * ============================================================================ */
+
+bool net_flow_dissect(const uint8_t *frame, size_t len, net_flow_keys_t *keys)
+{
+    memset(keys, 0, sizeof(*keys));
+    
+    if (len < ETH_HLEN) return false;
+    
+    const eth_hdr_t *eth = (const eth_hdr_t *)frame;
+    uint16_t type = ntohs(eth->type);
+    size_t off = ETH_HLEN;
+    
+    /* Up to two VLAN tags (802.1ad + 802.1Q) */
+    for (int i = 0; i < 2 && (type == ETH_P_8021Q || type == ETH_P_8021AD); i++) {
+        if (off + ETH_VLAN_HLEN > len) return false;
+        const vlan_hdr_t *vlan = (const vlan_hdr_t *)(frame + off);
+        if (i == 0) {
+            keys->vlan = ntohs(vlan->tci) & VLAN_VID_MASK;
+        }
+        type = ntohs(vlan->type);
+        off += ETH_VLAN_HLEN;
+    }
+    
+    keys->l3_off = off;
+    
+    if (type == ETH_P_IP) {
+        if (off + sizeof(ipv4_hdr_t) > len) return false;
+        const ipv4_hdr_t *ip = (const ipv4_hdr_t *)(frame + off);
+        size_t ihl = (ip->ver_ihl & 0x0F) * 4;
+        if ((ip->ver_ihl >> 4) != 4 || ihl < sizeof(ipv4_hdr_t)) return false;
+        
+        keys->l3_proto = ETH_P_IP;
+        keys->addr_len = 4;
+        memcpy(keys->src, &ip->saddr, 4);
+        memcpy(keys->dst, &ip->daddr, 4);
+        
+        /* Only the first fragment carries ports */
+        if (ntohs(ip->frag_off) & (IP_MF | IP_OFFSET)) return true;
+        keys->l4_proto = ip->protocol;
+        off += ihl;
+    } else if (type == ETH_P_IPV6) {
+        if (off + sizeof(ipv6_hdr_t) > len) return false;
+        const ipv6_hdr_t *ip6 = (const ipv6_hdr_t *)(frame + off);
+        
+        keys->l3_proto = ETH_P_IPV6;
+        keys->addr_len = 16;
+        memcpy(keys->src, ip6->saddr, 16);
+        memcpy(keys->dst, ip6->daddr, 16);
+        
+        /* Extension headers are not walked: such flows hash on addresses */
+        keys->l4_proto = ip6->nexthdr;
+        off += sizeof(ipv6_hdr_t);
+    } else {
+        return false;
+    }
+    
+    if ((keys->l4_proto == IPPROTO_TCP || keys->l4_proto == IPPROTO_UDP) &&
+        off + 4 <= len) {
+        const udp_hdr_t *l4 = (const udp_hdr_t *)(frame + off);
+        keys->l4_off = off;
+        keys->sport = l4->source;
+        keys->dport = l4->dest;
+    } else {
+        keys->l4_proto = 0;
+    }
+    
+    return true;
+}
+
+void net_flow_reverse(net_flow_keys_t *keys)
+{
+    uint8_t tmp[16];
+    
+    memcpy(tmp, keys->src, sizeof(tmp));
+    memcpy(keys->src, keys->dst, sizeof(tmp));
+    memcpy(keys->dst, tmp, sizeof(tmp));
+    
+    uint16_t port = keys->sport;
+    keys->sport = keys->dport;
+    keys->dport = port;
+}
+
+/* ============================================================================
+ * Hashing
+ * ============================================================================ */
+
+uint32_t net_toeplitz_hash(const uint8_t *key, const uint8_t *data, size_t len)
+{
+    uint32_t hash = 0;
+    uint32_t window = ((uint32_t)key[0] << 24) | ((uint32_t)key[1] << 16) |
+                      ((uint32_t)key[2] << 8) | key[3];
+    
+    for (size_t i = 0; i < len; i++) {
+        uint8_t next = key[i + 4];
+        for (int bit = 7; bit >= 0; bit--) {
+            if (data[i] & (1 << bit)) {
+                hash ^= window;
+            }
+            window = (window << 1) | ((next >> bit) & 1);
+        }
+    }
+    
+    return hash;
+}
+
+uint32_t net_flow_hash(const net_flow_keys_t *keys, const uint8_t *key,
+                       uint32_t hash_types)
+{
+    uint8_t input[36];          /* src, dst, sport, dport */
+    uint32_t l3_type, l4_type;
+    
+    if (keys->l3_proto == ETH_P_IP) {
+        l3_type = NET_RSS_HASH_IPV4;
+        l4_type = keys->l4_proto == IPPROTO_TCP ? NET_RSS_HASH_TCPV4 :
+                  keys->l4_proto == IPPROTO_UDP ? NET_RSS_HASH_UDPV4 : 0;
+    } else if (keys->l3_proto == ETH_P_IPV6) {
+        l3_type = NET_RSS_HASH_IPV6;
+        l4_type = keys->l4_proto == IPPROTO_TCP ? NET_RSS_HASH_TCPV6 :
+                  keys->l4_proto == IPPROTO_UDP ? NET_RSS_HASH_UDPV6 : 0;
+    } else {
+        return 0;
+    }
+    
+    size_t alen = keys->addr_len;
+    size_t len = 2 * alen;
+    memcpy(input, keys->src, alen);
+    memcpy(input + alen, keys->dst, alen);
+    
+    if (l4_type & hash_types) {
+        memcpy(input + len, &keys->sport, 2);
+        memcpy(input + len + 2, &keys->dport, 2);
+        len += 4;
+    } else if (!(l3_type & hash_types)) {
+        return 0;
+    }
+    
+    return net_toeplitz_hash(key, input, len);
+}
@@ -0,0 +1,239 @@
+/*
+ * PureVisor - Network Offload Implementation
+ * 
+ * Frames keep their offload state (partial checksum, TCP super-frame)
+ * while they travel between virtual ports; the work is only done here,
+ * for the receivers that cannot accept them as they are.
+ */
+
+#include <lib/types.h>
+#include <lib/string.h>
+#include <net/offload.h>
+#include <net/flow.h>
+#include <net/proto.h>
+
+/* ============================================================================
+ * Checksum Helpers
+ * ============================================================================ */
+
+uint64_t net_csum_add(uint64_t sum, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    
+    while (len >= 2) {
+        sum += ((uint32_t)p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        sum += (uint32_t)p[0] << 8;
+    }
+    return sum;
+}
+
+uint64_t net_csum_pkt(const pktbuf_t *pb, size_t offset, size_t len, uint64_t sum)
+{
+    bool odd = false;           /* Previous segment ended mid-word */
+    
+    for (const pktbuf_t *seg = pb; seg && len > 0; seg = seg->next) {
+        if (offset >= seg->len) {
+            offset -= seg->len;
+            continue;
+        }
+        
+        const uint8_t *p = seg->data + offset;
+        size_t n = MIN(seg->len - offset, len);
+        len -= n;
+        offset = 0;
+        
+        if (odd && n > 0) {
+            sum += p[0];
+            p++;
+            n--;
+            odd = false;
+        }
+        sum = net_csum_add(sum, p, n & ~(size_t)1);
+        if (n & 1) {
+            sum += (uint32_t)p[n - 1] << 8;
+            odd = true;
+        }
+    }
+    return sum;
+}
+
+uint16_t net_csum_fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t)sum;
+}
+
+/* ============================================================================
+ * Checksum Completion
+ * ============================================================================ */
+
+pktbuf_t *net_csum_resolve(pktbuf_t *pb)
+{
+    pktbuf_offload_t *ol = &pb->ol;
+    size_t field = (size_t)ol->csum_start + ol->csum_offset;
+    size_t hdr_len = field + 2;
+    
+    if (hdr_len > pb->pkt_len || hdr_len > PKTBUF_DATA_SIZE) {
+        pktbuf_free(pb);
+        return NULL;
+    }
+    
+    /* Private header copy; the sender's buffers are never written */
+    pktbuf_t *out = pktbuf_alloc();
+    if (!out) {
+        pktbuf_free(pb);
+        return NULL;
+    }
+    pktbuf_copy_out(pb, 0, out->data, hdr_len);
+    out->len = out->pkt_len = hdr_len;
+    
+    if (pktbuf_attach_ref(out, pb, hdr_len, pb->pkt_len - hdr_len) != 0) {
+        pktbuf_free(out);
+        pktbuf_free(pb);
+        return NULL;
+    }
+    
+    /* The field already holds the pseudo-header sum */
+    uint64_t sum = net_csum_pkt(pb, ol->csum_start, pb->pkt_len - ol->csum_start, 0);
+    uint16_t csum = (uint16_t)~net_csum_fold(sum);
+    
+    /* Zero means "no checksum" only to UDP; TCP carries it as computed */
+    net_flow_keys_t keys;
+    if (csum == 0 && net_flow_dissect(out->data, hdr_len, &keys) &&
+        keys.l4_proto == IPPROTO_UDP) {
+        csum = 0xFFFF;
+    }
+    out->data[field] = csum >> 8;
+    out->data[field + 1] = csum & 0xFF;
+    
+    out->ol = *ol;
+    out->ol.flags = (ol->flags & ~PKTBUF_OL_CSUM_PARTIAL) | PKTBUF_OL_CSUM_VALID;
+    
+    pktbuf_free(pb);
+    return out;
+}
+
+/* ============================================================================
+ * TCP Segmentation
+ * ============================================================================ */
+
+int net_gso_segment(pktbuf_t *pb, pktbuf_queue_t *out)
+{
+    uint8_t hdr[NET_GSO_HDR_MAX];
+    net_flow_keys_t keys;
+    size_t avail = pktbuf_copy_out(pb, 0, hdr, sizeof(hdr));
+    size_t mss = pb->ol.gso_size;
+    int count = 0;
+    
+    if (mss == 0 || !net_flow_dissect(hdr, avail, &keys) ||
+        keys.l4_proto != IPPROTO_TCP ||
+        keys.l4_off + sizeof(tcp_hdr_t) > avail) {
+        pktbuf_free(pb);
+        return -1;
+    }
+    
+    const tcp_hdr_t *tcp = (const tcp_hdr_t *)(hdr + keys.l4_off);
+    size_t tcp_hlen = (size_t)(tcp->doff >> 4) * 4;
+    size_t hdr_len = keys.l4_off + tcp_hlen;
+    if (tcp_hlen < sizeof(tcp_hdr_t) || hdr_len > avail || hdr_len >= pb->pkt_len) {
+        pktbuf_free(pb);
+        return -1;
+    }
+    
+    size_t payload = pb->pkt_len - hdr_len;
+    uint32_t seq = ntohl(tcp->seq);
+    uint8_t tcp_flags = tcp->flags;
+    uint16_t ip_id = 0;
+    if (keys.l3_proto == ETH_P_IP) {
+        ip_id = ntohs(((const ipv4_hdr_t *)(hdr + keys.l3_off))->id);
+    }
+    
+    for (size_t off = 0; off < payload; off += mss) {
+        size_t seg_len = MIN(mss, payload - off);
+        size_t l4_len = tcp_hlen + seg_len;
+        
+        pktbuf_t *seg = pktbuf_alloc();
+        if (!seg) break;
+        
+        uint8_t *h = seg->data;
+        memcpy(h, hdr, hdr_len);
+        seg->len = seg->pkt_len = hdr_len;
+        
+        tcp_hdr_t *th = (tcp_hdr_t *)(h + keys.l4_off);
+        th->seq = htonl(seq + (uint32_t)off);
+        th->flags = tcp_flags;
+        if (off + seg_len < payload) {
+            th->flags &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        }
+        if (off > 0) {
+            th->flags &= ~TCP_FLAG_CWR;
+        }
+        th->check = 0;
+        
+        /* Pseudo header: addresses, protocol, TCP length */
+        uint64_t sum;
+        if (keys.l3_proto == ETH_P_IP) {
+            ipv4_hdr_t *ip = (ipv4_hdr_t *)(h + keys.l3_off);
+            size_t ihl = (ip->ver_ihl & 0x0F) * 4;
+            ip->tot_len = htons((uint16_t)(ihl + l4_len));
+            ip->id = htons((uint16_t)(ip_id + count));
+            ip->check = 0;
+            ip->check = htons((uint16_t)~net_csum_fold(net_csum_add(0, ip, ihl)));
+            sum = net_csum_add(0, (const uint8_t *)ip + 12, 8);
+        } else {
+            ipv6_hdr_t *ip6 = (ipv6_hdr_t *)(h + keys.l3_off);
+            ip6->payload_len = htons((uint16_t)l4_len);
+            sum = net_csum_add(0, ip6->saddr, 32);
+        }
+        sum += IPPROTO_TCP + l4_len;
+        sum = net_csum_add(sum, th, tcp_hlen);
+        sum = net_csum_pkt(pb, hdr_len + off, seg_len, sum);
+        th->check = htons((uint16_t)~net_csum_fold(sum));
+        
+        if (pktbuf_attach_ref(seg, pb, hdr_len + off, seg_len) != 0) {
+            pktbuf_free(seg);
+            break;
+        }
+        seg->ol.flags = PKTBUF_OL_CSUM_VALID;
+        
+        pktq_push(out, seg);
+        count++;
+    }
+    
+    /* Segments hold their own references; a short run is left to TCP */
+    pktbuf_free(pb);
+    return count > 0 ? count : -1;
+}
+
+/* ============================================================================
+ * Resolution
+ * ============================================================================ */
+
+int net_offload_resolve(pktbuf_t *pb, uint32_t caps, pktbuf_queue_t *out)
+{
+    pktbuf_offload_t *ol = &pb->ol;
+    
+    if (ol->gso_type != PKTBUF_GSO_NONE) {
+        uint32_t need = NET_CAP_CSUM |
+                        (ol->gso_type == PKTBUF_GSO_TCPV4 ? NET_CAP_TSO4 : NET_CAP_TSO6);
+        if ((caps & need) == need) {
+            pktq_push(out, pb);
+            return 1;
+        }
+        return net_gso_segment(pb, out);
+    }
+    
+    if ((ol->flags & PKTBUF_OL_CSUM_PARTIAL) && !(caps & NET_CAP_CSUM)) {
+        pb = net_csum_resolve(pb);
+        if (!pb) return -1;
+    }
+    
+    pktq_push(out, pb);
+    return 1;
+}
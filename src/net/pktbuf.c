@@ -0,0 +1,329 @@
+/*
+ * PureVisor - Packet Buffer Pool Implementation
+ * 
+ * Preallocated packet buffers shared by all network backends
+ */
+
+#include <lib/types.h>
+#include <lib/string.h>
+#include <net/pktbuf.h>
+#include <mm/pmm.h>
+#include <kernel/smp.h>
+#include <kernel/console.h>
+
+/* ============================================================================
+ * Global State
+ * ============================================================================ */
+
+/* Per-CPU free object cache (accessed only by its own CPU) */
+typedef struct pktbuf_cache {
+    uint32_t count;
+    uint16_t objs[PKTBUF_CACHE_SIZE];
+} pktbuf_cache_t;
+
+static pktbuf_t *pkt_hdrs = NULL;           /* Segment descriptors */
+static uint8_t *pkt_data = NULL;            /* Data buffers */
+static uint16_t pkt_free_stack[PKTBUF_POOL_COUNT];
+static uint32_t pkt_free_top = 0;
+static spinlock_t pkt_lock = SPINLOCK_INIT;
+static pktbuf_cache_t pkt_caches[MAX_CPUS];
+static pktbuf_stats_t pkt_stats;
+static bool pktbuf_initialized = false;
+
+#define PKTBUF_HDR_ORDER    6   /* 2^6 pages for PKTBUF_POOL_COUNT headers */
+
+STATIC_ASSERT(sizeof(pktbuf_t) == 128, "pktbuf_t must be two cache lines");
+STATIC_ASSERT(PKTBUF_POOL_COUNT * sizeof(pktbuf_t) <= (PAGE_SIZE << PKTBUF_HDR_ORDER),
+              "pktbuf header area too small");
+
+/* ============================================================================
+ * Global Pool
+ * ============================================================================ */
+
+/* Move up to @n objects from the global pool into @cache */
+static void pool_refill(pktbuf_cache_t *cache, uint32_t n)
+{
+    spinlock_acquire(&pkt_lock);
+    while (n-- > 0 && pkt_free_top > 0 && cache->count < PKTBUF_CACHE_SIZE) {
+        cache->objs[cache->count++] = pkt_free_stack[--pkt_free_top];
+    }
+    spinlock_release(&pkt_lock);
+}
+
+/* Return up to @n objects from @cache to the global pool */
+static void pool_flush(pktbuf_cache_t *cache, uint32_t n)
+{
+    spinlock_acquire(&pkt_lock);
+    while (n-- > 0 && cache->count > 0) {
+        pkt_free_stack[pkt_free_top++] = cache->objs[--cache->count];
+    }
+    spinlock_release(&pkt_lock);
+}
+
+static inline pktbuf_cache_t *local_cache(void)
+{
+    return &pkt_caches[smp_get_current_cpu() % MAX_CPUS];
+}
+
+static pktbuf_t *seg_alloc(void)
+{
+    if (!pktbuf_initialized) return NULL;
+    
+    pktbuf_cache_t *cache = local_cache();
+    if (cache->count == 0) {
+        pool_refill(cache, PKTBUF_CACHE_BATCH);
+        if (cache->count == 0) {
+            pkt_stats.alloc_failures++;
+            return NULL;
+        }
+    }
+    
+    uint16_t idx = cache->objs[--cache->count];
+    pktbuf_t *pb = &pkt_hdrs[idx];
+    
+    pb->next = NULL;
+    pb->nextpkt = NULL;
+    pb->data = pkt_data + (size_t)idx * PKTBUF_SIZE + PKTBUF_HEADROOM;
+    pb->len = 0;
+    pb->flags = 0;
+    pb->index = idx;
+    pb->pkt_len = 0;
+    pb->refcnt = 1;
+    pb->status = -1;
+    pb->destructor = NULL;
+    pb->destructor_ctx = NULL;
+    memset(&pb->ol, 0, sizeof(pb->ol));
+    
+    pkt_stats.allocs++;
+    return pb;
+}
+
+static void seg_free(pktbuf_t *pb)
+{
+    pktbuf_cache_t *cache = local_cache();
+    
+    if (cache->count >= PKTBUF_CACHE_SIZE) {
+        pool_flush(cache, PKTBUF_CACHE_BATCH);
+    }
+    cache->objs[cache->count++] = pb->index;
+    pkt_stats.frees++;
+}
+
+/* ============================================================================
+ * Public API
+ * ============================================================================ */
+
+int pktbuf_init(void)
+{
+    if (pktbuf_initialized) return 0;
+    
+    phys_addr_t data_phys = pmm_alloc_pages(PKTBUF_POOL_ORDER);
+    if (!data_phys) {
+        pr_error("Pktbuf: Failed to allocate data area");
+        return -1;
+    }
+    
+    phys_addr_t hdr_phys = pmm_alloc_pages(PKTBUF_HDR_ORDER);
+    if (!hdr_phys) {
+        pmm_free_pages(data_phys, PKTBUF_POOL_ORDER);
+        pr_error("Pktbuf: Failed to allocate descriptors");
+        return -1;
+    }
+    
+    pkt_data = phys_to_virt(data_phys);
+    pkt_hdrs = phys_to_virt(hdr_phys);
+    memset(pkt_hdrs, 0, PKTBUF_POOL_COUNT * sizeof(pktbuf_t));
+    memset(pkt_caches, 0, sizeof(pkt_caches));
+    memset(&pkt_stats, 0, sizeof(pkt_stats));
+    
+    /* Lowest indices on top so early packets share cache lines */
+    for (uint32_t i = 0; i < PKTBUF_POOL_COUNT; i++) {
+        pkt_free_stack[i] = PKTBUF_POOL_COUNT - 1 - i;
+        pkt_hdrs[i].index = i;
+    }
+    pkt_free_top = PKTBUF_POOL_COUNT;
+    pkt_stats.total = PKTBUF_POOL_COUNT;
+    
+    pktbuf_initialized = true;
+    
+    pr_info("Pktbuf: %u buffers of %u bytes (%llu KB)",
+            PKTBUF_POOL_COUNT, PKTBUF_SIZE,
+            (uint64_t)PKTBUF_POOL_COUNT * PKTBUF_SIZE / KB);
+    
+    return 0;
+}
+
+pktbuf_t *pktbuf_alloc(void)
+{
+    return seg_alloc();
+}
+
+pktbuf_t *pktbuf_alloc_ext(void *addr, uint32_t len)
+{
+    pktbuf_t *pb = seg_alloc();
+    if (!pb) return NULL;
+    
+    pb->data = addr;
+    pb->len = len;
+    pb->pkt_len = len;
+    pb->flags |= PKTBUF_F_EXTERNAL;
+    return pb;
+}
+
+pktbuf_t *pktbuf_alloc_copy(const void *data, size_t len)
+{
+    const uint8_t *src = data;
+    pktbuf_t *head = NULL;
+    pktbuf_t *tail = NULL;
+    size_t remain = len;
+    
+    do {
+        pktbuf_t *seg = seg_alloc();
+        if (!seg) {
+            pktbuf_free(head);
+            return NULL;
+        }
+        
+        uint32_t chunk = remain > PKTBUF_DATA_SIZE ? PKTBUF_DATA_SIZE : remain;
+        memcpy(seg->data, src, chunk);
+        seg->len = chunk;
+        src += chunk;
+        remain -= chunk;
+        
+        if (tail) {
+            tail->next = seg;
+        } else {
+            head = seg;
+        }
+        tail = seg;
+    } while (remain > 0);
+    
+    head->pkt_len = len;
+    return head;
+}
+
+pktbuf_t *pktbuf_ref(pktbuf_t *pb)
+{
+    if (pb) {
+        __sync_fetch_and_add(&pb->refcnt, 1);
+    }
+    return pb;
+}
+
+void pktbuf_free(pktbuf_t *pb)
+{
+    if (!pb) return;
+    
+    if (__sync_sub_and_fetch(&pb->refcnt, 1) != 0) {
+        return;
+    }
+    
+    if (pb->destructor) {
+        pb->destructor(pb->destructor_ctx, pb->status);
+    }
+    
+    while (pb) {
+        pktbuf_t *next = pb->next;
+        seg_free(pb);
+        pb = next;
+    }
+}
+
+void pktbuf_cat(pktbuf_t *head, pktbuf_t *tail)
+{
+    pktbuf_t *last = head;
+    while (last->next) {
+        last = last->next;
+    }
+    last->next = tail;
+    
+    for (pktbuf_t *seg = tail; seg; seg = seg->next) {
+        head->pkt_len += seg->len;
+    }
+    tail->pkt_len = 0;
+}
+
+static void pktbuf_release_src(void *ctx, int status)
+{
+    pktbuf_t *src = ctx;
+    
+    if (status == 0) {
+        src->status = 0;
+    }
+    pktbuf_free(src);
+}
+
+int pktbuf_attach_ref(pktbuf_t *head, pktbuf_t *src, size_t offset, size_t len)
+{
+    pktbuf_t *chain = NULL;
+    pktbuf_t *tail = NULL;
+    
+    if (len == 0) return 0;
+    
+    for (pktbuf_t *seg = src; seg && len > 0; seg = seg->next) {
+        if (offset >= seg->len) {
+            offset -= seg->len;
+            continue;
+        }
+        
+        uint32_t chunk = MIN(seg->len - offset, len);
+        pktbuf_t *ext = pktbuf_alloc_ext(seg->data + offset, chunk);
+        if (!ext) {
+            pktbuf_free(chain);
+            return -1;
+        }
+        
+        if (tail) {
+            tail->next = ext;
+        } else {
+            chain = ext;
+        }
+        tail = ext;
+        len -= chunk;
+        offset = 0;
+    }
+    
+    if (len > 0) {
+        pktbuf_free(chain);     /* Range past the end of @src */
+        return -1;
+    }
+    
+    pktbuf_cat(head, chain);
+    pktbuf_set_destructor(head, pktbuf_release_src, pktbuf_ref(src));
+    return 0;
+}
+
+void pktbuf_set_destructor(pktbuf_t *pb, pktbuf_destructor_t fn, void *ctx)
+{
+    pb->destructor = fn;
+    pb->destructor_ctx = ctx;
+}
+
+size_t pktbuf_copy_out(const pktbuf_t *pb, size_t offset, void *dst, size_t len)
+{
+    uint8_t *out = dst;
+    size_t copied = 0;
+    
+    for (const pktbuf_t *seg = pb; seg && copied < len; seg = seg->next) {
+        if (offset >= seg->len) {
+            offset -= seg->len;
+            continue;
+        }
+        
+        size_t chunk = seg->len - offset;
+        if (chunk > len - copied) chunk = len - copied;
+        memcpy(out + copied, seg->data + offset, chunk);
+        copied += chunk;
+        offset = 0;
+    }
+    
+    return copied;
+}
+
+void pktbuf_get_stats(pktbuf_stats_t *stats)
+{
+    spinlock_acquire(&pkt_lock);
+    *stats = pkt_stats;
+    stats->free = pkt_free_top;
+    spinlock_release(&pkt_lock);
+}
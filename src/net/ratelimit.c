@@ -0,0 +1,92 @@
+/*
+ * PureVisor - Network Rate Limiting Implementation
+ */
+
+#include <lib/types.h>
+#include <net/ratelimit.h>
+#include <arch/x86_64/cpu.h>
+
+#define TOKEN_SCALE     1000000ULL      /* Tokens per unit; one per rate-us */
+
+/* ============================================================================
+ * Token Bucket
+ * ============================================================================ */
+
+static void tbucket_init(net_tbucket_t *tb, uint64_t rate, uint64_t burst,
+                         uint32_t share)
+{
+    tb->rate = rate / share;
+    if (rate && !tb->rate) {
+        tb->rate = 1;
+    }
+    
+    burst = burst ? burst / share : tb->rate * NET_RATE_BURST_US / 1000000;
+    if (!burst) {
+        burst = 1;
+    }
+    tb->depth = (int64_t)(burst * TOKEN_SCALE);
+    tb->tokens = tb->depth;
+}
+
+static void tbucket_refill(net_tbucket_t *tb, uint64_t elapsed_us)
+{
+    if (!tb->rate) return;
+    
+    tb->tokens += (int64_t)(elapsed_us * tb->rate);
+    if (tb->tokens > tb->depth) {
+        tb->tokens = tb->depth;
+    }
+}
+
+static uint64_t tbucket_wait(const net_tbucket_t *tb)
+{
+    if (!tb->rate || tb->tokens >= 0) return 0;
+    
+    /* Round up so a wake-up never comes early */
+    return ((uint64_t)-tb->tokens + tb->rate - 1) / tb->rate;
+}
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+void net_ratelimit_init(net_ratelimit_t *rl, const net_rate_config_t *cfg,
+                        uint32_t share)
+{
+    static const net_rate_config_t unlimited;
+    
+    if (!cfg) cfg = &unlimited;
+    if (!share) share = 1;
+    
+    tbucket_init(&rl->bytes, cfg->bytes_per_sec, cfg->burst_bytes, share);
+    tbucket_init(&rl->pkts, cfg->pkts_per_sec, cfg->burst_pkts, share);
+    rl->last_us = rdtsc_us();
+    rl->throttled = 0;
+}
+
+uint64_t net_ratelimit_wait(net_ratelimit_t *rl, uint64_t now_us)
+{
+    if (now_us > rl->last_us) {
+        /* Anything beyond a second would only overflow into a full bucket */
+        uint64_t elapsed = MIN(now_us - rl->last_us, 1000000ULL);
+        tbucket_refill(&rl->bytes, elapsed);
+        tbucket_refill(&rl->pkts, elapsed);
+        rl->last_us = now_us;
+    }
+    
+    uint64_t wait = MAX(tbucket_wait(&rl->bytes), tbucket_wait(&rl->pkts));
+    if (wait) {
+        rl->throttled++;
+    }
+    return wait;
+}
+
+void net_ratelimit_charge(net_ratelimit_t *rl, size_t bytes)
+{
+    if (rl->bytes.rate) {
+        rl->bytes.tokens -= (int64_t)(bytes * TOKEN_SCALE);
+    }
+    if (rl->pkts.rate) {
+        rl->pkts.tokens -= (int64_t)TOKEN_SCALE;
+    }
+}
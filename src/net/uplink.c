@@ -0,0 +1,857 @@
+/*
+ * PureVisor - Cluster Uplink Implementation
+ * 
+ * Polled driver for a modern virtio-net device. Every TX descriptor owns
+ * a slot holding its virtio-net header; frames up to the copybreak are
+ * copied in behind the header, so a small frame costs one descriptor and
+ * its buffer is released before the device has seen it. Notifications
+ * and avail index updates are done once per burst.
+ */
+
+#include <lib/types.h>
+#include <lib/string.h>
+#include <net/uplink.h>
+#include <net/offload.h>
+#include <virtio/virtio.h>
+#include <pci/pci.h>
+#include <mm/pmm.h>
+#include <mm/heap.h>
+#include <mm/paging.h>
+#include <kernel/console.h>
+#include <arch/x86_64/cpu.h>
+
+#define UPLINK_RING_ORDER       1       /* Descriptors, then avail and used */
+#define UPLINK_USED_OFFSET      (PAGE_SIZE + 1024)
+#define UPLINK_SLOTS_ORDER      4       /* UPLINK_RING_SIZE TX slots */
+#define UPLINK_CTRL_ACK         128     /* Ack byte in the control buffer */
+#define UPLINK_SPIN_LIMIT       1000000
+#define UPLINK_CFG_MAX_PAIRS    8       /* virtio_net_config_t.max_virtqueue_pairs */
+
+#define UPLINK_FEATURES         (BIT(VIRTIO_F_VERSION_1) |           \
+                                 BIT(VIRTIO_NET_F_MAC) |             \
+                                 BIT(VIRTIO_NET_F_CSUM) |            \
+                                 BIT(VIRTIO_NET_F_GUEST_CSUM) |      \
+                                 BIT(VIRTIO_NET_F_HOST_TSO4) |       \
+                                 BIT(VIRTIO_NET_F_HOST_TSO6) |       \
+                                 BIT(VIRTIO_NET_F_CTRL_VQ) |         \
+                                 BIT(VIRTIO_NET_F_MQ))
+
+/* ============================================================================
+ * Register Access
+ * ============================================================================ */
+
+static inline uint32_t common_read(uplink_t *up, uint32_t offset, int size)
+{
+    return up->io.read(up->io.ctx, UPLINK_REGION_COMMON, offset, size);
+}
+
+static inline void common_write(uplink_t *up, uint32_t offset, int size,
+                                uint32_t value)
+{
+    up->io.write(up->io.ctx, UPLINK_REGION_COMMON, offset, size, value);
+}
+
+static void set_status(uplink_t *up, uint8_t status)
+{
+    common_write(up, VIRTIO_PCI_COMMON_STATUS, 1, status);
+}
+
+static uint8_t get_status(uplink_t *up)
+{
+    return (uint8_t)common_read(up, VIRTIO_PCI_COMMON_STATUS, 1);
+}
+
+static inline bool has_feature(uplink_t *up, uint32_t bit)
+{
+    return (up->features & BIT(bit)) != 0;
+}
+
+/* ============================================================================
+ * Virtqueues
+ * ============================================================================ */
+
+static int ring_init(uplink_t *up, uplink_ring_t *r, uint16_t index)
+{
+    common_write(up, VIRTIO_PCI_COMMON_Q_SELECT, 2, index);
+    uint16_t num = (uint16_t)common_read(up, VIRTIO_PCI_COMMON_Q_SIZE, 2);
+    if (num > UPLINK_RING_SIZE) {
+        num = UPLINK_RING_SIZE;
+        common_write(up, VIRTIO_PCI_COMMON_Q_SIZE, 2, num);
+    }
+    if (num == 0 || (num & (num - 1))) {
+        return -1;
+    }
+    
+    phys_addr_t phys = pmm_alloc_pages(UPLINK_RING_ORDER);
+    r->cookie = kmalloc(num * sizeof(pktbuf_t *), GFP_KERNEL | GFP_ZERO);
+    if (!phys || !r->cookie) {
+        if (phys) pmm_free_pages(phys, UPLINK_RING_ORDER);
+        kfree(r->cookie);
+        r->cookie = NULL;
+        return -1;
+    }
+    memset(phys_to_virt(phys), 0, PAGE_SIZE << UPLINK_RING_ORDER);
+    
+    r->index = index;
+    r->num = num;
+    r->phys = phys;
+    r->desc = phys_to_virt(phys);
+    r->avail = phys_to_virt(phys + PAGE_SIZE);
+    r->used = phys_to_virt(phys + UPLINK_USED_OFFSET);
+    r->avail_idx = 0;
+    r->last_used = 0;
+    r->unkicked = 0;
+    
+    for (uint16_t i = 0; i < num; i++) {
+        r->desc[i].next = i + 1;
+    }
+    r->free_head = 0;
+    r->num_free = num;
+    
+    /* Polled: interrupts are never wanted */
+    r->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    
+    phys_addr_t avail = phys + PAGE_SIZE;
+    phys_addr_t used = phys + UPLINK_USED_OFFSET;
+    common_write(up, VIRTIO_PCI_COMMON_Q_DESCLO, 4, (uint32_t)phys);
+    common_write(up, VIRTIO_PCI_COMMON_Q_DESCHI, 4, (uint32_t)(phys >> 32));
+    common_write(up, VIRTIO_PCI_COMMON_Q_AVAILLO, 4, (uint32_t)avail);
+    common_write(up, VIRTIO_PCI_COMMON_Q_AVAILHI, 4, (uint32_t)(avail >> 32));
+    common_write(up, VIRTIO_PCI_COMMON_Q_USEDLO, 4, (uint32_t)used);
+    common_write(up, VIRTIO_PCI_COMMON_Q_USEDHI, 4, (uint32_t)(used >> 32));
+    r->notify_off = common_read(up, VIRTIO_PCI_COMMON_Q_NOFF, 2) * up->io.notify_mult;
+    common_write(up, VIRTIO_PCI_COMMON_Q_ENABLE, 2, 1);
+    
+    return 0;
+}
+
+/* Device must be reset first */
+static void ring_free(uplink_ring_t *r)
+{
+    if (!r->phys) return;
+    
+    for (uint16_t i = 0; i < r->num; i++) {
+        if (r->cookie[i]) {
+            pktbuf_free(r->cookie[i]);
+        }
+    }
+    kfree(r->cookie);
+    pmm_free_pages(r->phys, UPLINK_RING_ORDER);
+    memset(r, 0, sizeof(*r));
+}
+
+static inline uint16_t ring_get_desc(uplink_ring_t *r)
+{
+    uint16_t d = r->free_head;
+    r->free_head = r->desc[d].next;
+    r->num_free--;
+    return d;
+}
+
+static void ring_put_chain(uplink_ring_t *r, uint16_t head)
+{
+    uint16_t tail = head;
+    uint16_t n = 1;
+    
+    while (r->desc[tail].flags & VIRTQ_DESC_F_NEXT) {
+        tail = r->desc[tail].next;
+        n++;
+    }
+    r->desc[tail].next = r->free_head;
+    r->free_head = head;
+    r->num_free += n;
+}
+
+static inline void ring_publish(uplink_ring_t *r, uint16_t head)
+{
+    r->avail->ring[r->avail_idx & (r->num - 1)] = head;
+    r->avail_idx++;
+    r->unkicked++;
+}
+
+/* Expose everything published so far; returns true if the device was notified */
+static bool ring_kick(uplink_t *up, uplink_ring_t *r)
+{
+    if (!r->unkicked) return false;
+    
+    /* Ring entries before the index (x86 keeps stores in order) */
+    barrier();
+    r->avail->idx = r->avail_idx;
+    r->unkicked = 0;
+    
+    /* Index store before the flags load */
+    mb();
+    if (r->used->flags & VIRTQ_USED_F_NO_NOTIFY) {
+        return false;
+    }
+    up->io.write(up->io.ctx, UPLINK_REGION_NOTIFY, r->notify_off, 2, r->index);
+    return true;
+}
+
+static inline bool ring_pop_used(uplink_ring_t *r, uint16_t *id, uint32_t *len)
+{
+    if (r->last_used == *(volatile uint16_t *)&r->used->idx) {
+        return false;
+    }
+    barrier();
+    
+    virtq_used_elem_t *e = &r->used->ring[r->last_used & (r->num - 1)];
+    *id = (uint16_t)e->id;
+    *len = e->len;
+    r->last_used++;
+    return true;
+}
+
+/* ============================================================================
+ * Transmit
+ * ============================================================================ */
+
+static void tx_build_hdr(const pktbuf_offload_t *ol, virtio_net_hdr_t *hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    
+    if (ol->flags & PKTBUF_OL_CSUM_PARTIAL) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = ol->csum_start;
+        hdr->csum_offset = ol->csum_offset;
+    }
+    
+    if (ol->gso_type != PKTBUF_GSO_NONE) {
+        hdr->gso_type = ol->gso_type == PKTBUF_GSO_TCPV4 ?
+                        VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+        hdr->gso_size = ol->gso_size;
+        hdr->hdr_len = ol->hdr_len;
+    }
+}
+
+/* Caller holds tx_lock */
+static void tx_reap(uplink_queue_t *q)
+{
+    uplink_ring_t *r = &q->tx;
+    uint16_t id;
+    uint32_t len;
+    
+    while (ring_pop_used(r, &id, &len)) {
+        pktbuf_t *pb = r->cookie[id];
+        if (pb) {
+            r->cookie[id] = NULL;
+            pb->status = 0;
+            pktbuf_free(pb);
+        }
+        ring_put_chain(r, id);
+    }
+}
+
+/* Caller holds tx_lock; consumes @pb */
+static bool tx_enqueue(uplink_queue_t *q, pktbuf_t *pb)
+{
+    uplink_ring_t *r = &q->tx;
+    bool copy = pb->pkt_len <= UPLINK_TX_COPYBREAK;
+    uint32_t need = 1;
+    
+    if (!copy) {
+        for (pktbuf_t *seg = pb; seg; seg = seg->next) {
+            if (seg->len) need++;
+        }
+    }
+    if (r->num_free < need) {
+        tx_reap(q);
+        if (r->num_free < need) {
+            q->tx_drops++;
+            pktbuf_free(pb);
+            return false;
+        }
+    }
+    
+    uint16_t head = ring_get_desc(r);
+    uint8_t *slot = q->tx_slots + (size_t)head * UPLINK_TX_SLOT_SIZE;
+    virtq_desc_t *d = &r->desc[head];
+    uint32_t len = pb->pkt_len;
+    
+    tx_build_hdr(&pb->ol, (virtio_net_hdr_t *)slot);
+    d->addr = virt_to_phys(slot);
+    d->flags = 0;
+    
+    if (copy) {
+        pktbuf_copy_out(pb, 0, slot + sizeof(virtio_net_hdr_t), len);
+        d->len = sizeof(virtio_net_hdr_t) + len;
+        pb->status = 0;
+        pktbuf_free(pb);
+    } else {
+        d->len = sizeof(virtio_net_hdr_t);
+        for (pktbuf_t *seg = pb; seg; seg = seg->next) {
+            if (!seg->len) continue;
+            uint16_t i = ring_get_desc(r);
+            d->flags = VIRTQ_DESC_F_NEXT;
+            d->next = i;
+            d = &r->desc[i];
+            d->addr = virt_to_phys(seg->data);
+            d->len = seg->len;
+            d->flags = 0;
+        }
+        r->cookie[head] = pb;
+    }
+    
+    ring_publish(r, head);
+    q->tx_packets++;
+    q->tx_bytes += len;
+    return true;
+}
+
+uint32_t uplink_xmit_burst(uplink_t *up, pktbuf_queue_t *q)
+{
+    uplink_queue_t *uq = &up->queues[smp_get_current_cpu() % up->queue_pairs];
+    pktbuf_queue_t ready;
+    pktbuf_t *pb;
+    uint32_t dropped = 0;
+    uint32_t sent = 0;
+    
+    /* Software fallback for offloads the device did not negotiate */
+    pktq_init(&ready);
+    while ((pb = pktq_pop(q)) != NULL) {
+        if (net_offload_resolve(pb, up->caps, &ready) < 0) {
+            dropped++;
+        }
+    }
+    
+    spinlock_acquire(&uq->tx_lock);
+    while ((pb = pktq_pop(&ready)) != NULL) {
+        if (tx_enqueue(uq, pb)) {
+            sent++;
+        }
+    }
+    if (ring_kick(up, &uq->tx)) {
+        uq->kicks++;
+    }
+    uq->tx_drops += dropped;
+    spinlock_release(&uq->tx_lock);
+    
+    return sent;
+}
+
+int uplink_xmit(uplink_t *up, pktbuf_t *pb)
+{
+    pktbuf_queue_t q;
+    
+    pktq_init(&q);
+    pktq_push(&q, pb);
+    return uplink_xmit_burst(up, &q) ? 0 : -1;
+}
+
+int uplink_send(uplink_t *up, const void *frame, size_t len)
+{
+    pktbuf_t *pb = pktbuf_alloc_copy(frame, len);
+    if (!pb) return -1;
+    
+    return uplink_xmit(up, pb);
+}
+
+/* ============================================================================
+ * Receive
+ * ============================================================================ */
+
+/* Caller holds rx_lock */
+static void rx_refill(uplink_queue_t *q)
+{
+    uplink_ring_t *r = &q->rx;
+    
+    while (r->num_free) {
+        pktbuf_t *pb = pktbuf_alloc();
+        if (!pb) break;
+        
+        uint16_t id = ring_get_desc(r);
+        r->desc[id].addr = virt_to_phys(pb->data);
+        r->desc[id].len = PKTBUF_DATA_SIZE;
+        r->desc[id].flags = VIRTQ_DESC_F_WRITE;
+        r->cookie[id] = pb;
+        ring_publish(r, id);
+    }
+}
+
+/* Caller holds rx_lock */
+static uint32_t rx_poll(uplink_t *up, uplink_queue_t *q, uint32_t budget,
+                        pktbuf_queue_t *out)
+{
+    uplink_ring_t *r = &q->rx;
+    uint32_t n = 0;
+    uint16_t id;
+    uint32_t len;
+    
+    while (n < budget && ring_pop_used(r, &id, &len)) {
+        pktbuf_t *pb = r->cookie[id];
+        r->cookie[id] = NULL;
+        ring_put_chain(r, id);
+        
+        if (!pb || len <= sizeof(virtio_net_hdr_t) || len > PKTBUF_DATA_SIZE) {
+            q->rx_drops++;
+            if (pb) pktbuf_free(pb);
+            continue;
+        }
+        
+        const virtio_net_hdr_t *hdr = (const virtio_net_hdr_t *)pb->data;
+        if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            pb->ol.flags |= PKTBUF_OL_CSUM_PARTIAL;
+            pb->ol.csum_start = hdr->csum_start;
+            pb->ol.csum_offset = hdr->csum_offset;
+        } else if (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+            pb->ol.flags |= PKTBUF_OL_CSUM_VALID;
+        }
+        
+        pb->data += sizeof(virtio_net_hdr_t);
+        pb->len = len - sizeof(virtio_net_hdr_t);
+        pb->pkt_len = pb->len;
+        
+        q->rx_packets++;
+        q->rx_bytes += pb->len;
+        pktq_push(out, pb);
+        n++;
+    }
+    
+    rx_refill(q);
+    if (ring_kick(up, r)) {
+        q->kicks++;
+    }
+    return n;
+}
+
+static void rx_deliver(uplink_t *up, pktbuf_queue_t *batch)
+{
+    pktbuf_t *pb;
+    
+    if (batch->count == 0) return;
+    
+    if (up->rx_fn) {
+        while ((pb = pktq_pop(batch)) != NULL) {
+            up->rx_fn(up->rx_ctx, pb);
+        }
+    } else if (up->backend) {
+        net_backend_rx_enqueue_burst(up->backend, batch);
+    } else {
+        while ((pb = pktq_pop(batch)) != NULL) {
+            pktbuf_free(pb);
+        }
+    }
+}
+
+uint32_t uplink_poll(uplink_t *up, uint32_t budget)
+{
+    uint32_t received = 0;
+    
+    for (uint16_t i = 0; i < up->queue_pairs; i++) {
+        uplink_queue_t *q = &up->queues[i];
+        pktbuf_queue_t batch;
+        
+        if (spinlock_try_acquire(&q->tx_lock)) {
+            tx_reap(q);
+            spinlock_release(&q->tx_lock);
+        }
+        
+        if (!spinlock_try_acquire(&q->rx_lock)) continue;
+        pktq_init(&batch);
+        received += rx_poll(up, q, budget, &batch);
+        spinlock_release(&q->rx_lock);
+        
+        /* Outside the lock: receivers may transmit in response */
+        rx_deliver(up, &batch);
+    }
+    
+    return received;
+}
+
+void uplink_set_rx_handler(uplink_t *up, uplink_rx_fn_t fn, void *ctx)
+{
+    up->rx_ctx = ctx;
+    up->rx_fn = fn;
+}
+
+/* ============================================================================
+ * Control Queue
+ * ============================================================================ */
+
+static int ctrl_command(uplink_t *up, uint8_t class, uint8_t cmd,
+                        const void *data, size_t len)
+{
+    uplink_ring_t *r = &up->ctrl;
+    uint8_t *buf = up->ctrl_buf;
+    
+    if (!up->has_ctrl || r->num_free < 2 ||
+        sizeof(virtio_net_ctrl_hdr_t) + len > UPLINK_CTRL_ACK) {
+        return -1;
+    }
+    
+    virtio_net_ctrl_hdr_t *hdr = (virtio_net_ctrl_hdr_t *)buf;
+    hdr->class = class;
+    hdr->cmd = cmd;
+    memcpy(buf + sizeof(*hdr), data, len);
+    buf[UPLINK_CTRL_ACK] = VIRTIO_NET_ERR;
+    
+    uint16_t head = ring_get_desc(r);
+    uint16_t ack = ring_get_desc(r);
+    r->desc[head].addr = virt_to_phys(buf);
+    r->desc[head].len = sizeof(*hdr) + len;
+    r->desc[head].flags = VIRTQ_DESC_F_NEXT;
+    r->desc[head].next = ack;
+    r->desc[ack].addr = virt_to_phys(buf + UPLINK_CTRL_ACK);
+    r->desc[ack].len = 1;
+    r->desc[ack].flags = VIRTQ_DESC_F_WRITE;
+    ring_publish(r, head);
+    ring_kick(up, r);
+    
+    /* Rare and at setup only: wait for the answer */
+    uint16_t id;
+    uint32_t used_len;
+    for (uint32_t spin = 0; spin < UPLINK_SPIN_LIMIT; spin++) {
+        if (ring_pop_used(r, &id, &used_len)) {
+            ring_put_chain(r, id);
+            return *(volatile uint8_t *)&buf[UPLINK_CTRL_ACK] == VIRTIO_NET_OK ? 0 : -1;
+        }
+        pause();
+    }
+    
+    pr_warn("Uplink: Control command %u/%u timed out", class, cmd);
+    return -1;
+}
+
+/* ============================================================================
+ * Network Backend
+ * ============================================================================ */
+
+static int uplink_be_transmit(net_backend_t *be, const net_sg_t *sg, uint32_t nsg,
+                              const pktbuf_offload_t *ol, net_tx_done_t done,
+                              void *ctx)
+{
+    uplink_t *up = be->priv;
+    
+    if (up->backend_tx.count >= NET_RX_RING_SIZE) {
+        uplink_xmit_burst(up, &up->backend_tx);
+    }
+    
+    pktbuf_t *pb = net_backend_attach_sg(sg, nsg, ol, done, ctx);
+    if (!pb) return -1;
+    
+    pktq_push(&up->backend_tx, pb);
+    return 0;
+}
+
+static void uplink_be_tx_flush(net_backend_t *be)
+{
+    uplink_t *up = be->priv;
+    uplink_xmit_burst(up, &up->backend_tx);
+}
+
+static void uplink_be_release(net_backend_t *be)
+{
+    uplink_t *up = be->priv;
+    pktbuf_t *pb;
+    
+    while ((pb = pktq_pop(&up->backend_tx)) != NULL) {
+        pktbuf_free(pb);
+    }
+    up->backend = NULL;
+    be->priv = NULL;
+}
+
+net_backend_t *uplink_backend(uplink_t *up)
+{
+    if (up->backend) return up->backend;
+    
+    net_backend_t *be = kmalloc(sizeof(net_backend_t), GFP_KERNEL | GFP_ZERO);
+    if (!be) return NULL;
+    
+    /* Frontends present the uplink's own address, so no promiscuous mode */
+    be->type = NET_BACKEND_UPLINK;
+    memcpy(be->mac, up->mac, 6);
+    pktq_init(&be->rx_queue);
+    be->transmit = uplink_be_transmit;
+    be->tx_flush = uplink_be_tx_flush;
+    be->release = uplink_be_release;
+    be->priv = up;
+    
+    up->backend = be;
+    return be;
+}
+
+/* ============================================================================
+ * Device Setup
+ * ============================================================================ */
+
+static void uplink_free_queues(uplink_t *up)
+{
+    for (uint16_t i = 0; i < UPLINK_MAX_QUEUE_PAIRS; i++) {
+        uplink_queue_t *q = &up->queues[i];
+        ring_free(&q->rx);
+        ring_free(&q->tx);
+        if (q->tx_slots) {
+            pmm_free_pages(virt_to_phys(q->tx_slots), UPLINK_SLOTS_ORDER);
+            q->tx_slots = NULL;
+        }
+    }
+    ring_free(&up->ctrl);
+    if (up->ctrl_buf) {
+        pmm_free_page(virt_to_phys(up->ctrl_buf));
+        up->ctrl_buf = NULL;
+    }
+}
+
+static int uplink_start(uplink_t *up, uint16_t max_pairs)
+{
+    /* Reset, then the virtio 1.0 initialization sequence */
+    set_status(up, 0);
+    for (uint32_t spin = 0; get_status(up) != 0; spin++) {
+        if (spin == UPLINK_SPIN_LIMIT) return -1;
+        pause();
+    }
+    set_status(up, VIRTIO_STATUS_ACKNOWLEDGE);
+    set_status(up, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    
+    uint64_t offered = 0;
+    for (uint32_t sel = 0; sel < 2; sel++) {
+        common_write(up, VIRTIO_PCI_COMMON_DFSELECT, 4, sel);
+        offered |= (uint64_t)common_read(up, VIRTIO_PCI_COMMON_DF, 4) << (32 * sel);
+    }
+    if (!(offered & BIT(VIRTIO_F_VERSION_1))) {
+        pr_error("Uplink: Device lacks VERSION_1, legacy devices are not supported");
+        return -1;
+    }
+    
+    uint64_t wanted = UPLINK_FEATURES;
+    if (!(offered & BIT(VIRTIO_NET_F_CSUM))) {
+        wanted &= ~(BIT(VIRTIO_NET_F_HOST_TSO4) | BIT(VIRTIO_NET_F_HOST_TSO6));
+    }
+    if (!(offered & BIT(VIRTIO_NET_F_CTRL_VQ))) {
+        wanted &= ~BIT(VIRTIO_NET_F_MQ);
+    }
+    up->features = offered & wanted;
+    
+    for (uint32_t sel = 0; sel < 2; sel++) {
+        common_write(up, VIRTIO_PCI_COMMON_GFSELECT, 4, sel);
+        common_write(up, VIRTIO_PCI_COMMON_GF, 4, (uint32_t)(up->features >> (32 * sel)));
+    }
+    set_status(up, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                   VIRTIO_STATUS_FEATURES_OK);
+    if (!(get_status(up) & VIRTIO_STATUS_FEATURES_OK)) {
+        pr_error("Uplink: Feature negotiation failed");
+        return -1;
+    }
+    
+    /* Device configuration */
+    if (has_feature(up, VIRTIO_NET_F_MAC)) {
+        for (int i = 0; i < 6; i++) {
+            up->mac[i] = (uint8_t)up->io.read(up->io.ctx, UPLINK_REGION_DEVICE, i, 1);
+        }
+    } else {
+        net_generate_mac(up->mac);
+    }
+    
+    uint16_t device_pairs = 1;
+    if (has_feature(up, VIRTIO_NET_F_MQ)) {
+        device_pairs = (uint16_t)up->io.read(up->io.ctx, UPLINK_REGION_DEVICE,
+                                             UPLINK_CFG_MAX_PAIRS, 2);
+        if (device_pairs == 0) device_pairs = 1;
+    }
+    up->queue_pairs = MIN(MIN(device_pairs, max_pairs), UPLINK_MAX_QUEUE_PAIRS);
+    if (up->queue_pairs == 0) up->queue_pairs = 1;
+    
+    /* Queues: rx0, tx0, rx1, tx1, ..., then control after the device maximum */
+    for (uint16_t i = 0; i < up->queue_pairs; i++) {
+        uplink_queue_t *q = &up->queues[i];
+        phys_addr_t slots = pmm_alloc_pages(UPLINK_SLOTS_ORDER);
+        if (!slots) return -1;
+        q->tx_slots = phys_to_virt(slots);
+        q->rx_lock = SPINLOCK_INIT;
+        q->tx_lock = SPINLOCK_INIT;
+        
+        if (ring_init(up, &q->rx, 2 * i) != 0 ||
+            ring_init(up, &q->tx, 2 * i + 1) != 0) {
+            return -1;
+        }
+    }
+    
+    if (has_feature(up, VIRTIO_NET_F_CTRL_VQ)) {
+        phys_addr_t buf = pmm_alloc_page();
+        if (!buf) return -1;
+        up->ctrl_buf = phys_to_virt(buf);
+        if (ring_init(up, &up->ctrl, 2 * device_pairs) != 0) return -1;
+        up->has_ctrl = true;
+    }
+    
+    set_status(up, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                   VIRTIO_STATUS_FEATURES_OK | VIRTIO_STATUS_DRIVER_OK);
+    
+    if (up->queue_pairs > 1) {
+        uint16_t pairs = up->queue_pairs;
+        if (ctrl_command(up, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                         &pairs, sizeof(pairs)) != 0) {
+            up->queue_pairs = 1;
+        }
+    }
+    
+    /* Offloads the device takes off our hands on transmit */
+    if (has_feature(up, VIRTIO_NET_F_CSUM)) up->caps |= NET_CAP_CSUM;
+    if (has_feature(up, VIRTIO_NET_F_HOST_TSO4)) up->caps |= NET_CAP_TSO4;
+    if (has_feature(up, VIRTIO_NET_F_HOST_TSO6)) up->caps |= NET_CAP_TSO6;
+    
+    for (uint16_t i = 0; i < up->queue_pairs; i++) {
+        uplink_queue_t *q = &up->queues[i];
+        rx_refill(q);
+        ring_kick(up, &q->rx);
+    }
+    
+    return 0;
+}
+
+uplink_t *uplink_create(const uplink_io_t *io, uint16_t max_pairs)
+{
+    if (pktbuf_init() != 0) return NULL;
+    
+    uplink_t *up = kmalloc(sizeof(uplink_t), GFP_KERNEL | GFP_ZERO);
+    if (!up) return NULL;
+    
+    up->io = *io;
+    if (io->ctx == NULL) {
+        /* uplink_start() below is the first to access them */
+        memcpy((void *)up->regions, (const void *)io->regions, sizeof(up->regions));
+        up->io.ctx = up->regions;
+    }
+    pktq_init(&up->backend_tx);
+    
+    if (uplink_start(up, max_pairs) != 0) {
+        set_status(up, VIRTIO_STATUS_FAILED);
+        uplink_free_queues(up);
+        kfree(up);
+        return NULL;
+    }
+    
+    pr_info("Uplink: MAC=%02x:%02x:%02x:%02x:%02x:%02x, %u queue pairs, features 0x%llx",
+            up->mac[0], up->mac[1], up->mac[2], up->mac[3], up->mac[4], up->mac[5],
+            up->queue_pairs, up->features);
+    
+    return up;
+}
+
+void uplink_destroy(uplink_t *up)
+{
+    if (!up) return;
+    
+    net_backend_destroy(up->backend);
+    
+    /* Stop the device before its rings go away */
+    set_status(up, 0);
+    uplink_free_queues(up);
+    kfree(up);
+}
+
+/* ============================================================================
+ * PCI Probe
+ * ============================================================================ */
+
+static uint32_t mmio_read(void *ctx, uint32_t region, uint32_t offset, int size)
+{
+    volatile uint8_t *p = ((volatile uint8_t **)ctx)[region] + offset;
+    
+    switch (size) {
+        case 1:  return *p;
+        case 2:  return *(volatile uint16_t *)p;
+        default: return *(volatile uint32_t *)p;
+    }
+}
+
+static void mmio_write(void *ctx, uint32_t region, uint32_t offset, int size,
+                       uint32_t value)
+{
+    volatile uint8_t *p = ((volatile uint8_t **)ctx)[region] + offset;
+    
+    switch (size) {
+        case 1:  *p = (uint8_t)value; break;
+        case 2:  *(volatile uint16_t *)p = (uint16_t)value; break;
+        default: *(volatile uint32_t *)p = value; break;
+    }
+}
+
+static bool is_virtio_net(uint8_t bus, uint8_t dev)
+{
+    if (pci_host_read(bus, dev, 0, PCI_VENDOR_ID, 2) != VIRTIO_PCI_VENDOR_ID) {
+        return false;
+    }
+    
+    uint32_t id = pci_host_read(bus, dev, 0, PCI_DEVICE_ID, 2);
+    return id == VIRTIO_PCI_DEVICE_NET_MODERN ||
+           (id == VIRTIO_PCI_DEVICE_NET &&
+            pci_host_read(bus, dev, 0, PCI_SUBSYSTEM_ID, 2) == VIRTIO_SUBSYS_NET);
+}
+
+/* Map the register regions named by the vendor capabilities */
+static uint32_t map_regions(uint8_t bus, uint8_t dev, volatile uint8_t **regions)
+{
+    uint32_t notify_mult = 0;
+    
+    if (!(pci_host_read(bus, dev, 0, PCI_STATUS, 2) & PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+    
+    uint8_t pos = pci_host_read(bus, dev, 0, PCI_CAPABILITIES, 1) & 0xFC;
+    for (int n = 0; pos && n < 48; n++) {
+        if (pci_host_read(bus, dev, 0, pos, 1) == PCI_CAP_VENDOR) {
+            uint8_t type = pci_host_read(bus, dev, 0, pos + 3, 1);
+            uint8_t bar = pci_host_read(bus, dev, 0, pos + 4, 1);
+            uint32_t offset = pci_host_read(bus, dev, 0, pos + 8, 4);
+            uint32_t length = pci_host_read(bus, dev, 0, pos + 12, 4);
+            int region = -1;
+            
+            switch (type) {
+                case VIRTIO_PCI_CAP_COMMON_CFG: region = UPLINK_REGION_COMMON; break;
+                case VIRTIO_PCI_CAP_ISR_CFG:    region = UPLINK_REGION_ISR; break;
+                case VIRTIO_PCI_CAP_DEVICE_CFG: region = UPLINK_REGION_DEVICE; break;
+                case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                    region = UPLINK_REGION_NOTIFY;
+                    notify_mult = pci_host_read(bus, dev, 0, pos + 16, 4);
+                    break;
+            }
+            
+            /* The first capability of each type is the preferred one */
+            uint64_t base = bar < PCI_MAX_BARS ? pci_host_bar(bus, dev, 0, bar) : 0;
+            if (region >= 0 && !regions[region] && base && length) {
+                regions[region] = paging_map_io(base + offset, length);
+            }
+        }
+        pos = pci_host_read(bus, dev, 0, pos + 1, 1) & 0xFC;
+    }
+    
+    return notify_mult;
+}
+
+uplink_t *uplink_probe(void)
+{
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t dev = 0; dev < 32; dev++) {
+            if (!is_virtio_net(bus, dev)) continue;
+            
+            uplink_io_t io = {
+                .read = mmio_read,
+                .write = mmio_write,
+                .ctx = NULL,
+            };
+            io.notify_mult = map_regions(bus, dev, io.regions);
+            if (!io.regions[UPLINK_REGION_COMMON] || !io.regions[UPLINK_REGION_DEVICE] ||
+                !io.regions[UPLINK_REGION_NOTIFY]) {
+                pr_warn("Uplink: %02x:%02x.0 has no modern interface", bus, dev);
+                continue;
+            }
+            
+            uint16_t cmd = pci_host_read(bus, dev, 0, PCI_COMMAND, 2);
+            pci_host_write(bus, dev, 0, PCI_COMMAND, 2,
+                           cmd | PCI_CMD_MEM_SPACE | PCI_CMD_BUS_MASTER);
+            
+            /* ctx NULL: uplink_create points it at the uplink's own regions */
+            uplink_t *up = uplink_create(&io, UPLINK_MAX_QUEUE_PAIRS);
+            if (!up) continue;
+            
+            up->bus = bus;
+            up->device = dev;
+            up->function = 0;
+            return up;
+        }
+    }
+    
+    return NULL;
+}
@@ -0,0 +1,453 @@
+/*
+ * PureVisor - Virtual Switch Implementation
+ * 
+ * Frames move between ports by reference: a VM's TX buffers are handed
+ * to every receiver without copying, and only a VLAN tag rewrite gets a
+ * private header.
+ */
+
+#include <lib/types.h>
+#include <lib/string.h>
+#include <net/vswitch.h>
+#include <net/proto.h>
+#include <cluster/vm.h>
+#include <mm/heap.h>
+#include <kernel/console.h>
+#include <arch/x86_64/cpu.h>
+
+/* ============================================================================
+ * Global State
+ * ============================================================================ */
+
+static vswitch_t *switches[VSWITCH_MAX];
+
+static inline uint32_t vswitch_now(void)
+{
+    return (uint32_t)(rdtsc_us() / 1000000);
+}
+
+/* ============================================================================
+ * Forwarding Database
+ * ============================================================================ */
+
+static uint32_t fdb_hash(const uint8_t *mac, uint16_t vlan)
+{
+    uint32_t h = 2166136261U;   /* FNV-1a */
+    
+    for (int i = 0; i < ETH_ALEN; i++) {
+        h = (h ^ mac[i]) * 16777619U;
+    }
+    h = (h ^ vlan) * 16777619U;
+    return h % VSWITCH_FDB_BUCKETS;
+}
+
+static void fdb_learn(vswitch_t *sw, const uint8_t *mac, uint16_t vlan,
+                      uint16_t port, uint32_t now)
+{
+    vswitch_fdb_entry_t *set = sw->fdb[fdb_hash(mac, vlan)];
+    vswitch_fdb_entry_t *victim = &set[0];
+    
+    for (int i = 0; i < VSWITCH_FDB_WAYS; i++) {
+        vswitch_fdb_entry_t *e = &set[i];
+        if (e->port != VSWITCH_PORT_NONE && e->vlan == vlan &&
+            memcmp(e->mac, mac, ETH_ALEN) == 0) {
+            e->port = port;     /* Station may have moved */
+            e->last_seen = now;
+            return;
+        }
+        if (e->port == VSWITCH_PORT_NONE) {
+            victim = e;
+        } else if (victim->port != VSWITCH_PORT_NONE &&
+                   e->last_seen < victim->last_seen) {
+            victim = e;
+        }
+    }
+    
+    memcpy(victim->mac, mac, ETH_ALEN);
+    victim->vlan = vlan;
+    victim->port = port;
+    victim->last_seen = now;
+}
+
+static uint16_t fdb_lookup(vswitch_t *sw, const uint8_t *mac, uint16_t vlan,
+                           uint32_t now)
+{
+    vswitch_fdb_entry_t *set = sw->fdb[fdb_hash(mac, vlan)];
+    
+    for (int i = 0; i < VSWITCH_FDB_WAYS; i++) {
+        vswitch_fdb_entry_t *e = &set[i];
+        if (e->port != VSWITCH_PORT_NONE && e->vlan == vlan &&
+            memcmp(e->mac, mac, ETH_ALEN) == 0) {
+            if (now - e->last_seen > VSWITCH_FDB_AGE_SEC) {
+                e->port = VSWITCH_PORT_NONE;
+                return VSWITCH_PORT_NONE;
+            }
+            return e->port;
+        }
+    }
+    return VSWITCH_PORT_NONE;
+}
+
+static void fdb_flush_port(vswitch_t *sw, uint16_t port)
+{
+    for (int b = 0; b < VSWITCH_FDB_BUCKETS; b++) {
+        for (int i = 0; i < VSWITCH_FDB_WAYS; i++) {
+            if (sw->fdb[b][i].port == port) {
+                sw->fdb[b][i].port = VSWITCH_PORT_NONE;
+            }
+        }
+    }
+}
+
+/* ============================================================================
+ * VLAN Handling
+ * ============================================================================ */
+
+static inline bool port_member(const vswitch_port_t *port, uint16_t vlan)
+{
+    return port->trunk || port->vlan == vlan;
+}
+
+static inline bool port_tags(const vswitch_port_t *port, uint16_t vlan)
+{
+    return port->trunk && port->vlan != vlan;
+}
+
+/*
+ * Add or remove an 802.1Q tag. The new header is private; the rest of
+ * the frame still references @pb, which keeps its own reference.
+ */
+static pktbuf_t *vlan_rewrite(pktbuf_t *pb, bool tagged, uint16_t vlan)
+{
+    pktbuf_t *out = pktbuf_alloc();
+    if (!out) return NULL;
+    
+    uint8_t *h = out->data;
+    size_t skip;
+    int shift;
+    
+    pktbuf_copy_out(pb, 0, h, 2 * ETH_ALEN);
+    if (tagged) {
+        /* Keep the encapsulated ethertype, drop the tag */
+        pktbuf_copy_out(pb, ETH_HLEN + 2, h + 2 * ETH_ALEN, 2);
+        out->len = ETH_HLEN;
+        skip = ETH_HLEN + ETH_VLAN_HLEN;
+        shift = -ETH_VLAN_HLEN;
+    } else {
+        vlan_hdr_t tag;
+        tag.tci = htons(vlan & VLAN_VID_MASK);
+        pktbuf_copy_out(pb, 2 * ETH_ALEN, &tag.type, 2);
+        h[12] = ETH_P_8021Q >> 8;
+        h[13] = ETH_P_8021Q & 0xFF;
+        memcpy(h + ETH_HLEN, &tag, sizeof(tag));
+        out->len = ETH_HLEN + ETH_VLAN_HLEN;
+        skip = ETH_HLEN;
+        shift = ETH_VLAN_HLEN;
+    }
+    out->pkt_len = out->len;
+    
+    if (pktbuf_attach_ref(out, pb, skip, pb->pkt_len - skip) != 0) {
+        pktbuf_free(out);
+        return NULL;
+    }
+    
+    /* Offload offsets move with the header */
+    out->ol = pb->ol;
+    if (out->ol.flags & PKTBUF_OL_CSUM_PARTIAL) {
+        out->ol.csum_start += shift;
+    }
+    if (out->ol.hdr_len) {
+        out->ol.hdr_len += shift;
+    }
+    return out;
+}
+
+/* ============================================================================
+ * Forwarding
+ * ============================================================================ */
+
+static void switch_frame(vswitch_t *sw, vswitch_port_t *in, pktbuf_t *pb,
+                         pktbuf_queue_t *egress, uint32_t now)
+{
+    uint8_t hdr[ETH_HLEN + ETH_VLAN_HLEN];
+    size_t len = pktbuf_copy_out(pb, 0, hdr, sizeof(hdr));
+    const eth_hdr_t *eth = (const eth_hdr_t *)hdr;
+    
+    if (len < ETH_HLEN) goto drop;
+    
+    /* Classify: tagged frames are only accepted on trunks */
+    bool tagged = ntohs(eth->type) == ETH_P_8021Q && len >= sizeof(hdr);
+    uint16_t vlan = in->vlan;
+    if (tagged) {
+        if (!in->trunk) goto drop;
+        vlan = ntohs(((const vlan_hdr_t *)(hdr + ETH_HLEN))->tci) & VLAN_VID_MASK;
+    }
+    
+    if (!eth_is_multicast(eth->src)) {
+        fdb_learn(sw, eth->src, vlan, in->index, now);
+    }
+    
+    /* Known unicast goes to one port, everything else floods the VLAN */
+    uint16_t dest = VSWITCH_PORT_NONE;
+    if (!eth_is_multicast(eth->dst)) {
+        dest = fdb_lookup(sw, eth->dst, vlan, now);
+    }
+    if (dest == in->index) goto drop;
+    
+    pktbuf_t *variant[2] = {NULL, NULL};    /* [tagged] */
+    variant[tagged] = pb;
+    uint32_t sent = 0;
+    
+    for (uint16_t i = 0; i < VSWITCH_MAX_PORTS; i++) {
+        vswitch_port_t *out = sw->ports[i];
+        if (!out || out == in || !port_member(out, vlan)) continue;
+        if (dest != VSWITCH_PORT_NONE && dest != i) continue;
+        
+        bool want = port_tags(out, vlan);
+        if (!variant[want]) {
+            variant[want] = vlan_rewrite(pb, tagged, vlan);
+            if (!variant[want]) {
+                out->drops++;
+                continue;
+            }
+        }
+        
+        pktq_push(&egress[i], pktbuf_ref(variant[want]));
+        sent++;
+    }
+    
+    if (dest == VSWITCH_PORT_NONE) {
+        sw->flooded++;
+    } else if (sent) {
+        sw->forwarded++;
+    }
+    
+    /* Receivers hold their own references */
+    pktbuf_free(variant[!tagged]);
+    pktbuf_free(pb);
+    return;
+
+drop:
+    in->drops++;
+    sw->dropped++;
+    pktbuf_free(pb);
+}
+
+void vswitch_forward(vswitch_t *sw)
+{
+    pktbuf_queue_t egress[VSWITCH_MAX_PORTS];
+    bool pending = true;
+    
+    if (sw->forwarding) return;
+    sw->forwarding = true;
+    
+    for (uint16_t i = 0; i < VSWITCH_MAX_PORTS; i++) {
+        pktq_init(&egress[i]);
+    }
+    
+    while (pending) {
+        uint32_t now = vswitch_now();
+        
+        /* One burst per port keeps a busy VM from starving the others */
+        for (uint16_t i = 0; i < VSWITCH_MAX_PORTS; i++) {
+            vswitch_port_t *port = sw->ports[i];
+            if (!port) continue;
+            
+            pktbuf_t *pb;
+            for (uint32_t n = 0; n < VSWITCH_BURST &&
+                 (pb = pktq_pop(&port->ingress)) != NULL; n++) {
+                switch_frame(sw, port, pb, egress, now);
+            }
+        }
+        
+        pending = false;
+        for (uint16_t i = 0; i < VSWITCH_MAX_PORTS; i++) {
+            vswitch_port_t *port = sw->ports[i];
+            if (!port) continue;
+            
+            if (egress[i].count) {
+                uint32_t count = egress[i].count;
+                int dropped = net_backend_rx_enqueue_burst(port->be, &egress[i]);
+                port->tx_frames += count - dropped;
+                port->drops += dropped;
+            }
+            if (port->ingress.head) {
+                pending = true;
+            }
+        }
+    }
+    
+    sw->forwarding = false;
+}
+
+/* ============================================================================
+ * Port Backend
+ * ============================================================================ */
+
+static int vswitch_port_transmit(net_backend_t *be, const net_sg_t *sg, uint32_t nsg,
+                                 const pktbuf_offload_t *ol, net_tx_done_t done,
+                                 void *ctx)
+{
+    vswitch_port_t *port = be->priv;
+    
+    if (port->ingress.count >= VSWITCH_PORT_QUEUE) {
+        vswitch_forward(port->sw);
+        if (port->ingress.count >= VSWITCH_PORT_QUEUE) {
+            port->drops++;
+            return -1;
+        }
+    }
+    
+    pktbuf_t *pb = net_backend_attach_sg(sg, nsg, ol, done, ctx);
+    if (!pb) return -1;
+    
+    pktq_push(&port->ingress, pb);
+    port->rx_frames++;
+    return 0;
+}
+
+static void vswitch_port_tx_flush(net_backend_t *be)
+{
+    vswitch_port_t *port = be->priv;
+    vswitch_forward(port->sw);
+}
+
+static void vswitch_port_release(net_backend_t *be)
+{
+    vswitch_port_t *port = be->priv;
+    vswitch_t *sw = port->sw;
+    pktbuf_t *pb;
+    
+    sw->ports[port->index] = NULL;
+    sw->port_count--;
+    fdb_flush_port(sw, port->index);
+    
+    while ((pb = pktq_pop(&port->ingress)) != NULL) {
+        pktbuf_free(pb);
+    }
+    
+    kfree(port);
+    be->priv = NULL;
+}
+
+net_backend_t *vswitch_port_create(vswitch_t *sw, const uint8_t mac[6],
+                                   uint16_t vlan, bool trunk)
+{
+    uint16_t index;
+    
+    if (!sw) return NULL;
+    
+    for (index = 0; index < VSWITCH_MAX_PORTS; index++) {
+        if (!sw->ports[index]) break;
+    }
+    if (index == VSWITCH_MAX_PORTS) {
+        pr_error("vSwitch %s: No free ports", sw->name);
+        return NULL;
+    }
+    
+    if (pktbuf_init() != 0) return NULL;
+    
+    vswitch_port_t *port = kmalloc(sizeof(vswitch_port_t), GFP_KERNEL | GFP_ZERO);
+    net_backend_t *be = kmalloc(sizeof(net_backend_t), GFP_KERNEL | GFP_ZERO);
+    if (!port || !be) {
+        kfree(port);
+        kfree(be);
+        return NULL;
+    }
+    
+    port->sw = sw;
+    port->index = index;
+    port->be = be;
+    port->vlan = vlan & VLAN_VID_MASK;
+    port->trunk = trunk;
+    pktq_init(&port->ingress);
+    
+    be->type = NET_BACKEND_VSWITCH;
+    if (mac) {
+        memcpy(be->mac, mac, 6);
+    } else {
+        net_generate_mac(be->mac);
+    }
+    pktq_init(&be->rx_queue);
+    be->transmit = vswitch_port_transmit;
+    be->tx_flush = vswitch_port_tx_flush;
+    be->release = vswitch_port_release;
+    be->priv = port;
+    
+    sw->ports[index] = port;
+    sw->port_count++;
+    
+    pr_info("vSwitch %s: Port %u, VLAN %u%s", sw->name, index, port->vlan,
+            trunk ? " (trunk)" : "");
+    
+    return be;
+}
+
+/* ============================================================================
+ * Switch Management
+ * ============================================================================ */
+
+vswitch_t *vswitch_create(const char *name)
+{
+    int slot;
+    
+    for (slot = 0; slot < VSWITCH_MAX; slot++) {
+        if (!switches[slot]) break;
+    }
+    if (slot == VSWITCH_MAX) return NULL;
+    
+    vswitch_t *sw = kmalloc(sizeof(vswitch_t), GFP_KERNEL | GFP_ZERO);
+    if (!sw) return NULL;
+    
+    strncpy(sw->name, name, VSWITCH_NAME_MAX - 1);
+    for (int b = 0; b < VSWITCH_FDB_BUCKETS; b++) {
+        for (int i = 0; i < VSWITCH_FDB_WAYS; i++) {
+            sw->fdb[b][i].port = VSWITCH_PORT_NONE;
+        }
+    }
+    
+    switches[slot] = sw;
+    pr_info("vSwitch %s: Created", sw->name);
+    return sw;
+}
+
+void vswitch_destroy(vswitch_t *sw)
+{
+    if (!sw) return;
+    
+    for (uint16_t i = 0; i < VSWITCH_MAX_PORTS; i++) {
+        if (sw->ports[i]) {
+            net_backend_destroy(sw->ports[i]->be);
+        }
+    }
+    
+    for (int slot = 0; slot < VSWITCH_MAX; slot++) {
+        if (switches[slot] == sw) {
+            switches[slot] = NULL;
+        }
+    }
+    kfree(sw);
+}
+
+vswitch_t *vswitch_find(const char *name)
+{
+    for (int slot = 0; slot < VSWITCH_MAX; slot++) {
+        if (switches[slot] && strcmp(switches[slot]->name, name) == 0) {
+            return switches[slot];
+        }
+    }
+    return NULL;
+}
+
+net_backend_t *vswitch_connect_nic(const vm_nic_config_t *nic)
+{
+    if (!nic || !nic->enabled || !nic->network[0]) return NULL;
+    
+    vswitch_t *sw = vswitch_find(nic->network);
+    if (!sw) {
+        sw = vswitch_create(nic->network);
+        if (!sw) return NULL;
+    }
+    
+    return vswitch_port_create(sw, nic->mac, (uint16_t)nic->vlan, false);
+}
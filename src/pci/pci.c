@@ -9,6 +9,7 @@
 #include <pci/pci.h>
 #include <mm/heap.h>
 #include <kernel/console.h>
+#include <arch/x86_64/cpu.h>
 
 /* ============================================================================
  * Global State
@@ -71,8 +72,8 @@ static uint32_t config_read_default(pci_device_t *dev, uint8_t offset, int size)
     return value;
 }
 
-static void config_write_default(pci_device_t *dev, uint8_t offset,
-                                 int size, uint32_t value)
+void pci_config_write_default(pci_device_t *dev, uint8_t offset,
+                              int size, uint32_t value)
 {
     if (offset + size > PCI_CONFIG_SPACE_SIZE) {
         return;
@@ -262,7 +263,7 @@ int pci_config_write(uint8_t bus, uint8_t device, uint8_t function,
         return dev->config_write(dev, offset, size, value);
     }
     
-    config_write_default(dev, offset, size, value);
+    pci_config_write_default(dev, offset, size, value);
     return 0;
 }
 
@@ -350,3 +351,50 @@ void pci_add_capability(pci_device_t *dev, uint8_t cap_id,
         dev->msix_cap_offset = offset;
     }
 }
+
+/* ============================================================================
+ * Host Bus Access
+ * ============================================================================ */
+
+uint32_t pci_host_read(uint8_t bus, uint8_t device, uint8_t function,
+                       uint8_t offset, int size)
+{
+    uint16_t port = PCI_CONFIG_DATA + (offset & 3);
+    
+    outl(PCI_CONFIG_ADDR, make_config_addr(bus, device, function, offset));
+    switch (size) {
+        case 1:  return inb(port);
+        case 2:  return inw(port);
+        default: return inl(PCI_CONFIG_DATA);
+    }
+}
+
+void pci_host_write(uint8_t bus, uint8_t device, uint8_t function,
+                    uint8_t offset, int size, uint32_t value)
+{
+    uint16_t port = PCI_CONFIG_DATA + (offset & 3);
+    
+    /* Sized accesses, so W1C status bits next to the target are untouched */
+    outl(PCI_CONFIG_ADDR, make_config_addr(bus, device, function, offset));
+    switch (size) {
+        case 1:  outb(port, (uint8_t)value); break;
+        case 2:  outw(port, (uint16_t)value); break;
+        default: outl(PCI_CONFIG_DATA, value); break;
+    }
+}
+
+uint64_t pci_host_bar(uint8_t bus, uint8_t device, uint8_t function, int bar)
+{
+    if (bar < 0 || bar >= PCI_MAX_BARS) return 0;
+    
+    uint8_t offset = PCI_BAR0 + bar * 4;
+    uint32_t lo = pci_host_read(bus, device, function, offset, 4);
+    
+    if (lo & PCI_BAR_IO) return 0;
+    
+    uint64_t base = lo & ~0x0FULL;
+    if ((lo & 0x06) == PCI_BAR_MEM_64 && bar < PCI_MAX_BARS - 1) {
+        base |= (uint64_t)pci_host_read(bus, device, function, offset + 4, 4) << 32;
+    }
+    return base;
+}
@@ -7,8 +7,12 @@
 #include <lib/types.h>
 #include <lib/string.h>
 #include <storage/block.h>
+#include <storage/qos.h>
 #include <mm/heap.h>
+#include <mm/pmm.h>
 #include <kernel/console.h>
+#include <kernel/apic.h>
+#include <kernel/timer.h>
 #include <arch/x86_64/cpu.h>
 
 /* ============================================================================
@@ -20,6 +24,25 @@ static uint32_t block_device_count = 0;
 static uint32_t next_device_id = 1;
 static bool block_initialized = false;
 
+/* Per-CPU free request cache (accessed only by its own CPU) */
+typedef struct block_req_cache {
+    uint32_t count;
+    uint16_t objs[BLOCK_REQ_CACHE_SIZE];
+} block_req_cache_t;
+
+/* Pool slots are whole cache lines, so requests never share one */
+#define REQ_SLOT_SIZE   ALIGN_UP(sizeof(block_request_t), 64)
+
+static uint8_t *req_pool = NULL;
+static uint16_t req_free_stack[BLOCK_REQ_POOL_COUNT];
+static uint32_t req_free_top = 0;
+static spinlock_t req_lock = SPINLOCK_INIT;
+static block_req_cache_t req_caches[MAX_CPUS];
+static block_req_stats_t req_stats;
+
+STATIC_ASSERT(BLOCK_REQ_POOL_COUNT * REQ_SLOT_SIZE <=
+              (PAGE_SIZE << BLOCK_REQ_POOL_ORDER), "request pool area too small");
+
 /* ============================================================================
  * UUID Generation
  * ============================================================================ */
@@ -44,127 +67,962 @@ void block_generate_uuid(char *uuid)
  * Request Management
  * ============================================================================ */
 
+static inline block_request_t *req_slot(uint32_t index)
+{
+    return (block_request_t *)(req_pool + (size_t)index * REQ_SLOT_SIZE);
+}
+
+/* Move up to @n requests above the reserve from the global pool into @cache */
+static void req_refill(block_req_cache_t *cache, uint32_t n)
+{
+    spinlock_acquire(&req_lock);
+    while (n-- > 0 && req_free_top > BLOCK_REQ_RESERVE &&
+           cache->count < BLOCK_REQ_CACHE_SIZE) {
+        cache->objs[cache->count++] = req_free_stack[--req_free_top];
+    }
+    spinlock_release(&req_lock);
+}
+
+/* Return up to @n requests from @cache to the global pool */
+static void req_flush(block_req_cache_t *cache, uint32_t n)
+{
+    spinlock_acquire(&req_lock);
+    while (n-- > 0 && cache->count > 0) {
+        req_free_stack[req_free_top++] = cache->objs[--cache->count];
+    }
+    spinlock_release(&req_lock);
+}
+
+static block_request_t *req_reserve_take(void)
+{
+    block_request_t *req = NULL;
+    
+    spinlock_acquire(&req_lock);
+    if (req_free_top > 0) {
+        req = req_slot(req_free_stack[--req_free_top]);
+    }
+    spinlock_release(&req_lock);
+    return req;
+}
+
+static void req_pool_init(void)
+{
+    phys_addr_t phys = pmm_alloc_pages(BLOCK_REQ_POOL_ORDER);
+    if (!phys) {
+        pr_warn("Block: No request pool, using the heap");
+        return;
+    }
+    
+    memset(req_caches, 0, sizeof(req_caches));
+    memset(&req_stats, 0, sizeof(req_stats));
+    
+    /* Lowest slots on top so early requests share cache lines */
+    for (uint32_t i = 0; i < BLOCK_REQ_POOL_COUNT; i++) {
+        req_free_stack[i] = BLOCK_REQ_POOL_COUNT - 1 - i;
+    }
+    req_free_top = BLOCK_REQ_POOL_COUNT;
+    req_stats.total = BLOCK_REQ_POOL_COUNT;
+    
+    barrier();
+    req_pool = phys_to_virt(phys);
+}
+
 block_request_t *block_alloc_request(void)
 {
-    block_request_t *req = kmalloc(sizeof(block_request_t), GFP_KERNEL | GFP_ZERO);
+    block_request_t *req = NULL;
+    
+    if (req_pool) {
+        block_req_cache_t *cache = &req_caches[smp_get_current_cpu() % MAX_CPUS];
+        if (cache->count == 0) {
+            req_refill(cache, BLOCK_REQ_CACHE_BATCH);
+        }
+        if (cache->count > 0) {
+            req = req_slot(cache->objs[--cache->count]);
+        }
+    }
+    
+    if (!req) {
+        req = kmalloc(sizeof(block_request_t), GFP_KERNEL);
+        if (req) {
+            req_stats.heap_allocs++;
+        } else if (req_pool && (req = req_reserve_take()) != NULL) {
+            req_stats.reserve_allocs++;
+        } else {
+            req_stats.alloc_failures++;
+            return NULL;
+        }
+    }
+    
+    uint16_t slot = 0;
+    uint8_t *p = (uint8_t *)req;
+    if (req_pool && p >= req_pool && p < req_pool + BLOCK_REQ_POOL_COUNT * REQ_SLOT_SIZE) {
+        slot = (uint16_t)((p - req_pool) / REQ_SLOT_SIZE) + 1;
+    }
+    
+    memset(req, 0, sizeof(block_request_t));
+    req->slot = slot;
+    req_stats.allocs++;
     return req;
 }
 
 void block_free_request(block_request_t *req)
 {
-    if (req) {
+    if (!req) return;
+    
+    req_stats.frees++;
+    if (!req->slot) {
         kfree(req);
+        return;
+    }
+    
+    /* Top the reserve back up first */
+    if (req_free_top < BLOCK_REQ_RESERVE) {
+        spinlock_acquire(&req_lock);
+        req_free_stack[req_free_top++] = req->slot - 1;
+        spinlock_release(&req_lock);
+        return;
+    }
+    
+    block_req_cache_t *cache = &req_caches[smp_get_current_cpu() % MAX_CPUS];
+    if (cache->count >= BLOCK_REQ_CACHE_SIZE) {
+        req_flush(cache, BLOCK_REQ_CACHE_BATCH);
     }
+    cache->objs[cache->count++] = req->slot - 1;
+}
+
+void block_get_request_stats(block_req_stats_t *stats)
+{
+    spinlock_acquire(&req_lock);
+    *stats = req_stats;
+    stats->free = req_free_top;
+    spinlock_release(&req_lock);
 }
 
 /* ============================================================================
- * Synchronous I/O
+ * Scatter-Gather
  * ============================================================================ */
 
-static volatile int sync_complete;
-static int sync_status;
+uint64_t block_iov_length(const block_iovec_t *iov, uint32_t count)
+{
+    uint64_t len = 0;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        len += iov[i].len;
+    }
+    return len;
+}
 
-static void sync_completion(void *ctx UNUSED, int status)
+#define IOV_COPY_TO     0
+#define IOV_COPY_FROM   1
+#define IOV_ZERO        2
+
+/* Apply @action to @len bytes of the request data from @offset */
+static void iov_walk(const block_request_t *req, uint64_t offset, size_t len,
+                     int action, uint8_t *buf)
 {
-    sync_status = status;
-    sync_complete = 1;
+    for (uint32_t i = 0; i < req->iov_count && len; i++) {
+        const block_iovec_t *v = &req->iov[i];
+        
+        if (offset >= v->len) {
+            offset -= v->len;
+            continue;
+        }
+        
+        uint8_t *seg = (uint8_t *)v->base + offset;
+        size_t n = MIN(len, (size_t)(v->len - offset));
+        
+        switch (action) {
+            case IOV_COPY_TO:
+                memcpy(seg, buf, n);
+                break;
+            case IOV_COPY_FROM:
+                memcpy(buf, seg, n);
+                break;
+            default:
+                memset(seg, 0, n);
+                break;
+        }
+        
+        if (buf) buf += n;
+        len -= n;
+        offset = 0;
+    }
 }
 
-int block_read(block_device_t *dev, uint64_t offset, void *buf, uint32_t len)
+void block_iov_copy_to(const block_request_t *req, uint64_t offset,
+                       const void *src, size_t len)
 {
-    if (!dev || !dev->ops || !dev->ops->submit) {
-        return -1;
+    iov_walk(req, offset, len, IOV_COPY_TO, (uint8_t *)src);
+}
+
+void block_iov_copy_from(const block_request_t *req, uint64_t offset,
+                         void *dst, size_t len)
+{
+    iov_walk(req, offset, len, IOV_COPY_FROM, dst);
+}
+
+void block_iov_zero(const block_request_t *req, uint64_t offset, size_t len)
+{
+    iov_walk(req, offset, len, IOV_ZERO, NULL);
+}
+
+uint32_t block_iov_slice(const block_request_t *req, uint64_t offset,
+                         uint64_t len, block_iovec_t *out)
+{
+    uint32_t n = 0;
+    
+    for (uint32_t i = 0; i < req->iov_count && len; i++) {
+        const block_iovec_t *v = &req->iov[i];
+        
+        if (offset >= v->len) {
+            offset -= v->len;
+            continue;
+        }
+        
+        out[n].base = (uint8_t *)v->base + offset;
+        out[n].len = (uint32_t)MIN(len, v->len - offset);
+        len -= out[n].len;
+        offset = 0;
+        n++;
     }
+    return n;
+}
+
+/* ============================================================================
+ * Lock-free Request Lists
+ * ============================================================================ */
+
+static void list_push(block_request_t *volatile *list, block_request_t *req)
+{
+    block_request_t *old;
     
-    if (offset + len > dev->size) {
-        return -1;
+    do {
+        old = *list;
+        req->next = old;
+    } while (!__sync_bool_compare_and_swap(list, old, req));
+}
+
+/* Take the whole list, oldest first */
+static block_request_t *list_take(block_request_t *volatile *list)
+{
+    block_request_t *req = __sync_lock_test_and_set(list, NULL);
+    block_request_t *fifo = NULL;
+    
+    while (req) {
+        block_request_t *next = req->next;
+        req->next = fifo;
+        fifo = req;
+        req = next;
     }
+    return fifo;
+}
+
+/* ============================================================================
+ * Completion Context
+ * ============================================================================ */
+
+/* Finished requests per submitting CPU, callbacks not yet run */
+static block_request_t *volatile done_lists[MAX_CPUS];
+
+uint32_t block_run_completions(void)
+{
+    block_request_t *volatile *list = &done_lists[smp_get_current_cpu()];
+    uint32_t count = 0;
     
-    block_request_t *req = block_alloc_request();
-    if (!req) return -1;
+    /* Callbacks may submit, complete and run nested; the loop picks that up */
+    while (*list) {
+        block_request_t *req = list_take(list);
+        while (req) {
+            block_request_t *next = req->next;
+            req->next = NULL;
+            if (req->completion) {
+                req->completion(req->completion_ctx, req->status);
+            }
+            req = next;
+            count++;
+        }
+    }
     
-    req->op = BLOCK_OP_READ;
-    req->offset = offset;
-    req->length = len;
-    req->buffer = buf;
-    req->completion = sync_completion;
-    req->flags = BLOCK_REQ_SYNC;
+    return count;
+}
+
+/* ============================================================================
+ * Request Merging
+ * ============================================================================ */
+
+/* Adjacent requests sharing one backend request, which comes first */
+typedef struct block_merge {
+    block_request_t req;
+    block_request_t *first;     /* By offset, linked through next */
+    block_request_t *last;
+    uint32_t count;
+    block_iovec_t iov[BLOCK_MERGE_MAX_SEGS];
+} block_merge_t;
+
+/* Wrappers come from here; when it is empty requests go unmerged */
+static block_merge_t merge_pool[BLOCK_MERGE_POOL_COUNT];
+static uint16_t merge_free_stack[BLOCK_MERGE_POOL_COUNT];
+static uint32_t merge_free_top;
+static uint32_t merge_fresh;            /* Slots never handed out yet */
+static spinlock_t merge_lock = SPINLOCK_INIT;
+
+static block_merge_t *merge_alloc(void)
+{
+    block_merge_t *m = NULL;
     
-    sync_complete = 0;
+    spinlock_acquire(&merge_lock);
+    if (merge_free_top > 0) {
+        m = &merge_pool[merge_free_stack[--merge_free_top]];
+    } else if (merge_fresh < BLOCK_MERGE_POOL_COUNT) {
+        m = &merge_pool[merge_fresh++];
+    }
+    spinlock_release(&merge_lock);
+    return m;
+}
+
+static void merge_free(block_merge_t *m)
+{
+    spinlock_acquire(&merge_lock);
+    merge_free_stack[merge_free_top++] = (uint16_t)(m - merge_pool);
+    spinlock_release(&merge_lock);
+}
+
+/* Whether @next can directly follow @prev in one backend request */
+static bool merge_ok(const block_request_t *prev, const block_request_t *next)
+{
+    block_device_t *dev = prev->dev;
     
-    int ret = dev->ops->submit(dev, req);
-    if (ret != 0) {
-        block_free_request(req);
-        return ret;
+    if (next->dev != dev || next->hwq != prev->hwq || next->op != prev->op) {
+        return false;
+    }
+    if (prev->op != BLOCK_OP_READ && prev->op != BLOCK_OP_WRITE) {
+        return false;
+    }
+    if (((prev->flags ^ next->flags) & ~(BLOCK_REQ_SYNC | BLOCK_REQ_MERGED)) ||
+        ((prev->flags | next->flags) & BLOCK_REQ_PREFLUSH)) {
+        return false;
+    }
+    if (prev->offset + prev->length != next->offset) {
+        return false;
+    }
+    if ((uint64_t)prev->length + next->length > dev->max_io_size ||
+        prev->iov_count + next->iov_count > BLOCK_MERGE_MAX_SEGS) {
+        return false;
+    }
+    if (dev->io_boundary &&
+        prev->offset / dev->io_boundary !=
+        (next->offset + next->length - 1) / dev->io_boundary) {
+        return false;
     }
+    return true;
+}
+
+/* Wrap @req so that more can be merged into it; takes over its list link */
+static block_merge_t *merge_start(block_request_t *req)
+{
+    block_merge_t *m = merge_alloc();
+    if (!m) return NULL;
+    
+    m->req = *req;
+    m->req.flags |= BLOCK_REQ_MERGED;
+    m->req.buffer = NULL;
+    m->req.completion = NULL;
+    m->req.iov = m->iov;
+    memcpy(m->iov, req->iov, req->iov_count * sizeof(block_iovec_t));
+    
+    req->next = NULL;
+    m->first = req;
+    m->last = req;
+    m->count = 1;
+    return m;
+}
+
+/*
+ * Add @req at one end of @m. A wrapper built by a plug is opened up and
+ * its requests spliced in, so that only the outermost one is completed.
+ */
+static void merge_add(block_merge_t *m, block_request_t *req, bool front)
+{
+    block_request_t *r = &m->req;
+    block_merge_t *inner = NULL;
+    block_request_t *first = req;
+    block_request_t *last = req;
+    uint32_t count = 1;
     
-    /* Wait for completion */
-    while (!sync_complete) {
-        __asm__ volatile("pause" ::: "memory");
+    if (req->flags & BLOCK_REQ_MERGED) {
+        inner = (block_merge_t *)req;
+        first = inner->first;
+        last = inner->last;
+        count = inner->count;
     }
     
-    ret = sync_status;
+    if (front) {
+        memmove(m->iov + req->iov_count, m->iov,
+                r->iov_count * sizeof(block_iovec_t));
+        memcpy(m->iov, req->iov, req->iov_count * sizeof(block_iovec_t));
+        r->offset = req->offset;
+        last->next = m->first;
+        m->first = first;
+    } else {
+        memcpy(m->iov + r->iov_count, req->iov,
+               req->iov_count * sizeof(block_iovec_t));
+        last->next = NULL;
+        m->last->next = first;
+        m->last = last;
+    }
+    
+    r->iov_count += req->iov_count;
+    r->length += req->length;
+    r->flags |= req->flags & BLOCK_REQ_SYNC;
+    m->count += count;
+    
+    if (inner) {
+        merge_free(inner);
+    }
+}
+
+/* Merge @req into an adjacent request of a list; true if it was absorbed */
+static bool merge_into_list(block_request_t **head, block_request_t **tail,
+                            block_request_t *req)
+{
+    block_request_t **link = head;
+    
+    for (block_request_t *ent = *head; ent; link = &ent->next, ent = ent->next) {
+        bool back = merge_ok(ent, req);
+        if (!back && !merge_ok(req, ent)) continue;
+        
+        block_merge_t *m = (block_merge_t *)ent;
+        if (!(ent->flags & BLOCK_REQ_MERGED)) {
+            m = merge_start(ent);
+            if (!m) return false;
+            *link = &m->req;
+            if (*tail == ent) *tail = &m->req;
+        }
+        
+        merge_add(m, req, !back);
+        return true;
+    }
+    
+    return false;
+}
+
+/* ============================================================================
+ * Request Queues
+ * ============================================================================ */
+
+static spinlock_t mq_init_lock = SPINLOCK_INIT;
+
+uint32_t block_hw_queues_per_cpu(void)
+{
+    return CLAMP(smp_get_cpu_count(), 1, BLOCK_MAX_HW_QUEUES);
+}
+
+static int block_mq_init(block_device_t *dev)
+{
+    spinlock_acquire(&mq_init_lock);
+    
+    if (!dev->sw_queues) {
+        uint32_t cpus = MAX(smp_get_cpu_count(), 1);
+        block_sw_queue_t *sw = kmalloc(cpus * sizeof(block_sw_queue_t),
+                                       GFP_KERNEL | GFP_ZERO);
+        if (!sw) {
+            spinlock_release(&mq_init_lock);
+            return -1;
+        }
+        
+        dev->nr_hw_queues = CLAMP(dev->nr_hw_queues, 1, BLOCK_MAX_HW_QUEUES);
+        if (dev->max_queue_depth == 0) {
+            dev->max_queue_depth = BLOCK_DEFAULT_QUEUE_DEPTH;
+        }
+        if (dev->max_io_size == 0) {
+            dev->max_io_size = BLOCK_DEFAULT_MAX_IO;
+        }
+        for (uint32_t i = 0; i < dev->nr_hw_queues; i++) {
+            block_hw_queue_t *hwq = &dev->hw_queues[i];
+            memset(hwq, 0, sizeof(*hwq));
+            spinlock_init(&hwq->lock);
+        }
+        
+        dev->nr_sw_queues = cpus;
+        barrier();
+        dev->sw_queues = sw;
+    }
+    
+    spinlock_release(&mq_init_lock);
+    return 0;
+}
+
+/*
+ * Move requests from the software queues mapped here, merging those
+ * adjacent to one still waiting; caller holds hwq->lock
+ */
+static void hwq_gather(block_device_t *dev, uint32_t index)
+{
+    block_hw_queue_t *hwq = &dev->hw_queues[index];
     
-    if (ret == 0) {
-        dev->read_ops++;
-        dev->read_bytes += len;
+    for (uint32_t cpu = index; cpu < dev->nr_sw_queues; cpu += dev->nr_hw_queues) {
+        block_request_t *req = list_take(&dev->sw_queues[cpu].pending);
+        while (req) {
+            block_request_t *next = req->next;
+            req->next = NULL;
+            
+            uint32_t depth = hwq->queued + hwq->inflight;
+            hwq->depth_sum += depth;
+            hwq->depth_samples++;
+            hwq->depth_max = MAX(hwq->depth_max, depth);
+            
+            if (!merge_into_list(&hwq->head, &hwq->tail, req)) {
+                if (hwq->tail) {
+                    hwq->tail->next = req;
+                } else {
+                    hwq->head = req;
+                }
+                hwq->tail = req;
+                hwq->queued++;
+            }
+            req = next;
+        }
+    }
+}
+
+/*
+ * Hand queued requests to the backend while the queue has free slots.
+ * One loop owns the queue at a time: a call made while it runs, such as
+ * block_complete() from inside a submit that finished inline, returns at
+ * once and leaves the loop to gather what it queued on its next pass,
+ * so the stack stays one submit deep however many requests complete.
+ */
+static void hwq_dispatch(block_device_t *dev, uint32_t index)
+{
+    block_hw_queue_t *hwq = &dev->hw_queues[index];
+    
+    spinlock_acquire(&hwq->lock);
+    if (hwq->dispatching) {
+        spinlock_release(&hwq->lock);
+        return;
+    }
+    hwq->dispatching = true;
+    spinlock_release(&hwq->lock);
+    
+    while (1) {
+        block_request_t *req = NULL;
+        
+        spinlock_acquire(&hwq->lock);
+        hwq_gather(dev, index);
+        if (hwq->inflight < dev->max_queue_depth) {
+            req = hwq->head;
+            if (req && dev->qos && !block_qos_admit(dev->qos, req)) {
+                req = NULL;
+            }
+            if (req) {
+                hwq->head = req->next;
+                if (!hwq->head) hwq->tail = NULL;
+                hwq->queued--;
+                hwq->inflight++;
+            }
+        }
+        /* Nothing to send: give the queue up under the lock it is checked under */
+        if (!req) {
+            hwq->dispatching = false;
+        }
+        spinlock_release(&hwq->lock);
+        
+        if (!req) break;
+        req->next = NULL;
+        
+        int ret = dev->ops->submit(dev, req);
+        if (ret != 0) {
+            block_complete(req, ret);
+        }
+    }
+}
+
+static uint32_t lat_type(uint8_t op)
+{
+    if (op == BLOCK_OP_READ) return BLOCK_LAT_READ;
+    if (op == BLOCK_OP_WRITE) return BLOCK_LAT_WRITE;
+    return BLOCK_LAT_OTHER;
+}
+
+/* Caller holds the lock of the hardware queue owning @lat */
+static void lat_record(block_latency_t *lat, const block_request_t *req,
+                       uint64_t now)
+{
+    uint64_t us = now > req->submit_us ? now - req->submit_us : 0;
+    uint32_t bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+    
+    lat->buckets[MIN(bucket, BLOCK_LAT_BUCKETS - 1)]++;
+    lat->count++;
+    lat->sum_us += us;
+    lat->max_us = MAX(lat->max_us, us);
+}
+
+uint64_t block_latency_percentile(const block_latency_t *lat, uint32_t permille)
+{
+    if (!lat->count) return 0;
+    
+    uint64_t want = (lat->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    
+    for (uint32_t i = 0; i < BLOCK_LAT_BUCKETS - 1; i++) {
+        seen += lat->buckets[i];
+        if (seen >= want) {
+            return MIN(2ULL << i, lat->max_us);
+        }
+    }
+    return lat->max_us;
+}
+
+void block_complete(block_request_t *req, int status)
+{
+    block_device_t *dev = req->dev;
+    uint32_t index = req->hwq;
+    block_hw_queue_t *hwq = &dev->hw_queues[index];
+    block_merge_t *m = NULL;
+    uint32_t count = 1;
+    bool kick = false;
+    
+    if (req->flags & BLOCK_REQ_MERGED) {
+        m = (block_merge_t *)req;
+        count = m->count;
+    }
+    
+    spinlock_acquire(&hwq->lock);
+    hwq->inflight--;
+    if (status == 0) {
+        if (req->op == BLOCK_OP_READ) {
+            hwq->read_ops += count;
+            hwq->read_bytes += req->length;
+        } else if (req->op == BLOCK_OP_WRITE) {
+            hwq->write_ops += count;
+            hwq->write_bytes += req->length;
+        }
     } else {
-        dev->errors++;
+        hwq->errors += count;
     }
+    hwq->merges += count - 1;
     
-    block_free_request(req);
-    return ret;
+    block_latency_t *lat = &hwq->latency[lat_type(req->op)];
+    uint64_t now = rdtsc_us();
+    if (m) {
+        for (block_request_t *child = m->first; child; child = child->next) {
+            lat_record(lat, child, now);
+        }
+    } else {
+        lat_record(lat, req, now);
+    }
+    spinlock_release(&hwq->lock);
+    
+    if (req->flags & BLOCK_REQ_QOS) {
+        kick = block_qos_done(dev->qos, req);
+    }
+    
+    /* Each callback runs where its request came from, with its cache */
+    uint32_t cpu = smp_get_current_cpu();
+    bool local = false;
+    
+    if (m) {
+        block_request_t *child = m->first;
+        while (child) {
+            block_request_t *next = child->next;
+            child->status = status;
+            local |= child->cpu == cpu;
+            list_push(&done_lists[child->cpu], child);
+            child = next;
+        }
+        merge_free(m);
+    } else {
+        req->status = status;
+        local = req->cpu == cpu;
+        list_push(&done_lists[req->cpu], req);
+    }
+    
+    /* The freed slot goes to the next waiter before callbacks add more */
+    if (kick) {
+        block_kick(dev);
+    } else {
+        hwq_dispatch(dev, index);
+    }
+    if (local) {
+        block_run_completions();
+    }
 }
 
-int block_write(block_device_t *dev, uint64_t offset, const void *buf, uint32_t len)
+/* ============================================================================
+ * Plugging
+ * ============================================================================ */
+
+static block_plug_t *plugs[MAX_CPUS];
+
+/* Queue everything held, kicking each hardware queue once per run */
+static void plug_flush(block_plug_t *plug)
 {
-    if (!dev || !dev->ops || !dev->ops->submit) {
+    block_request_t *req = plug->head;
+    block_device_t *dev = NULL;
+    uint32_t index = 0;
+    
+    plug->head = NULL;
+    plug->tail = NULL;
+    plug->count = 0;
+    
+    while (req) {
+        block_request_t *next = req->next;
+        
+        if (dev && (req->dev != dev || req->hwq != index)) {
+            hwq_dispatch(dev, index);
+        }
+        dev = req->dev;
+        index = req->hwq;
+        
+        list_push(&dev->sw_queues[req->cpu % dev->nr_sw_queues].pending, req);
+        req = next;
+    }
+    
+    if (dev) {
+        hwq_dispatch(dev, index);
+    }
+}
+
+static void plug_add(block_plug_t *plug, block_request_t *req)
+{
+    if (merge_into_list(&plug->head, &plug->tail, req)) return;
+    
+    req->next = NULL;
+    if (plug->tail) {
+        plug->tail->next = req;
+    } else {
+        plug->head = req;
+    }
+    plug->tail = req;
+    
+    if (++plug->count >= BLOCK_PLUG_MAX) {
+        plug_flush(plug);
+    }
+}
+
+void block_start_plug(block_plug_t *plug)
+{
+    uint32_t cpu = smp_get_current_cpu();
+    
+    plug->head = NULL;
+    plug->tail = NULL;
+    plug->count = 0;
+    
+    if (!plugs[cpu]) {
+        plugs[cpu] = plug;
+    }
+}
+
+void block_finish_plug(block_plug_t *plug)
+{
+    uint32_t cpu = smp_get_current_cpu();
+    
+    if (plugs[cpu] == plug) {
+        plugs[cpu] = NULL;
+    }
+    plug_flush(plug);
+}
+
+int block_submit_async(block_device_t *dev, block_request_t *req)
+{
+    if (!dev || !dev->ops || !dev->ops->submit || !req) {
         return -1;
     }
     
-    if (dev->readonly) {
+    if (req->offset + req->length > dev->size) {
         return -1;
     }
     
-    if (offset + len > dev->size) {
+    if (dev->readonly && req->op != BLOCK_OP_READ && req->op != BLOCK_OP_FLUSH) {
         return -1;
     }
     
-    block_request_t *req = block_alloc_request();
-    if (!req) return -1;
+    if (!req->iov) {
+        req->iov_single.base = req->buffer;
+        req->iov_single.len = req->length;
+        req->iov = &req->iov_single;
+        req->iov_count = 1;
+    } else if (block_iov_length(req->iov, req->iov_count) != req->length) {
+        return -1;
+    }
     
-    req->op = BLOCK_OP_WRITE;
-    req->offset = offset;
-    req->length = len;
-    req->buffer = (void *)buf;
-    req->completion = sync_completion;
-    req->flags = BLOCK_REQ_SYNC;
+    /* Not registered: set up on first use */
+    if (!dev->sw_queues && block_mq_init(dev) != 0) {
+        return -1;
+    }
+    
+    uint32_t cpu = smp_get_current_cpu();
+    block_sw_queue_t *sw = &dev->sw_queues[cpu % dev->nr_sw_queues];
     
-    sync_complete = 0;
+    req->dev = dev;
+    req->status = 0;
+    req->submit_us = rdtsc_us();
+    req->cpu = (uint8_t)cpu;
+    req->hwq = (uint8_t)(cpu % dev->nr_hw_queues);
     
-    int ret = dev->ops->submit(dev, req);
-    if (ret != 0) {
-        block_free_request(req);
-        return ret;
+    sw->submitted++;
+    
+    if (plugs[cpu]) {
+        plug_add(plugs[cpu], req);
+        return 0;
     }
     
-    while (!sync_complete) {
-        __asm__ volatile("pause" ::: "memory");
+    list_push(&sw->pending, req);
+    hwq_dispatch(dev, req->hwq);
+    return 0;
+}
+
+void block_poll(block_device_t *dev)
+{
+    if (dev && dev->ops && dev->ops->poll) {
+        dev->ops->poll(dev);
     }
+    block_run_completions();
+}
+
+void block_kick(block_device_t *dev)
+{
+    if (!dev->sw_queues) return;
     
-    ret = sync_status;
+    for (uint32_t i = 0; i < dev->nr_hw_queues; i++) {
+        hwq_dispatch(dev, i);
+    }
+}
+
+void block_get_stats(block_device_t *dev, block_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!dev->sw_queues) return;
     
-    if (ret == 0) {
-        dev->write_ops++;
-        dev->write_bytes += len;
-    } else {
-        dev->errors++;
+    for (uint32_t i = 0; i < dev->nr_hw_queues; i++) {
+        block_hw_queue_t *hwq = &dev->hw_queues[i];
+        stats->read_ops += hwq->read_ops;
+        stats->write_ops += hwq->write_ops;
+        stats->read_bytes += hwq->read_bytes;
+        stats->write_bytes += hwq->write_bytes;
+        stats->errors += hwq->errors;
+        stats->merges += hwq->merges;
+        stats->depth_sum += hwq->depth_sum;
+        stats->depth_samples += hwq->depth_samples;
+        stats->depth_max = MAX(stats->depth_max, hwq->depth_max);
+        
+        for (uint32_t t = 0; t < BLOCK_LAT_TYPES; t++) {
+            block_latency_t *dst = &stats->latency[t];
+            const block_latency_t *src = &hwq->latency[t];
+            for (uint32_t b = 0; b < BLOCK_LAT_BUCKETS; b++) {
+                dst->buckets[b] += src->buckets[b];
+            }
+            dst->count += src->count;
+            dst->sum_us += src->sum_us;
+            dst->max_us = MAX(dst->max_us, src->max_us);
+        }
+        stats->queued += hwq->queued;
+        stats->inflight += hwq->inflight;
+    }
+}
+
+/* ============================================================================
+ * Synchronous I/O
+ * ============================================================================ */
+
+typedef struct block_waiter {
+    volatile bool done;
+    int status;
+} block_waiter_t;
+
+static void block_wake(void *ctx, int status)
+{
+    block_waiter_t *w = ctx;
+    
+    w->status = status;
+    barrier();
+    w->done = true;
+}
+
+int block_submit_wait(block_device_t *dev, block_request_t *req)
+{
+    block_waiter_t w = { .done = false, .status = -1 };
+    
+    req->completion = block_wake;
+    req->completion_ctx = &w;
+    req->flags |= BLOCK_REQ_SYNC;
+    
+    if (block_submit_async(dev, req) != 0) {
+        return -1;
+    }
+    
+    /* Nothing held back can be waited for */
+    block_plug_t *plug = plugs[smp_get_current_cpu()];
+    if (plug) {
+        plug_flush(plug);
     }
     
+    /*
+     * Poll the device and the timers that release throttled requests.
+     * After a brief spin, sleep until the next interrupt, but only if a
+     * periodic tick guarantees one; otherwise keep polling.
+     */
+    for (uint32_t polls = 0; !w.done; polls++) {
+        block_poll(dev);
+        ktimer_run();
+        if (w.done) break;
+        if (polls >= BLOCK_WAIT_SPIN && lapic_timer_active() &&
+            (read_rflags() & RFLAGS_IF)) {
+            hlt();
+        } else {
+            pause();
+        }
+    }
+    
+    return w.status;
+}
+
+static int block_rw_sync(block_device_t *dev, uint8_t op, uint64_t offset,
+                         const block_iovec_t *iov, uint32_t count)
+{
+    if (!dev || !dev->ops || !dev->ops->submit) {
+        return -1;
+    }
+    
+    block_request_t *req = block_alloc_request();
+    if (!req) return -1;
+    
+    req->op = op;
+    req->offset = offset;
+    req->length = block_iov_length(iov, count);
+    req->iov = iov;
+    req->iov_count = count;
+    
+    int ret = block_submit_wait(dev, req);
+    
     block_free_request(req);
     return ret;
 }
 
+int block_read(block_device_t *dev, uint64_t offset, void *buf, uint32_t len)
+{
+    block_iovec_t iov = { .base = buf, .len = len };
+    return block_rw_sync(dev, BLOCK_OP_READ, offset, &iov, 1);
+}
+
+int block_write(block_device_t *dev, uint64_t offset, const void *buf, uint32_t len)
+{
+    block_iovec_t iov = { .base = (void *)buf, .len = len };
+    return block_rw_sync(dev, BLOCK_OP_WRITE, offset, &iov, 1);
+}
+
+int block_readv(block_device_t *dev, uint64_t offset,
+                const block_iovec_t *iov, uint32_t count)
+{
+    return block_rw_sync(dev, BLOCK_OP_READ, offset, iov, count);
+}
+
+int block_writev(block_device_t *dev, uint64_t offset,
+                 const block_iovec_t *iov, uint32_t count)
+{
+    return block_rw_sync(dev, BLOCK_OP_WRITE, offset, iov, count);
+}
+
 int block_flush(block_device_t *dev)
 {
     if (!dev || !dev->ops) {
@@ -178,15 +1036,6 @@ int block_flush(block_device_t *dev)
     return 0;
 }
 
-int block_submit_async(block_device_t *dev, block_request_t *req)
-{
-    if (!dev || !dev->ops || !dev->ops->submit || !req) {
-        return -1;
-    }
-    
-    return dev->ops->submit(dev, req);
-}
-
 /* ============================================================================
  * Device Management
  * ============================================================================ */
@@ -200,6 +1049,7 @@ int block_init(void)
     block_devices = NULL;
     block_device_count = 0;
     next_device_id = 1;
+    req_pool_init();
     block_initialized = true;
     
     pr_info("Block: Initialization complete");
@@ -225,12 +1075,9 @@ int block_register(block_device_t *dev)
         dev->num_blocks = dev->size / dev->block_size;
     }
     
-    /* Initialize queue */
-    dev->queue_head = NULL;
-    dev->queue_tail = NULL;
-    dev->queue_depth = 0;
-    if (dev->max_queue_depth == 0) {
-        dev->max_queue_depth = 32;
+    /* Initialize queues */
+    if (!dev->sw_queues && block_mq_init(dev) != 0) {
+        return -1;
     }
     
     /* Add to list */
@@ -260,6 +1107,10 @@ void block_unregister(block_device_t *dev)
     }
     dev->online = false;
     
+    block_qos_remove(dev);
+    kfree(dev->sw_queues);
+    dev->sw_queues = NULL;
+    
     /* Remove from list */
     block_device_t **pp = &block_devices;
     while (*pp) {
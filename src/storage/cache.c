@@ -0,0 +1,953 @@
+/*
+ * PureVisor - Block Buffer Cache Implementation
+ * 
+ * One lock per cache. Data moves between pages and requests under it;
+ * I/O to the lower device is only issued after dropping it.
+ */
+
+#include <lib/types.h>
+#include <lib/string.h>
+#include <storage/cache.h>
+#include <mm/heap.h>
+#include <mm/pmm.h>
+#include <kernel/console.h>
+
+/* Lower request made on behalf of a front request */
+typedef struct cache_io {
+    block_request_t req;
+    block_request_t *front;
+    uint64_t seq;               /* write_seq when issued */
+    uint64_t gen;               /* Flush generation waited for, 0 = none */
+    struct cache_io *next;      /* Pending list */
+} cache_io_t;
+
+/* Read-ahead or write-back of a run of cache pages */
+typedef struct cache_run {
+    block_request_t req;
+    block_cache_t *cache;
+    uint32_t count;
+    block_cache_page_t *pages[BLOCK_CACHE_WB_RUN];
+    block_iovec_t iov[BLOCK_CACHE_WB_RUN];
+    struct cache_run *next;
+} cache_run_t;
+
+/* Outcome of looking up the pages of a read */
+#define CACHE_HIT       0
+#define CACHE_WAIT      1       /* Present, some still being read ahead */
+#define CACHE_MISS      2
+
+/* What to do with a write */
+#define CACHE_DONE      0       /* Completed in the cache */
+#define CACHE_THROUGH   1       /* Send to the lower device */
+#define CACHE_PARK      2       /* Retry once write-back has made progress */
+#define CACHE_FAIL      3
+
+static void cache_read(block_cache_t *cache, block_request_t *req, cache_io_t *io);
+static void cache_write(block_cache_t *cache, cache_io_t *io);
+static void cache_writeback(block_cache_t *cache);
+
+/* ============================================================================
+ * Page Table
+ * ============================================================================ */
+
+static inline uint32_t hash_index(const block_cache_t *cache, uint64_t index)
+{
+    return (uint32_t)((index * 0x9E3779B97F4A7C15ULL) >> 32) & cache->hash_mask;
+}
+
+/* Caller holds cache->lock */
+static block_cache_page_t *page_lookup(block_cache_t *cache, uint64_t index)
+{
+    block_cache_page_t *page = cache->hash[hash_index(cache, index)];
+    
+    while (page && page->index != index) {
+        page = page->hnext;
+    }
+    return page;
+}
+
+/* Caller holds cache->lock */
+static void page_remove(block_cache_t *cache, block_cache_page_t *page)
+{
+    block_cache_page_t **pp = &cache->hash[hash_index(cache, page->index)];
+    
+    while (*pp && *pp != page) {
+        pp = &(*pp)->hnext;
+    }
+    if (*pp) {
+        *pp = page->hnext;
+    }
+    
+    page->hnext = NULL;
+    page->state = BLOCK_CACHE_FREE;
+    page->referenced = false;
+    page->stale = false;
+    page->readahead = false;
+}
+
+/* Take a page for @index, evicting in CLOCK order; caller holds cache->lock */
+static block_cache_page_t *page_alloc(block_cache_t *cache, uint64_t index,
+                                      uint8_t state)
+{
+    for (uint32_t scanned = 0; scanned < 2 * cache->nr_pages; scanned++) {
+        block_cache_page_t *page = &cache->pages[cache->clock_hand];
+        cache->clock_hand = (cache->clock_hand + 1) % cache->nr_pages;
+        
+        if (page->state == BLOCK_CACHE_READING || page->dirty || page->writing) {
+            continue;
+        }
+        if (page->state == BLOCK_CACHE_VALID) {
+            if (page->referenced) {
+                page->referenced = false;
+                continue;
+            }
+            page_remove(cache, page);
+            cache->evictions++;
+        }
+        
+        uint32_t h = hash_index(cache, index);
+        page->index = index;
+        page->state = state;
+        page->hnext = cache->hash[h];
+        cache->hash[h] = page;
+        return page;
+    }
+    
+    return NULL;
+}
+
+/* Dirty pages stay: they are newer than anything in flight */
+static void page_invalidate(block_cache_t *cache, block_cache_page_t *page)
+{
+    if (page->dirty || page->writing) return;
+    
+    if (page->state == BLOCK_CACHE_READING) {
+        page->stale = true;
+    } else {
+        page_remove(cache, page);
+    }
+}
+
+/* Forget pages overlapping a range; caller holds cache->lock */
+static void cache_invalidate(block_cache_t *cache, uint64_t offset, uint64_t len)
+{
+    if (!len) return;
+    
+    uint64_t first = offset / BLOCK_CACHE_PAGE;
+    uint64_t last = (offset + len - 1) / BLOCK_CACHE_PAGE;
+    
+    /* Large ranges, e.g. a discard of the whole device, walk the pages */
+    if (last - first >= cache->nr_pages) {
+        for (uint32_t i = 0; i < cache->nr_pages; i++) {
+            block_cache_page_t *page = &cache->pages[i];
+            if (page->state != BLOCK_CACHE_FREE &&
+                page->index >= first && page->index <= last) {
+                page_invalidate(cache, page);
+            }
+        }
+        return;
+    }
+    
+    for (uint64_t idx = first; idx <= last; idx++) {
+        block_cache_page_t *page = page_lookup(cache, idx);
+        if (page) {
+            page_invalidate(cache, page);
+        }
+    }
+}
+
+/* Whether a range has data the lower device lacks; caller holds cache->lock */
+static bool range_dirty(block_cache_t *cache, uint64_t offset, uint64_t len)
+{
+    if (!len || (!cache->nr_dirty && !cache->nr_writing)) return false;
+    
+    uint64_t first = offset / BLOCK_CACHE_PAGE;
+    uint64_t last = (offset + len - 1) / BLOCK_CACHE_PAGE;
+    
+    if (last - first >= cache->nr_pages) {
+        for (uint32_t i = 0; i < cache->nr_pages; i++) {
+            block_cache_page_t *page = &cache->pages[i];
+            if ((page->dirty || page->writing) &&
+                page->index >= first && page->index <= last) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    for (uint64_t idx = first; idx <= last; idx++) {
+        block_cache_page_t *page = page_lookup(cache, idx);
+        if (page && (page->dirty || page->writing)) return true;
+    }
+    return false;
+}
+
+/* Caller holds cache->lock */
+static void pending_add(block_cache_t *cache, cache_io_t *io)
+{
+    io->next = NULL;
+    if (cache->pending_tail) {
+        cache->pending_tail->next = io;
+    } else {
+        cache->pending = io;
+    }
+    cache->pending_tail = io;
+    cache->waits++;
+}
+
+/* Give everything held back another go */
+static void cache_retry(block_cache_t *cache)
+{
+    spinlock_acquire(&cache->lock);
+    cache_io_t *io = cache->pending;
+    cache->pending = NULL;
+    cache->pending_tail = NULL;
+    spinlock_release(&cache->lock);
+    
+    while (io) {
+        cache_io_t *next = io->next;
+        io->next = NULL;
+        if (io->front->op == BLOCK_OP_READ) {
+            cache_read(cache, io->front, io);
+        } else {
+            cache_write(cache, io);
+        }
+        io = next;
+    }
+}
+
+/* ============================================================================
+ * Lower Device I/O
+ * ============================================================================ */
+
+/* Cache the pages a successful read fully covered */
+static void cache_fill(block_cache_t *cache, block_request_t *req, uint64_t seq)
+{
+    uint64_t first = (req->offset + BLOCK_CACHE_PAGE - 1) / BLOCK_CACHE_PAGE;
+    uint64_t end = (req->offset + req->length) / BLOCK_CACHE_PAGE;
+    
+    spinlock_acquire(&cache->lock);
+    
+    /* A write overlapping the read in any way may have reordered with it */
+    if (cache->write_seq == seq) {
+        for (uint64_t idx = first; idx < end; idx++) {
+            if (page_lookup(cache, idx)) continue;
+            
+            block_cache_page_t *page = page_alloc(cache, idx, BLOCK_CACHE_VALID);
+            if (!page) break;
+            block_iov_copy_from(req, idx * BLOCK_CACHE_PAGE - req->offset,
+                                page->data, BLOCK_CACHE_PAGE);
+        }
+    }
+    
+    spinlock_release(&cache->lock);
+}
+
+static void cache_io_done(void *ctx, int status)
+{
+    cache_io_t *io = ctx;
+    block_request_t *front = io->front;
+    block_cache_t *cache = front->dev->priv;
+    
+    if (front->op == BLOCK_OP_READ) {
+        if (status == 0) {
+            cache_fill(cache, front, io->seq);
+        }
+    } else if (front->op != BLOCK_OP_FLUSH) {
+        spinlock_acquire(&cache->lock);
+        cache->write_seq++;
+        cache_invalidate(cache, front->offset, front->length);
+        spinlock_release(&cache->lock);
+    }
+    
+    kfree(io);
+    block_complete(front, status);
+}
+
+static cache_io_t *cache_io_alloc(block_request_t *front)
+{
+    cache_io_t *io = kmalloc(sizeof(cache_io_t), GFP_KERNEL | GFP_ZERO);
+    
+    if (io) {
+        io->front = front;
+    }
+    return io;
+}
+
+/* Pass a front request to the lower device */
+static void cache_issue(block_cache_t *cache, cache_io_t *io)
+{
+    block_request_t *front = io->front;
+    
+    io->req.op = front->op;
+    io->req.flags = front->flags & (BLOCK_REQ_FUA | BLOCK_REQ_PREFLUSH);
+    io->req.offset = front->offset;
+    io->req.length = front->length;
+    io->req.iov = front->iov;
+    io->req.iov_count = front->iov_count;
+    io->req.completion = cache_io_done;
+    io->req.completion_ctx = io;
+    
+    if (block_submit_async(cache->lower, &io->req) != 0) {
+        kfree(io);
+        block_complete(front, -1);
+    }
+}
+
+/* ============================================================================
+ * Read-ahead
+ * ============================================================================ */
+
+static void cache_ra_done(void *ctx, int status)
+{
+    cache_run_t *ra = ctx;
+    block_cache_t *cache = ra->cache;
+    
+    spinlock_acquire(&cache->lock);
+    
+    for (uint32_t i = 0; i < ra->count; i++) {
+        block_cache_page_t *page = ra->pages[i];
+        if (status == 0 && !page->stale) {
+            page->state = BLOCK_CACHE_VALID;
+            page->readahead = true;
+        } else {
+            page_remove(cache, page);
+        }
+    }
+    
+    spinlock_release(&cache->lock);
+    kfree(ra);
+    
+    /* Readers see the pages now, or miss and read for themselves */
+    cache_retry(cache);
+}
+
+/* Claim pages for up to @count pages from @first; caller holds cache->lock */
+static cache_run_t *ra_prepare(block_cache_t *cache, uint64_t first, uint32_t count)
+{
+    uint64_t limit = cache->blkdev.size / BLOCK_CACHE_PAGE;
+    
+    /* Only the part not cached yet */
+    while (count && first < limit && page_lookup(cache, first)) {
+        first++;
+        count--;
+    }
+    if (first >= limit || !count) return NULL;
+    count = (uint32_t)MIN(count, limit - first);
+    
+    cache_run_t *ra = kmalloc(sizeof(cache_run_t), GFP_KERNEL | GFP_ZERO);
+    if (!ra) return NULL;
+    
+    uint32_t n = 0;
+    while (n < count && !page_lookup(cache, first + n)) {
+        block_cache_page_t *page = page_alloc(cache, first + n, BLOCK_CACHE_READING);
+        if (!page) break;
+        ra->pages[n] = page;
+        ra->iov[n].base = page->data;
+        ra->iov[n].len = BLOCK_CACHE_PAGE;
+        n++;
+    }
+    
+    if (!n) {
+        kfree(ra);
+        return NULL;
+    }
+    
+    ra->cache = cache;
+    ra->count = n;
+    ra->req.op = BLOCK_OP_READ;
+    ra->req.offset = first * BLOCK_CACHE_PAGE;
+    ra->req.length = n * BLOCK_CACHE_PAGE;
+    ra->req.iov = ra->iov;
+    ra->req.iov_count = n;
+    ra->req.completion = cache_ra_done;
+    ra->req.completion_ctx = ra;
+    cache->readahead_pages += n;
+    return ra;
+}
+
+/*
+ * Track sequential readers and keep the read-ahead of each at least half
+ * a window in front of it, doubling the window every time. Caller holds
+ * cache->lock; returns a read-ahead to issue, or NULL.
+ */
+static cache_run_t *cache_stream(block_cache_t *cache, const block_request_t *req)
+{
+    if (cache->config.no_readahead) return NULL;
+    
+    uint64_t end = req->offset + req->length;
+    block_cache_stream_t *st = NULL;
+    block_cache_stream_t *lru = &cache->streams[0];
+    
+    for (uint32_t i = 0; i < BLOCK_CACHE_STREAMS; i++) {
+        block_cache_stream_t *s = &cache->streams[i];
+        if (s->last_used && s->next == req->offset) {
+            st = s;
+            break;
+        }
+        if (s->last_used < lru->last_used) {
+            lru = s;
+        }
+    }
+    
+    cache->stream_tick++;
+    if (!st) {
+        /* A new reader: nothing to go on yet */
+        lru->next = end;
+        lru->ra_end = end;
+        lru->window = MIN(BLOCK_CACHE_RA_MIN, cache->config.readahead_max);
+        lru->last_used = cache->stream_tick;
+        return NULL;
+    }
+    
+    st->next = end;
+    st->last_used = cache->stream_tick;
+    
+    uint64_t window = (uint64_t)st->window * BLOCK_CACHE_PAGE;
+    if (st->ra_end >= end + window / 2) return NULL;
+    
+    uint64_t first = (MAX(st->ra_end, end) + BLOCK_CACHE_PAGE - 1) / BLOCK_CACHE_PAGE;
+    cache_run_t *ra = ra_prepare(cache, first, st->window);
+    
+    st->ra_end = (first + st->window) * BLOCK_CACHE_PAGE;
+    st->window = MIN(st->window * 2, cache->config.readahead_max);
+    return ra;
+}
+
+/* ============================================================================
+ * Write-back
+ * ============================================================================ */
+
+/* Heapsort by page index: the dirty set can be large and we hold a lock */
+static void sort_pages(block_cache_page_t **v, uint32_t n)
+{
+    for (uint32_t end = n, start = n / 2; end > 1; ) {
+        uint32_t root;
+        if (start > 0) {
+            root = --start;
+        } else {
+            block_cache_page_t *t = v[--end];
+            v[end] = v[0];
+            v[0] = t;
+            root = 0;
+        }
+        
+        for (uint32_t child; (child = 2 * root + 1) < end; root = child) {
+            if (child + 1 < end && v[child + 1]->index > v[child]->index) {
+                child++;
+            }
+            if (v[root]->index >= v[child]->index) break;
+            block_cache_page_t *t = v[root];
+            v[root] = v[child];
+            v[child] = t;
+        }
+    }
+}
+
+static void cache_wb_done(void *ctx, int status)
+{
+    cache_run_t *wb = ctx;
+    block_cache_t *cache = wb->cache;
+    
+    spinlock_acquire(&cache->lock);
+    
+    /* Failed pages stay cached but clean; the next flush reports it */
+    for (uint32_t i = 0; i < wb->count; i++) {
+        wb->pages[i]->writing = false;
+    }
+    cache->nr_writing -= wb->count;
+    if (status != 0) {
+        cache->wb_error = status;
+    }
+    
+    spinlock_release(&cache->lock);
+    kfree(wb);
+    
+    cache_retry(cache);
+}
+
+/* Write every dirty page back, in device order and contiguous runs */
+static void cache_writeback(block_cache_t *cache)
+{
+    uint64_t boundary = cache->lower->io_boundary;
+    cache_run_t *runs = NULL;
+    cache_run_t **tail = &runs;
+    uint32_t n = 0;
+    
+    spinlock_acquire(&cache->lock);
+    
+    cache->wb_armed = false;
+    ktimer_cancel(&cache->wb_timer);
+    
+    for (uint32_t i = 0; i < cache->nr_pages; i++) {
+        if (cache->pages[i].dirty) {
+            cache->wb_sort[n++] = &cache->pages[i];
+        }
+    }
+    sort_pages(cache->wb_sort, n);
+    
+    for (uint32_t i = 0; i < n; ) {
+        cache_run_t *wb = kmalloc(sizeof(cache_run_t), GFP_KERNEL | GFP_ZERO);
+        if (!wb) break;
+        
+        block_cache_page_t *page;
+        uint32_t count = 0;
+        do {
+            page = cache->wb_sort[i++];
+            page->dirty = false;
+            page->writing = true;
+            wb->pages[count] = page;
+            wb->iov[count].base = page->data;
+            wb->iov[count].len = BLOCK_CACHE_PAGE;
+            count++;
+        } while (i < n && count < BLOCK_CACHE_WB_RUN &&
+                 cache->wb_sort[i]->index == page->index + 1 &&
+                 !(boundary && cache->wb_sort[i]->index * BLOCK_CACHE_PAGE % boundary == 0));
+        
+        wb->cache = cache;
+        wb->count = count;
+        wb->req.op = BLOCK_OP_WRITE;
+        wb->req.offset = wb->pages[0]->index * BLOCK_CACHE_PAGE;
+        wb->req.length = count * BLOCK_CACHE_PAGE;
+        wb->req.iov = wb->iov;
+        wb->req.iov_count = count;
+        wb->req.completion = cache_wb_done;
+        wb->req.completion_ctx = wb;
+        
+        cache->nr_dirty -= count;
+        cache->nr_writing += count;
+        cache->writeback_pages += count;
+        cache->writeback_ios++;
+        *tail = wb;
+        tail = &wb->next;
+    }
+    
+    /* Out of memory: come back later for the rest */
+    if (cache->nr_dirty) {
+        cache->wb_armed = true;
+        ktimer_arm(&cache->wb_timer, BLOCK_CACHE_WB_DELAY_US);
+    }
+    
+    spinlock_release(&cache->lock);
+    
+    while (runs) {
+        cache_run_t *next = runs->next;
+        if (block_submit_async(cache->lower, &runs->req) != 0) {
+            cache_wb_done(runs, -1);
+        }
+        runs = next;
+    }
+}
+
+static void cache_wb_timer(void *ctx)
+{
+    cache_writeback((block_cache_t *)ctx);
+}
+
+/* Whether everything dirtied before generation @gen is written back */
+static bool flush_done(block_cache_t *cache, uint64_t gen)
+{
+    if (!cache->nr_dirty && !cache->nr_writing) return true;
+    
+    for (uint32_t i = 0; i < cache->nr_pages; i++) {
+        block_cache_page_t *page = &cache->pages[i];
+        if ((page->dirty || page->writing) && page->gen < gen) return false;
+    }
+    return true;
+}
+
+/* Copy a write into the cache; caller holds cache->lock */
+static int cache_absorb(block_cache_t *cache, block_request_t *req)
+{
+    uint64_t first = req->offset / BLOCK_CACHE_PAGE;
+    uint64_t last = (req->offset + req->length - 1) / BLOCK_CACHE_PAGE;
+    uint64_t end = req->offset + req->length;
+    uint32_t fresh = 0;
+    
+    /* Every page has to be cached already or written whole */
+    for (uint64_t idx = first; idx <= last; idx++) {
+        block_cache_page_t *page = page_lookup(cache, idx);
+        uint64_t base = idx * BLOCK_CACHE_PAGE;
+        
+        if (page) {
+            if (page->state != BLOCK_CACHE_VALID || page->writing) {
+                return CACHE_THROUGH;
+            }
+            if (!page->dirty) fresh++;
+        } else if (req->offset > base || end < base + BLOCK_CACHE_PAGE) {
+            return CACHE_THROUGH;
+        } else {
+            fresh++;
+        }
+    }
+    
+    if (fresh > cache->dirty_max) return CACHE_THROUGH;
+    if (cache->nr_dirty + fresh > cache->dirty_max) {
+        cache->throttled++;
+        return CACHE_PARK;
+    }
+    
+    /*
+     * Running out of pages part way leaves the pages done so far dirty
+     * with the new data; the retry writes the same data again.
+     */
+    for (uint64_t idx = first; idx <= last; idx++) {
+        block_cache_page_t *page = page_lookup(cache, idx);
+        if (!page) {
+            page = page_alloc(cache, idx, BLOCK_CACHE_VALID);
+            if (!page) {
+                cache->throttled++;
+                return CACHE_PARK;
+            }
+        }
+        
+        uint64_t base = idx * BLOCK_CACHE_PAGE;
+        uint64_t start = MAX(req->offset, base);
+        uint64_t stop = MIN(end, base + BLOCK_CACHE_PAGE);
+        block_iov_copy_from(req, start - req->offset, page->data + (start - base),
+                            stop - start);
+        
+        page->referenced = true;
+        if (!page->dirty) {
+            page->dirty = true;
+            page->gen = cache->flush_gen;
+            cache->nr_dirty++;
+        }
+    }
+    
+    /* Reads in flight must not cache what they saw before this */
+    cache->write_seq++;
+    cache->write_hits++;
+    return CACHE_DONE;
+}
+
+/* ============================================================================
+ * Front Device
+ * ============================================================================ */
+
+/* Copy a read out of the cache if all of it is there; caller holds cache->lock */
+static int cache_lookup(block_cache_t *cache, block_request_t *req)
+{
+    uint64_t first = req->offset / BLOCK_CACHE_PAGE;
+    uint64_t last = (req->offset + req->length - 1) / BLOCK_CACHE_PAGE;
+    int result = CACHE_HIT;
+    
+    for (uint64_t idx = first; idx <= last; idx++) {
+        block_cache_page_t *page = page_lookup(cache, idx);
+        if (!page) return CACHE_MISS;
+        if (page->state == BLOCK_CACHE_READING) {
+            result = CACHE_WAIT;
+        }
+    }
+    if (result != CACHE_HIT) return result;
+    
+    for (uint64_t idx = first; idx <= last; idx++) {
+        block_cache_page_t *page = page_lookup(cache, idx);
+        uint64_t base = idx * BLOCK_CACHE_PAGE;
+        uint64_t start = MAX(req->offset, base);
+        uint64_t end = MIN(req->offset + req->length, base + BLOCK_CACHE_PAGE);
+        
+        block_iov_copy_to(req, start - req->offset, page->data + (start - base),
+                          end - start);
+        page->referenced = true;
+        if (page->readahead) {
+            page->readahead = false;
+            cache->readahead_hits++;
+        }
+    }
+    
+    cache->hits += last - first + 1;
+    return CACHE_HIT;
+}
+
+/* @io is set when retrying a read held back before */
+static void cache_read(block_cache_t *cache, block_request_t *req, cache_io_t *io)
+{
+    cache_run_t *ra = NULL;
+    bool issue = false;
+    bool kick = false;
+    
+    spinlock_acquire(&cache->lock);
+    
+    int result = cache_lookup(cache, req);
+    if (!io) {
+        ra = cache_stream(cache, req);
+    }
+    
+    if (result != CACHE_HIT) {
+        if (!io) {
+            io = cache_io_alloc(req);
+        }
+        if (!io) {
+            /* Failed below */
+        } else if (result == CACHE_WAIT) {
+            pending_add(cache, io);
+        } else if (range_dirty(cache, req->offset, req->length)) {
+            /* The lower device has older data than the cache */
+            pending_add(cache, io);
+            kick = true;
+        } else {
+            cache->misses += (req->offset + req->length - 1) / BLOCK_CACHE_PAGE -
+                             req->offset / BLOCK_CACHE_PAGE + 1;
+            io->seq = cache->write_seq;
+            issue = true;
+        }
+    }
+    
+    spinlock_release(&cache->lock);
+    
+    /* The reader first, then what it will want next */
+    if (result == CACHE_HIT) {
+        kfree(io);
+        block_complete(req, 0);
+    } else if (!io) {
+        block_complete(req, -1);
+    } else if (issue) {
+        cache_issue(cache, io);
+    }
+    
+    if (ra && block_submit_async(cache->lower, &ra->req) != 0) {
+        cache_ra_done(ra, -1);
+    }
+    if (kick) {
+        cache_writeback(cache);
+    }
+}
+
+/* Writes, discards and flushes */
+static void cache_write(block_cache_t *cache, cache_io_t *io)
+{
+    block_request_t *req = io->front;
+    bool flush = req->op == BLOCK_OP_FLUSH || (req->flags & BLOCK_REQ_PREFLUSH);
+    bool kick = false;
+    int action = CACHE_THROUGH;
+    
+    spinlock_acquire(&cache->lock);
+    
+    /* Everything dirtied before a flush is written back ahead of it */
+    if (flush && !io->gen) {
+        io->gen = ++cache->flush_gen;
+        cache->flushes++;
+        kick = cache->nr_dirty != 0;
+    }
+    
+    if (io->gen && !flush_done(cache, io->gen)) {
+        action = CACHE_PARK;
+    } else if (flush && cache->wb_error) {
+        cache->wb_error = 0;
+        action = CACHE_FAIL;
+    } else if (cache->config.writeback && req->op == BLOCK_OP_WRITE &&
+               !(req->flags & (BLOCK_REQ_FUA | BLOCK_REQ_PREFLUSH))) {
+        action = cache_absorb(cache, req);
+    }
+    
+    /* Nothing may overtake dirty pages on the way down */
+    if (action == CACHE_THROUGH && range_dirty(cache, req->offset, req->length)) {
+        action = CACHE_PARK;
+    }
+    
+    if (action == CACHE_THROUGH) {
+        cache->write_seq++;
+        cache_invalidate(cache, req->offset, req->length);
+    } else if (action == CACHE_PARK) {
+        pending_add(cache, io);
+        kick = true;
+    } else if (action == CACHE_DONE) {
+        if (cache->nr_dirty >= cache->dirty_max / 2) {
+            kick = true;
+        } else if (!cache->wb_armed) {
+            cache->wb_armed = true;
+            ktimer_arm(&cache->wb_timer, BLOCK_CACHE_WB_DELAY_US);
+        }
+    }
+    
+    spinlock_release(&cache->lock);
+    
+    if (action == CACHE_THROUGH) {
+        cache_issue(cache, io);
+    } else if (action == CACHE_DONE || action == CACHE_FAIL) {
+        kfree(io);
+        block_complete(req, action == CACHE_DONE ? 0 : -1);
+    }
+    
+    if (kick) {
+        cache_writeback(cache);
+    }
+}
+
+static int cache_submit(block_device_t *dev, block_request_t *req)
+{
+    block_cache_t *cache = (block_cache_t *)dev->priv;
+    
+    if (req->op == BLOCK_OP_READ) {
+        if (!req->length) {
+            block_complete(req, 0);
+        } else {
+            cache_read(cache, req, NULL);
+        }
+        return 0;
+    }
+    
+    if (req->op != BLOCK_OP_WRITE && req->op != BLOCK_OP_DISCARD &&
+        req->op != BLOCK_OP_WRITE_ZEROES && req->op != BLOCK_OP_FLUSH) {
+        return -1;
+    }
+    
+    cache_io_t *io = cache_io_alloc(req);
+    if (!io) return -1;
+    
+    cache_write(cache, io);
+    return 0;
+}
+
+static void cache_poll(block_device_t *dev)
+{
+    block_cache_t *cache = (block_cache_t *)dev->priv;
+    
+    block_poll(cache->lower);
+}
+
+/* Through the queue, behind everything submitted before */
+static int cache_flush(block_device_t *dev)
+{
+    block_request_t req = { .op = BLOCK_OP_FLUSH };
+    
+    return block_submit_wait(dev, &req);
+}
+
+static const block_ops_t cache_ops = {
+    .submit = cache_submit,
+    .flush = cache_flush,
+    .poll = cache_poll,
+};
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+static void cache_free(block_cache_t *cache)
+{
+    if (cache->pages) {
+        for (uint32_t i = 0; i < cache->nr_pages; i++) {
+            if (cache->pages[i].data) {
+                pmm_free_pages(virt_to_phys(cache->pages[i].data), 0);
+            }
+        }
+    }
+    
+    kfree(cache->pages);
+    kfree(cache->hash);
+    kfree(cache->wb_sort);
+    kfree(cache);
+}
+
+block_cache_t *block_cache_create(block_device_t *lower,
+                                  const block_cache_config_t *cfg)
+{
+    static const block_cache_config_t defaults;
+    
+    if (!lower) return NULL;
+    if (!cfg) cfg = &defaults;
+    
+    block_cache_t *cache = kmalloc(sizeof(block_cache_t), GFP_KERNEL | GFP_ZERO);
+    if (!cache) return NULL;
+    
+    cache->lower = lower;
+    cache->config = *cfg;
+    if (!cache->config.max_bytes) {
+        cache->config.max_bytes = BLOCK_CACHE_DEFAULT_SIZE;
+    }
+    if (!cache->config.readahead_max || cache->config.readahead_max > BLOCK_CACHE_RA_MAX) {
+        cache->config.readahead_max = BLOCK_CACHE_RA_MAX;
+    }
+    if (!cache->config.dirty_max || cache->config.dirty_max > cache->config.max_bytes) {
+        cache->config.dirty_max = cache->config.max_bytes / 2;
+    }
+    
+    cache->nr_pages = (uint32_t)(cache->config.max_bytes / BLOCK_CACHE_PAGE);
+    cache->dirty_max = (uint32_t)MAX(cache->config.dirty_max / BLOCK_CACHE_PAGE, 1);
+    if (!cache->nr_pages) {
+        kfree(cache);
+        return NULL;
+    }
+    
+    uint32_t buckets = 1;
+    while (buckets < cache->nr_pages) {
+        buckets <<= 1;
+    }
+    cache->hash_mask = buckets - 1;
+    
+    cache->pages = kmalloc(cache->nr_pages * sizeof(block_cache_page_t),
+                           GFP_KERNEL | GFP_ZERO);
+    cache->hash = kmalloc(buckets * sizeof(block_cache_page_t *),
+                          GFP_KERNEL | GFP_ZERO);
+    cache->wb_sort = kmalloc(cache->nr_pages * sizeof(block_cache_page_t *),
+                             GFP_KERNEL);
+    if (!cache->pages || !cache->hash || !cache->wb_sort) {
+        cache_free(cache);
+        return NULL;
+    }
+    
+    for (uint32_t i = 0; i < cache->nr_pages; i++) {
+        phys_addr_t phys = pmm_alloc_pages(0);
+        if (!phys) {
+            pr_error("Cache: Out of memory for %u pages", cache->nr_pages);
+            cache_free(cache);
+            return NULL;
+        }
+        cache->pages[i].data = phys_to_virt(phys);
+    }
+    
+    spinlock_init(&cache->lock);
+    ktimer_init(&cache->wb_timer, cache_wb_timer, cache);
+    
+    /* Front device, interchangeable with the lower one */
+    snprintf(cache->blkdev.name, BLOCK_MAX_NAME, "%s-cache", lower->name);
+    block_generate_uuid(cache->blkdev.uuid);
+    cache->blkdev.size = lower->size;
+    cache->blkdev.block_size = lower->block_size;
+    cache->blkdev.num_blocks = lower->num_blocks;
+    cache->blkdev.readonly = lower->readonly;
+    cache->blkdev.ops = &cache_ops;
+    cache->blkdev.priv = cache;
+    cache->blkdev.nr_hw_queues = block_hw_queues_per_cpu();
+    cache->blkdev.max_io_size = lower->max_io_size;
+    cache->blkdev.io_boundary = lower->io_boundary;
+    
+    if (block_register(&cache->blkdev) != 0) {
+        cache_free(cache);
+        return NULL;
+    }
+    
+    pr_info("Cache: %s, %llu KB in %u pages, %s",
+            cache->blkdev.name, cache->config.max_bytes / KB, cache->nr_pages,
+            cache->config.writeback ? "write-back" : "write-through");
+    return cache;
+}
+
+void block_cache_destroy(block_cache_t *cache)
+{
+    if (!cache) return;
+    
+    if (block_flush(&cache->blkdev) != 0) {
+        pr_warn("Cache: %s: write-back failed", cache->blkdev.name);
+    }
+    
+    ktimer_cancel(&cache->wb_timer);
+    block_unregister(&cache->blkdev);
+    cache_free(cache);
+}
+
+void block_cache_drop(block_cache_t *cache)
+{
+    spinlock_acquire(&cache->lock);
+    
+    for (uint32_t i = 0; i < cache->nr_pages; i++) {
+        if (cache->pages[i].state != BLOCK_CACHE_FREE) {
+            page_invalidate(cache, &cache->pages[i]);
+        }
+    }
+    memset(cache->streams, 0, sizeof(cache->streams));
+    
+    spinlock_release(&cache->lock);
+}
@@ -472,7 +472,7 @@ static int apply_storage_entry(raft_context_t *raft, raft_log_entry_t *entry)
         }
         
         if (vol) {
-            block_write(&vol->blkdev, offset, data, len);
+            block_write(volume_get_block_device(vol), offset, data, len);
         }
     }
     
@@ -548,7 +548,7 @@ int dist_storage_read(dist_storage_t *ds, const char *volume,
     storage_pool_t *pool = ds->local_pool;
     for (storage_volume_t *v = pool->volumes; v; v = v->next) {
         if (strcmp(v->name, volume) == 0) {
-            return block_read(&v->blkdev, offset, data, len);
+            return block_read(volume_get_block_device(v), offset, data, len);
         }
     }
     
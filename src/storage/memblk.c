@@ -1,26 +1,120 @@
 /*
  * PureVisor - Memory Block Device
  * 
- * RAM-backed block device for testing
+ * Sparse RAM-backed block device. Data pages hang off a radix tree of
+ * page-sized nodes, like a page table, and are only allocated once
+ * written.
  */
 
 #include <lib/types.h>
 #include <lib/string.h>
-#include <storage/block.h>
+#include <storage/memblk.h>
 #include <mm/pmm.h>
 #include <mm/heap.h>
 #include <kernel/console.h>
+#include <kernel/smp.h>
 
 /* ============================================================================
  * Memory Device Structure
  * ============================================================================ */
 
+#define MEM_RADIX_SHIFT     9                           /* Slots per node: one page of pointers */
+#define MEM_RADIX_SLOTS     (1U << MEM_RADIX_SHIFT)
+#define MEM_RADIX_MASK      (MEM_RADIX_SLOTS - 1)
+
 typedef struct mem_block_device {
     block_device_t blkdev;
-    void *memory;
+    void **root;
+    uint32_t height;            /* Node levels above the data pages */
     uint64_t mem_size;
+    uint64_t data_pages;
+    uint64_t node_pages;
+    spinlock_t lock;            /* Tree and data */
 } mem_block_device_t;
 
+/* ============================================================================
+ * Radix Tree
+ * ============================================================================ */
+
+static void *mem_page_alloc(bool zero)
+{
+    phys_addr_t phys = pmm_alloc_pages(0);
+    if (!phys) return NULL;
+    
+    void *page = phys_to_virt(phys);
+    if (zero) {
+        memset(page, 0, PAGE_SIZE);
+    }
+    return page;
+}
+
+static void mem_page_free(void *page)
+{
+    pmm_free_pages(virt_to_phys(page), 0);
+}
+
+/*
+ * Data page @index, or NULL if it was never written. With @create it is
+ * allocated, along with any nodes on the way; *@created tells whether it
+ * is new and so holds garbage.
+ */
+static uint8_t *mem_lookup(mem_block_device_t *mdev, uint64_t index,
+                           bool create, bool *created)
+{
+    void **node = mdev->root;
+    
+    for (uint32_t level = mdev->height; level > 0; level--) {
+        uint32_t slot = (index >> ((level - 1) * MEM_RADIX_SHIFT)) & MEM_RADIX_MASK;
+        
+        if (!node[slot]) {
+            if (!create) return NULL;
+            
+            node[slot] = mem_page_alloc(level > 1);
+            if (!node[slot]) return NULL;
+            if (level > 1) {
+                mdev->node_pages++;
+            } else {
+                mdev->data_pages++;
+                *created = true;
+            }
+        }
+        node = node[slot];
+    }
+    
+    return (uint8_t *)node;
+}
+
+/* Interior nodes stay: they are 1/512 of the data they once held */
+static void mem_remove(mem_block_device_t *mdev, uint64_t index)
+{
+    void **node = mdev->root;
+    
+    for (uint32_t level = mdev->height; level > 1; level--) {
+        node = node[(index >> ((level - 1) * MEM_RADIX_SHIFT)) & MEM_RADIX_MASK];
+        if (!node) return;
+    }
+    
+    uint32_t slot = index & MEM_RADIX_MASK;
+    if (node[slot]) {
+        mem_page_free(node[slot]);
+        node[slot] = NULL;
+        mdev->data_pages--;
+    }
+}
+
+static void mem_free_tree(void **node, uint32_t level)
+{
+    for (uint32_t slot = 0; slot < MEM_RADIX_SLOTS; slot++) {
+        if (!node[slot]) continue;
+        if (level > 1) {
+            mem_free_tree(node[slot], level - 1);
+        } else {
+            mem_page_free(node[slot]);
+        }
+    }
+    mem_page_free(node);
+}
+
 /* ============================================================================
  * Operations
  * ============================================================================ */
@@ -30,40 +124,72 @@ static int mem_submit(block_device_t *dev, block_request_t *req)
     mem_block_device_t *mdev = (mem_block_device_t *)dev->priv;
     
     if (req->offset + req->length > mdev->mem_size) {
-        req->status = -1;
-        if (req->completion) req->completion(req->completion_ctx, -1);
+        return -1;
+    }
+    if (req->op != BLOCK_OP_READ && req->op != BLOCK_OP_WRITE &&
+        req->op != BLOCK_OP_FLUSH && req->op != BLOCK_OP_DISCARD &&
+        req->op != BLOCK_OP_WRITE_ZEROES) {
         return -1;
     }
     
     int status = 0;
-    uint8_t *mem = (uint8_t *)mdev->memory;
+    uint64_t done = 0;
     
-    switch (req->op) {
-        case BLOCK_OP_READ:
-            memcpy(req->buffer, mem + req->offset, req->length);
-            break;
-            
-        case BLOCK_OP_WRITE:
-            memcpy(mem + req->offset, req->buffer, req->length);
-            break;
-            
-        case BLOCK_OP_FLUSH:
-            /* Nothing to do for memory */
-            break;
+    spinlock_acquire(&mdev->lock);
+    
+    /* Page by page; FLUSH has no length and nothing to do for memory */
+    while (done < req->length) {
+        uint64_t offset = req->offset + done;
+        uint64_t index = offset / PAGE_SIZE;
+        uint32_t in_page = offset % PAGE_SIZE;
+        uint32_t chunk = (uint32_t)MIN(PAGE_SIZE - in_page, req->length - done);
+        bool whole = chunk == PAGE_SIZE;
+        bool created = false;
+        uint8_t *page;
+        
+        switch (req->op) {
+            case BLOCK_OP_READ:
+                page = mem_lookup(mdev, index, false, &created);
+                if (page) {
+                    block_iov_copy_to(req, done, page + in_page, chunk);
+                } else {
+                    block_iov_zero(req, done, chunk);
+                }
+                break;
             
-        case BLOCK_OP_WRITE_ZEROES:
-            memset(mem + req->offset, 0, req->length);
-            break;
+            case BLOCK_OP_WRITE:
+                page = mem_lookup(mdev, index, true, &created);
+                if (!page) {
+                    status = -1;
+                    break;
+                }
+                if (created && !whole) {
+                    memset(page, 0, PAGE_SIZE);
+                }
+                block_iov_copy_from(req, done, page + in_page, chunk);
+                break;
             
-        default:
-            status = -1;
-            break;
+            default:
+                /* Discard and write-zeroes both leave zeroes behind */
+                if (whole) {
+                    mem_remove(mdev, index);
+                } else {
+                    page = mem_lookup(mdev, index, false, &created);
+                    if (page) {
+                        memset(page + in_page, 0, chunk);
+                    }
+                }
+                break;
+        }
+        
+        if (status) break;
+        done += chunk;
     }
     
-    req->status = status;
-    if (req->completion) req->completion(req->completion_ctx, status);
+    spinlock_release(&mdev->lock);
     
-    return status;
+    block_complete(req, status);
+    return 0;
 }
 
 static int mem_flush(block_device_t *dev UNUSED)
@@ -82,21 +208,27 @@ static const block_ops_t mem_ops = {
 
 block_device_t *mem_block_create(const char *name, uint64_t size)
 {
-    mem_block_device_t *mdev = kmalloc(sizeof(mem_block_device_t), 
+    mem_block_device_t *mdev = kmalloc(sizeof(mem_block_device_t),
                                         GFP_KERNEL | GFP_ZERO);
     if (!mdev) return NULL;
     
-    /* Allocate memory */
     uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-    phys_addr_t phys = pmm_alloc_pages(pages > 10 ? 10 : pages);
-    if (!phys) {
+    
+    /* Enough levels to reach every page */
+    mdev->height = 1;
+    while (mdev->height * MEM_RADIX_SHIFT < 64 &&
+           (1ULL << (mdev->height * MEM_RADIX_SHIFT)) < pages) {
+        mdev->height++;
+    }
+    
+    mdev->root = mem_page_alloc(true);
+    if (!mdev->root) {
         kfree(mdev);
         return NULL;
     }
-    
-    mdev->memory = phys_to_virt(phys);
+    mdev->node_pages = 1;
     mdev->mem_size = pages * PAGE_SIZE;
-    memset(mdev->memory, 0, mdev->mem_size);
+    spinlock_init(&mdev->lock);
     
     /* Setup block device */
     strncpy(mdev->blkdev.name, name, BLOCK_MAX_NAME - 1);
@@ -105,9 +237,10 @@ block_device_t *mem_block_create(const char *name, uint64_t size)
     mdev->blkdev.num_blocks = mdev->mem_size / BLOCK_DEFAULT_SIZE;
     mdev->blkdev.ops = &mem_ops;
     mdev->blkdev.priv = mdev;
-    mdev->blkdev.max_queue_depth = 32;
+    mdev->blkdev.max_queue_depth = BLOCK_DEFAULT_QUEUE_DEPTH;
+    mdev->blkdev.nr_hw_queues = block_hw_queues_per_cpu();
     
-    pr_info("MemBlock: Created '%s', %llu MB", name, mdev->mem_size / MB);
+    pr_info("MemBlock: Created '%s', %llu MB sparse", name, mdev->mem_size / MB);
     
     return &mdev->blkdev;
 }
@@ -118,11 +251,13 @@ void mem_block_destroy(block_device_t *dev)
     
     mem_block_device_t *mdev = (mem_block_device_t *)dev->priv;
     
-    if (mdev->memory) {
-        phys_addr_t phys = virt_to_phys(mdev->memory);
-        uint64_t pages = (mdev->mem_size + PAGE_SIZE - 1) / PAGE_SIZE;
-        pmm_free_pages(phys, pages > 10 ? 10 : pages);
-    }
-    
+    mem_free_tree(mdev->root, mdev->height);
     kfree(mdev);
 }
+
+uint64_t mem_block_used(block_device_t *dev)
+{
+    mem_block_device_t *mdev = (mem_block_device_t *)dev->priv;
+    
+    return mdev->data_pages * PAGE_SIZE;
+}
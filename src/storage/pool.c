@@ -9,6 +9,7 @@
 #include <storage/pool.h>
 #include <mm/heap.h>
 #include <kernel/console.h>
+#include <arch/x86_64/cpu.h>
 
 /* ============================================================================
  * Global State
@@ -23,79 +24,796 @@ static uint32_t next_volume_id = 1;
  * Volume Block Operations
  * ============================================================================ */
 
+#define VOLUME_MAX_COPIES   4   /* Primary and up to three replicas */
+#define VOLUME_LAT_FLOOR_US 50  /* Keeps idle fast devices from looking free */
+
+/* A volume request split into children, one per extent piece and copy */
+typedef struct volume_io {
+    block_request_t *parent;
+    storage_volume_t *vol;
+    uint32_t pending;           /* What the parent waits for, plus one while issuing */
+    uint32_t refs;              /* Children in flight, plus one while issuing */
+    int status;
+} volume_io_t;
+
+/*
+ * The copies of a written piece. The parent waits for a quorum of them
+ * rather than for each; copies still going when it completes write
+ * from a bounce buffer, since the parent's data is gone by then.
+ * Copies being resynced take the write but count for neither outcome.
+ * Those left behind by the parent lag, and are not read, until done.
+ */
+typedef struct volume_piece {
+    volume_io_t *io;
+    storage_pool_t *pool;
+    uint32_t copies;
+    uint32_t counted;           /* Copies the quorum is of */
+    uint32_t quorum;
+    uint32_t acks;
+    uint32_t fails;
+    uint32_t left;              /* Copies in flight */
+    uint32_t failed;            /* Mask of copies */
+    uint32_t resyncing;         /* Mask of copies */
+    uint32_t finished;          /* Mask of copies */
+    uint32_t lagging;           /* Mask of copies */
+    uint32_t primary;
+    uint32_t extents[VOLUME_MAX_COPIES];
+    uint8_t *bounce;
+} volume_piece_t;
+
+/*
+ * A read of a piece with more than one copy in sync. One copy is read
+ * at a time, the next only if it fails, or once hedge_us has passed;
+ * the first to answer completes the piece. Hedged reads read into
+ * bounce buffers, since the loser may finish after the parent.
+ */
+typedef struct volume_read {
+    volume_io_t *io;
+    uint32_t extents[VOLUME_MAX_COPIES];
+    uint32_t count;
+    uint32_t tried;             /* Mask of copies */
+    uint32_t inflight;          /* Copies being read */
+    uint32_t refs;              /* Copies being read, and the hedge list */
+    uint32_t finished;          /* The parent has its answer */
+    uint32_t hedge_copy;        /* Read by the hedge timer */
+    bool bounced;
+    uint32_t primary;           /* Of a parked read */
+    uint64_t extent_offset;
+    uint64_t done;
+    uint64_t len;
+    uint64_t deadline;
+    struct volume_read *next;
+} volume_read_t;
+
+typedef struct volume_child {
+    block_request_t req;
+    volume_io_t *io;
+    volume_piece_t *piece;      /* Copy of a replicated write, if not NULL */
+    volume_read_t *read;        /* Copy of a replicated read, if not NULL */
+    uint32_t copy;
+    uint32_t dev_idx;
+    uint64_t issue_us;
+    uint8_t *bounce;
+    block_iovec_t iov[];
+} volume_child_t;
+
+static void volume_io_done(volume_io_t *io, int status)
+{
+    if (status != 0) {
+        io->status = status;
+    }
+    if (__sync_sub_and_fetch(&io->pending, 1) != 0) return;
+    
+    block_complete(io->parent, io->status);
+}
+
+static void volume_io_put(volume_io_t *io)
+{
+    if (__sync_sub_and_fetch(&io->refs, 1) == 0) {
+        kfree(io);
+    }
+}
+
+static void extent_mark_stale(storage_pool_t *pool, uint32_t extent_id)
+{
+    extent_info_t *ext = &pool->extents[extent_id];
+    uint32_t old;
+    
+    /* A copy being resynced is counted already; the resync gives up */
+    do {
+        old = ext->stale;
+        if (old == EXTENT_STALE) return;
+    } while (!__sync_bool_compare_and_swap(&ext->stale, old, EXTENT_STALE));
+    
+    if (old == EXTENT_IN_SYNC) {
+        __sync_fetch_and_add(&pool->stale_extents, 1);
+        pr_warn("Pool: Extent %u of '%s' is stale", extent_id, pool->name);
+    }
+}
+
+/*
+ * Copies of @primary a write goes to, or a read may use, primary first.
+ * Reads skip copies still writing what a completed write left them;
+ * *@behind is set if that leaves none of those in sync.
+ */
+static uint32_t extent_in_sync(storage_pool_t *pool, uint32_t primary,
+                               uint32_t *extents, bool write, bool *behind)
+{
+    extent_info_t *ext = &pool->extents[primary];
+    uint32_t count = 0;
+    uint32_t lagging = 0;
+    
+    for (uint32_t r = 0; r <= ext->replica_count; r++) {
+        uint32_t id = r ? ext->replica_extents[r - 1] : primary;
+        extent_info_t *copy = &pool->extents[id];
+        if (copy->stale == EXTENT_IN_SYNC ||
+            (write && copy->stale == EXTENT_RESYNCING)) {
+            if (!write && copy->lagging) {
+                lagging++;
+                continue;
+            }
+            extents[count++] = id;
+        }
+    }
+    
+    if (behind) {
+        *behind = count == 0 && lagging != 0;
+    }
+    return count;
+}
+
+/*
+ * Writes are counted on every copy of @primary before the copies to
+ * write are chosen: volume_resync() either waits for a write that
+ * missed the copy it resyncs, or the write sees that copy resyncing.
+ */
+static void extent_writes_begin(storage_pool_t *pool, uint32_t primary)
+{
+    extent_info_t *ext = &pool->extents[primary];
+    
+    for (uint32_t r = 0; r <= ext->replica_count; r++) {
+        extent_info_t *copy = &pool->extents[r ? ext->replica_extents[r - 1] : primary];
+        __sync_fetch_and_add(&copy->writes, 1);
+        __sync_fetch_and_add(&copy->write_seq, 1);
+    }
+}
+
+static void extent_writes_end(storage_pool_t *pool, uint32_t primary)
+{
+    extent_info_t *ext = &pool->extents[primary];
+    
+    for (uint32_t r = 0; r <= ext->replica_count; r++) {
+        extent_info_t *copy = &pool->extents[r ? ext->replica_extents[r - 1] : primary];
+        __sync_fetch_and_sub(&copy->writes, 1);
+    }
+}
+
+/* Copies the parent is about to complete without lag until they finish */
+static void volume_unpark(storage_volume_t *vol);
+
+/* Copy @c of @piece has the write now, or has failed it */
+static void volume_piece_caught_up(volume_piece_t *piece, uint32_t c)
+{
+    extent_info_t *ext = &piece->pool->extents[piece->extents[c]];
+    
+    /* A lagging copy that failed missed a completed write */
+    if (piece->failed & (1U << c)) {
+        extent_mark_stale(piece->pool, piece->extents[c]);
+    }
+    if (__sync_sub_and_fetch(&ext->lagging, 1) == 0) {
+        volume_unpark(piece->io->vol);
+    }
+}
+
+static void volume_piece_lag(volume_piece_t *piece)
+{
+    storage_pool_t *pool = piece->pool;
+    
+    for (uint32_t c = 0; c < piece->copies; c++) {
+        uint32_t bit = 1U << c;
+        if ((piece->finished | piece->resyncing) & bit) continue;
+        
+        extent_info_t *ext = &pool->extents[piece->extents[c]];
+        __sync_fetch_and_add(&ext->lagging, 1);
+        __sync_fetch_and_or(&piece->lagging, bit);
+        
+        /* Finished meanwhile, before the bit was there to clear */
+        if ((piece->finished & bit) &&
+            (__sync_fetch_and_and(&piece->lagging, ~bit) & bit)) {
+            volume_piece_caught_up(piece, c);
+        }
+    }
+}
+
+static void volume_piece_done(volume_piece_t *piece, uint32_t copy, int status)
+{
+    storage_pool_t *pool = piece->pool;
+    uint32_t bit = 1U << copy;
+    
+    if (status != 0) {
+        __sync_fetch_and_or(&piece->failed, bit);
+    }
+    
+    __sync_fetch_and_or(&piece->finished, bit);
+    if (__sync_fetch_and_and(&piece->lagging, ~bit) & bit) {
+        volume_piece_caught_up(piece, copy);
+    }
+    
+    /* Exactly one of the two is reached, and only once */
+    if (piece->resyncing & bit) {
+        /* Nothing to count */
+    } else if (status == 0) {
+        if (__sync_add_and_fetch(&piece->acks, 1) == piece->quorum) {
+            volume_piece_lag(piece);
+            volume_io_done(piece->io, 0);
+        }
+    } else if (__sync_add_and_fetch(&piece->fails, 1) ==
+               piece->counted - piece->quorum + 1 && piece->bounce) {
+        volume_io_done(piece->io, -1);
+    }
+    
+    if (__sync_sub_and_fetch(&piece->left, 1) != 0) return;
+    
+    /* The copies wrote from the parent's buffer: it is done only now */
+    if (!piece->bounce && piece->fails) {
+        volume_io_done(piece->io, -1);
+    }
+    
+    /* If no copy took the write, none is newer than the others */
+    if (piece->acks) {
+        for (uint32_t c = 0; c < piece->copies; c++) {
+            if (piece->failed & (1U << c)) {
+                extent_mark_stale(pool, piece->extents[c]);
+            }
+        }
+    }
+    extent_writes_end(pool, piece->primary);
+    if (piece->bounce) {
+        kfree(piece->bounce);
+    }
+    kfree(piece);
+}
+
+static void volume_read_done(volume_read_t *read, volume_child_t *child, int status);
+
+static void volume_child_done(void *ctx, int status)
+{
+    volume_child_t *child = ctx;
+    volume_io_t *io = child->io;
+    
+    if (child->req.op == BLOCK_OP_READ && child->req.length) {
+        storage_pool_t *pool = io->vol->pool;
+        uint32_t lat = (uint32_t)MIN(rdtsc_us() - child->issue_us, 0xFFFFFFFFULL);
+        
+        /* Racing updates only lose a sample */
+        __sync_fetch_and_sub(&pool->device_reads[child->dev_idx], 1);
+        pool->device_read_us[child->dev_idx] =
+            (pool->device_read_us[child->dev_idx] * 7 + lat) / 8;
+    }
+    
+    if (child->piece) {
+        volume_piece_done(child->piece, child->copy, status);
+    } else if (child->read) {
+        volume_read_done(child->read, child, status);
+    } else {
+        volume_io_done(io, status);
+    }
+    
+    if (child->bounce) {
+        kfree(child->bounce);
+    }
+    kfree(child);
+    volume_io_put(io);
+}
+
+/* Send @len bytes of the parent's data from @done to device @dev_idx */
+static void volume_issue(volume_io_t *io, volume_piece_t *piece,
+                         volume_read_t *read, uint32_t copy, uint32_t dev_idx,
+                         uint64_t dev_offset, uint64_t done, uint64_t len)
+{
+    block_request_t *parent = io->parent;
+    storage_pool_t *pool = io->vol->pool;
+    
+    if (!piece && !read) {
+        __sync_fetch_and_add(&io->pending, 1);
+    }
+    
+    volume_child_t *child = kmalloc(sizeof(volume_child_t) +
+                                    parent->iov_count * sizeof(block_iovec_t),
+                                    GFP_KERNEL | GFP_ZERO);
+    if (child && read && read->bounced) {
+        child->bounce = kmalloc(len, GFP_KERNEL);
+        if (!child->bounce) {
+            kfree(child);
+            child = NULL;
+        }
+    }
+    if (!child) {
+        if (piece) {
+            volume_piece_done(piece, copy, -1);
+        } else if (read) {
+            volume_read_done(read, NULL, -1);
+        } else {
+            volume_io_done(io, -1);
+        }
+        return;
+    }
+    
+    child->io = io;
+    child->piece = piece;
+    child->read = read;
+    child->copy = copy;
+    child->dev_idx = dev_idx;
+    child->req.op = parent->op;
+    child->req.flags = parent->flags & (BLOCK_REQ_FUA | BLOCK_REQ_PREFLUSH);
+    child->req.offset = dev_offset;
+    child->req.length = len;
+    if (child->bounce || (piece && piece->bounce)) {
+        child->iov[0].base = child->bounce ? child->bounce : piece->bounce;
+        child->iov[0].len = (uint32_t)len;
+        child->req.iov = child->iov;
+        child->req.iov_count = 1;
+    } else if (len) {
+        child->req.iov = child->iov;
+        child->req.iov_count = block_iov_slice(parent, done, len, child->iov);
+    }
+    child->req.completion = volume_child_done;
+    child->req.completion_ctx = child;
+    
+    if (child->req.op == BLOCK_OP_READ && len) {
+        __sync_fetch_and_add(&pool->device_reads[dev_idx], 1);
+        child->issue_us = rdtsc_us();
+    }
+    
+    __sync_fetch_and_add(&io->refs, 1);
+    if (block_submit_async(pool->devices[dev_idx], &child->req) != 0) {
+        volume_child_done(child, -1);
+    }
+}
+
+/* Write a piece to every in-sync or resyncing copy of @primary */
+static void volume_write_piece(storage_volume_t *vol, volume_io_t *io,
+                               uint32_t primary, uint64_t extent_offset,
+                               uint64_t done, uint64_t len)
+{
+    storage_pool_t *pool = vol->pool;
+    uint32_t extents[VOLUME_MAX_COPIES];
+    
+    volume_piece_t *piece = kmalloc(sizeof(volume_piece_t), GFP_KERNEL | GFP_ZERO);
+    if (!piece) {
+        io->status = -1;
+        return;
+    }
+    
+    extent_writes_begin(pool, primary);
+    uint32_t copies = extent_in_sync(pool, primary, extents, true, NULL);
+    uint32_t counted = 0;
+    for (uint32_t c = 0; c < copies; c++) {
+        if (pool->extents[extents[c]].stale == EXTENT_RESYNCING) {
+            piece->resyncing |= 1U << c;
+        } else {
+            counted++;
+        }
+    }
+    if (counted == 0) {
+        extent_writes_end(pool, primary);
+        kfree(piece);
+        io->status = -1;
+        return;
+    }
+    
+    piece->io = io;
+    piece->pool = pool;
+    piece->counted = counted;
+    piece->quorum = vol->write_quorum ? MIN(vol->write_quorum, counted) : counted;
+    piece->primary = primary;
+    
+    /*
+     * Without a bounce buffer, every copy counted has to finish first,
+     * and the copies being resynced go without the write.
+     */
+    if (piece->quorum < copies) {
+        piece->bounce = kmalloc(len, GFP_KERNEL);
+        if (piece->bounce) {
+            block_iov_copy_from(io->parent, done, piece->bounce, len);
+        } else {
+            uint32_t kept = 0;
+            for (uint32_t c = 0; c < copies; c++) {
+                if (piece->resyncing & (1U << c)) {
+                    extent_mark_stale(pool, extents[c]);
+                } else {
+                    extents[kept++] = extents[c];
+                }
+            }
+            copies = kept;
+            piece->resyncing = 0;
+            piece->quorum = copies;
+        }
+    }
+    
+    piece->copies = copies;
+    piece->left = copies;
+    memcpy(piece->extents, extents, sizeof(extents));
+    
+    __sync_fetch_and_add(&io->pending, 1);
+    for (uint32_t c = 0; c < copies; c++) {
+        extent_info_t *copy = &pool->extents[extents[c]];
+        volume_issue(io, piece, NULL, c, copy->device_id,
+                     copy->device_offset + extent_offset, done, len);
+    }
+}
+
+/* Copy to read next, skipping those in @skip; read->count if none */
+static uint32_t volume_pick_copy(storage_volume_t *vol, volume_read_t *read,
+                                 uint32_t skip)
+{
+    storage_pool_t *pool = vol->pool;
+    uint32_t best = read->count;
+    uint64_t best_cost = 0;
+    uint32_t start = 0;
+    
+    /* Equal costs go round-robin */
+    if (vol->read_policy == POOL_READ_BALANCE) {
+        start = __sync_fetch_and_add(&vol->read_rotor, 1) % read->count;
+    }
+    
+    for (uint32_t i = 0; i < read->count; i++) {
+        uint32_t c = (start + i) % read->count;
+        if (skip & (1U << c)) continue;
+        if (vol->read_policy == POOL_READ_PRIMARY) return c;
+        
+        uint32_t dev = pool->extents[read->extents[c]].device_id;
+        uint64_t cost = (uint64_t)(pool->device_reads[dev] + 1) *
+                        (pool->device_read_us[dev] + VOLUME_LAT_FLOOR_US);
+        if (best == read->count || cost < best_cost) {
+            best = c;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+static void volume_read_put(volume_read_t *read)
+{
+    if (__sync_sub_and_fetch(&read->refs, 1) == 0) {
+        kfree(read);
+    }
+}
+
+/* Read one more copy; false if every copy has been tried */
+static bool volume_read_next(volume_read_t *read, bool hedge)
+{
+    storage_volume_t *vol = read->io->vol;
+    uint32_t c;
+    
+    /* Counted first, so a failure meanwhile does not give up early */
+    __sync_fetch_and_add(&read->inflight, 1);
+    do {
+        c = volume_pick_copy(vol, read, read->tried);
+        if (c == read->count) {
+            __sync_fetch_and_sub(&read->inflight, 1);
+            return false;
+        }
+    } while (__sync_fetch_and_or(&read->tried, 1U << c) & (1U << c));
+    
+    if (hedge) {
+        read->hedge_copy = c;
+    }
+    __sync_fetch_and_add(&read->refs, 1);
+    
+    extent_info_t *ext = &vol->pool->extents[read->extents[c]];
+    volume_issue(read->io, NULL, read, c, ext->device_id,
+                 ext->device_offset + read->extent_offset, read->done, read->len);
+    return true;
+}
+
+static void volume_read_done(volume_read_t *read, volume_child_t *child, int status)
+{
+    volume_io_t *io = read->io;
+    
+    __sync_fetch_and_sub(&read->inflight, 1);
+    
+    if (status == 0) {
+        if (__sync_bool_compare_and_swap(&read->finished, 0, 1)) {
+            if (child->bounce) {
+                block_iov_copy_to(io->parent, read->done, child->bounce, read->len);
+            }
+            if (child->copy == read->hedge_copy) {
+                io->vol->hedge_wins++;
+            }
+            volume_io_done(io, 0);
+        }
+    } else if (!read->finished && !volume_read_next(read, false) &&
+               read->inflight == 0 &&
+               __sync_bool_compare_and_swap(&read->finished, 0, 1)) {
+        volume_io_done(io, -1);
+    }
+    
+    volume_read_put(read);
+}
+
+static void volume_hedge_timer(void *ctx)
+{
+    storage_volume_t *vol = ctx;
+    uint64_t now = rdtsc_us();
+    volume_read_t *due = NULL;
+    
+    spinlock_acquire(&vol->hedge_lock);
+    while (vol->hedging &&
+           (vol->hedging->finished || vol->hedging->deadline <= now)) {
+        volume_read_t *read = vol->hedging;
+        vol->hedging = read->next;
+        read->next = due;
+        due = read;
+    }
+    if (vol->hedging) {
+        ktimer_arm(&vol->hedge_timer, vol->hedging->deadline - now);
+    } else {
+        vol->hedging_tail = NULL;
+    }
+    spinlock_release(&vol->hedge_lock);
+    
+    while (due) {
+        volume_read_t *read = due;
+        volume_io_t *io = read->io;
+        due = read->next;
+        
+        if (!read->finished && volume_read_next(read, true)) {
+            vol->hedged++;
+        }
+        volume_read_put(read);
+        volume_io_put(io);
+    }
+}
+
+/* Hold a read until a copy of @primary stops lagging */
+static void volume_park(storage_volume_t *vol, volume_io_t *io,
+                        uint32_t primary, uint64_t extent_offset,
+                        uint64_t done, uint64_t len)
+{
+    volume_read_t *read = kmalloc(sizeof(volume_read_t), GFP_KERNEL | GFP_ZERO);
+    if (!read) {
+        io->status = -1;
+        return;
+    }
+    
+    read->io = io;
+    read->primary = primary;
+    read->extent_offset = extent_offset;
+    read->done = done;
+    read->len = len;
+    __sync_fetch_and_add(&io->pending, 1);
+    __sync_fetch_and_add(&io->refs, 1);
+    
+    spinlock_acquire(&vol->hedge_lock);
+    read->next = vol->parked;
+    vol->parked = read;
+    spinlock_release(&vol->hedge_lock);
+    
+    /* It may have caught up before the read was there to be woken */
+    bool behind;
+    uint32_t extents[VOLUME_MAX_COPIES];
+    if (extent_in_sync(vol->pool, primary, extents, false, &behind) || !behind) {
+        volume_unpark(vol);
+    }
+}
+
+static void volume_read_piece(storage_volume_t *vol, volume_io_t *io,
+                              uint32_t primary, uint64_t extent_offset,
+                              uint64_t done, uint64_t len);
+
+/* Try the parked reads again; those still behind park once more */
+static void volume_unpark(storage_volume_t *vol)
+{
+    spinlock_acquire(&vol->hedge_lock);
+    volume_read_t *read = vol->parked;
+    vol->parked = NULL;
+    spinlock_release(&vol->hedge_lock);
+    
+    while (read) {
+        volume_read_t *next = read->next;
+        volume_io_t *io = read->io;
+        
+        volume_read_piece(vol, io, read->primary, read->extent_offset,
+                          read->done, read->len);
+        volume_io_done(io, 0);
+        volume_io_put(io);
+        kfree(read);
+        read = next;
+    }
+}
+
+/* Read a piece from one of the in-sync copies of @primary */
+static void volume_read_piece(storage_volume_t *vol, volume_io_t *io,
+                              uint32_t primary, uint64_t extent_offset,
+                              uint64_t done, uint64_t len)
+{
+    storage_pool_t *pool = vol->pool;
+    uint32_t extents[VOLUME_MAX_COPIES];
+    bool behind;
+    uint32_t count = extent_in_sync(pool, primary, extents, false, &behind);
+    
+    if (behind) {
+        volume_park(vol, io, primary, extent_offset, done, len);
+        return;
+    }
+    if (count <= 1) {
+        extent_info_t *ext = &pool->extents[count ? extents[0] : primary];
+        volume_issue(io, NULL, NULL, 0, ext->device_id,
+                     ext->device_offset + extent_offset, done, len);
+        return;
+    }
+    
+    volume_read_t *read = kmalloc(sizeof(volume_read_t), GFP_KERNEL | GFP_ZERO);
+    if (!read) {
+        io->status = -1;
+        return;
+    }
+    
+    read->io = io;
+    memcpy(read->extents, extents, sizeof(extents));
+    read->count = count;
+    read->refs = 1;
+    read->hedge_copy = VOLUME_MAX_COPIES;
+    read->bounced = vol->hedge_us && len <= POOL_HEDGE_MAX;
+    read->extent_offset = extent_offset;
+    read->done = done;
+    read->len = len;
+    __sync_fetch_and_add(&io->pending, 1);
+    
+    /* The hedge list keeps both the read and its request */
+    if (read->bounced) {
+        read->deadline = rdtsc_us() + vol->hedge_us;
+        read->refs++;
+        __sync_fetch_and_add(&io->refs, 1);
+        
+        spinlock_acquire(&vol->hedge_lock);
+        if (vol->hedging_tail) {
+            vol->hedging_tail->next = read;
+        } else {
+            vol->hedging = read;
+            ktimer_arm(&vol->hedge_timer, vol->hedge_us);
+        }
+        vol->hedging_tail = read;
+        spinlock_release(&vol->hedge_lock);
+    }
+    
+    volume_read_next(read, false);
+    volume_read_put(read);
+}
+
+static int volume_alloc_extent(storage_volume_t *vol, uint32_t extent_idx,
+                               uint32_t *pool_extent);
+
+/*
+ * Volume extent holding @offset; *@extent_offset is where in it, and
+ * *@len is cut short at the end of the stripe unit
+ */
+static uint32_t volume_locate(storage_volume_t *vol, uint64_t offset,
+                              uint64_t *extent_offset, uint64_t *len)
+{
+    uint64_t group_size = (uint64_t)vol->stripe_width * POOL_EXTENT_SIZE;
+    uint64_t in_group = offset % group_size;
+    uint64_t unit = in_group / vol->stripe_unit;
+    uint64_t in_unit = in_group % vol->stripe_unit;
+    
+    *extent_offset = unit / vol->stripe_width * vol->stripe_unit + in_unit;
+    *len = MIN(*len, vol->stripe_unit - in_unit);
+    return (uint32_t)(offset / group_size * vol->stripe_width +
+                      unit % vol->stripe_width);
+}
+
+/* Pool extent behind a volume extent; 0 if unallocated */
+static int volume_map(storage_volume_t *vol, uint32_t extent_idx, bool write,
+                      uint32_t *pool_extent)
+{
+    storage_pool_t *pool = vol->pool;
+    
+    *pool_extent = vol->extent_map[extent_idx];
+    
+    /* Handle thin provisioning - allocate on write */
+    if (*pool_extent == 0 && write) {
+        spinlock_acquire(&pool->lock);
+        
+        /* Another hardware queue may have allocated it meanwhile */
+        *pool_extent = vol->extent_map[extent_idx];
+        if (*pool_extent == 0) {
+            if (volume_alloc_extent(vol, extent_idx, pool_extent) != 0) {
+                spinlock_release(&pool->lock);
+                return -1;
+            }
+            vol->allocated += POOL_EXTENT_SIZE;
+        }
+        
+        spinlock_release(&pool->lock);
+    }
+    
+    return 0;
+}
+
+/*
+ * Requests are split at extent boundaries, since neighbouring volume
+ * extents can be anywhere in the pool, and at stripe units. The pieces,
+ * and the copies of written pieces on replicas, are issued at once, so
+ * a request spanning a stripe group keeps each of its devices busy; it
+ * completes when all pieces have, or for writes, a quorum of each
+ * piece's copies.
+ */
 static int volume_submit(block_device_t *dev, block_request_t *req)
 {
     storage_volume_t *vol = (storage_volume_t *)dev->priv;
     storage_pool_t *pool = vol->pool;
     
     if (!vol->online || pool->state == POOL_STATE_OFFLINE) {
-        req->status = -1;
-        if (req->completion) req->completion(req->completion_ctx, -1);
         return -1;
     }
     
-    /* Calculate extent */
-    uint32_t extent_idx = req->offset / POOL_EXTENT_SIZE;
-    uint64_t extent_offset = req->offset % POOL_EXTENT_SIZE;
-    
-    if (extent_idx >= vol->num_extents) {
-        req->status = -1;
-        if (req->completion) req->completion(req->completion_ctx, -1);
+    if (req->offset + req->length > vol->size) {
         return -1;
     }
     
-    uint32_t pool_extent = vol->extent_map[extent_idx];
-    
-    /* Handle thin provisioning - allocate on write */
-    if (pool_extent == 0 && req->op == BLOCK_OP_WRITE) {
-        if (pool_alloc_extent(pool, &pool_extent) != 0) {
-            req->status = -1;
-            if (req->completion) req->completion(req->completion_ctx, -1);
-            return -1;
-        }
-        vol->extent_map[extent_idx] = pool_extent;
-        vol->allocated += POOL_EXTENT_SIZE;
+    if (req->op != BLOCK_OP_READ && req->op != BLOCK_OP_WRITE &&
+        req->op != BLOCK_OP_FLUSH) {
+        block_complete(req, 0);
+        return 0;
     }
     
-    /* Unallocated read returns zeros */
-    if (pool_extent == 0 && req->op == BLOCK_OP_READ) {
-        memset(req->buffer, 0, req->length);
-        req->status = 0;
-        if (req->completion) req->completion(req->completion_ctx, 0);
+    volume_io_t *io = kmalloc(sizeof(volume_io_t), GFP_KERNEL | GFP_ZERO);
+    if (!io) return -1;
+    
+    io->parent = req;
+    io->vol = vol;
+    io->pending = 1;
+    io->refs = 1;
+    
+    if (req->op == BLOCK_OP_FLUSH) {
+        for (uint32_t i = 0; i < pool->device_count; i++) {
+            volume_issue(io, NULL, NULL, 0, i, 0, 0, 0);
+        }
+        volume_io_done(io, 0);
+        volume_io_put(io);
         return 0;
     }
     
-    /* Get physical location */
-    extent_info_t *ext = &pool->extents[pool_extent];
-    block_device_t *phys_dev = pool->devices[ext->device_id];
-    uint64_t phys_offset = ext->device_offset + extent_offset;
+    for (uint64_t done = 0; done < req->length; ) {
+        uint64_t extent_offset;
+        uint64_t len = req->length - done;
+        uint32_t extent_idx = volume_locate(vol, req->offset + done,
+                                            &extent_offset, &len);
+        uint32_t pool_extent;
+        
+        if (volume_map(vol, extent_idx, req->op == BLOCK_OP_WRITE, &pool_extent) != 0) {
+            io->status = -1;
+            break;
+        }
+        
+        /* Unallocated read returns zeros */
+        if (pool_extent == 0 && req->op == BLOCK_OP_READ) {
+            block_iov_zero(req, done, len);
+            done += len;
+            continue;
+        }
+        
+        if (req->op == BLOCK_OP_WRITE) {
+            volume_write_piece(vol, io, pool_extent, extent_offset, done, len);
+        } else {
+            volume_read_piece(vol, io, pool_extent, extent_offset, done, len);
+        }
+        
+        done += len;
+    }
     
-    /* Perform I/O */
-    int ret = 0;
     if (req->op == BLOCK_OP_READ) {
-        ret = block_read(phys_dev, phys_offset, req->buffer, req->length);
         pool->read_ops++;
         pool->read_bytes += req->length;
-    } else if (req->op == BLOCK_OP_WRITE) {
-        ret = block_write(phys_dev, phys_offset, req->buffer, req->length);
-        
-        /* Write to replicas */
-        for (uint32_t r = 0; r < ext->replica_count; r++) {
-            uint32_t rep_ext = ext->replica_extents[r];
-            extent_info_t *rep = &pool->extents[rep_ext];
-            block_device_t *rep_dev = pool->devices[rep->device_id];
-            uint64_t rep_offset = rep->device_offset + extent_offset;
-            block_write(rep_dev, rep_offset, req->buffer, req->length);
-        }
-        
+    } else {
         pool->write_ops++;
         pool->write_bytes += req->length;
     }
     
-    req->status = ret;
-    if (req->completion) req->completion(req->completion_ctx, ret);
-    
-    return ret;
+    volume_io_done(io, 0);
+    volume_io_put(io);
+    return 0;
 }
 
 static int volume_flush(block_device_t *dev)
@@ -120,32 +838,149 @@ static const block_ops_t volume_ops = {
  * Extent Management
  * ============================================================================ */
 
-int pool_alloc_extent(storage_pool_t *pool, uint32_t *extent_id)
+#define EXTENT_NONE     POOL_MAX_EXTENTS
+
+static void map_set_free(storage_pool_t *pool, uint32_t id)
+{
+    uint32_t word = id / 64;
+    
+    pool->free_map[word] |= 1ULL << (id % 64);
+    pool->free_summary[word / 64] |= 1ULL << (word % 64);
+    pool->free_top |= 1ULL << (word / 64);
+}
+
+static void map_clear(storage_pool_t *pool, uint32_t id)
+{
+    uint32_t word = id / 64;
+    
+    pool->free_map[word] &= ~(1ULL << (id % 64));
+    if (pool->free_map[word]) return;
+    
+    pool->free_summary[word / 64] &= ~(1ULL << (word % 64));
+    if (pool->free_summary[word / 64]) return;
+    
+    pool->free_top &= ~(1ULL << (word / 64));
+}
+
+static bool map_is_free(storage_pool_t *pool, uint32_t id)
+{
+    return pool->free_map[id / 64] & (1ULL << (id % 64));
+}
+
+/* First free extent at or after @from, or EXTENT_NONE */
+static uint32_t map_next_free(storage_pool_t *pool, uint32_t from)
+{
+    if (from >= POOL_MAX_EXTENTS) return EXTENT_NONE;
+    
+    /* Rest of the word @from is in */
+    uint32_t word = from / 64;
+    uint64_t bits = pool->free_map[word] & (~0ULL << (from % 64));
+    if (bits) {
+        return word * 64 + __builtin_ctzll(bits);
+    }
+    
+    /* Rest of its summary word */
+    if (++word >= POOL_MAP_WORDS) return EXTENT_NONE;
+    uint32_t sum = word / 64;
+    bits = pool->free_summary[sum] & (~0ULL << (word % 64));
+    
+    /* Any later summary word */
+    if (!bits) {
+        if (++sum >= POOL_SUMMARY_WORDS) return EXTENT_NONE;
+        uint64_t top = pool->free_top & (~0ULL << sum);
+        if (!top) return EXTENT_NONE;
+        sum = __builtin_ctzll(top);
+        bits = pool->free_summary[sum];
+    }
+    
+    word = sum * 64 + __builtin_ctzll(bits);
+    return word * 64 + __builtin_ctzll(pool->free_map[word]);
+}
+
+/* Caller holds pool->lock or has the pool to itself */
+static void extent_take(storage_pool_t *pool, uint32_t id)
+{
+    extent_info_t *ext = &pool->extents[id];
+    
+    ext->state = EXTENT_ALLOCATED;
+    map_clear(pool, id);
+    pool->free_extents--;
+    pool->device_free[ext->device_id]--;
+}
+
+/* Free extent from @hint on, wrapping around */
+static uint32_t extent_find(storage_pool_t *pool, uint32_t hint)
+{
+    uint32_t id = map_next_free(pool, hint);
+    
+    if (id == EXTENT_NONE && hint) {
+        id = map_next_free(pool, 0);
+    }
+    return id;
+}
+
+int pool_alloc_extent_hint(storage_pool_t *pool, uint32_t hint,
+                           uint32_t *extent_id)
 {
     if (pool->free_extents == 0) {
         return -1;
     }
     
-    /* Find free extent */
-    for (uint32_t i = pool->next_extent; i < pool->total_extents; i++) {
-        if (pool->extents[i].state == EXTENT_FREE) {
-            pool->extents[i].state = EXTENT_ALLOCATED;
-            pool->free_extents--;
-            pool->next_extent = i + 1;
-            *extent_id = i;
-            return 0;
-        }
+    uint32_t id = extent_find(pool, hint < pool->total_extents ? hint : 0);
+    if (id == EXTENT_NONE) {
+        return -1;
+    }
+    
+    extent_take(pool, id);
+    pool->next_extent = id + 1;
+    *extent_id = id;
+    return 0;
+}
+
+int pool_alloc_extent(storage_pool_t *pool, uint32_t *extent_id)
+{
+    return pool_alloc_extent_hint(pool, pool->next_extent, extent_id);
+}
+
+int pool_alloc_extent_run(storage_pool_t *pool, uint32_t count, uint32_t hint,
+                          uint32_t *first)
+{
+    if (count == 0 || count > pool->free_extents) {
+        return -1;
+    }
+    if (hint >= pool->total_extents) {
+        hint = 0;
     }
     
-    /* Wrap around */
-    for (uint32_t i = 1; i < pool->next_extent; i++) {
-        if (pool->extents[i].state == EXTENT_FREE) {
-            pool->extents[i].state = EXTENT_ALLOCATED;
-            pool->free_extents--;
-            pool->next_extent = i + 1;
-            *extent_id = i;
-            return 0;
+    /* From the hint to the end, then from the start */
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t from = pass ? 0 : hint;
+        
+        while (true) {
+            uint32_t start = map_next_free(pool, from);
+            if (start == EXTENT_NONE) break;
+            
+            /* Runs stop where the next device's extents begin */
+            uint32_t dev = pool->extents[start].device_id;
+            uint32_t end = start + 1;
+            while (end - start < count && end < pool->total_extents &&
+                   map_is_free(pool, end) &&
+                   pool->extents[end].device_id == dev) {
+                end++;
+            }
+            
+            if (end - start == count) {
+                for (uint32_t i = start; i < end; i++) {
+                    extent_take(pool, i);
+                }
+                pool->next_extent = end;
+                *first = start;
+                return 0;
+            }
+            from = end;
         }
+        
+        if (hint == 0) break;
     }
     
     return -1;
@@ -153,36 +988,95 @@ int pool_alloc_extent(storage_pool_t *pool, uint32_t *extent_id)
 
 void pool_free_extent(storage_pool_t *pool, uint32_t extent_id)
 {
-    if (extent_id > 0 && extent_id < pool->total_extents) {
-        pool->extents[extent_id].state = EXTENT_FREE;
-        pool->extents[extent_id].volume_id = 0;
-        pool->free_extents++;
+    if (extent_id == 0 || extent_id >= pool->total_extents) return;
+    
+    extent_info_t *ext = &pool->extents[extent_id];
+    if (ext->state != EXTENT_ALLOCATED) return;
+    
+    ext->state = EXTENT_FREE;
+    ext->volume_id = 0;
+    ext->replica_count = 0;
+    if (ext->stale) {
+        ext->stale = 0;
+        pool->stale_extents--;
     }
+    map_set_free(pool, extent_id);
+    pool->free_extents++;
+    pool->device_free[ext->device_id]++;
 }
 
-int pool_alloc_replicated_extent(storage_pool_t *pool, uint32_t replication,
-                                  uint32_t *extent_ids)
+int pool_alloc_extent_on(storage_pool_t *pool, uint32_t dev_idx, uint32_t hint,
+                         uint32_t *extent_id)
 {
-    uint32_t needed = replication + 1;  /* Primary + replicas */
+    if (dev_idx >= pool->device_count || !pool->device_free[dev_idx]) {
+        return -1;
+    }
     
-    if (pool->free_extents < needed) {
+    uint32_t first = pool->device_first[dev_idx];
+    if (hint < first || hint >= pool->total_extents ||
+        pool->extents[hint].device_id != dev_idx) {
+        hint = first;
+    }
+    
+    /* The device's extents are contiguous; wrap to its first one */
+    uint32_t id = map_next_free(pool, hint);
+    if ((id == EXTENT_NONE || pool->extents[id].device_id != dev_idx) &&
+        hint != first) {
+        id = map_next_free(pool, first);
+    }
+    if (id == EXTENT_NONE || pool->extents[id].device_id != dev_idx) {
         return -1;
     }
     
-    /* Allocate primary */
-    if (pool_alloc_extent(pool, &extent_ids[0]) != 0) {
+    extent_take(pool, id);
+    *extent_id = id;
+    return 0;
+}
+
+/* Replicas for the primary in extent_ids[0]; all are freed on failure */
+static int extent_add_replicas(storage_pool_t *pool, uint32_t replication,
+                               uint32_t *extent_ids)
+{
+    if (pool->free_extents < replication) {
+        pool_free_extent(pool, extent_ids[0]);
         return -1;
     }
     
     /* Allocate replicas on different devices if possible */
     for (uint32_t r = 1; r <= replication; r++) {
-        if (pool_alloc_extent(pool, &extent_ids[r]) != 0) {
+        uint32_t best = POOL_MAX_DEVICES;
+        bool best_unused = false;
+        
+        for (uint32_t d = 0; d < pool->device_count; d++) {
+            if (!pool->device_free[d]) continue;
+            
+            bool unused = true;
+            for (uint32_t i = 0; i < r; i++) {
+                if (pool->extents[extent_ids[i]].device_id == d) {
+                    unused = false;
+                    break;
+                }
+            }
+            
+            if (best == POOL_MAX_DEVICES || (unused && !best_unused) ||
+                (unused == best_unused &&
+                 pool->device_free[d] > pool->device_free[best])) {
+                best = d;
+                best_unused = unused;
+            }
+        }
+        
+        uint32_t id = best < POOL_MAX_DEVICES
+                    ? extent_find(pool, pool->device_first[best]) : EXTENT_NONE;
+        if (id == EXTENT_NONE) {
             /* Rollback */
             for (uint32_t i = 0; i < r; i++) {
                 pool_free_extent(pool, extent_ids[i]);
             }
             return -1;
         }
+        extent_take(pool, id);
+        extent_ids[r] = id;
         
         /* Link replica to primary */
         pool->extents[extent_ids[0]].replica_extents[r-1] = extent_ids[r];
@@ -193,6 +1087,23 @@ int pool_alloc_replicated_extent(storage_pool_t *pool, uint32_t replication,
     return 0;
 }
 
+int pool_alloc_replicated_extent(storage_pool_t *pool, uint32_t replication,
+                                  uint32_t *extent_ids)
+{
+    uint32_t needed = replication + 1;  /* Primary + replicas */
+    
+    if (pool->free_extents < needed) {
+        return -1;
+    }
+    
+    /* Allocate primary */
+    if (pool_alloc_extent(pool, &extent_ids[0]) != 0) {
+        return -1;
+    }
+    
+    return extent_add_replicas(pool, replication, extent_ids);
+}
+
 /* ============================================================================
  * Pool Management
  * ============================================================================ */
@@ -207,6 +1118,7 @@ storage_pool_t *pool_create(const char *name)
     pool->id = next_pool_id++;
     
     pool->state = POOL_STATE_OFFLINE;
+    spinlock_init(&pool->lock);
     pool->default_replication = POOL_REPL_NONE;
     pool->default_thin = true;
     
@@ -261,6 +1173,13 @@ int pool_add_device(storage_pool_t *pool, block_device_t *dev)
     /* Calculate extents from this device */
     uint64_t dev_extents = dev->size / POOL_EXTENT_SIZE;
     uint32_t old_total = pool->total_extents;
+    if (dev_extents > POOL_MAX_EXTENTS - old_total) {
+        dev_extents = POOL_MAX_EXTENTS - old_total;
+    }
+    if (dev_extents == 0) {
+        pool->device_count--;
+        return -1;
+    }
     uint32_t new_total = old_total + dev_extents;
     
     /* Reallocate extent array */
@@ -277,17 +1196,26 @@ int pool_add_device(storage_pool_t *pool, block_device_t *dev)
     }
     pool->extents = new_extents;
     
-    /* Initialize new extents */
+    /* Initialize new extents; extent 0 means "unallocated" to volumes */
     uint64_t offset = 0;
+    pool->device_first[dev_idx] = old_total;
+    pool->device_free[dev_idx] = 0;
     for (uint32_t i = old_total; i < new_total; i++) {
-        pool->extents[i].state = EXTENT_FREE;
         pool->extents[i].device_id = dev_idx;
         pool->extents[i].device_offset = offset;
         offset += POOL_EXTENT_SIZE;
+        
+        if (i == 0) {
+            pool->extents[i].state = EXTENT_RESERVED;
+            continue;
+        }
+        pool->extents[i].state = EXTENT_FREE;
+        map_set_free(pool, i);
+        pool->device_free[dev_idx]++;
     }
     
     pool->total_extents = new_total;
-    pool->free_extents += dev_extents;
+    pool->free_extents += pool->device_free[dev_idx];
     pool->total_size += dev_extents * POOL_EXTENT_SIZE;
     pool->free_size = pool->free_extents * POOL_EXTENT_SIZE;
     
@@ -323,9 +1251,29 @@ int pool_remove_device(storage_pool_t *pool, block_device_t *dev)
         }
     }
     
+    /* Its extents stay in the array, never to be allocated again */
+    for (uint32_t i = 0; i < pool->total_extents; i++) {
+        extent_info_t *ext = &pool->extents[i];
+        
+        if (ext->device_id == (uint32_t)dev_idx) {
+            if (ext->state == EXTENT_FREE) {
+                ext->state = EXTENT_RESERVED;
+                map_clear(pool, i);
+                pool->free_extents--;
+            }
+        } else if (ext->device_id > (uint32_t)dev_idx) {
+            ext->device_id--;
+        }
+    }
+    pool->free_size = pool->free_extents * POOL_EXTENT_SIZE;
+    
     /* Remove device */
     for (uint32_t i = dev_idx; i < pool->device_count - 1; i++) {
         pool->devices[i] = pool->devices[i + 1];
+        pool->device_first[i] = pool->device_first[i + 1];
+        pool->device_free[i] = pool->device_free[i + 1];
+        pool->device_reads[i] = pool->device_reads[i + 1];
+        pool->device_read_us[i] = pool->device_read_us[i + 1];
     }
     pool->device_count--;
     
@@ -343,15 +1291,95 @@ int pool_get_status(storage_pool_t *pool)
  * Volume Management
  * ============================================================================ */
 
+/* Free a volume's extent and its replicas */
+static void volume_free_extent(storage_pool_t *pool, uint32_t pool_extent)
+{
+    extent_info_t *ext = &pool->extents[pool_extent];
+    
+    for (uint32_t r = 0; r < ext->replica_count; r++) {
+        pool_free_extent(pool, ext->replica_extents[r]);
+    }
+    pool_free_extent(pool, pool_extent);
+}
+
+/*
+ * Allocate volume extent @extent_idx and its replicas. Striped volumes
+ * go round-robin across devices, each column after its extent in the
+ * previous stripe group; others right after the extent before. Caller
+ * holds pool->lock or has the pool to itself.
+ */
+static int volume_alloc_extent(storage_volume_t *vol, uint32_t extent_idx,
+                               uint32_t *pool_extent)
+{
+    storage_pool_t *pool = vol->pool;
+    uint32_t width = vol->stripe_width;
+    uint32_t ext_ids[4];
+    
+    if (pool->free_extents < vol->replication + 1) {
+        return -1;
+    }
+    
+    if (width > 1) {
+        uint32_t dev = (vol->stripe_start + extent_idx) % pool->device_count;
+        uint32_t hint = extent_idx >= width && vol->extent_map[extent_idx - width]
+                      ? vol->extent_map[extent_idx - width] + 1 : 0;
+        
+        /* A full device costs the stripe a column, not the write */
+        if (pool_alloc_extent_on(pool, dev, hint, &ext_ids[0]) != 0 &&
+            pool_alloc_extent(pool, &ext_ids[0]) != 0) {
+            return -1;
+        }
+    } else {
+        uint32_t hint = extent_idx > 0 && vol->extent_map[extent_idx - 1]
+                      ? vol->extent_map[extent_idx - 1] + 1 : pool->next_extent;
+        
+        if (pool_alloc_extent_hint(pool, hint, &ext_ids[0]) != 0) {
+            return -1;
+        }
+    }
+    
+    if (extent_add_replicas(pool, vol->replication, ext_ids) != 0) {
+        return -1;
+    }
+    
+    pool->extents[ext_ids[0]].volume_id = vol->id;
+    pool->extents[ext_ids[0]].volume_offset = (uint64_t)extent_idx * POOL_EXTENT_SIZE;
+    vol->extent_map[extent_idx] = ext_ids[0];
+    *pool_extent = ext_ids[0];
+    return 0;
+}
+
 storage_volume_t *volume_create(storage_pool_t *pool, const char *name,
                                  uint64_t size, uint32_t replication, bool thin)
+{
+    return volume_create_striped(pool, name, size, replication, thin, 1, 0);
+}
+
+storage_volume_t *volume_create_striped(storage_pool_t *pool, const char *name,
+                                        uint64_t size, uint32_t replication,
+                                        bool thin, uint32_t stripe_width,
+                                        uint32_t stripe_unit)
 {
     if (!pool || pool->state == POOL_STATE_OFFLINE) {
         return NULL;
     }
     
-    /* Calculate required extents */
+    if (stripe_width <= 1) {
+        stripe_width = 1;
+        stripe_unit = POOL_EXTENT_SIZE;
+    } else if (stripe_unit == 0) {
+        stripe_unit = POOL_STRIPE_UNIT_DEFAULT;
+    }
+    if (stripe_width > pool->device_count ||
+        stripe_unit < POOL_STRIPE_UNIT_MIN || stripe_unit > POOL_EXTENT_SIZE ||
+        (stripe_unit & (stripe_unit - 1))) {
+        pr_error("Pool: Invalid stripe %u x %u", stripe_width, stripe_unit);
+        return NULL;
+    }
+    
+    /* Calculate required extents, in whole stripe groups */
     uint32_t num_extents = (size + POOL_EXTENT_SIZE - 1) / POOL_EXTENT_SIZE;
+    num_extents = (num_extents + stripe_width - 1) / stripe_width * stripe_width;
     uint32_t needed = num_extents * (replication + 1);
     
     if (!thin && pool->free_extents < needed) {
@@ -366,11 +1394,23 @@ storage_volume_t *volume_create(storage_pool_t *pool, const char *name,
     block_generate_uuid(vol->uuid);
     vol->id = next_volume_id++;
     
-    vol->size = num_extents * POOL_EXTENT_SIZE;
+    vol->size = (uint64_t)num_extents * POOL_EXTENT_SIZE;
     vol->replication = replication;
     vol->thin_provisioned = thin;
     vol->pool = pool;
     vol->num_extents = num_extents;
+    vol->stripe_width = stripe_width;
+    vol->stripe_unit = stripe_unit;
+    vol->read_policy = POOL_READ_BALANCE;
+    spinlock_init(&vol->hedge_lock);
+    ktimer_init(&vol->hedge_timer, volume_hedge_timer, vol);
+    
+    /* Start on the emptiest device */
+    for (uint32_t d = 1; d < pool->device_count; d++) {
+        if (pool->device_free[d] > pool->device_free[vol->stripe_start]) {
+            vol->stripe_start = d;
+        }
+    }
     
     /* Allocate extent map */
     vol->extent_map = kmalloc(num_extents * sizeof(uint32_t), GFP_KERNEL | GFP_ZERO);
@@ -379,22 +1419,29 @@ storage_volume_t *volume_create(storage_pool_t *pool, const char *name,
         return NULL;
     }
     
-    /* Pre-allocate if not thin */
+    /* Pre-allocate if not thin, in one run if there is one */
     if (!thin) {
+        uint32_t first = 0;
+        bool run = stripe_width == 1 && replication == POOL_REPL_NONE &&
+                   pool_alloc_extent_run(pool, num_extents, pool->next_extent,
+                                         &first) == 0;
+        
         for (uint32_t i = 0; i < num_extents; i++) {
-            uint32_t ext_ids[4];
-            if (pool_alloc_replicated_extent(pool, replication, ext_ids) != 0) {
+            uint32_t pool_extent;
+            if (run) {
+                pool_extent = first + i;
+                pool->extents[pool_extent].volume_id = vol->id;
+                pool->extents[pool_extent].volume_offset = (uint64_t)i * POOL_EXTENT_SIZE;
+                vol->extent_map[i] = pool_extent;
+            } else if (volume_alloc_extent(vol, i, &pool_extent) != 0) {
                 /* Rollback */
                 for (uint32_t j = 0; j < i; j++) {
-                    pool_free_extent(pool, vol->extent_map[j]);
+                    volume_free_extent(pool, vol->extent_map[j]);
                 }
                 kfree(vol->extent_map);
                 kfree(vol);
                 return NULL;
             }
-            vol->extent_map[i] = ext_ids[0];
-            pool->extents[ext_ids[0]].volume_id = vol->id;
-            pool->extents[ext_ids[0]].volume_offset = i * POOL_EXTENT_SIZE;
         }
         vol->allocated = vol->size;
         pool->used_size += vol->size;
@@ -409,6 +1456,8 @@ storage_volume_t *volume_create(storage_pool_t *pool, const char *name,
     vol->blkdev.num_blocks = vol->size / BLOCK_DEFAULT_SIZE;
     vol->blkdev.ops = &volume_ops;
     vol->blkdev.priv = vol;
+    vol->blkdev.nr_hw_queues = block_hw_queues_per_cpu();
+    vol->blkdev.io_boundary = (uint64_t)stripe_width * POOL_EXTENT_SIZE;  /* Stripe groups map apart */
     
     vol->online = true;
     
@@ -420,13 +1469,21 @@ storage_volume_t *volume_create(storage_pool_t *pool, const char *name,
     /* Register block device */
     block_register(&vol->blkdev);
     
-    pr_info("Pool: Created volume '%s' (%llu MB, %s)",
+    pr_info("Pool: Created volume '%s' (%llu MB, %s, stripe %u x %u KB)",
             vol->name, vol->size / MB,
-            thin ? "thin" : "thick");
+            thin ? "thin" : "thick", stripe_width, stripe_unit / KB);
     
     return vol;
 }
 
+static void volume_drop_cache(storage_volume_t *vol)
+{
+    if (vol->cache) {
+        block_cache_destroy(vol->cache);
+        vol->cache = NULL;
+    }
+}
+
 void volume_destroy(storage_volume_t *vol)
 {
     if (!vol) return;
@@ -434,17 +1491,34 @@ void volume_destroy(storage_volume_t *vol)
     storage_pool_t *pool = vol->pool;
     
     /* Unregister block device */
+    volume_drop_cache(vol);
     block_unregister(&vol->blkdev);
     
+    /* Reads done before their hedge was due */
+    ktimer_cancel(&vol->hedge_timer);
+    while (vol->hedging) {
+        volume_read_t *read = vol->hedging;
+        volume_io_t *io = read->io;
+        vol->hedging = read->next;
+        volume_read_put(read);
+        volume_io_put(io);
+    }
+    vol->hedging_tail = NULL;
+    
+    /* Reads still waiting for a copy that will not catch up now */
+    while (vol->parked) {
+        volume_read_t *read = vol->parked;
+        volume_io_t *io = read->io;
+        vol->parked = read->next;
+        volume_io_done(io, -1);
+        volume_io_put(io);
+        kfree(read);
+    }
+    
     /* Free extents */
     for (uint32_t i = 0; i < vol->num_extents; i++) {
         if (vol->extent_map[i] != 0) {
-            extent_info_t *ext = &pool->extents[vol->extent_map[i]];
-            /* Free replicas */
-            for (uint32_t r = 0; r < ext->replica_count; r++) {
-                pool_free_extent(pool, ext->replica_extents[r]);
-            }
-            pool_free_extent(pool, vol->extent_map[i]);
+            volume_free_extent(pool, vol->extent_map[i]);
         }
     }
     
@@ -473,6 +1547,8 @@ int volume_resize(storage_volume_t *vol, uint64_t new_size)
     if (!vol) return -1;
     
     uint32_t new_extents = (new_size + POOL_EXTENT_SIZE - 1) / POOL_EXTENT_SIZE;
+    new_extents = (new_extents + vol->stripe_width - 1) / vol->stripe_width *
+                  vol->stripe_width;
     
     if (new_extents == vol->num_extents) {
         return 0;
@@ -495,6 +1571,10 @@ int volume_resize(storage_volume_t *vol, uint64_t new_size)
     vol->size = new_extents * POOL_EXTENT_SIZE;
     vol->blkdev.size = vol->size;
     vol->blkdev.num_blocks = vol->size / BLOCK_DEFAULT_SIZE;
+    if (vol->cache) {
+        vol->cache->blkdev.size = vol->blkdev.size;
+        vol->cache->blkdev.num_blocks = vol->blkdev.num_blocks;
+    }
     
     pr_info("Pool: Resized volume '%s' to %llu MB", vol->name, vol->size / MB);
     
@@ -505,9 +1585,16 @@ storage_volume_t *volume_snapshot(storage_volume_t *vol, const char *name)
 {
     if (!vol) return NULL;
     
+    /* The snapshot shares what is on disk */
+    if (vol->cache) {
+        block_flush(&vol->cache->blkdev);
+    }
+    
     /* Create COW snapshot - simplified implementation */
-    storage_volume_t *snap = volume_create(vol->pool, name, vol->size, 
-                                            vol->replication, true);
+    storage_volume_t *snap = volume_create_striped(vol->pool, name, vol->size,
+                                                   vol->replication, true,
+                                                   vol->stripe_width,
+                                                   vol->stripe_unit);
     if (!snap) return NULL;
     
     /* Copy extent map (for COW, would mark as shared) */
@@ -521,5 +1608,149 @@ storage_volume_t *volume_snapshot(storage_volume_t *vol, const char *name)
 
 block_device_t *volume_get_block_device(storage_volume_t *vol)
 {
-    return vol ? &vol->blkdev : NULL;
+    if (!vol) return NULL;
+    
+    return vol->cache ? &vol->cache->blkdev : &vol->blkdev;
+}
+
+bool volume_is_attached(storage_volume_t *vol)
+{
+    return vol->blkdev.users || (vol->cache && vol->cache->blkdev.users);
+}
+
+int volume_set_cache(storage_volume_t *vol, const block_cache_config_t *cfg)
+{
+    if (!vol || volume_is_attached(vol)) return -1;
+    
+    volume_drop_cache(vol);
+    if (!cfg) return 0;
+    
+    vol->cache = block_cache_create(&vol->blkdev, cfg);
+    return vol->cache ? 0 : -1;
+}
+
+int volume_set_write_quorum(storage_volume_t *vol, uint32_t quorum)
+{
+    if (!vol || quorum > vol->replication + 1) return -1;
+    
+    vol->write_quorum = quorum;
+    return 0;
+}
+
+int volume_set_read_policy(storage_volume_t *vol, uint32_t policy,
+                           uint32_t hedge_us)
+{
+    if (!vol || policy > POOL_READ_PRIMARY) return -1;
+    
+    vol->read_policy = policy;
+    vol->hedge_us = hedge_us;
+    return 0;
+}
+
+#define RESYNC_CHUNK    (64 * KB)
+#define RESYNC_RETRIES  8       /* Copies of a chunk overtaken by writes */
+
+/* Wait out the volume writes to @ext's copies */
+static void extent_quiesce(storage_pool_t *pool, extent_info_t *ext)
+{
+    while (ext->writes) {
+        for (uint32_t d = 0; d < pool->device_count; d++) {
+            block_poll(pool->devices[d]);
+        }
+        ktimer_run();
+        pause();
+        barrier();
+    }
+}
+
+/*
+ * Rewrite @dst from @src, a chunk at a time. A write begun while a
+ * chunk was copied may have reached @dst before the older data did,
+ * so that chunk is copied again.
+ */
+static int extent_copy(storage_pool_t *pool, extent_info_t *src,
+                       extent_info_t *dst, uint8_t *buf)
+{
+    for (uint64_t off = 0; off < POOL_EXTENT_SIZE; off += RESYNC_CHUNK) {
+        uint32_t tries = 0;
+        uint32_t seq;
+        
+        do {
+            if (tries++ == RESYNC_RETRIES) return -1;
+            
+            extent_quiesce(pool, src);
+            seq = src->write_seq;
+            if (block_read(pool->devices[src->device_id], src->device_offset + off,
+                           buf, RESYNC_CHUNK) != 0 ||
+                block_write(pool->devices[dst->device_id], dst->device_offset + off,
+                            buf, RESYNC_CHUNK) != 0) {
+                return -1;
+            }
+            barrier();
+        } while (src->write_seq != seq);
+    }
+    return 0;
+}
+
+int volume_resync(storage_volume_t *vol)
+{
+    if (!vol) return -1;
+    
+    storage_pool_t *pool = vol->pool;
+    int stale = 0;
+    
+    uint8_t *buf = kmalloc(RESYNC_CHUNK, GFP_KERNEL);
+    if (!buf) return -1;
+    
+    for (uint32_t i = 0; i < vol->num_extents; i++) {
+        if (vol->extent_map[i] == 0) continue;
+        
+        extent_info_t *ext = &pool->extents[vol->extent_map[i]];
+        extent_info_t *copies[VOLUME_MAX_COPIES];
+        uint32_t count = 0;
+        
+        copies[count++] = ext;
+        for (uint32_t r = 0; r < ext->replica_count; r++) {
+            copies[count++] = &pool->extents[ext->replica_extents[r]];
+        }
+        
+        /* A copy lagging behind a write is no source; wait for one to finish */
+        uint32_t in_sync[VOLUME_MAX_COPIES];
+        uint32_t sources;
+        bool behind;
+        while (!(sources = extent_in_sync(pool, vol->extent_map[i], in_sync, false,
+                                          &behind)) && behind) {
+            extent_quiesce(pool, ext);
+        }
+        extent_info_t *src = sources ? &pool->extents[in_sync[0]] : NULL;
+        for (uint32_t c = 0; c < count; c++) {
+            if (copies[c]->stale == EXTENT_IN_SYNC) continue;
+            
+            /* Writes go to the copy from here on; those before are waited for */
+            if (!src || !__sync_bool_compare_and_swap(&copies[c]->stale, EXTENT_STALE,
+                                                      EXTENT_RESYNCING)) {
+                stale++;
+                continue;
+            }
+            if (extent_copy(pool, src, copies[c], buf) != 0) {
+                __sync_bool_compare_and_swap(&copies[c]->stale, EXTENT_RESYNCING,
+                                             EXTENT_STALE);
+                stale++;
+                continue;
+            }
+            
+            /* Unless a write failed on it meanwhile */
+            if (__sync_bool_compare_and_swap(&copies[c]->stale, EXTENT_RESYNCING,
+                                             EXTENT_IN_SYNC)) {
+                __sync_fetch_and_sub(&pool->stale_extents, 1);
+            } else {
+                stale++;
+            }
+        }
+    }
+    
+    kfree(buf);
+    
+    pr_info("Pool: Resynced '%s', %d copies still stale", vol->name, stale);
+    return stale;
 }
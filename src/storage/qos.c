@@ -0,0 +1,240 @@
+/*
+ * PureVisor - Block I/O QoS Implementation
+ * 
+ * Token buckets reuse the network rate limiter, with I/Os counted as
+ * packets. Latency targets are enforced across all devices with QoS:
+ * they share the pool's physical devices, so a device of lower weight
+ * gives up queue depth while one of higher weight is too slow.
+ */
+
+#include <lib/types.h>
+#include <lib/string.h>
+#include <storage/qos.h>
+#include <mm/heap.h>
+#include <kernel/console.h>
+#include <arch/x86_64/cpu.h>
+
+/* ============================================================================
+ * Global State
+ * ============================================================================ */
+
+static block_qos_t *qos_list;
+static uint64_t window_start;
+static spinlock_t qos_list_lock = SPINLOCK_INIT;
+
+static void qos_timer(void *ctx)
+{
+    block_qos_t *qos = ctx;
+    
+    block_kick(qos->dev);
+}
+
+/* Depth the device has without QoS */
+static uint32_t qos_full_depth(const block_qos_t *qos)
+{
+    block_device_t *dev = qos->dev;
+    uint32_t depth = dev->max_queue_depth ? dev->max_queue_depth
+                                          : BLOCK_DEFAULT_QUEUE_DEPTH;
+    
+    return depth * MAX(dev->nr_hw_queues, 1);
+}
+
+/* ============================================================================
+ * Latency Targets
+ * ============================================================================ */
+
+/* Caller holds qos_list_lock */
+static void qos_throttle(block_qos_t *qos)
+{
+    spinlock_acquire(&qos->lock);
+    uint32_t depth = qos->depth_limit ? qos->depth_limit : qos_full_depth(qos);
+    qos->depth_limit = MAX(depth / 2, 1);
+    spinlock_release(&qos->lock);
+}
+
+/* Caller holds qos_list_lock */
+static void qos_relax(block_qos_t *qos)
+{
+    if (!qos->depth_limit) return;
+    
+    spinlock_acquire(&qos->lock);
+    qos->depth_limit *= 2;
+    if (qos->depth_limit >= qos_full_depth(qos)) {
+        qos->depth_limit = 0;
+    }
+    spinlock_release(&qos->lock);
+    
+    /* Dispatch may end up back here; leave it to the timer */
+    ktimer_arm(&qos->timer, 0);
+}
+
+/* Caller holds qos_list_lock */
+static void qos_window(uint64_t now)
+{
+    uint32_t missed_weight = 0;
+    
+    window_start = now;
+    
+    for (block_qos_t *qos = qos_list; qos; qos = qos->next) {
+        spinlock_acquire(&qos->lock);
+        qos->latency_us = qos->lat_count ? qos->lat_sum_us / qos->lat_count : 0;
+        qos->lat_sum_us = 0;
+        qos->lat_count = 0;
+        spinlock_release(&qos->lock);
+        
+        if (qos->config.latency_target_us &&
+            qos->latency_us > qos->config.latency_target_us) {
+            qos->missed++;
+            missed_weight = MAX(missed_weight, qos->config.weight);
+        }
+    }
+    
+    for (block_qos_t *qos = qos_list; qos; qos = qos->next) {
+        if (qos->config.weight < missed_weight) {
+            qos_throttle(qos);
+        } else {
+            qos_relax(qos);
+        }
+    }
+}
+
+void block_qos_evaluate(void)
+{
+    spinlock_acquire(&qos_list_lock);
+    qos_window(rdtsc_us());
+    spinlock_release(&qos_list_lock);
+}
+
+/* ============================================================================
+ * Dispatch Hooks
+ * ============================================================================ */
+
+bool block_qos_admit(block_qos_t *qos, block_request_t *req)
+{
+    net_ratelimit_t *rl = req->op == BLOCK_OP_READ ? &qos->read_limit
+                                                   : &qos->write_limit;
+    uint64_t now = rdtsc_us();
+    bool ok = false;
+    
+    spinlock_acquire(&qos->lock);
+    
+    if (qos->depth_limit && qos->inflight >= qos->depth_limit) {
+        qos->depth_wait = true;
+    } else {
+        uint64_t wait = net_ratelimit_wait(rl, now);
+        if (wait) {
+            ktimer_arm(&qos->timer, wait);
+        } else {
+            bool data = req->op == BLOCK_OP_READ || req->op == BLOCK_OP_WRITE;
+            net_ratelimit_charge(rl, data ? req->length : 0);
+            qos->inflight++;
+            ok = true;
+        }
+    }
+    
+    if (ok) {
+        req->flags |= BLOCK_REQ_QOS;
+        req->issue_us = now;
+    } else {
+        qos->throttled++;
+    }
+    
+    spinlock_release(&qos->lock);
+    return ok;
+}
+
+bool block_qos_done(block_qos_t *qos, block_request_t *req)
+{
+    uint64_t now = rdtsc_us();
+    bool kick = false;
+    
+    req->flags &= ~BLOCK_REQ_QOS;
+    
+    spinlock_acquire(&qos->lock);
+    qos->inflight--;
+    qos->lat_sum_us += now - req->issue_us;
+    qos->lat_count++;
+    if (qos->depth_wait && qos->inflight < qos->depth_limit) {
+        qos->depth_wait = false;
+        kick = true;
+    }
+    spinlock_release(&qos->lock);
+    
+    /* Whoever gets there first closes the window */
+    if (now - window_start >= BLOCK_QOS_WINDOW_US &&
+        spinlock_try_acquire(&qos_list_lock)) {
+        if (now - window_start >= BLOCK_QOS_WINDOW_US) {
+            qos_window(now);
+        }
+        spinlock_release(&qos_list_lock);
+    }
+    
+    return kick;
+}
+
+/* ============================================================================
+ * Configuration
+ * ============================================================================ */
+
+int block_qos_set(block_device_t *dev, const block_qos_config_t *cfg)
+{
+    static const block_qos_config_t unlimited;
+    block_qos_t *qos = dev->qos;
+    
+    if (!cfg) cfg = &unlimited;
+    if (cfg->weight > BLOCK_QOS_WEIGHT_MAX) {
+        return -1;
+    }
+    
+    if (!qos) {
+        qos = kmalloc(sizeof(block_qos_t), GFP_KERNEL | GFP_ZERO);
+        if (!qos) return -1;
+        
+        qos->dev = dev;
+        spinlock_init(&qos->lock);
+        ktimer_init(&qos->timer, qos_timer, qos);
+        
+        spinlock_acquire(&qos_list_lock);
+        qos->next = qos_list;
+        qos_list = qos;
+        spinlock_release(&qos_list_lock);
+    }
+    
+    /* Requests in flight keep their accounting across the change */
+    spinlock_acquire(&qos->lock);
+    qos->config = *cfg;
+    if (!qos->config.weight) {
+        qos->config.weight = BLOCK_QOS_WEIGHT_DEFAULT;
+    }
+    net_ratelimit_init(&qos->read_limit, &qos->config.read, 1);
+    net_ratelimit_init(&qos->write_limit, &qos->config.write, 1);
+    qos->depth_limit = 0;
+    qos->depth_wait = false;
+    spinlock_release(&qos->lock);
+    
+    dev->qos = qos;
+    block_kick(dev);
+    
+    pr_info("Block: QoS for %s, weight %u, latency target %u us",
+            dev->name, qos->config.weight, qos->config.latency_target_us);
+    return 0;
+}
+
+void block_qos_remove(block_device_t *dev)
+{
+    block_qos_t *qos = dev->qos;
+    if (!qos) return;
+    
+    spinlock_acquire(&qos_list_lock);
+    for (block_qos_t **pp = &qos_list; *pp; pp = &(*pp)->next) {
+        if (*pp == qos) {
+            *pp = qos->next;
+            break;
+        }
+    }
+    spinlock_release(&qos_list_lock);
+    
+    ktimer_cancel(&qos->timer);
+    dev->qos = NULL;
+    kfree(qos);
+}
@@ -10,6 +10,11 @@
 #include <cluster/node.h>
 #include <cluster/vm.h>
 #include <cluster/scheduler.h>
+#include <mgmt/api.h>
+#include <storage/memblk.h>
+#include <net/vswitch.h>
+#include <virtio/virtio_net.h>
+#include <virtio/virtio_blk.h>
 #include <mm/heap.h>
 
 /* ============================================================================
@@ -118,10 +123,61 @@ static test_result_t test_vm_config_struct(void)
     return TEST_PASS;
 }
 
+static test_result_t test_vm_nic_qos(void)
+{
+    vm_manager_t mgr;
+    api_context_t api;
+    api_request_t req;
+    api_response_t resp;
+    vm_config_t config = {0};
+    
+    vm_manager_init(&mgr, NULL);
+    api_init(&api);
+    api.vm_manager = &mgr;
+    
+    strcpy(config.name, "qos-vm");
+    config.nic_count = 1;
+    strcpy(config.nics[0].network, "test-qos");
+    config.nics[0].enabled = true;
+    config.nics[0].tx_limit.pkts_per_sec = 1000;
+    
+    virtual_machine_t *vm = virt_vm_create(&mgr, &config);
+    TEST_ASSERT_NOT_NULL(vm);
+    TEST_ASSERT_NULL(vm->nic_devs[0]);
+    
+    /* Starting attaches the NIC with its configured limits */
+    TEST_ASSERT_EQ(virt_vm_start(&mgr, vm), 0);
+    virtio_net_t *net = vm->nic_devs[0];
+    TEST_ASSERT_NOT_NULL(net);
+    TEST_ASSERT_EQ(net->tx_rate.pkts_per_sec, 1000);
+    
+    /* Changed through the API, applied to the running device */
+    memset(&req, 0, sizeof(req));
+    req.method = API_METHOD_POST;
+    snprintf(req.path, sizeof(req.path), "/api/v1/vms/%u/qos", vm->id);
+    strcpy(req.query, "nic=0&tx_pps=500&rx_bps=1000000");
+    TEST_ASSERT_EQ(api_response_init(&resp), 0);
+    TEST_ASSERT_EQ(api_handle_request(&api, &req, &resp), 0);
+    TEST_ASSERT_EQ(resp.status, API_STATUS_OK);
+    api_response_free(&resp);
+    TEST_ASSERT_EQ(net->tx_rate.pkts_per_sec, 500);
+    TEST_ASSERT_EQ(net->rx_rate.bytes_per_sec, 1000000);
+    
+    /* Stopping detaches it; the limits stay in the configuration */
+    TEST_ASSERT_EQ(virt_vm_stop(&mgr, vm), 0);
+    TEST_ASSERT_NULL(vm->nic_devs[0]);
+    TEST_ASSERT_EQ(vm->config.nics[0].tx_limit.pkts_per_sec, 500);
+    
+    virt_vm_destroy(&mgr, vm);
+    vswitch_destroy(vswitch_find("test-qos"));
+    return TEST_PASS;
+}
+
 static test_case_t vm_tests[] = {
     {"vm_states", test_vm_states},
     {"vm_constants", test_vm_constants},
     {"vm_config_struct", test_vm_config_struct},
+    {"vm_nic_qos", test_vm_nic_qos},
 };
 
 static test_suite_t vm_suite = {
@@ -168,6 +224,134 @@ static test_suite_t scheduler_suite = {
     .test_count = sizeof(scheduler_tests) / sizeof(scheduler_tests[0]),
 };
 
+/* ============================================================================
+ * Management API Tests
+ * ============================================================================ */
+
+static test_result_t test_api_volume_list(void)
+{
+    api_context_t api;
+    api_request_t req = {0};
+    api_response_t resp;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    storage_pool_t *pool = pool_create("api");
+    TEST_ASSERT_NOT_NULL(pool);
+    block_device_t *mem = mem_block_create("api0", 8 * POOL_EXTENT_SIZE);
+    TEST_ASSERT_NOT_NULL(mem);
+    TEST_ASSERT_EQ(pool_add_device(pool, mem), 0);
+    for (int i = 0; i < 8; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "list%d", i);
+        TEST_ASSERT_NOT_NULL(volume_create(pool, name, POOL_EXTENT_SIZE, POOL_REPL_NONE, true));
+    }
+    
+    api_init(&api);
+    api.pool = pool;
+    req.method = API_METHOD_GET;
+    strcpy(req.path, "/api/v1/volumes");
+    TEST_ASSERT_EQ(api_response_init(&resp), 0);
+    
+    /* Room for part of the list: whole entries only, and marked */
+    resp.body_capacity = 1500;
+    TEST_ASSERT_EQ(api_handle_request(&api, &req, &resp), 0);
+    TEST_ASSERT(resp.body_len < resp.body_capacity);
+    TEST_ASSERT_NOT_NULL(strstr(resp.body, "\"list7\""));
+    TEST_ASSERT_NULL(strstr(resp.body, "\"list0\""));
+    TEST_ASSERT_NOT_NULL(strstr(resp.body, "}],\"truncated\":true}"));
+    
+    /* Everything fits */
+    resp.body_capacity = API_MAX_RESPONSE;
+    memset(&req, 0, sizeof(req));
+    req.method = API_METHOD_GET;
+    strcpy(req.path, "/api/v1/volumes");
+    TEST_ASSERT_EQ(api_handle_request(&api, &req, &resp), 0);
+    TEST_ASSERT_NOT_NULL(strstr(resp.body, "\"list0\""));
+    TEST_ASSERT_NULL(strstr(resp.body, "truncated"));
+    TEST_ASSERT_EQ(resp.body[resp.body_len - 1], '}');
+    
+    api_response_free(&resp);
+    pool_destroy(pool);
+    block_unregister(mem);
+    mem_block_destroy(mem);
+    return TEST_PASS;
+}
+
+/* POST to @path and give back the response status, 0 if none */
+static uint32_t api_volume_post(api_context_t *api, const char *path,
+                                const char *query)
+{
+    api_request_t req = {0};
+    api_response_t resp;
+    uint32_t status = 0;
+    
+    req.method = API_METHOD_POST;
+    strcpy(req.path, path);
+    strcpy(req.query, query);
+    if (api_response_init(&resp) != 0) return 0;
+    if (api_handle_request(api, &req, &resp) == 0) {
+        status = resp.status;
+    }
+    api_response_free(&resp);
+    return status;
+}
+
+static test_result_t test_api_volume_cache(void)
+{
+    api_context_t api;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    storage_pool_t *pool = pool_create("apicache");
+    TEST_ASSERT_NOT_NULL(pool);
+    block_device_t *mem = mem_block_create("apicache0", 2 * POOL_EXTENT_SIZE);
+    TEST_ASSERT_NOT_NULL(mem);
+    TEST_ASSERT_EQ(pool_add_device(pool, mem), 0);
+    storage_volume_t *vol = volume_create(pool, "cached", POOL_EXTENT_SIZE,
+                                          POOL_REPL_NONE, true);
+    TEST_ASSERT_NOT_NULL(vol);
+    
+    api_init(&api);
+    api.pool = pool;
+    
+    TEST_ASSERT_EQ(api_volume_post(&api, "/api/v1/volumes/cached/cache", "size_mb=1"),
+                   API_STATUS_OK);
+    block_device_t *dev = volume_get_block_device(vol);
+    TEST_ASSERT(dev != &vol->blkdev);
+    
+    /* A backend holds the cache's device: it stays put */
+    blk_backend_t *be = blk_backend_create_device(dev);
+    TEST_ASSERT_NOT_NULL(be);
+    TEST_ASSERT(volume_is_attached(vol));
+    TEST_ASSERT_EQ(api_volume_post(&api, "/api/v1/volumes/cached/cache", "size_mb=0"),
+                   API_STATUS_CONFLICT);
+    TEST_ASSERT_EQ(volume_set_cache(vol, NULL), -1);
+    TEST_ASSERT(volume_get_block_device(vol) == dev);
+    
+    blk_backend_destroy(be);
+    TEST_ASSERT(!volume_is_attached(vol));
+    TEST_ASSERT_EQ(api_volume_post(&api, "/api/v1/volumes/cached/cache", "size_mb=0"),
+                   API_STATUS_OK);
+    TEST_ASSERT(volume_get_block_device(vol) == &vol->blkdev);
+    
+    pool_destroy(pool);
+    block_unregister(mem);
+    mem_block_destroy(mem);
+    return TEST_PASS;
+}
+
+static test_case_t api_tests[] = {
+    {"api_volume_list", test_api_volume_list},
+    {"api_volume_cache", test_api_volume_cache},
+};
+
+static test_suite_t api_suite = {
+    .name = "Management API",
+    .setup = NULL,
+    .teardown = NULL,
+    .tests = api_tests,
+    .test_count = sizeof(api_tests) / sizeof(api_tests[0]),
+};
+
 /* ============================================================================
  * Suite Registration
  * ============================================================================ */
@@ -177,4 +361,5 @@ void test_cluster_suite(void)
     test_register_suite(&node_suite);
     test_register_suite(&vm_suite);
     test_register_suite(&scheduler_suite);
+    test_register_suite(&api_suite);
 }
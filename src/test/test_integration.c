@@ -159,6 +159,7 @@ int run_all_tests(void)
     test_paging_suite();
     test_vmx_suite();
     test_storage_suite();
+    test_net_suite();
     test_cluster_suite();
     test_integration_suite();
     
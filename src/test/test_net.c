@@ -0,0 +1,1102 @@
+/*
+ * PureVisor - Network Test Suite
+ * 
+ * Unit tests for packet buffers and virtual networking
+ */
+
+#include <lib/types.h>
+#include <lib/string.h>
+#include <test/framework.h>
+#include <net/pktbuf.h>
+#include <net/flow.h>
+#include <net/proto.h>
+#include <net/offload.h>
+#include <net/vswitch.h>
+#include <net/uplink.h>
+#include <virtio/virtio_net.h>
+#include <vmm/mmio.h>
+#include <mm/pmm.h>
+
+/* ============================================================================
+ * Packet Buffer Tests
+ * ============================================================================ */
+
+static int pktbuf_destructor_calls;
+
+static void count_destructor(void *ctx UNUSED, int status UNUSED)
+{
+    pktbuf_destructor_calls++;
+}
+
+static void pktbuf_setup(void)
+{
+    pktbuf_init();
+}
+
+static test_result_t test_pktbuf_alignment(void)
+{
+    pktbuf_t *pb = pktbuf_alloc();
+    TEST_ASSERT_NOT_NULL(pb);
+    
+    TEST_ASSERT(((uintptr_t)pb & 63) == 0);
+    TEST_ASSERT(((uintptr_t)(pb->data - PKTBUF_HEADROOM) & 63) == 0);
+    TEST_ASSERT_EQ(pb->refcnt, 1);
+    
+    pktbuf_free(pb);
+    return TEST_PASS;
+}
+
+static test_result_t test_pktbuf_chain_copy(void)
+{
+    /* Jumbo frame spans several segments */
+    static uint8_t frame[9000];
+    static uint8_t out[9000];
+    for (uint32_t i = 0; i < sizeof(frame); i++) {
+        frame[i] = (uint8_t)(i * 7);
+    }
+    
+    pktbuf_t *pb = pktbuf_alloc_copy(frame, sizeof(frame));
+    TEST_ASSERT_NOT_NULL(pb);
+    TEST_ASSERT_EQ(pb->pkt_len, sizeof(frame));
+    TEST_ASSERT_NOT_NULL(pb->next);
+    
+    TEST_ASSERT_EQ(pktbuf_copy_out(pb, 0, out, sizeof(out)), sizeof(frame));
+    TEST_ASSERT_MEM_EQ(out, frame, sizeof(frame));
+    
+    /* Offset read crossing a segment boundary */
+    TEST_ASSERT_EQ(pktbuf_copy_out(pb, PKTBUF_DATA_SIZE - 4, out, 8), 8);
+    TEST_ASSERT_MEM_EQ(out, frame + PKTBUF_DATA_SIZE - 4, 8);
+    
+    pktbuf_free(pb);
+    return TEST_PASS;
+}
+
+static test_result_t test_pktbuf_refcount(void)
+{
+    static uint8_t ext[64];
+    
+    pktbuf_t *pb = pktbuf_alloc_ext(ext, sizeof(ext));
+    TEST_ASSERT_NOT_NULL(pb);
+    
+    pktbuf_destructor_calls = 0;
+    pktbuf_set_destructor(pb, count_destructor, NULL);
+    
+    /* Broadcast to three receivers */
+    pktbuf_ref(pb);
+    pktbuf_ref(pb);
+    pktbuf_free(pb);
+    pktbuf_free(pb);
+    TEST_ASSERT_EQ(pktbuf_destructor_calls, 0);
+    
+    pktbuf_free(pb);
+    TEST_ASSERT_EQ(pktbuf_destructor_calls, 1);
+    
+    return TEST_PASS;
+}
+
+static test_case_t pktbuf_tests[] = {
+    {"pktbuf_alignment", test_pktbuf_alignment},
+    {"pktbuf_chain_copy", test_pktbuf_chain_copy},
+    {"pktbuf_refcount", test_pktbuf_refcount},
+};
+
+static test_suite_t pktbuf_suite = {
+    .name = "Packet Buffers",
+    .setup = pktbuf_setup,
+    .teardown = NULL,
+    .tests = pktbuf_tests,
+    .test_count = sizeof(pktbuf_tests) / sizeof(pktbuf_tests[0]),
+};
+
+/* ============================================================================
+ * Flow Hashing Tests
+ * ============================================================================ */
+
+/* Build an Ethernet/IPv4/TCP header for @saddr:@sport -> @daddr:@dport */
+static void build_tcp4_frame(uint8_t *frame, const uint8_t saddr[4], uint16_t sport,
+                             const uint8_t daddr[4], uint16_t dport)
+{
+    memset(frame, 0, NET_FLOW_PARSE_LEN);
+    
+    eth_hdr_t *eth = (eth_hdr_t *)frame;
+    eth->type = htons(ETH_P_IP);
+    
+    ipv4_hdr_t *ip = (ipv4_hdr_t *)(frame + ETH_HLEN);
+    ip->ver_ihl = 0x45;
+    ip->protocol = IPPROTO_TCP;
+    memcpy(&ip->saddr, saddr, 4);
+    memcpy(&ip->daddr, daddr, 4);
+    
+    tcp_hdr_t *tcp = (tcp_hdr_t *)(frame + ETH_HLEN + sizeof(ipv4_hdr_t));
+    tcp->source = htons(sport);
+    tcp->dest = htons(dport);
+    tcp->doff = 5 << 4;
+}
+
+static test_result_t test_flow_toeplitz(void)
+{
+    /* Verification vector from the Microsoft RSS specification */
+    static const uint8_t src[4] = {66, 9, 149, 187};
+    static const uint8_t dst[4] = {161, 142, 100, 80};
+    uint8_t frame[NET_FLOW_PARSE_LEN];
+    net_flow_keys_t keys;
+    
+    build_tcp4_frame(frame, src, 2794, dst, 1766);
+    TEST_ASSERT(net_flow_dissect(frame, sizeof(frame), &keys));
+    TEST_ASSERT_EQ(keys.l4_proto, IPPROTO_TCP);
+    
+    TEST_ASSERT_EQ(net_flow_hash(&keys, net_rss_default_key, NET_RSS_HASH_ALL),
+                   0x51ccc178);
+    TEST_ASSERT_EQ(net_flow_hash(&keys, net_rss_default_key, NET_RSS_HASH_IPV4),
+                   0x323e8fc2);
+    TEST_ASSERT_EQ(net_flow_hash(&keys, net_rss_default_key, NET_RSS_HASH_IPV6), 0);
+    
+    return TEST_PASS;
+}
+
+static test_result_t test_flow_reverse(void)
+{
+    static const uint8_t a[4] = {10, 0, 0, 1};
+    static const uint8_t b[4] = {10, 0, 0, 2};
+    uint8_t frame[NET_FLOW_PARSE_LEN];
+    net_flow_keys_t tx, rx;
+    
+    /* A transmitted frame keyed in reverse matches its reply */
+    build_tcp4_frame(frame, a, 40000, b, 80);
+    TEST_ASSERT(net_flow_dissect(frame, sizeof(frame), &tx));
+    net_flow_reverse(&tx);
+    
+    build_tcp4_frame(frame, b, 80, a, 40000);
+    TEST_ASSERT(net_flow_dissect(frame, sizeof(frame), &rx));
+    
+    TEST_ASSERT_EQ(net_flow_hash(&tx, net_rss_default_key, NET_RSS_HASH_ALL),
+                   net_flow_hash(&rx, net_rss_default_key, NET_RSS_HASH_ALL));
+    
+    /* Non-IP frames are unclassified */
+    ((eth_hdr_t *)frame)->type = htons(ETH_P_ARP);
+    TEST_ASSERT(!net_flow_dissect(frame, sizeof(frame), &rx));
+    
+    return TEST_PASS;
+}
+
+static test_case_t flow_tests[] = {
+    {"toeplitz_vector", test_flow_toeplitz},
+    {"reverse_flow", test_flow_reverse},
+};
+
+static test_suite_t flow_suite = {
+    .name = "Flow Hashing",
+    .setup = NULL,
+    .teardown = NULL,
+    .tests = flow_tests,
+    .test_count = sizeof(flow_tests) / sizeof(flow_tests[0]),
+};
+
+/* ============================================================================
+ * Offload Tests
+ * ============================================================================ */
+
+#define TCP4_HLEN   (ETH_HLEN + sizeof(ipv4_hdr_t) + sizeof(tcp_hdr_t))
+
+/* Verify the IPv4 header and TCP checksums of a flat frame */
+static bool tcp4_csum_ok(const uint8_t *frame, size_t len)
+{
+    const uint8_t *ip = frame + ETH_HLEN;
+    size_t l4_len = len - ETH_HLEN - sizeof(ipv4_hdr_t);
+    
+    if (net_csum_fold(net_csum_add(0, ip, sizeof(ipv4_hdr_t))) != 0xFFFF) {
+        return false;
+    }
+    
+    uint64_t sum = net_csum_add(0, ip + 12, 8) + IPPROTO_TCP + l4_len;
+    sum = net_csum_add(sum, ip + sizeof(ipv4_hdr_t), l4_len);
+    return net_csum_fold(sum) == 0xFFFF;
+}
+
+static test_result_t test_offload_gso_segment(void)
+{
+    static const uint8_t a[4] = {10, 0, 0, 1};
+    static const uint8_t b[4] = {10, 0, 0, 2};
+    static uint8_t frame[TCP4_HLEN + 4000];
+    static uint8_t out[TCP4_HLEN + 1448];
+    
+    build_tcp4_frame(frame, a, 40000, b, 80);
+    for (size_t i = TCP4_HLEN; i < sizeof(frame); i++) {
+        frame[i] = (uint8_t)(i * 3);
+    }
+    ((tcp_hdr_t *)(frame + ETH_HLEN + sizeof(ipv4_hdr_t)))->seq = htonl(1000);
+    ((tcp_hdr_t *)(frame + ETH_HLEN + sizeof(ipv4_hdr_t)))->flags =
+        TCP_FLAG_ACK | TCP_FLAG_PSH;
+    
+    pktbuf_t *pb = pktbuf_alloc_copy(frame, sizeof(frame));
+    TEST_ASSERT_NOT_NULL(pb);
+    pb->ol.flags = PKTBUF_OL_CSUM_PARTIAL;
+    pb->ol.gso_type = PKTBUF_GSO_TCPV4;
+    pb->ol.gso_size = 1448;
+    pb->ol.csum_start = ETH_HLEN + sizeof(ipv4_hdr_t);
+    pb->ol.csum_offset = 16;
+    
+    /* A GSO-capable receiver gets the super-frame untouched */
+    pktbuf_queue_t q;
+    pktq_init(&q);
+    TEST_ASSERT_EQ(net_offload_resolve(pktbuf_ref(pb), NET_CAP_CSUM | NET_CAP_TSO4, &q), 1);
+    TEST_ASSERT(pktq_pop(&q) == pb);
+    pktbuf_free(pb);
+    
+    /* Otherwise it is cut into MSS-sized frames with valid checksums */
+    TEST_ASSERT_EQ(net_offload_resolve(pb, 0, &q), 3);
+    for (uint32_t i = 0; i < 3; i++) {
+        pktbuf_t *seg = pktq_pop(&q);
+        size_t payload = i < 2 ? 1448 : 4000 - 2 * 1448;
+        TEST_ASSERT_EQ(seg->pkt_len, TCP4_HLEN + payload);
+        
+        pktbuf_copy_out(seg, 0, out, seg->pkt_len);
+        const tcp_hdr_t *tcp = (const tcp_hdr_t *)(out + ETH_HLEN + sizeof(ipv4_hdr_t));
+        TEST_ASSERT_EQ(ntohl(tcp->seq), 1000 + i * 1448);
+        TEST_ASSERT_EQ(!!(tcp->flags & TCP_FLAG_PSH), i == 2);
+        TEST_ASSERT(tcp4_csum_ok(out, seg->pkt_len));
+        TEST_ASSERT_MEM_EQ(out + TCP4_HLEN, frame + TCP4_HLEN + i * 1448, payload);
+        pktbuf_free(seg);
+    }
+    
+    return TEST_PASS;
+}
+
+static test_result_t test_offload_csum_resolve(void)
+{
+    static const uint8_t a[4] = {192, 168, 1, 1};
+    static const uint8_t b[4] = {192, 168, 1, 2};
+    static uint8_t frame[TCP4_HLEN + 333];
+    
+    build_tcp4_frame(frame, a, 1234, b, 22);
+    for (size_t i = TCP4_HLEN; i < sizeof(frame); i++) {
+        frame[i] = (uint8_t)(i ^ 0x5A);
+    }
+    ipv4_hdr_t *ip = (ipv4_hdr_t *)(frame + ETH_HLEN);
+    ip->tot_len = htons(sizeof(frame) - ETH_HLEN);
+    ip->check = htons((uint16_t)~net_csum_fold(net_csum_add(0, ip, sizeof(*ip))));
+    
+    /* Partial checksum: the field holds the pseudo-header sum */
+    size_t l4_len = sizeof(frame) - ETH_HLEN - sizeof(ipv4_hdr_t);
+    uint16_t pseudo = net_csum_fold(net_csum_add(0, (uint8_t *)ip + 12, 8) +
+                                    IPPROTO_TCP + l4_len);
+    ((tcp_hdr_t *)(frame + ETH_HLEN + sizeof(*ip)))->check = htons(pseudo);
+    
+    pktbuf_t *pb = pktbuf_alloc_copy(frame, sizeof(frame));
+    TEST_ASSERT_NOT_NULL(pb);
+    pb->ol.flags = PKTBUF_OL_CSUM_PARTIAL;
+    pb->ol.csum_start = ETH_HLEN + sizeof(*ip);
+    pb->ol.csum_offset = 16;
+    
+    pktbuf_queue_t q;
+    pktq_init(&q);
+    TEST_ASSERT_EQ(net_offload_resolve(pb, NET_CAP_TSO4, &q), 1);
+    pb = pktq_pop(&q);
+    TEST_ASSERT(pb->ol.flags & PKTBUF_OL_CSUM_VALID);
+    
+    static uint8_t out[sizeof(frame)];
+    TEST_ASSERT_EQ(pktbuf_copy_out(pb, 0, out, sizeof(out)), sizeof(frame));
+    TEST_ASSERT(tcp4_csum_ok(out, sizeof(out)));
+    
+    pktbuf_free(pb);
+    return TEST_PASS;
+}
+
+static test_case_t offload_tests[] = {
+    {"gso_segment", test_offload_gso_segment},
+    {"csum_resolve", test_offload_csum_resolve},
+};
+
+static test_suite_t offload_suite = {
+    .name = "Network Offloads",
+    .setup = pktbuf_setup,
+    .teardown = NULL,
+    .tests = offload_tests,
+    .test_count = sizeof(offload_tests) / sizeof(offload_tests[0]),
+};
+
+/* ============================================================================
+ * Virtio-net Tests
+ * ============================================================================ */
+
+static test_result_t test_virtio_net_mergeable_rx(void)
+{
+    static uint8_t frame[3000];
+    for (uint32_t i = 0; i < sizeof(frame); i++) {
+        frame[i] = (uint8_t)(i * 13);
+    }
+    
+    net_backend_t *be = net_backend_create_loopback();
+    TEST_ASSERT_NOT_NULL(be);
+    virtio_net_t *net = virtio_net_create(be);
+    TEST_ASSERT_NOT_NULL(net);
+    net->dev.guest_features = BIT(VIRTIO_NET_F_MRG_RXBUF);
+    
+    /* Guest RX ring with four 1 KB buffers, two posted */
+    phys_addr_t ring = pmm_alloc_pages(2);
+    phys_addr_t bufs = pmm_alloc_pages(0);
+    TEST_ASSERT(ring != 0 && bufs != 0);
+    memset(phys_to_virt(ring), 0, 4 * PAGE_SIZE);
+    
+    virtqueue_t *vq = net->queues[0].rx_vq;
+    virtq_set_addr(vq, ring, ring + PAGE_SIZE, ring + 2 * PAGE_SIZE);
+    for (uint16_t i = 0; i < 4; i++) {
+        vq->desc[i].addr = bufs + i * 1024;
+        vq->desc[i].len = 1024;
+        vq->desc[i].flags = VIRTQ_DESC_F_WRITE;
+        vq->avail->ring[i] = i;
+    }
+    vq->avail->idx = 2;
+    
+    /* Not enough buffers: the frame waits and nothing is consumed */
+    TEST_ASSERT_EQ(virtio_net_receive(net, frame, sizeof(frame)), 0);
+    TEST_ASSERT_EQ(vq->used->idx, 0);
+    TEST_ASSERT_EQ(vq->last_avail_idx, 0);
+    TEST_ASSERT_EQ(net->queues[0].backlog.count, 1);
+    
+    /* Header + 3000 bytes spread over three buffers */
+    vq->avail->idx = 4;
+    net->dev.queue_notify(&net->dev, 0);
+    TEST_ASSERT_EQ(vq->used->idx, 3);
+    TEST_ASSERT_EQ(vq->used->ring[0].len, 1024);
+    TEST_ASSERT_EQ(vq->used->ring[2].len, sizeof(frame) + sizeof(virtio_net_hdr_t) - 2048);
+    
+    virtio_net_hdr_t *hdr = phys_to_virt(bufs);
+    TEST_ASSERT_EQ(hdr->num_buffers, 3);
+    TEST_ASSERT_MEM_EQ((uint8_t *)phys_to_virt(bufs) + sizeof(virtio_net_hdr_t),
+                       frame, sizeof(frame));
+    
+    virtio_net_destroy(net);
+    net_backend_destroy(be);
+    pmm_free_pages(bufs, 0);
+    pmm_free_pages(ring, 2);
+    return TEST_PASS;
+}
+
+static test_result_t test_virtio_net_tx_ratelimit(void)
+{
+    net_backend_t *be = net_backend_create_loopback();
+    TEST_ASSERT_NOT_NULL(be);
+    virtio_net_t *net = virtio_net_create(be);
+    TEST_ASSERT_NOT_NULL(net);
+    
+    /* Three 64-byte frames behind legacy headers */
+    phys_addr_t ring = pmm_alloc_pages(2);
+    phys_addr_t bufs = pmm_alloc_pages(0);
+    TEST_ASSERT(ring != 0 && bufs != 0);
+    memset(phys_to_virt(ring), 0, 4 * PAGE_SIZE);
+    memset(phys_to_virt(bufs), 0, PAGE_SIZE);
+    
+    virtqueue_t *vq = net->queues[0].tx_vq;
+    virtq_set_addr(vq, ring, ring + PAGE_SIZE, ring + 2 * PAGE_SIZE);
+    for (uint16_t i = 0; i < 3; i++) {
+        vq->desc[i].addr = bufs + i * 256;
+        vq->desc[i].len = VIRTIO_NET_HDR_LEGACY_LEN + 64;
+        vq->avail->ring[i] = i;
+    }
+    vq->avail->idx = 3;
+    
+    /* One packet per second with a burst of one: the bucket may go one
+     * frame into debt, then the rest waits in the guest's ring */
+    net_rate_config_t tx = { .pkts_per_sec = 1, .burst_pkts = 1 };
+    virtio_net_set_rate_limit(net, &tx, NULL);
+    TEST_ASSERT_EQ(vq->last_avail_idx, 2);
+    TEST_ASSERT_EQ(net->queues[0].tx_inflight, 2);
+    TEST_ASSERT(net->queues[0].tx_timer.armed);
+    TEST_ASSERT_EQ(net->queues[0].tx_limit.throttled, 1);
+    
+    /* Kicks while throttled do not bypass the limit */
+    net->dev.queue_notify(&net->dev, 1);
+    TEST_ASSERT_EQ(vq->last_avail_idx, 2);
+    
+    /* Lifting the limit drains the ring */
+    virtio_net_set_rate_limit(net, NULL, NULL);
+    TEST_ASSERT_EQ(vq->last_avail_idx, 3);
+    TEST_ASSERT_EQ(net->queues[0].tx_inflight, 3);
+    
+    virtio_net_destroy(net);
+    net_backend_destroy(be);
+    pmm_free_pages(bufs, 0);
+    pmm_free_pages(ring, 2);
+    return TEST_PASS;
+}
+
+/* Capturing backend: holds each transmitted frame until the test completes it */
+static net_sg_t zc_sg[NET_SG_MAX];
+static uint32_t zc_nsg;
+static net_tx_done_t zc_done;
+static void *zc_ctx;
+
+static int zc_transmit(net_backend_t *be UNUSED, const net_sg_t *sg, uint32_t nsg,
+                       const pktbuf_offload_t *ol UNUSED, net_tx_done_t done, void *ctx)
+{
+    memcpy(zc_sg, sg, nsg * sizeof(net_sg_t));
+    zc_nsg = nsg;
+    zc_done = done;
+    zc_ctx = ctx;
+    return 0;
+}
+
+static test_result_t test_virtio_net_zero_copy_tx(void)
+{
+    net_backend_t *be = net_backend_create_loopback();
+    TEST_ASSERT_NOT_NULL(be);
+    be->transmit = zc_transmit;
+    virtio_net_t *net = virtio_net_create(be);
+    TEST_ASSERT_NOT_NULL(net);
+    
+    phys_addr_t ring = pmm_alloc_pages(2);
+    phys_addr_t bufs = pmm_alloc_pages(0);
+    TEST_ASSERT(ring != 0 && bufs != 0);
+    memset(phys_to_virt(ring), 0, 4 * PAGE_SIZE);
+    memset(phys_to_virt(bufs), 0, PAGE_SIZE);
+    
+    /* Header and payload in separate descriptors of one chain */
+    virtqueue_t *vq = net->queues[0].tx_vq;
+    virtq_set_addr(vq, ring, ring + PAGE_SIZE, ring + 2 * PAGE_SIZE);
+    vq->desc[0].addr = bufs;
+    vq->desc[0].len = VIRTIO_NET_HDR_LEGACY_LEN;
+    vq->desc[0].flags = VIRTQ_DESC_F_NEXT;
+    vq->desc[0].next = 1;
+    vq->desc[1].addr = bufs + 256;
+    vq->desc[1].len = 64;
+    vq->avail->ring[0] = 0;
+    vq->avail->idx = 1;
+    
+    /* The backend is handed the guest's payload in place */
+    zc_nsg = 0;
+    net->dev.queue_notify(&net->dev, 1);
+    TEST_ASSERT_EQ(zc_nsg, 1);
+    TEST_ASSERT(zc_sg[0].addr == phys_to_virt(bufs + 256));
+    TEST_ASSERT_EQ(zc_sg[0].len, 64);
+    
+    /* The chain stays with the backend until it completes */
+    TEST_ASSERT_EQ(vq->last_avail_idx, 1);
+    TEST_ASSERT_EQ(vq->used->idx, 0);
+    TEST_ASSERT_EQ(net->queues[0].tx_inflight, 1);
+    
+    zc_done(zc_ctx, 0);
+    TEST_ASSERT_EQ(vq->used->idx, 1);
+    TEST_ASSERT_EQ(vq->used->ring[0].id, 0);
+    TEST_ASSERT_EQ(net->queues[0].tx_inflight, 0);
+    TEST_ASSERT_EQ(net->queues[0].tx_packets, 1);
+    
+    /* A header sharing its descriptor with data is skipped, not copied */
+    vq->desc[2].addr = bufs + 512;
+    vq->desc[2].len = VIRTIO_NET_HDR_LEGACY_LEN + 64;
+    vq->avail->ring[1] = 2;
+    vq->avail->idx = 2;
+    net->dev.queue_notify(&net->dev, 1);
+    TEST_ASSERT_EQ(zc_nsg, 1);
+    TEST_ASSERT(zc_sg[0].addr == phys_to_virt(bufs + 512 + VIRTIO_NET_HDR_LEGACY_LEN));
+    TEST_ASSERT_EQ(vq->used->idx, 1);
+    
+    zc_done(zc_ctx, 0);
+    TEST_ASSERT_EQ(vq->used->idx, 2);
+    TEST_ASSERT_EQ(vq->used->ring[1].id, 2);
+    TEST_ASSERT_EQ(net->queues[0].tx_inflight, 0);
+    
+    virtio_net_destroy(net);
+    net_backend_destroy(be);
+    pmm_free_pages(bufs, 0);
+    pmm_free_pages(ring, 2);
+    return TEST_PASS;
+}
+
+static test_result_t test_virtio_net_coalesce(void)
+{
+    static uint8_t frame[60];
+    
+    net_backend_t *be = net_backend_create_loopback();
+    TEST_ASSERT_NOT_NULL(be);
+    virtio_net_t *net = virtio_net_create(be);
+    TEST_ASSERT_NOT_NULL(net);
+    
+    phys_addr_t ring = pmm_alloc_pages(2);
+    phys_addr_t bufs = pmm_alloc_pages(0);
+    TEST_ASSERT(ring != 0 && bufs != 0);
+    memset(phys_to_virt(ring), 0, 4 * PAGE_SIZE);
+    
+    virtqueue_t *vq = net->queues[0].rx_vq;
+    virtq_set_addr(vq, ring, ring + PAGE_SIZE, ring + 2 * PAGE_SIZE);
+    for (uint16_t i = 0; i < 16; i++) {
+        vq->desc[i].addr = bufs + i * 128;
+        vq->desc[i].len = 128;
+        vq->desc[i].flags = VIRTQ_DESC_F_WRITE;
+        vq->avail->ring[i] = i;
+    }
+    vq->avail->idx = 16;
+    
+    /* Every fourth frame interrupts */
+    virtio_set_coalesce(&net->dev, 0, 4, 1000000, false);
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQ(virtio_net_receive(net, frame, sizeof(frame)), 0);
+    }
+    TEST_ASSERT_EQ(vq->used->idx, 3);
+    TEST_ASSERT(!net->dev.pci.interrupt_pending);
+    TEST_ASSERT(vq->coalesce.timer.armed);
+    
+    virtio_net_receive(net, frame, sizeof(frame));
+    TEST_ASSERT(net->dev.pci.interrupt_pending);
+    TEST_ASSERT_EQ(vq->coalesce.interrupts, 1);
+    TEST_ASSERT(!vq->coalesce.timer.armed);
+    
+    /* A straggler waits for the timer, or for a flush */
+    net->dev.pci.interrupt_pending = false;
+    virtio_net_receive(net, frame, sizeof(frame));
+    TEST_ASSERT(!net->dev.pci.interrupt_pending);
+    virtio_flush_interrupts(&net->dev);
+    TEST_ASSERT(net->dev.pci.interrupt_pending);
+    TEST_ASSERT_EQ(vq->coalesce.interrupts, 2);
+    
+    /* Adaptive: a high observed rate selects a deep profile */
+    virtio_set_coalesce(&net->dev, 0, 0, 0, true);
+    vq->coalesce.window_start -= VIRTQ_COALESCE_WINDOW_US;
+    vq->coalesce.window_count = 10000;
+    virtio_net_receive(net, frame, sizeof(frame));
+    TEST_ASSERT_GT(vq->coalesce.max_frames, 1);
+    TEST_ASSERT_GT(vq->coalesce.max_usecs, 0);
+    TEST_ASSERT_EQ(vq->coalesce.pending, 1);
+    
+    virtio_net_destroy(net);
+    net_backend_destroy(be);
+    pmm_free_pages(bufs, 0);
+    pmm_free_pages(ring, 2);
+    return TEST_PASS;
+}
+
+static test_result_t test_virtio_net_queue_shrink(void)
+{
+    static uint8_t frame[60];
+    
+    net_backend_t *be = net_backend_create_loopback();
+    TEST_ASSERT_NOT_NULL(be);
+    virtio_net_t *net = virtio_net_create_mq(be, 2);
+    TEST_ASSERT_NOT_NULL(net);
+    net->dev.guest_features = BIT(VIRTIO_NET_F_MQ);
+    
+    /* Rings for RX queue 0 (buffers posted) and the control queue */
+    phys_addr_t rx_ring = pmm_alloc_pages(2);
+    phys_addr_t ctrl_ring = pmm_alloc_pages(2);
+    phys_addr_t bufs = pmm_alloc_pages(0);
+    TEST_ASSERT(rx_ring != 0 && ctrl_ring != 0 && bufs != 0);
+    memset(phys_to_virt(rx_ring), 0, 4 * PAGE_SIZE);
+    memset(phys_to_virt(ctrl_ring), 0, 4 * PAGE_SIZE);
+    memset(phys_to_virt(bufs), 0, PAGE_SIZE);
+    
+    virtqueue_t *rx = net->queues[0].rx_vq;
+    virtq_set_addr(rx, rx_ring, rx_ring + PAGE_SIZE, rx_ring + 2 * PAGE_SIZE);
+    for (uint16_t i = 0; i < 4; i++) {
+        rx->desc[i].addr = bufs + i * 256;
+        rx->desc[i].len = 256;
+        rx->desc[i].flags = VIRTQ_DESC_F_WRITE;
+        rx->avail->ring[i] = i;
+    }
+    rx->avail->idx = 4;
+    
+    /* Two pairs active, with frames parked on the second */
+    net->curr_queue_pairs = 2;
+    for (int i = 0; i < 2; i++) {
+        pktq_push(&net->queues[1].backlog, pktbuf_alloc_copy(frame, sizeof(frame)));
+    }
+    
+    /* VQ_PAIRS_SET 1: header + pair count, then the ack byte */
+    uint8_t *cmd = (uint8_t *)phys_to_virt(bufs) + 2048;
+    virtio_net_ctrl_hdr_t hdr = {
+        .class = VIRTIO_NET_CTRL_MQ,
+        .cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+    };
+    uint16_t pairs = 1;
+    memcpy(cmd, &hdr, sizeof(hdr));
+    memcpy(cmd + sizeof(hdr), &pairs, sizeof(pairs));
+    cmd[64] = 0xFF;
+    
+    virtqueue_t *ctrl = &net->dev.queues[4];
+    virtq_set_addr(ctrl, ctrl_ring, ctrl_ring + PAGE_SIZE, ctrl_ring + 2 * PAGE_SIZE);
+    ctrl->desc[0].addr = bufs + 2048;
+    ctrl->desc[0].len = sizeof(hdr) + sizeof(pairs);
+    ctrl->desc[0].flags = VIRTQ_DESC_F_NEXT;
+    ctrl->desc[0].next = 1;
+    ctrl->desc[1].addr = bufs + 2048 + 64;
+    ctrl->desc[1].len = 1;
+    ctrl->desc[1].flags = VIRTQ_DESC_F_WRITE;
+    ctrl->avail->ring[0] = 0;
+    ctrl->avail->idx = 1;
+    
+    /* The stranded frames move to the remaining queue and are delivered */
+    net->dev.queue_notify(&net->dev, 4);
+    TEST_ASSERT_EQ(cmd[64], VIRTIO_NET_OK);
+    TEST_ASSERT_EQ(net->curr_queue_pairs, 1);
+    TEST_ASSERT_EQ(net->queues[1].backlog.count, 0);
+    TEST_ASSERT_EQ(net->queues[1].rx_dropped, 0);
+    TEST_ASSERT_EQ(rx->used->idx, 2);
+    TEST_ASSERT_EQ(net->queues[0].rx_packets, 2);
+    
+    virtio_net_destroy(net);
+    net_backend_destroy(be);
+    pmm_free_pages(bufs, 0);
+    pmm_free_pages(ctrl_ring, 2);
+    pmm_free_pages(rx_ring, 2);
+    return TEST_PASS;
+}
+
+static test_result_t test_virtio_net_modern_notify(void)
+{
+    net_backend_t *be = net_backend_create_loopback();
+    TEST_ASSERT_NOT_NULL(be);
+    virtio_net_t *net = virtio_net_create(be);
+    TEST_ASSERT_NOT_NULL(net);
+    pci_device_t *pci = &net->dev.pci;
+    
+    /* Walk the vendor capabilities to the notify structure */
+    uint32_t pos, val, mult = 0;
+    pci->config_read(pci, PCI_CAPABILITIES, 1, &pos);
+    TEST_ASSERT_EQ(pos, VIRTIO_PCI_CAP_BASE);
+    for (int n = 0; pos && n < 8; n++) {
+        pci->config_read(pci, pos, 4, &val);
+        TEST_ASSERT_EQ(val & 0xFF, PCI_CAP_VENDOR);
+        if (((val >> 24) & 0xFF) == VIRTIO_PCI_CAP_NOTIFY_CFG) {
+            pci->config_read(pci, pos + 16, 4, &mult);
+        }
+        pos = (val >> 8) & 0xFF;
+    }
+    TEST_ASSERT_EQ(mult, VIRTIO_PCI_NOTIFY_MULTIPLIER);
+    
+    /* Feature bits above 31 are visible through the select window */
+    uint64_t feat;
+    pci->bar_write(pci, VIRTIO_PCI_MODERN_BAR, VIRTIO_PCI_COMMON_DFSELECT, 4, 1);
+    pci->bar_read(pci, VIRTIO_PCI_MODERN_BAR, VIRTIO_PCI_COMMON_DF, 4, &feat);
+    TEST_ASSERT(feat & BIT(VIRTIO_F_VERSION_1 - 32));
+    
+    /* Bring up TX queue 0 through the common configuration */
+    phys_addr_t ring = pmm_alloc_pages(2);
+    phys_addr_t bufs = pmm_alloc_pages(0);
+    TEST_ASSERT(ring != 0 && bufs != 0);
+    memset(phys_to_virt(ring), 0, 4 * PAGE_SIZE);
+    memset(phys_to_virt(bufs), 0, PAGE_SIZE);
+    
+    static const struct { uint64_t reg, val; } setup[] = {
+        { VIRTIO_PCI_COMMON_Q_DESCLO, 0 },
+        { VIRTIO_PCI_COMMON_Q_AVAILLO, PAGE_SIZE },
+        { VIRTIO_PCI_COMMON_Q_USEDLO, 2 * PAGE_SIZE },
+    };
+    pci->bar_write(pci, VIRTIO_PCI_MODERN_BAR, VIRTIO_PCI_COMMON_Q_SELECT, 2, 1);
+    for (uint32_t i = 0; i < ARRAY_SIZE(setup); i++) {
+        pci->bar_write(pci, VIRTIO_PCI_MODERN_BAR, setup[i].reg, 4,
+                       (uint32_t)ring + setup[i].val);
+    }
+    pci->bar_write(pci, VIRTIO_PCI_MODERN_BAR, VIRTIO_PCI_COMMON_Q_DESCHI, 4, ring >> 32);
+    pci->bar_write(pci, VIRTIO_PCI_MODERN_BAR, VIRTIO_PCI_COMMON_Q_AVAILHI, 4, ring >> 32);
+    pci->bar_write(pci, VIRTIO_PCI_MODERN_BAR, VIRTIO_PCI_COMMON_Q_USEDHI, 4, ring >> 32);
+    pci->bar_write(pci, VIRTIO_PCI_MODERN_BAR, VIRTIO_PCI_COMMON_Q_ENABLE, 2, 1);
+    
+    virtqueue_t *vq = net->queues[0].tx_vq;
+    TEST_ASSERT(vq->enabled);
+    TEST_ASSERT_EQ(vq->used_addr, ring + 2 * PAGE_SIZE);
+    
+    vq->desc[0].addr = bufs;
+    vq->desc[0].len = VIRTIO_NET_HDR_LEGACY_LEN + 64;
+    vq->avail->ring[0] = 0;
+    vq->avail->idx = 1;
+    
+    /* The doorbell is trapped in the owning guest's address space only */
+    ept_context_t *ept = ept_create();
+    ept_context_t *other = ept_create();
+    TEST_ASSERT(ept && other);
+    TEST_ASSERT_EQ(net->dev.doorbell, 0);
+    TEST_ASSERT_EQ(mmio_doorbell_attach(ept), 0);
+    TEST_ASSERT_EQ(mmio_doorbell_attach(other), 0);
+    virtio_pci_attach(&net->dev, ept);
+    phys_addr_t doorbell = net->dev.doorbell;
+    TEST_ASSERT(doorbell != 0);
+    TEST_ASSERT_EQ(ept_get_host_phys(other, doorbell), 0);
+    TEST_ASSERT(!mmio_doorbell_dispatch(other->eptp, doorbell + 1 * VIRTIO_PCI_NOTIFY_MULTIPLIER));
+    TEST_ASSERT_EQ(vq->last_avail_idx, 0);
+    
+    /* A trapped write to the queue's doorbell runs the TX path directly */
+    TEST_ASSERT(mmio_doorbell_dispatch(ept->eptp, doorbell + 1 * VIRTIO_PCI_NOTIFY_MULTIPLIER));
+    TEST_ASSERT_EQ(vq->last_avail_idx, 1);
+    TEST_ASSERT_EQ(net->queues[0].tx_inflight, 1);
+    TEST_ASSERT(!mmio_doorbell_dispatch(ept->eptp, doorbell + VIRTIO_PCI_REGION_SIZE));
+    
+    /* Guests read the doorbell from a zero page; only stores exit */
+    phys_addr_t backing = ept_get_host_phys(ept, doorbell);
+    TEST_ASSERT(backing != 0);
+    TEST_ASSERT_EQ(*(uint32_t *)phys_to_virt(backing), 0);
+    
+    /* Nothing else of the BAR is served to a guest, so it is not offered */
+    pci->config_read(pci, PCI_CAPABILITIES, 1, &pos);
+    TEST_ASSERT_EQ(pos, 0);
+    
+    virtio_net_destroy(net);
+    TEST_ASSERT(!mmio_doorbell_dispatch(ept->eptp, doorbell));
+    TEST_ASSERT_EQ(ept_get_host_phys(ept, doorbell), 0);
+    mmio_doorbell_detach(ept);
+    mmio_doorbell_detach(other);
+    ept_destroy(ept);
+    ept_destroy(other);
+    net_backend_destroy(be);
+    pmm_free_pages(bufs, 0);
+    pmm_free_pages(ring, 2);
+    return TEST_PASS;
+}
+
+static test_case_t virtio_net_tests[] = {
+    {"mergeable_rx", test_virtio_net_mergeable_rx},
+    {"tx_ratelimit", test_virtio_net_tx_ratelimit},
+    {"zero_copy_tx", test_virtio_net_zero_copy_tx},
+    {"coalesce", test_virtio_net_coalesce},
+    {"queue_shrink", test_virtio_net_queue_shrink},
+    {"modern_notify", test_virtio_net_modern_notify},
+};
+
+static test_suite_t virtio_net_suite = {
+    .name = "Virtio-net",
+    .setup = pktbuf_setup,
+    .teardown = NULL,
+    .tests = virtio_net_tests,
+    .test_count = sizeof(virtio_net_tests) / sizeof(virtio_net_tests[0]),
+};
+
+/* ============================================================================
+ * Virtual Switch Tests
+ * ============================================================================ */
+
+static int vswitch_done_calls;
+
+static void vswitch_tx_done(void *ctx UNUSED, int status UNUSED)
+{
+    vswitch_done_calls++;
+}
+
+static void vswitch_purge(net_backend_t *be)
+{
+    pktbuf_t *pb;
+    while ((pb = pktq_pop(&be->rx_queue)) != NULL) {
+        pktbuf_free(pb);
+    }
+}
+
+static test_result_t test_vswitch_forwarding(void)
+{
+    static const uint8_t mac_a[6] = {0x52, 0x54, 0x00, 0, 0, 0x0A};
+    static const uint8_t mac_b[6] = {0x52, 0x54, 0x00, 0, 0, 0x0B};
+    static uint8_t frame[64];
+    uint8_t tagged[sizeof(frame) + ETH_VLAN_HLEN];
+    
+    vswitch_t *sw = vswitch_create("test");
+    TEST_ASSERT_NOT_NULL(sw);
+    net_backend_t *a = vswitch_port_create(sw, mac_a, 10, false);
+    net_backend_t *b = vswitch_port_create(sw, mac_b, 10, false);
+    net_backend_t *c = vswitch_port_create(sw, NULL, 20, false);
+    net_backend_t *d = vswitch_port_create(sw, NULL, 0, true);
+    TEST_ASSERT(a && b && c && d);
+    
+    /* Broadcast from A: B untagged, trunk D tagged, C on another VLAN */
+    memset(frame, 0xFF, ETH_ALEN);
+    memcpy(frame + ETH_ALEN, mac_a, ETH_ALEN);
+    frame[12] = ETH_P_IP >> 8;
+    frame[13] = ETH_P_IP & 0xFF;
+    for (uint32_t i = ETH_HLEN; i < sizeof(frame); i++) {
+        frame[i] = (uint8_t)i;
+    }
+    
+    net_sg_t sg = {frame, sizeof(frame)};
+    vswitch_done_calls = 0;
+    TEST_ASSERT_EQ(a->transmit(a, &sg, 1, NULL, vswitch_tx_done, NULL), 0);
+    a->tx_flush(a);
+    
+    TEST_ASSERT_EQ(a->rx_queue.count, 0);
+    TEST_ASSERT_EQ(b->rx_queue.count, 1);
+    TEST_ASSERT_EQ(c->rx_queue.count, 0);
+    TEST_ASSERT_EQ(d->rx_queue.count, 1);
+    TEST_ASSERT_EQ(sw->flooded, 1);
+    
+    pktbuf_t *pb = b->rx_queue.head;
+    TEST_ASSERT_EQ(pb->pkt_len, sizeof(frame));
+    TEST_ASSERT_EQ(pktbuf_copy_out(pb, 0, tagged, sizeof(tagged)), sizeof(frame));
+    TEST_ASSERT_MEM_EQ(tagged, frame, sizeof(frame));
+    
+    pb = d->rx_queue.head;
+    TEST_ASSERT_EQ(pb->pkt_len, sizeof(tagged));
+    pktbuf_copy_out(pb, 0, tagged, sizeof(tagged));
+    TEST_ASSERT_MEM_EQ(tagged, frame, 2 * ETH_ALEN);
+    TEST_ASSERT_EQ(tagged[12], 0x81);
+    TEST_ASSERT_EQ(tagged[13], 0x00);
+    TEST_ASSERT_EQ(((tagged[14] << 8) | tagged[15]) & VLAN_VID_MASK, 10);
+    TEST_ASSERT_MEM_EQ(tagged + ETH_HLEN + 2, frame + 2 * ETH_ALEN,
+                       sizeof(frame) - 2 * ETH_ALEN);
+    
+    /* Receivers share the sender's buffer until they are done */
+    TEST_ASSERT_EQ(vswitch_done_calls, 0);
+    vswitch_purge(b);
+    vswitch_purge(d);
+    TEST_ASSERT_EQ(vswitch_done_calls, 1);
+    
+    /* A's address was learned: unicast from B reaches A alone */
+    memcpy(frame, mac_a, ETH_ALEN);
+    memcpy(frame + ETH_ALEN, mac_b, ETH_ALEN);
+    TEST_ASSERT_EQ(b->transmit(b, &sg, 1, NULL, vswitch_tx_done, NULL), 0);
+    b->tx_flush(b);
+    
+    TEST_ASSERT_EQ(a->rx_queue.count, 1);
+    TEST_ASSERT_EQ(d->rx_queue.count, 0);
+    TEST_ASSERT_EQ(sw->forwarded, 1);
+    vswitch_purge(a);
+    TEST_ASSERT_EQ(vswitch_done_calls, 2);
+    
+    /* Tagged frames are not accepted on access ports */
+    TEST_ASSERT_EQ(d->transmit(d, &(net_sg_t){tagged, sizeof(tagged)}, 1, NULL,
+                               vswitch_tx_done, NULL), 0);
+    TEST_ASSERT_EQ(c->transmit(c, &(net_sg_t){tagged, sizeof(tagged)}, 1, NULL,
+                               vswitch_tx_done, NULL), 0);
+    vswitch_forward(sw);
+    TEST_ASSERT_EQ(a->rx_queue.count, 1);     /* Untagged from the trunk */
+    TEST_ASSERT_EQ(b->rx_queue.count, 1);
+    TEST_ASSERT_EQ(c->rx_queue.count, 0);
+    TEST_ASSERT_EQ(sw->dropped, 1);
+    TEST_ASSERT_EQ(a->rx_queue.head->pkt_len, sizeof(frame));
+    vswitch_purge(a);
+    vswitch_purge(b);
+    TEST_ASSERT_EQ(vswitch_done_calls, 4);
+    
+    vswitch_destroy(sw);
+    TEST_ASSERT_NULL(vswitch_find("test"));
+    return TEST_PASS;
+}
+
+/* Frames a peer still holds outlive a reset or a destroyed sender */
+static test_result_t test_vswitch_nic_teardown(void)
+{
+    vswitch_t *sw = vswitch_create("teardown");
+    TEST_ASSERT_NOT_NULL(sw);
+    net_backend_t *a = vswitch_port_create(sw, NULL, 0, false);
+    net_backend_t *b = vswitch_port_create(sw, NULL, 0, false);
+    TEST_ASSERT(a && b);
+    virtio_net_t *net = virtio_net_create(a);
+    TEST_ASSERT_NOT_NULL(net);
+    
+    phys_addr_t ring = pmm_alloc_pages(2);
+    phys_addr_t bufs = pmm_alloc_pages(0);
+    TEST_ASSERT(ring != 0 && bufs != 0);
+    memset(phys_to_virt(ring), 0, 4 * PAGE_SIZE);
+    memset(phys_to_virt(bufs), 0, PAGE_SIZE);
+    
+    /* Two broadcasts from A */
+    virtqueue_t *vq = net->queues[0].tx_vq;
+    virtq_set_addr(vq, ring, ring + PAGE_SIZE, ring + 2 * PAGE_SIZE);
+    for (uint16_t i = 0; i < 2; i++) {
+        uint8_t *frame = (uint8_t *)phys_to_virt(bufs + i * 256) + VIRTIO_NET_HDR_LEGACY_LEN;
+        memset(frame, 0xFF, ETH_ALEN);
+        memcpy(frame + ETH_ALEN, a->mac, ETH_ALEN);
+        vq->desc[i].addr = bufs + i * 256;
+        vq->desc[i].len = VIRTIO_NET_HDR_LEGACY_LEN + 64;
+        vq->avail->ring[i] = i;
+    }
+    
+    /* Reset: the chain held by B never reaches the new ring */
+    vq->avail->idx = 1;
+    net->dev.queue_notify(&net->dev, 1);
+    TEST_ASSERT_EQ(b->rx_queue.count, 1);
+    TEST_ASSERT_EQ(net->queues[0].tx_inflight, 1);
+    net->dev.reset(&net->dev);
+    TEST_ASSERT_EQ(net->queues[0].tx_inflight, 0);
+    vswitch_purge(b);
+    TEST_ASSERT_EQ(vq->used->idx, 0);
+    
+    /* Destroy, port first: B's copy completes after both are gone */
+    vq->avail->idx = 2;
+    net->dev.queue_notify(&net->dev, 1);
+    TEST_ASSERT_EQ(b->rx_queue.count, 1);
+    TEST_ASSERT_EQ(net->queues[0].tx_inflight, 1);
+    net_backend_destroy(a);
+    TEST_ASSERT_NULL(net->backend);
+    virtio_net_destroy(net);
+    vswitch_purge(b);
+    
+    vswitch_destroy(sw);
+    pmm_free_pages(bufs, 0);
+    pmm_free_pages(ring, 2);
+    return TEST_PASS;
+}
+
+static test_case_t vswitch_tests[] = {
+    {"forwarding", test_vswitch_forwarding},
+    {"nic_teardown", test_vswitch_nic_teardown},
+};
+
+static test_suite_t vswitch_suite = {
+    .name = "Virtual Switch",
+    .setup = pktbuf_setup,
+    .teardown = NULL,
+    .tests = vswitch_tests,
+    .test_count = sizeof(vswitch_tests) / sizeof(vswitch_tests[0]),
+};
+
+/* ============================================================================
+ * Uplink Tests
+ * ============================================================================ */
+
+/* Drive the emulated device's modern BAR in place of a physical NIC */
+static uint32_t uplink_bar_read(void *ctx, uint32_t region, uint32_t offset, int size)
+{
+    pci_device_t *pci = ctx;
+    uint64_t val = 0;
+    
+    pci->bar_read(pci, VIRTIO_PCI_MODERN_BAR, region * VIRTIO_PCI_REGION_SIZE + offset,
+                  size, &val);
+    return (uint32_t)val;
+}
+
+static void uplink_bar_write(void *ctx, uint32_t region, uint32_t offset, int size,
+                             uint32_t value)
+{
+    pci_device_t *pci = ctx;
+    
+    pci->bar_write(pci, VIRTIO_PCI_MODERN_BAR, region * VIRTIO_PCI_REGION_SIZE + offset,
+                   size, value);
+}
+
+/*
+ * Accessors as uplink_probe() installs them: @ctx is the uplink's region
+ * table. Each entry here stands for the emulated device's BAR.
+ */
+static uint32_t uplink_region_read(void *ctx, uint32_t region, uint32_t offset, int size)
+{
+    volatile uint8_t **regions = ctx;
+    if (!regions[region]) return 0;
+    return uplink_bar_read((void *)regions[region], region, offset, size);
+}
+
+static void uplink_region_write(void *ctx, uint32_t region, uint32_t offset, int size,
+                                uint32_t value)
+{
+    volatile uint8_t **regions = ctx;
+    if (regions[region]) {
+        uplink_bar_write((void *)regions[region], region, offset, size, value);
+    }
+}
+
+static pktbuf_queue_t uplink_received;
+
+static void uplink_rx(void *ctx UNUSED, pktbuf_t *pb)
+{
+    pktq_push(&uplink_received, pb);
+}
+
+static test_result_t test_uplink_loopback(void)
+{
+    static uint8_t small[60], large[1400];
+    static uint8_t out[sizeof(large)];
+    for (uint32_t i = 0; i < sizeof(large); i++) {
+        large[i] = (uint8_t)(i * 7);
+        if (i < sizeof(small)) small[i] = (uint8_t)(i + 1);
+    }
+    
+    net_backend_t *be = net_backend_create_loopback();
+    TEST_ASSERT_NOT_NULL(be);
+    virtio_net_t *net = virtio_net_create_mq(be, 2);
+    TEST_ASSERT_NOT_NULL(net);
+    
+    uplink_io_t io = {
+        .read = uplink_bar_read,
+        .write = uplink_bar_write,
+        .ctx = &net->dev.pci,
+        .notify_mult = VIRTIO_PCI_NOTIFY_MULTIPLIER,
+    };
+    uplink_t *up = uplink_create(&io, UPLINK_MAX_QUEUE_PAIRS);
+    TEST_ASSERT_NOT_NULL(up);
+    
+    /* Both pairs agreed over the control queue; the MAC came from config */
+    TEST_ASSERT_EQ(up->queue_pairs, 2);
+    TEST_ASSERT_EQ(net->curr_queue_pairs, 2);
+    TEST_ASSERT_MEM_EQ(up->mac, be->mac, 6);
+    TEST_ASSERT(up->caps & NET_CAP_CSUM);
+    
+    /* Copied into the header slot, then through descriptor chains */
+    pktq_init(&uplink_received);
+    uplink_set_rx_handler(up, uplink_rx, NULL);
+    TEST_ASSERT_EQ(uplink_send(up, small, sizeof(small)), 0);
+    TEST_ASSERT_EQ(uplink_send(up, large, sizeof(large)), 0);
+    TEST_ASSERT_EQ(uplink_poll(up, UPLINK_POLL_BUDGET), 2);
+    TEST_ASSERT_EQ(uplink_received.count, 2);
+    
+    pktbuf_t *pb = pktq_pop(&uplink_received);
+    TEST_ASSERT_EQ(pb->pkt_len, sizeof(small));
+    TEST_ASSERT_MEM_EQ(pb->data, small, sizeof(small));
+    pktbuf_free(pb);
+    
+    pb = pktq_pop(&uplink_received);
+    TEST_ASSERT_EQ(pb->pkt_len, sizeof(large));
+    pktbuf_copy_out(pb, 0, out, sizeof(out));
+    TEST_ASSERT_MEM_EQ(out, large, sizeof(large));
+    pktbuf_free(pb);
+    
+    /* Every TX descriptor comes back once completions are reaped */
+    uplink_poll(up, UPLINK_POLL_BUDGET);
+    for (uint16_t i = 0; i < up->queue_pairs; i++) {
+        TEST_ASSERT_EQ(up->queues[i].tx.num_free, up->queues[i].tx.num);
+    }
+    
+    uplink_destroy(up);
+    virtio_net_destroy(net);
+    net_backend_destroy(be);
+    return TEST_PASS;
+}
+
+static test_result_t test_uplink_regions(void)
+{
+    net_backend_t *be = net_backend_create_loopback();
+    TEST_ASSERT_NOT_NULL(be);
+    virtio_net_t *net = virtio_net_create(be);
+    TEST_ASSERT_NOT_NULL(net);
+    
+    /* No ctx: the device is reached through the regions, from the start */
+    uplink_io_t io = {
+        .read = uplink_region_read,
+        .write = uplink_region_write,
+        .ctx = NULL,
+        .notify_mult = VIRTIO_PCI_NOTIFY_MULTIPLIER,
+    };
+    for (int i = 0; i < UPLINK_REGIONS; i++) {
+        io.regions[i] = (volatile uint8_t *)&net->dev.pci;
+    }
+    
+    uplink_t *up = uplink_create(&io, UPLINK_MAX_QUEUE_PAIRS);
+    TEST_ASSERT_NOT_NULL(up);
+    TEST_ASSERT(up->io.ctx == up->regions);
+    TEST_ASSERT_MEM_EQ(up->mac, be->mac, 6);
+    TEST_ASSERT_EQ(net->dev.status & VIRTIO_STATUS_DRIVER_OK, VIRTIO_STATUS_DRIVER_OK);
+    
+    uplink_destroy(up);
+    virtio_net_destroy(net);
+    net_backend_destroy(be);
+    return TEST_PASS;
+}
+
+static test_case_t uplink_tests[] = {
+    {"loopback", test_uplink_loopback},
+    {"regions", test_uplink_regions},
+};
+
+static test_suite_t uplink_suite = {
+    .name = "Uplink",
+    .setup = pktbuf_setup,
+    .teardown = NULL,
+    .tests = uplink_tests,
+    .test_count = sizeof(uplink_tests) / sizeof(uplink_tests[0]),
+};
+
+/* ============================================================================
+ * Suite Registration
+ * ============================================================================ */
+
+void test_net_suite(void)
+{
+    test_register_suite(&pktbuf_suite);
+    test_register_suite(&flow_suite);
+    test_register_suite(&offload_suite);
+    test_register_suite(&virtio_net_suite);
+    test_register_suite(&vswitch_suite);
+    test_register_suite(&uplink_suite);
+}
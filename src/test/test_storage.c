@@ -9,8 +9,13 @@
 #include <test/framework.h>
 #include <storage/block.h>
 #include <storage/pool.h>
+#include <storage/qos.h>
+#include <storage/cache.h>
+#include <storage/memblk.h>
 #include <storage/distributed.h>
 #include <mm/heap.h>
+#include <kernel/timer.h>
+#include <arch/x86_64/cpu.h>
 
 /* ============================================================================
  * Block Layer Tests
@@ -48,10 +53,789 @@ static test_result_t test_block_ops(void)
     return TEST_PASS;
 }
 
+static test_result_t test_block_request_pool(void)
+{
+    static block_request_t *reqs[BLOCK_REQ_POOL_COUNT];
+    block_req_stats_t st;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    
+    /* Pooled requests come zeroed, each on its own cache lines */
+    block_request_t *req = block_alloc_request();
+    TEST_ASSERT_NOT_NULL(req);
+    TEST_ASSERT_NE(req->slot, 0);
+    TEST_ASSERT_EQ((uintptr_t)req & 63, 0);
+    req->offset = 123;
+    block_free_request(req);
+    TEST_ASSERT(block_alloc_request() == req);
+    TEST_ASSERT_EQ(req->offset, 0);
+    block_free_request(req);
+    
+    /* Once the pool is dry the heap takes over, leaving the reserve */
+    block_get_request_stats(&st);
+    uint64_t heap_allocs = st.heap_allocs;
+    uint32_t n = 0;
+    while (n < BLOCK_REQ_POOL_COUNT) {
+        reqs[n] = block_alloc_request();
+        TEST_ASSERT_NOT_NULL(reqs[n]);
+        if (!reqs[n++]->slot) break;
+    }
+    TEST_ASSERT_EQ(n, BLOCK_REQ_POOL_COUNT - BLOCK_REQ_RESERVE + 1);
+    block_get_request_stats(&st);
+    TEST_ASSERT_EQ(st.heap_allocs, heap_allocs + 1);
+    TEST_ASSERT_EQ(st.free, BLOCK_REQ_RESERVE);
+    
+    while (n > 0) {
+        block_free_request(reqs[--n]);
+    }
+    return TEST_PASS;
+}
+
+/* Backend that holds requests until the test completes them */
+#define HELD_MAX    8
+
+static block_request_t *held[HELD_MAX];
+static uint32_t held_count;
+static int async_done;
+
+static int held_submit(block_device_t *dev UNUSED, block_request_t *req)
+{
+    if (held_count >= HELD_MAX) return -1;
+    held[held_count++] = req;
+    return 0;
+}
+
+/* Polled completion: everything held finishes on the next poll */
+static void held_poll(block_device_t *dev UNUSED)
+{
+    for (uint32_t i = 0; i < held_count; i++) {
+        if (held[i]) {
+            block_request_t *req = held[i];
+            held[i] = NULL;
+            block_complete(req, 0);
+        }
+    }
+}
+
+static const block_ops_t held_ops = {
+    .submit = held_submit,
+    .poll = held_poll,
+};
+
+static void count_async_done(void *ctx UNUSED, int status)
+{
+    if (status == 0) async_done++;
+}
+
+static test_result_t test_block_async_queue(void)
+{
+    block_device_t dev = {0};
+    block_request_t reqs[4] = {0};
+    
+    dev.size = 1 * MB;
+    dev.ops = &held_ops;
+    dev.max_queue_depth = 2;
+    dev.max_io_size = BLOCK_SIZE_4K;    /* Waiters stay apart */
+    held_count = 0;
+    async_done = 0;
+    
+    for (int i = 0; i < 4; i++) {
+        reqs[i].op = BLOCK_OP_READ;
+        reqs[i].offset = i * BLOCK_SIZE_4K;
+        reqs[i].length = BLOCK_SIZE_4K;
+        reqs[i].completion = count_async_done;
+        TEST_ASSERT_EQ(block_submit_async(&dev, &reqs[i]), 0);
+    }
+    
+    /* Two at the backend, two waiting for a slot */
+    block_stats_t st;
+    block_get_stats(&dev, &st);
+    TEST_ASSERT_EQ(st.inflight, 2);
+    TEST_ASSERT_EQ(st.queued, 2);
+    TEST_ASSERT_EQ(held_count, 2);
+    
+    /* A completion hands its slot to the oldest waiter */
+    held[0] = NULL;
+    block_complete(&reqs[0], 0);
+    TEST_ASSERT_EQ(async_done, 1);
+    TEST_ASSERT_EQ(held_count, 3);
+    TEST_ASSERT(held[2] == &reqs[2]);
+    block_get_stats(&dev, &st);
+    TEST_ASSERT_EQ(st.inflight, 2);
+    TEST_ASSERT_EQ(st.queued, 1);
+    
+    /* Out of range never reaches the backend */
+    block_request_t bad = { .op = BLOCK_OP_READ, .offset = dev.size, .length = 1 };
+    TEST_ASSERT_EQ(block_submit_async(&dev, &bad), -1);
+    
+    /* Polling drains the backend; the last waiter follows */
+    block_poll(&dev);
+    block_poll(&dev);
+    TEST_ASSERT_EQ(async_done, 4);
+    block_get_stats(&dev, &st);
+    TEST_ASSERT_EQ(st.inflight, 0);
+    TEST_ASSERT_EQ(st.queued, 0);
+    TEST_ASSERT_EQ(st.read_ops, 4);
+    
+    block_unregister(&dev);
+    return TEST_PASS;
+}
+
+static test_result_t test_block_sync_polled(void)
+{
+    block_device_t dev = {0};
+    static uint8_t buf[512];
+    
+    dev.size = 1 * MB;
+    dev.ops = &held_ops;
+    held_count = 0;
+    
+    /* The waiter polls the backend instead of spinning on a flag */
+    block_stats_t st;
+    TEST_ASSERT_EQ(block_read(&dev, 0, buf, sizeof(buf)), 0);
+    TEST_ASSERT_EQ(held_count, 1);
+    block_get_stats(&dev, &st);
+    TEST_ASSERT_EQ(st.inflight, 0);
+    
+    dev.readonly = true;
+    TEST_ASSERT_EQ(block_write(&dev, 0, buf, sizeof(buf)), -1);
+    TEST_ASSERT_EQ(held_count, 1);
+    
+    block_unregister(&dev);
+    return TEST_PASS;
+}
+
+static test_result_t test_block_hw_queues(void)
+{
+    block_device_t dev = {0};
+    block_request_t reqs[3] = {0};
+    
+    dev.size = 1 * MB;
+    dev.ops = &held_ops;
+    dev.nr_hw_queues = 4;
+    dev.max_queue_depth = 1;
+    held_count = 0;
+    async_done = 0;
+    
+    for (int i = 0; i < 3; i++) {
+        reqs[i].op = BLOCK_OP_WRITE;
+        reqs[i].length = BLOCK_SIZE_512;
+        reqs[i].completion = count_async_done;
+        TEST_ASSERT_EQ(block_submit_async(&dev, &reqs[i]), 0);
+    }
+    
+    /* Everything from this CPU lands on the hardware queue it maps to */
+    uint32_t cpu = smp_get_current_cpu();
+    block_hw_queue_t *hwq = &dev.hw_queues[cpu % 4];
+    TEST_ASSERT_EQ(reqs[0].hwq, cpu % 4);
+    TEST_ASSERT_EQ(reqs[0].cpu, cpu);
+    TEST_ASSERT_EQ(dev.sw_queues[cpu % dev.nr_sw_queues].submitted, 3);
+    TEST_ASSERT_EQ(hwq->inflight, 1);
+    TEST_ASSERT_EQ(hwq->queued, 2);
+    TEST_ASSERT_EQ(dev.hw_queues[(cpu + 1) % 4].queued, 0);
+    
+    /* Completions come back to this CPU and keep the queue moving */
+    block_poll(&dev);
+    TEST_ASSERT_EQ(async_done, 3);
+    TEST_ASSERT_EQ(hwq->write_ops, 3);
+    
+    block_unregister(&dev);
+    return TEST_PASS;
+}
+
+static test_result_t test_block_merge(void)
+{
+    block_device_t dev = {0};
+    block_request_t reqs[8] = {0};
+    static uint8_t data[8 * BLOCK_SIZE_4K];
+    static const int order[8] = { 1, 2, 3, 0, 4, 5, 6, 7 };
+    
+    dev.size = 1 * MB;
+    dev.ops = &held_ops;
+    dev.max_io_size = 4 * BLOCK_SIZE_4K;
+    held_count = 0;
+    async_done = 0;
+    
+    for (int i = 0; i < 8; i++) {
+        reqs[i].op = BLOCK_OP_WRITE;
+        reqs[i].offset = i * BLOCK_SIZE_4K;
+        reqs[i].length = BLOCK_SIZE_4K;
+        reqs[i].buffer = data + i * BLOCK_SIZE_4K;
+        reqs[i].completion = count_async_done;
+    }
+    
+    /* A plugged stream merges at both ends, up to the size limit */
+    block_plug_t plug;
+    block_start_plug(&plug);
+    for (int i = 0; i < 8; i++) {
+        TEST_ASSERT_EQ(block_submit_async(&dev, &reqs[order[i]]), 0);
+    }
+    TEST_ASSERT_EQ(held_count, 0);
+    block_finish_plug(&plug);
+    
+    TEST_ASSERT_EQ(held_count, 2);
+    TEST_ASSERT_EQ(held[0]->offset, 0);
+    TEST_ASSERT_EQ(held[0]->length, 4 * BLOCK_SIZE_4K);
+    TEST_ASSERT_EQ(held[0]->iov_count, 4);
+    TEST_ASSERT(held[0]->iov[0].base == data);
+    TEST_ASSERT(held[0]->iov[3].base == data + 3 * BLOCK_SIZE_4K);
+    TEST_ASSERT_EQ(held[1]->offset, 4 * BLOCK_SIZE_4K);
+    
+    /* Every merged request completes on its own */
+    block_poll(&dev);
+    TEST_ASSERT_EQ(async_done, 8);
+    block_stats_t st;
+    block_get_stats(&dev, &st);
+    TEST_ASSERT_EQ(st.write_ops, 8);
+    TEST_ASSERT_EQ(st.merges, 6);
+    
+    /* Without a plug, requests waiting for a slot merge in the queue */
+    dev.max_queue_depth = 1;
+    held_count = 0;
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQ(block_submit_async(&dev, &reqs[i]), 0);
+    }
+    TEST_ASSERT_EQ(held_count, 1);
+    block_get_stats(&dev, &st);
+    TEST_ASSERT_EQ(st.queued, 1);
+    
+    block_poll(&dev);
+    TEST_ASSERT_EQ(held_count, 2);
+    TEST_ASSERT_EQ(async_done, 11);
+    
+    block_unregister(&dev);
+    return TEST_PASS;
+}
+
+static test_result_t test_block_merge_plugged(void)
+{
+    block_device_t dev = {0};
+    block_request_t reqs[6] = {0};
+    static uint8_t data[6 * BLOCK_SIZE_4K];
+    static const uint32_t at[6] = { 0, 4, 5, 6, 2, 3 };  /* In 4K blocks */
+    
+    dev.size = 1 * MB;
+    dev.ops = &held_ops;
+    dev.max_queue_depth = 1;
+    held_count = 0;
+    async_done = 0;
+    
+    for (int i = 0; i < 6; i++) {
+        reqs[i].op = BLOCK_OP_WRITE;
+        reqs[i].offset = at[i] * BLOCK_SIZE_4K;
+        reqs[i].length = BLOCK_SIZE_4K;
+        reqs[i].buffer = data + i * BLOCK_SIZE_4K;
+        reqs[i].completion = count_async_done;
+    }
+    
+    /* One in flight fills the queue; the next waits */
+    TEST_ASSERT_EQ(block_submit_async(&dev, &reqs[0]), 0);
+    TEST_ASSERT_EQ(block_submit_async(&dev, &reqs[1]), 0);
+    TEST_ASSERT_EQ(held_count, 1);
+    
+    /* Plugged pairs arrive merged and join the waiting one at each end */
+    block_plug_t plug;
+    for (int i = 2; i < 6; i += 2) {
+        block_start_plug(&plug);
+        TEST_ASSERT_EQ(block_submit_async(&dev, &reqs[i]), 0);
+        TEST_ASSERT_EQ(block_submit_async(&dev, &reqs[i + 1]), 0);
+        block_finish_plug(&plug);
+    }
+    block_stats_t st;
+    block_get_stats(&dev, &st);
+    TEST_ASSERT_EQ(st.queued, 1);
+    
+    /* Finishing the first sends the rest as one */
+    block_request_t *first = held[0];
+    held[0] = NULL;
+    block_complete(first, 0);
+    TEST_ASSERT_EQ(held_count, 2);
+    TEST_ASSERT_EQ(held[1]->offset, 2 * BLOCK_SIZE_4K);
+    TEST_ASSERT_EQ(held[1]->length, 5 * BLOCK_SIZE_4K);
+    TEST_ASSERT_EQ(held[1]->iov_count, 5);
+    TEST_ASSERT(held[1]->iov[0].base == reqs[4].buffer);
+    TEST_ASSERT(held[1]->iov[4].base == reqs[3].buffer);
+    
+    /* Every request inside completes, not just the outer wrapper */
+    block_poll(&dev);
+    TEST_ASSERT_EQ(async_done, 6);
+    block_get_stats(&dev, &st);
+    TEST_ASSERT_EQ(st.write_ops, 6);
+    TEST_ASSERT_EQ(st.merges, 4);
+    
+    block_unregister(&dev);
+    return TEST_PASS;
+}
+
+static test_result_t test_block_qos(void)
+{
+    block_device_t fast = {0}, bulk = {0};
+    block_request_t reqs[4] = {0};
+    block_qos_config_t cfg = {0};
+    
+    fast.size = bulk.size = 1 * MB;
+    fast.ops = bulk.ops = &held_ops;
+    bulk.max_queue_depth = 4;
+    held_count = 0;
+    async_done = 0;
+    
+    for (int i = 0; i < 4; i++) {
+        reqs[i].op = BLOCK_OP_WRITE;
+        reqs[i].offset = i * 2 * BLOCK_SIZE_4K;
+        reqs[i].length = BLOCK_SIZE_4K;
+        reqs[i].completion = count_async_done;
+    }
+    
+    /* The burst, one more on credit, then one every 100 ms */
+    cfg.write.pkts_per_sec = 10;
+    cfg.write.burst_pkts = 1;
+    TEST_ASSERT_EQ(block_qos_set(&bulk, &cfg), 0);
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQ(block_submit_async(&bulk, &reqs[i]), 0);
+    }
+    TEST_ASSERT_EQ(held_count, 2);
+    TEST_ASSERT(bulk.qos->throttled > 0);
+    
+    /* Lifting the limit releases what is waiting */
+    TEST_ASSERT_EQ(block_qos_set(&bulk, NULL), 0);
+    TEST_ASSERT_EQ(held_count, 4);
+    block_poll(&bulk);
+    TEST_ASSERT_EQ(async_done, 4);
+    
+    /* The heavier device missing its target throttles the lighter one */
+    cfg = (block_qos_config_t){ .weight = 500, .latency_target_us = 1 };
+    TEST_ASSERT_EQ(block_qos_set(&fast, &cfg), 0);
+    block_request_t slow = { .op = BLOCK_OP_READ, .length = BLOCK_SIZE_512 };
+    held_count = 0;
+    TEST_ASSERT_EQ(block_submit_async(&fast, &slow), 0);
+    uint64_t start = rdtsc_us();
+    while (rdtsc_us() < start + 3) {
+        pause();
+    }
+    block_poll(&fast);
+    block_qos_evaluate();
+    TEST_ASSERT(fast.qos->latency_us >= 2);
+    TEST_ASSERT_EQ(fast.qos->depth_limit, 0);
+    TEST_ASSERT_EQ(bulk.qos->depth_limit, 2);
+    
+    held_count = 0;
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQ(block_submit_async(&bulk, &reqs[i]), 0);
+    }
+    TEST_ASSERT_EQ(held_count, 2);
+    
+    /* With every target met the depth comes back */
+    block_qos_evaluate();
+    ktimer_run();
+    TEST_ASSERT_EQ(bulk.qos->depth_limit, 0);
+    TEST_ASSERT_EQ(held_count, 3);
+    block_poll(&bulk);
+    TEST_ASSERT_EQ(async_done, 7);
+    
+    /* A throttled synchronous request is released while its caller waits */
+    cfg = (block_qos_config_t){ .write = { .pkts_per_sec = 1000, .burst_pkts = 1 } };
+    TEST_ASSERT_EQ(block_qos_set(&bulk, &cfg), 0);
+    held_count = 0;
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_EQ(block_submit_async(&bulk, &reqs[i]), 0);
+    }
+    uint64_t throttled = bulk.qos->throttled;
+    block_request_t sync = {
+        .op = BLOCK_OP_WRITE,
+        .offset = 16 * BLOCK_SIZE_4K,
+        .length = BLOCK_SIZE_4K,
+    };
+    TEST_ASSERT_EQ(block_submit_wait(&bulk, &sync), 0);
+    TEST_ASSERT(bulk.qos->throttled > throttled);
+    TEST_ASSERT_EQ(async_done, 9);
+    
+    block_unregister(&fast);
+    block_unregister(&bulk);
+    return TEST_PASS;
+}
+
+static test_result_t test_block_latency(void)
+{
+    block_device_t dev = {0};
+    block_request_t reqs[3] = {0};
+    
+    dev.size = 1 * MB;
+    dev.ops = &held_ops;
+    dev.max_queue_depth = 1;
+    dev.max_io_size = BLOCK_SIZE_4K;
+    held_count = 0;
+    
+    for (int i = 0; i < 3; i++) {
+        reqs[i].op = BLOCK_OP_WRITE;
+        reqs[i].offset = i * BLOCK_SIZE_4K;
+        reqs[i].length = BLOCK_SIZE_4K;
+        TEST_ASSERT_EQ(block_submit_async(&dev, &reqs[i]), 0);
+    }
+    
+    /* Each arrival saw the ones before it */
+    block_stats_t st;
+    block_get_stats(&dev, &st);
+    TEST_ASSERT_EQ(st.inflight, 1);
+    TEST_ASSERT_EQ(st.depth_samples, 3);
+    TEST_ASSERT_EQ(st.depth_sum, 0 + 1 + 2);
+    TEST_ASSERT_EQ(st.depth_max, 2);
+    
+    uint64_t start = rdtsc_us();
+    while (rdtsc_us() < start + 8) {
+        pause();
+    }
+    block_poll(&dev);
+    
+    /* Submission to completion, so the queued ones waited too */
+    block_get_stats(&dev, &st);
+    block_latency_t *lat = &st.latency[BLOCK_LAT_WRITE];
+    TEST_ASSERT_EQ(lat->count, 3);
+    TEST_ASSERT_EQ(st.latency[BLOCK_LAT_READ].count, 0);
+    TEST_ASSERT_GE(lat->max_us, 8);
+    TEST_ASSERT_EQ(lat->buckets[0] + lat->buckets[1] + lat->buckets[2], 0);
+    TEST_ASSERT_GE(block_latency_percentile(lat, 500), 8);
+    TEST_ASSERT_LE(block_latency_percentile(lat, 999), lat->max_us);
+    
+    /* Percentiles report the bucket's upper bound */
+    block_latency_t synth = {0};
+    synth.buckets[1] = 90;      /* 2-3 us */
+    synth.buckets[10] = 10;     /* 1-2 ms */
+    synth.count = 100;
+    synth.max_us = 1500;
+    TEST_ASSERT_EQ(block_latency_percentile(&synth, 500), 4);
+    TEST_ASSERT_EQ(block_latency_percentile(&synth, 900), 4);
+    TEST_ASSERT_EQ(block_latency_percentile(&synth, 990), 1500);
+    
+    block_unregister(&dev);
+    return TEST_PASS;
+}
+
+/* Flat backend moving data segment by segment */
+static uint8_t flat_disk[64 * KB];
+static uint32_t flat_reads;
+static uint32_t flat_flushes;
+static block_request_t flat_writes[8];  /* The first few, as seen */
+static uint32_t flat_write_count;
+
+static int flat_submit(block_device_t *dev UNUSED, block_request_t *req)
+{
+    if (req->op == BLOCK_OP_READ) {
+        flat_reads++;
+        block_iov_copy_to(req, 0, flat_disk + req->offset, req->length);
+    } else if (req->op == BLOCK_OP_FLUSH) {
+        flat_flushes++;
+    } else if (req->op == BLOCK_OP_WRITE) {
+        if (flat_write_count < 8) {
+            flat_writes[flat_write_count] = *req;
+        }
+        flat_write_count++;
+        block_iov_copy_from(req, 0, flat_disk + req->offset, req->length);
+    }
+    block_complete(req, 0);
+    return 0;
+}
+
+static const block_ops_t flat_ops = {
+    .submit = flat_submit,
+};
+
+static test_result_t test_block_iovec(void)
+{
+    block_device_t dev = {0};
+    static uint8_t a[700], b[100], c[1500], out[2300];
+    
+    dev.size = sizeof(flat_disk);
+    dev.ops = &flat_ops;
+    
+    memset(a, 0xA1, sizeof(a));
+    memset(b, 0xB2, sizeof(b));
+    memset(c, 0xC3, sizeof(c));
+    block_iovec_t iov[3] = {
+        { a, sizeof(a) }, { b, sizeof(b) }, { c, sizeof(c) },
+    };
+    
+    /* Uneven segments land back to back */
+    TEST_ASSERT_EQ(block_writev(&dev, 512, iov, 3), 0);
+    TEST_ASSERT_EQ(block_read(&dev, 512, out, sizeof(out)), 0);
+    TEST_ASSERT_MEM_EQ(out, a, sizeof(a));
+    TEST_ASSERT_MEM_EQ(out + sizeof(a), b, sizeof(b));
+    TEST_ASSERT_MEM_EQ(out + sizeof(a) + sizeof(b), c, sizeof(c));
+    
+    /* And scatter again on the way back */
+    memset(a, 0, sizeof(a));
+    memset(c, 0, sizeof(c));
+    iov[1] = iov[2];
+    TEST_ASSERT_EQ(block_readv(&dev, 512 + 100, iov, 2), 0);
+    TEST_ASSERT_EQ(a[0], 0xA1);
+    TEST_ASSERT_EQ(a[sizeof(a) - 1], 0xB2);
+    TEST_ASSERT_EQ(c[0], 0xC3);
+    
+    /* The length has to match the segments */
+    block_request_t req = { .op = BLOCK_OP_READ, .length = 1, .iov = iov, .iov_count = 1 };
+    TEST_ASSERT_EQ(block_submit_async(&dev, &req), -1);
+    
+    block_unregister(&dev);
+    return TEST_PASS;
+}
+
+/* Flat backend that notes how deeply submits nest */
+static uint32_t nest_depth;
+static uint32_t nest_max;
+
+static int nest_submit(block_device_t *dev, block_request_t *req)
+{
+    nest_depth++;
+    nest_max = MAX(nest_max, nest_depth);
+    int ret = flat_submit(dev, req);
+    nest_depth--;
+    return ret;
+}
+
+static const block_ops_t nest_ops = {
+    .submit = nest_submit,
+};
+
+static test_result_t test_block_inline_completion(void)
+{
+    block_device_t dev = {0};
+    block_request_t reqs[BLOCK_PLUG_MAX - 1] = {0};
+    static uint8_t data[512];
+    
+    dev.size = sizeof(flat_disk);
+    dev.ops = &nest_ops;
+    nest_depth = 0;
+    nest_max = 0;
+    async_done = 0;
+    
+    /* Gaps keep them apart; the plug queues them all at once */
+    block_plug_t plug;
+    block_start_plug(&plug);
+    for (uint32_t i = 0; i < ARRAY_SIZE(reqs); i++) {
+        reqs[i].op = BLOCK_OP_READ;
+        reqs[i].offset = i * 1024;
+        reqs[i].length = sizeof(data);
+        reqs[i].buffer = data;
+        reqs[i].completion = count_async_done;
+        TEST_ASSERT_EQ(block_submit_async(&dev, &reqs[i]), 0);
+    }
+    block_finish_plug(&plug);
+    
+    /* Each completes inside its submit; the next is sent from the loop */
+    TEST_ASSERT_EQ(async_done, ARRAY_SIZE(reqs));
+    TEST_ASSERT_EQ(nest_max, 1);
+    TEST_ASSERT_EQ(nest_depth, 0);
+    
+    block_unregister(&dev);
+    return TEST_PASS;
+}
+
+static test_result_t test_block_cache(void)
+{
+    block_device_t dev = {0};
+    block_cache_config_t cfg = { .max_bytes = 8 * PAGE_SIZE };
+    static uint8_t buf[2 * PAGE_SIZE];
+    
+    dev.size = sizeof(flat_disk);
+    dev.ops = &flat_ops;
+    for (uint32_t i = 0; i < sizeof(flat_disk); i++) {
+        flat_disk[i] = (uint8_t)(i / PAGE_SIZE + 1);
+    }
+    flat_reads = 0;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    block_cache_t *cache = block_cache_create(&dev, &cfg);
+    TEST_ASSERT_NOT_NULL(cache);
+    block_device_t *front = &cache->blkdev;
+    TEST_ASSERT_EQ(front->size, dev.size);
+    
+    /* A miss goes down once, then the page is there */
+    TEST_ASSERT_EQ(block_read(front, 0, buf, PAGE_SIZE), 0);
+    TEST_ASSERT_EQ(block_read(front, 100, buf, 200), 0);
+    TEST_ASSERT_EQ(buf[0], 1);
+    TEST_ASSERT_EQ(flat_reads, 1);
+    TEST_ASSERT_EQ(cache->misses, 1);
+    TEST_ASSERT_EQ(cache->hits, 1);
+    
+    /* Reading on from there is sequential and starts read-ahead */
+    TEST_ASSERT_EQ(block_read(front, PAGE_SIZE, buf, PAGE_SIZE), 0);
+    TEST_ASSERT_EQ(flat_reads, 3);
+    TEST_ASSERT_EQ(cache->readahead_pages, BLOCK_CACHE_RA_MIN);
+    TEST_ASSERT_EQ(block_read(front, 2 * PAGE_SIZE, buf, 2 * PAGE_SIZE), 0);
+    TEST_ASSERT_EQ(buf[0], 3);
+    TEST_ASSERT_EQ(buf[PAGE_SIZE], 4);
+    TEST_ASSERT_EQ(cache->readahead_hits, 2);
+    
+    /* Writes go through and the next read sees them */
+    memset(buf, 0xEE, PAGE_SIZE);
+    TEST_ASSERT_EQ(block_write(front, 3 * PAGE_SIZE + 512, buf, 512), 0);
+    TEST_ASSERT_EQ(flat_disk[3 * PAGE_SIZE + 512], 0xEE);
+    uint32_t reads = flat_reads;
+    TEST_ASSERT_EQ(block_read(front, 3 * PAGE_SIZE, buf, PAGE_SIZE), 0);
+    TEST_ASSERT_EQ(flat_reads, reads + 1);
+    TEST_ASSERT_EQ(buf[0], 4);
+    TEST_ASSERT_EQ(buf[512], 0xEE);
+    
+    /* Memory stays within the configured size */
+    for (uint32_t off = 0; off < sizeof(flat_disk); off += 4 * PAGE_SIZE) {
+        TEST_ASSERT_EQ(block_read(front, off, buf, PAGE_SIZE), 0);
+    }
+    TEST_ASSERT(cache->evictions > 0);
+    
+    block_cache_drop(cache);
+    reads = flat_reads;
+    TEST_ASSERT_EQ(block_read(front, 0, buf, PAGE_SIZE), 0);
+    TEST_ASSERT(flat_reads > reads);
+    
+    block_cache_destroy(cache);
+    block_unregister(&dev);
+    return TEST_PASS;
+}
+
+static test_result_t test_block_cache_writeback(void)
+{
+    block_device_t dev = {0};
+    block_cache_config_t cfg = {
+        .max_bytes = 16 * PAGE_SIZE,
+        .dirty_max = 8 * PAGE_SIZE,
+        .writeback = true,
+    };
+    static uint8_t buf[PAGE_SIZE];
+    
+    dev.size = sizeof(flat_disk);
+    dev.ops = &flat_ops;
+    memset(flat_disk, 0, sizeof(flat_disk));
+    flat_write_count = 0;
+    flat_flushes = 0;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    block_cache_t *cache = block_cache_create(&dev, &cfg);
+    TEST_ASSERT_NOT_NULL(cache);
+    block_device_t *front = &cache->blkdev;
+    
+    /* Whole pages complete in the cache and read back from it */
+    uint32_t order[3] = { 5, 3, 4 };
+    for (int i = 0; i < 3; i++) {
+        memset(buf, 0x50 + order[i], PAGE_SIZE);
+        TEST_ASSERT_EQ(block_write(front, order[i] * PAGE_SIZE, buf, PAGE_SIZE), 0);
+    }
+    TEST_ASSERT_EQ(flat_write_count, 0);
+    TEST_ASSERT_EQ(cache->nr_dirty, 3);
+    TEST_ASSERT_EQ(block_read(front, 4 * PAGE_SIZE, buf, 16), 0);
+    TEST_ASSERT_EQ(buf[0], 0x54);
+    
+    /* Half of dirty_max starts write-back, sorted and merged into runs */
+    memset(buf, 0x51, PAGE_SIZE);
+    TEST_ASSERT_EQ(block_write(front, 1 * PAGE_SIZE, buf, PAGE_SIZE), 0);
+    TEST_ASSERT_EQ(flat_write_count, 2);
+    TEST_ASSERT_EQ(flat_writes[0].offset, 1 * PAGE_SIZE);
+    TEST_ASSERT_EQ(flat_writes[0].length, PAGE_SIZE);
+    TEST_ASSERT_EQ(flat_writes[1].offset, 3 * PAGE_SIZE);
+    TEST_ASSERT_EQ(flat_writes[1].length, 3 * PAGE_SIZE);
+    TEST_ASSERT_EQ(flat_disk[5 * PAGE_SIZE], 0x55);
+    TEST_ASSERT_EQ(cache->nr_dirty, 0);
+    
+    /* Partial pages not cached go through */
+    memset(buf, 0x77, 512);
+    TEST_ASSERT_EQ(block_write(front, 8 * PAGE_SIZE, buf, 512), 0);
+    TEST_ASSERT_EQ(flat_write_count, 3);
+    TEST_ASSERT_EQ(flat_disk[8 * PAGE_SIZE], 0x77);
+    
+    /* A flush writes back what was dirty, then flushes the device */
+    memset(buf, 0x66, PAGE_SIZE);
+    TEST_ASSERT_EQ(block_write(front, 6 * PAGE_SIZE, buf, PAGE_SIZE), 0);
+    TEST_ASSERT_EQ(flat_disk[6 * PAGE_SIZE], 0);
+    TEST_ASSERT_EQ(block_flush(front), 0);
+    TEST_ASSERT_EQ(flat_disk[6 * PAGE_SIZE], 0x66);
+    TEST_ASSERT_EQ(flat_flushes, 1);
+    
+    /* FUA goes to the device, behind the dirty page it overwrites */
+    TEST_ASSERT_EQ(block_write(front, 6 * PAGE_SIZE, buf, PAGE_SIZE), 0);
+    block_iovec_t iov = { buf, 512 };
+    block_request_t req = {
+        .op = BLOCK_OP_WRITE, .flags = BLOCK_REQ_FUA,
+        .offset = 6 * PAGE_SIZE, .length = 512, .iov = &iov, .iov_count = 1,
+    };
+    memset(buf, 0x99, 512);
+    TEST_ASSERT_EQ(block_submit_wait(front, &req), 0);
+    TEST_ASSERT_EQ(flat_disk[6 * PAGE_SIZE], 0x99);
+    TEST_ASSERT_EQ(flat_writes[flat_write_count - 1].flags & BLOCK_REQ_FUA, BLOCK_REQ_FUA);
+    TEST_ASSERT(cache->waits > 0);
+    
+    /* Dirty data survives the cache going away */
+    memset(buf, 0x42, PAGE_SIZE);
+    TEST_ASSERT_EQ(block_write(front, 10 * PAGE_SIZE, buf, PAGE_SIZE), 0);
+    block_cache_destroy(cache);
+    TEST_ASSERT_EQ(flat_disk[10 * PAGE_SIZE], 0x42);
+    
+    block_unregister(&dev);
+    return TEST_PASS;
+}
+
+static test_result_t test_mem_block_sparse(void)
+{
+    static uint8_t buf[PAGE_SIZE];
+    static const uint8_t zero[PAGE_SIZE];
+    uint64_t far = 700 * MB + PAGE_SIZE;
+    
+    /* Far larger than it could ever be backed here */
+    block_device_t *dev = mem_block_create("sparse", 1ULL * GB);
+    TEST_ASSERT_NOT_NULL(dev);
+    TEST_ASSERT_EQ(dev->size, 1ULL * GB);
+    TEST_ASSERT_EQ(mem_block_used(dev), 0);
+    
+    /* Unwritten space reads as zero; writes allocate the page they touch */
+    memset(buf, 0xAB, 512);
+    TEST_ASSERT_EQ(block_write(dev, far + 100, buf, 512), 0);
+    TEST_ASSERT_EQ(mem_block_used(dev), PAGE_SIZE);
+    TEST_ASSERT_EQ(block_read(dev, far, buf, PAGE_SIZE), 0);
+    TEST_ASSERT_MEM_EQ(buf, zero, 100);
+    TEST_ASSERT_EQ(buf[100], 0xAB);
+    TEST_ASSERT_EQ(buf[611], 0xAB);
+    TEST_ASSERT_MEM_EQ(buf + 612, zero, PAGE_SIZE - 612);
+    TEST_ASSERT_EQ(block_read(dev, dev->size - PAGE_SIZE, buf, PAGE_SIZE), 0);
+    TEST_ASSERT_MEM_EQ(buf, zero, PAGE_SIZE);
+    
+    /* Across a page boundary */
+    memset(buf, 0xCD, PAGE_SIZE);
+    TEST_ASSERT_EQ(block_write(dev, 2048, buf, PAGE_SIZE), 0);
+    TEST_ASSERT_EQ(mem_block_used(dev), 3 * PAGE_SIZE);
+    
+    /* Discarding whole pages frees them, partial ones are zeroed */
+    block_request_t req = {
+        .op = BLOCK_OP_DISCARD, .offset = 0, .length = PAGE_SIZE + 1024,
+    };
+    TEST_ASSERT_EQ(block_submit_wait(dev, &req), 0);
+    TEST_ASSERT_EQ(mem_block_used(dev), 2 * PAGE_SIZE);
+    TEST_ASSERT_EQ(block_read(dev, 0, buf, 2 * 1024), 0);
+    TEST_ASSERT_MEM_EQ(buf, zero, 2 * 1024);
+    TEST_ASSERT_EQ(block_read(dev, PAGE_SIZE, buf, PAGE_SIZE), 0);
+    TEST_ASSERT_MEM_EQ(buf, zero, 1024);
+    TEST_ASSERT_EQ(buf[1024], 0xCD);
+    TEST_ASSERT_EQ(buf[2047], 0xCD);
+    TEST_ASSERT_EQ(buf[2048], 0);
+    
+    block_unregister(dev);
+    mem_block_destroy(dev);
+    return TEST_PASS;
+}
+
 static test_case_t block_tests[] = {
     {"block_constants", test_block_constants},
     {"block_request_create", test_block_request_create},
     {"block_ops", test_block_ops},
+    {"block_request_pool", test_block_request_pool},
+    {"block_async_queue", test_block_async_queue},
+    {"block_sync_polled", test_block_sync_polled},
+    {"block_hw_queues", test_block_hw_queues},
+    {"block_iovec", test_block_iovec},
+    {"block_inline_completion", test_block_inline_completion},
+    {"block_merge", test_block_merge},
+    {"block_merge_plugged", test_block_merge_plugged},
+    {"block_qos", test_block_qos},
+    {"block_latency", test_block_latency},
+    {"block_cache", test_block_cache},
+    {"block_cache_writeback", test_block_cache_writeback},
+    {"mem_block_sparse", test_mem_block_sparse},
 };
 
 static test_suite_t block_suite = {
@@ -92,10 +876,670 @@ static test_result_t test_pool_states(void)
     return TEST_PASS;
 }
 
+static test_result_t test_pool_volume_split(void)
+{
+    static uint8_t a[16 * KB], b[16 * KB];
+    uint64_t boundary = POOL_EXTENT_SIZE;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    block_device_t *m0 = mem_block_create("split0", 16 * MB);
+    block_device_t *m1 = mem_block_create("split1", 16 * MB);
+    TEST_ASSERT_NOT_NULL(m0);
+    TEST_ASSERT_NOT_NULL(m1);
+    
+    storage_pool_t *pool = pool_create("split");
+    TEST_ASSERT_NOT_NULL(pool);
+    TEST_ASSERT_EQ(pool_add_device(pool, m0), 0);
+    TEST_ASSERT_EQ(pool_add_device(pool, m1), 0);
+    
+    /* Take the first extent so the volume's land further in */
+    TEST_ASSERT_NOT_NULL(volume_create(pool, "pad", POOL_EXTENT_SIZE, POOL_REPL_NONE, false));
+    storage_volume_t *vol = volume_create(pool, "vol", 3 * POOL_EXTENT_SIZE, POOL_REPL_NONE, true);
+    TEST_ASSERT_NOT_NULL(vol);
+    
+    /* A write across an extent boundary lands in both extents */
+    for (uint32_t i = 0; i < sizeof(a); i++) {
+        a[i] = (uint8_t)(i * 7 + 1);
+    }
+    TEST_ASSERT_EQ(block_write(&vol->blkdev, boundary - 8 * KB, a, sizeof(a)), 0);
+    TEST_ASSERT_EQ(vol->allocated, 2 * POOL_EXTENT_SIZE);
+    TEST_ASSERT(vol->extent_map[0] != 0);
+    TEST_ASSERT(vol->extent_map[1] != 0);
+    
+    extent_info_t *ext = &pool->extents[vol->extent_map[1]];
+    TEST_ASSERT_EQ(block_read(pool->devices[ext->device_id], ext->device_offset, b, 8 * KB), 0);
+    TEST_ASSERT_MEM_EQ(b, a + 8 * KB, 8 * KB);
+    
+    memset(b, 0xFF, sizeof(b));
+    TEST_ASSERT_EQ(block_read(&vol->blkdev, boundary - 8 * KB, b, sizeof(b)), 0);
+    TEST_ASSERT_MEM_EQ(b, a, sizeof(a));
+    
+    /* Unallocated pieces of a read come back zeroed */
+    TEST_ASSERT_EQ(block_write(&vol->blkdev, 2 * boundary - 4 * KB, a, 4 * KB), 0);
+    memset(b, 0xFF, sizeof(b));
+    TEST_ASSERT_EQ(block_read(&vol->blkdev, 2 * boundary - 4 * KB, b, sizeof(b)), 0);
+    TEST_ASSERT_MEM_EQ(b, a, 4 * KB);
+    TEST_ASSERT_EQ(b[4 * KB], 0);
+    TEST_ASSERT_EQ(b[sizeof(b) - 1], 0);
+    
+    TEST_ASSERT_EQ(block_flush(&vol->blkdev), 0);
+    
+    pool_destroy(pool);
+    block_unregister(m0);
+    block_unregister(m1);
+    mem_block_destroy(m0);
+    mem_block_destroy(m1);
+    return TEST_PASS;
+}
+
+static test_result_t test_pool_extent_alloc(void)
+{
+    static uint8_t buf[4 * KB];
+    uint32_t first;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    block_device_t *m0 = mem_block_create("alloc0", 16 * POOL_EXTENT_SIZE);
+    block_device_t *m1 = mem_block_create("alloc1", 8 * POOL_EXTENT_SIZE);
+    TEST_ASSERT_NOT_NULL(m0);
+    TEST_ASSERT_NOT_NULL(m1);
+    
+    storage_pool_t *pool = pool_create("alloc");
+    TEST_ASSERT_NOT_NULL(pool);
+    TEST_ASSERT_EQ(pool_add_device(pool, m0), 0);
+    TEST_ASSERT_EQ(pool_add_device(pool, m1), 0);
+    
+    /* Extent 0 is never handed out */
+    TEST_ASSERT_EQ(pool->extents[0].state, EXTENT_RESERVED);
+    TEST_ASSERT_EQ(pool->free_extents, 23);
+    TEST_ASSERT_EQ(pool->device_free[0], 15);
+    TEST_ASSERT_EQ(pool->device_free[1], 8);
+    pool_free_extent(pool, 0);
+    TEST_ASSERT_EQ(pool->free_extents, 23);
+    
+    /* A thin volume grows next to its last extent, not at the rotor */
+    storage_volume_t *a = volume_create(pool, "a", 4 * POOL_EXTENT_SIZE, POOL_REPL_NONE, true);
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_EQ(block_write(&a->blkdev, 0, buf, sizeof(buf)), 0);
+    TEST_ASSERT_EQ(a->extent_map[0], 1);
+    
+    storage_volume_t *c = volume_create(pool, "c", 2 * POOL_EXTENT_SIZE, POOL_REPL_NONE, false);
+    TEST_ASSERT_NOT_NULL(c);
+    volume_destroy(c);
+    TEST_ASSERT_EQ(pool->next_extent, 4);
+    
+    TEST_ASSERT_EQ(block_write(&a->blkdev, POOL_EXTENT_SIZE, buf, sizeof(buf)), 0);
+    TEST_ASSERT_EQ(a->extent_map[1], 2);
+    TEST_ASSERT_EQ(pool->extents[2].volume_id, a->id);
+    TEST_ASSERT_EQ(pool->extents[2].volume_offset, POOL_EXTENT_SIZE);
+    
+    /* Thick volumes take one run, which does not span devices */
+    storage_volume_t *d = volume_create(pool, "d", 10 * POOL_EXTENT_SIZE, POOL_REPL_NONE, false);
+    TEST_ASSERT_NOT_NULL(d);
+    TEST_ASSERT_EQ(d->extent_map[0], 3);
+    TEST_ASSERT_EQ(d->extent_map[9], 12);
+    
+    storage_volume_t *e = volume_create(pool, "e", 5 * POOL_EXTENT_SIZE, POOL_REPL_NONE, false);
+    TEST_ASSERT_NOT_NULL(e);
+    TEST_ASSERT_EQ(e->extent_map[0], 16);
+    TEST_ASSERT_EQ(e->extent_map[4], 20);
+    TEST_ASSERT_EQ(pool->extents[16].device_id, 1);
+    TEST_ASSERT_EQ(pool->device_free[0], 3);
+    TEST_ASSERT_EQ(pool->device_free[1], 3);
+    
+    /* Replicas go to another device */
+    storage_volume_t *f = volume_create(pool, "f", POOL_EXTENT_SIZE, POOL_REPL_MIRROR, false);
+    TEST_ASSERT_NOT_NULL(f);
+    extent_info_t *ext = &pool->extents[f->extent_map[0]];
+    TEST_ASSERT_EQ(ext->replica_count, 1);
+    TEST_ASSERT(ext->device_id != pool->extents[ext->replica_extents[0]].device_id);
+    TEST_ASSERT_EQ(pool->free_extents, 4);
+    TEST_ASSERT_EQ(pool->device_free[0], 2);
+    TEST_ASSERT_EQ(pool->device_free[1], 2);
+    
+    /* Two free extents per device: no run of three */
+    TEST_ASSERT_EQ(pool_alloc_extent_run(pool, 3, 0, &first), -1);
+    volume_destroy(e);
+    TEST_ASSERT_EQ(pool->device_free[1], 7);
+    TEST_ASSERT_EQ(pool_alloc_extent_run(pool, 3, 0, &first), 0);
+    TEST_ASSERT_EQ(first, 16);
+    for (uint32_t i = 0; i < 3; i++) {
+        pool_free_extent(pool, first + i);
+    }
+    pool_free_extent(pool, first);
+    TEST_ASSERT_EQ(pool->free_extents, 9);
+    
+    pool_destroy(pool);
+    block_unregister(m0);
+    block_unregister(m1);
+    mem_block_destroy(m0);
+    mem_block_destroy(m1);
+    return TEST_PASS;
+}
+
+static test_result_t test_pool_volume_stripe(void)
+{
+    static uint8_t a[256 * KB], b[256 * KB];
+    block_device_t *m[3];
+    block_stats_t st;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    storage_pool_t *pool = pool_create("stripe");
+    TEST_ASSERT_NOT_NULL(pool);
+    for (int i = 0; i < 3; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "stripe%d", i);
+        m[i] = mem_block_create(name, 8 * POOL_EXTENT_SIZE);
+        TEST_ASSERT_NOT_NULL(m[i]);
+        TEST_ASSERT_EQ(pool_add_device(pool, m[i]), 0);
+    }
+    
+    /* Wider than the pool, or an odd unit */
+    TEST_ASSERT_NULL(volume_create_striped(pool, "bad", POOL_EXTENT_SIZE, POOL_REPL_NONE, true, 4, 0));
+    TEST_ASSERT_NULL(volume_create_striped(pool, "bad", POOL_EXTENT_SIZE, POOL_REPL_NONE, true, 3, 3000));
+    
+    /* Sizes round up to whole stripe groups */
+    storage_volume_t *vol = volume_create_striped(pool, "vol", POOL_EXTENT_SIZE,
+                                                  POOL_REPL_NONE, true, 3, 64 * KB);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQ(vol->num_extents, 3);
+    TEST_ASSERT_EQ(vol->size, 3 * POOL_EXTENT_SIZE);
+    
+    /* Four units: columns 0, 1, 2, then 0 again a row down; every device gets some */
+    for (uint32_t i = 0; i < sizeof(a); i++) {
+        a[i] = (uint8_t)(i * 13 + 5);
+    }
+    TEST_ASSERT_EQ(block_write(&vol->blkdev, 0, a, sizeof(a)), 0);
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT(vol->extent_map[i] != 0);
+        block_get_stats(m[i], &st);
+        TEST_ASSERT_GT(st.write_ops, 0);
+    }
+    TEST_ASSERT(pool->extents[vol->extent_map[0]].device_id !=
+                pool->extents[vol->extent_map[1]].device_id);
+    TEST_ASSERT(pool->extents[vol->extent_map[1]].device_id !=
+                pool->extents[vol->extent_map[2]].device_id);
+    TEST_ASSERT(pool->extents[vol->extent_map[0]].device_id !=
+                pool->extents[vol->extent_map[2]].device_id);
+    
+    extent_info_t *ext = &pool->extents[vol->extent_map[1]];
+    TEST_ASSERT_EQ(block_read(pool->devices[ext->device_id], ext->device_offset, b, 64 * KB), 0);
+    TEST_ASSERT_MEM_EQ(b, a + 64 * KB, 64 * KB);
+    ext = &pool->extents[vol->extent_map[0]];
+    TEST_ASSERT_EQ(block_read(pool->devices[ext->device_id], ext->device_offset + 64 * KB, b, 64 * KB), 0);
+    TEST_ASSERT_MEM_EQ(b, a + 192 * KB, 64 * KB);
+    
+    memset(b, 0, sizeof(b));
+    TEST_ASSERT_EQ(block_read(&vol->blkdev, 0, b, sizeof(b)), 0);
+    TEST_ASSERT_MEM_EQ(b, a, sizeof(b));
+    
+    /* Thick striped volumes alternate devices too, group after group */
+    storage_volume_t *thick = volume_create_striped(pool, "thick", 4 * POOL_EXTENT_SIZE,
+                                                    POOL_REPL_NONE, false, 2, 0);
+    TEST_ASSERT_NOT_NULL(thick);
+    TEST_ASSERT_EQ(thick->stripe_unit, POOL_STRIPE_UNIT_DEFAULT);
+    for (uint32_t i = 1; i < thick->num_extents; i++) {
+        TEST_ASSERT(pool->extents[thick->extent_map[i]].device_id !=
+                    pool->extents[thick->extent_map[i - 1]].device_id);
+    }
+    
+    pool_destroy(pool);
+    for (int i = 0; i < 3; i++) {
+        block_unregister(m[i]);
+        mem_block_destroy(m[i]);
+    }
+    return TEST_PASS;
+}
+
+static int quorum_status;
+
+static void quorum_done(void *ctx UNUSED, int status)
+{
+    quorum_status = status;
+    async_done++;
+}
+
+static test_result_t test_pool_replica_quorum(void)
+{
+    static uint8_t a[8 * KB], b[8 * KB];
+    block_stats_t st;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    block_device_t *m0 = mem_block_create("quorum0", 4 * POOL_EXTENT_SIZE);
+    block_device_t *m1 = mem_block_create("quorum1", 4 * POOL_EXTENT_SIZE);
+    TEST_ASSERT_NOT_NULL(m0);
+    TEST_ASSERT_NOT_NULL(m1);
+    
+    storage_pool_t *pool = pool_create("quorum");
+    TEST_ASSERT_NOT_NULL(pool);
+    TEST_ASSERT_EQ(pool_add_device(pool, m0), 0);
+    TEST_ASSERT_EQ(pool_add_device(pool, m1), 0);
+    
+    storage_volume_t *vol = volume_create(pool, "vol", POOL_EXTENT_SIZE, POOL_REPL_MIRROR, false);
+    TEST_ASSERT_NOT_NULL(vol);
+    extent_info_t *primary = &pool->extents[vol->extent_map[0]];
+    extent_info_t *replica = &pool->extents[primary->replica_extents[0]];
+    TEST_ASSERT_EQ(replica->device_id, 1);
+    
+    TEST_ASSERT_EQ(volume_set_write_quorum(vol, 3), -1);
+    TEST_ASSERT_EQ(volume_set_write_quorum(vol, 1), 0);
+    
+    /* The replica's device holds its writes from here on */
+    const block_ops_t *m1_ops = m1->ops;
+    m1->ops = &held_ops;
+    held_count = 0;
+    
+    /* One copy is a quorum; the other writes from a copy of the data */
+    memset(a, 0x5A, sizeof(a));
+    TEST_ASSERT_EQ(block_write(&vol->blkdev, 0, a, sizeof(a)), 0);
+    TEST_ASSERT_EQ(held_count, 1);
+    block_request_t *r = held[0];
+    TEST_ASSERT(r->iov[0].base != a);
+    TEST_ASSERT_MEM_EQ(r->iov[0].base, a, sizeof(a));
+    
+    /* Until it has the write, the replica is not read */
+    TEST_ASSERT_EQ(replica->lagging, 1);
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQ(block_read(&vol->blkdev, 0, b, sizeof(b)), 0);
+        TEST_ASSERT_MEM_EQ(b, a, sizeof(a));
+    }
+    TEST_ASSERT_EQ(held_count, 1);
+    held[0] = NULL;
+    block_complete(r, 0);
+    TEST_ASSERT_EQ(replica->lagging, 0);
+    TEST_ASSERT_EQ(pool->stale_extents, 0);
+    
+    /* Waiting for both, a failed replica fails the write and goes stale */
+    TEST_ASSERT_EQ(volume_set_write_quorum(vol, 0), 0);
+    memset(a, 0xA5, sizeof(a));
+    block_request_t w = { .op = BLOCK_OP_WRITE, .length = sizeof(a), .buffer = a,
+                          .completion = quorum_done };
+    async_done = 0;
+    TEST_ASSERT_EQ(block_submit_async(&vol->blkdev, &w), 0);
+    TEST_ASSERT_EQ(async_done, 0);
+    TEST_ASSERT_EQ(held_count, 2);
+    r = held[1];
+    held[1] = NULL;
+    block_complete(r, -1);
+    TEST_ASSERT_EQ(async_done, 1);
+    TEST_ASSERT_EQ(quorum_status, -1);
+    TEST_ASSERT_EQ(replica->stale, 1);
+    TEST_ASSERT_EQ(primary->stale, 0);
+    TEST_ASSERT_EQ(pool->stale_extents, 1);
+    m1->ops = m1_ops;
+    
+    /* Writes skip the stale copy */
+    block_get_stats(m1, &st);
+    uint64_t m1_writes = st.write_ops;
+    TEST_ASSERT_EQ(block_write(&vol->blkdev, 0, a, sizeof(a)), 0);
+    block_get_stats(m1, &st);
+    TEST_ASSERT_EQ(st.write_ops, m1_writes);
+    
+    /* Resync copies the primary over */
+    TEST_ASSERT_EQ(volume_resync(vol), 0);
+    TEST_ASSERT_EQ(replica->stale, 0);
+    TEST_ASSERT_EQ(pool->stale_extents, 0);
+    TEST_ASSERT_EQ(block_read(m1, replica->device_offset, b, sizeof(b)), 0);
+    TEST_ASSERT_MEM_EQ(b, a, sizeof(a));
+    
+    pool_destroy(pool);
+    block_unregister(m0);
+    block_unregister(m1);
+    mem_block_destroy(m0);
+    mem_block_destroy(m1);
+    return TEST_PASS;
+}
+
+static test_result_t test_pool_replica_lagging_read(void)
+{
+    static uint8_t a[8 * KB], b[8 * KB];
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    block_device_t *m0 = mem_block_create("behind0", 4 * POOL_EXTENT_SIZE);
+    block_device_t *m1 = mem_block_create("behind1", 4 * POOL_EXTENT_SIZE);
+    TEST_ASSERT_NOT_NULL(m0);
+    TEST_ASSERT_NOT_NULL(m1);
+    
+    storage_pool_t *pool = pool_create("behind");
+    TEST_ASSERT_NOT_NULL(pool);
+    TEST_ASSERT_EQ(pool_add_device(pool, m0), 0);
+    TEST_ASSERT_EQ(pool_add_device(pool, m1), 0);
+    
+    storage_volume_t *vol = volume_create(pool, "vol", POOL_EXTENT_SIZE, POOL_REPL_MIRROR, false);
+    TEST_ASSERT_NOT_NULL(vol);
+    extent_info_t *primary = &pool->extents[vol->extent_map[0]];
+    extent_info_t *replica = &pool->extents[primary->replica_extents[0]];
+    TEST_ASSERT_EQ(volume_set_write_quorum(vol, 1), 0);
+    
+    /* The replica lags behind one write, the primary behind another */
+    const block_ops_t *m0_ops = m0->ops;
+    const block_ops_t *m1_ops = m1->ops;
+    m1->ops = &held_ops;
+    held_count = 0;
+    async_done = 0;
+    memset(a, 0x77, sizeof(a));
+    TEST_ASSERT_EQ(block_write(&vol->blkdev, 0, a, sizeof(a)), 0);
+    
+    m0->ops = &held_ops;
+    block_request_t w = { .op = BLOCK_OP_WRITE, .offset = 64 * KB, .length = sizeof(a),
+                          .buffer = a, .completion = quorum_done };
+    TEST_ASSERT_EQ(block_submit_async(&vol->blkdev, &w), 0);
+    TEST_ASSERT_EQ(held_count, 3);
+    block_request_t *r = held[2];
+    TEST_ASSERT(r->dev == m1);
+    held[2] = NULL;
+    block_complete(r, 0);
+    TEST_ASSERT_EQ(async_done, 1);
+    TEST_ASSERT_EQ(primary->lagging, 1);
+    TEST_ASSERT_EQ(replica->lagging, 1);
+    
+    /* Neither copy surely has the first write: the read waits */
+    block_request_t rd = { .op = BLOCK_OP_READ, .length = sizeof(b), .buffer = b,
+                           .completion = count_async_done };
+    TEST_ASSERT_EQ(block_submit_async(&vol->blkdev, &rd), 0);
+    TEST_ASSERT_EQ(held_count, 3);
+    TEST_ASSERT_EQ(async_done, 1);
+    
+    /* The replica catching up sends it there */
+    r = held[0];
+    held[0] = NULL;
+    block_complete(r, 0);
+    TEST_ASSERT_EQ(replica->lagging, 0);
+    TEST_ASSERT_EQ(held_count, 4);
+    TEST_ASSERT(held[3]->dev == m1);
+    TEST_ASSERT_EQ(held[3]->op, BLOCK_OP_READ);
+    TEST_ASSERT_EQ(held[3]->offset, replica->device_offset);
+    
+    held_poll(NULL);
+    TEST_ASSERT_EQ(async_done, 2);
+    TEST_ASSERT_EQ(primary->lagging, 0);
+    TEST_ASSERT_EQ(pool->stale_extents, 0);
+    
+    m0->ops = m0_ops;
+    m1->ops = m1_ops;
+    pool_destroy(pool);
+    block_unregister(m0);
+    block_unregister(m1);
+    mem_block_destroy(m0);
+    mem_block_destroy(m1);
+    return TEST_PASS;
+}
+
+/* Backend failing everything at once */
+static int fail_submit(block_device_t *dev UNUSED, block_request_t *req UNUSED)
+{
+    return -1;
+}
+
+static const block_ops_t fail_ops = {
+    .submit = fail_submit,
+};
+
+static test_result_t test_pool_replica_early_fail(void)
+{
+    static uint8_t a[8 * KB];
+    block_device_t *m[3];
+    const block_ops_t *ops[3];
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    storage_pool_t *pool = pool_create("early");
+    TEST_ASSERT_NOT_NULL(pool);
+    for (int i = 0; i < 3; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "early%d", i);
+        m[i] = mem_block_create(name, 4 * POOL_EXTENT_SIZE);
+        TEST_ASSERT_NOT_NULL(m[i]);
+        TEST_ASSERT_EQ(pool_add_device(pool, m[i]), 0);
+        ops[i] = m[i]->ops;
+    }
+    
+    storage_volume_t *vol = volume_create(pool, "vol", POOL_EXTENT_SIZE, POOL_REPL_TRIPLE, false);
+    TEST_ASSERT_NOT_NULL(vol);
+    extent_info_t *primary = &pool->extents[vol->extent_map[0]];
+    
+    /* Waiting for every copy: no bounce buffer, they write from @a */
+    m[primary->device_id]->ops = &fail_ops;
+    uint32_t held_dev = (primary->device_id + 1) % 3;
+    m[held_dev]->ops = &held_ops;
+    held_count = 0;
+    async_done = 0;
+    
+    memset(a, 0x3C, sizeof(a));
+    block_request_t w = { .op = BLOCK_OP_WRITE, .length = sizeof(a), .buffer = a,
+                          .completion = quorum_done };
+    TEST_ASSERT_EQ(block_submit_async(&vol->blkdev, &w), 0);
+    TEST_ASSERT_EQ(held_count, 1);
+    TEST_ASSERT(held[0]->iov[0].base == a);
+    
+    /* The early failure already decides it, but a copy still reads @a */
+    TEST_ASSERT_EQ(async_done, 0);
+    block_request_t *r = held[0];
+    held[0] = NULL;
+    block_complete(r, 0);
+    TEST_ASSERT_EQ(async_done, 1);
+    TEST_ASSERT_EQ(quorum_status, -1);
+    TEST_ASSERT_EQ(primary->stale, 1);
+    TEST_ASSERT_EQ(pool->stale_extents, 1);
+    
+    for (int i = 0; i < 3; i++) {
+        m[i]->ops = ops[i];
+    }
+    pool_destroy(pool);
+    for (int i = 0; i < 3; i++) {
+        block_unregister(m[i]);
+        mem_block_destroy(m[i]);
+    }
+    return TEST_PASS;
+}
+
+/* Writes to the volume while resync rewrites the replica's second chunk */
+static storage_volume_t *resync_vol;
+static const block_ops_t *resync_base;
+static uint64_t resync_at;
+static uint32_t resync_writes;
+static uint8_t resync_new[8 * KB];
+
+static int resync_submit(block_device_t *dev, block_request_t *req)
+{
+    if (req->op == BLOCK_OP_WRITE && req->offset == resync_at) {
+        resync_writes++;
+        if (resync_writes == 1) {
+            memset(resync_new, 0xB1, sizeof(resync_new));
+            block_write(&resync_vol->blkdev, 0, resync_new, sizeof(resync_new));
+            memset(resync_new, 0xB2, sizeof(resync_new));
+            block_write(&resync_vol->blkdev, 64 * KB, resync_new, sizeof(resync_new));
+        }
+    }
+    return resync_base->submit(dev, req);
+}
+
+static test_result_t test_pool_resync_writes(void)
+{
+    static uint8_t a[128 * KB], b[128 * KB];
+    block_ops_t ops;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    block_device_t *m0 = mem_block_create("resync0", 4 * POOL_EXTENT_SIZE);
+    block_device_t *m1 = mem_block_create("resync1", 4 * POOL_EXTENT_SIZE);
+    TEST_ASSERT_NOT_NULL(m0);
+    TEST_ASSERT_NOT_NULL(m1);
+    
+    storage_pool_t *pool = pool_create("resync");
+    TEST_ASSERT_NOT_NULL(pool);
+    TEST_ASSERT_EQ(pool_add_device(pool, m0), 0);
+    TEST_ASSERT_EQ(pool_add_device(pool, m1), 0);
+    
+    storage_volume_t *vol = volume_create(pool, "vol", POOL_EXTENT_SIZE, POOL_REPL_MIRROR, false);
+    TEST_ASSERT_NOT_NULL(vol);
+    extent_info_t *primary = &pool->extents[vol->extent_map[0]];
+    extent_info_t *replica = &pool->extents[primary->replica_extents[0]];
+    TEST_ASSERT_EQ(replica->device_id, 1);
+    
+    memset(a, 0x11, sizeof(a));
+    TEST_ASSERT_EQ(block_write(&vol->blkdev, 0, a, sizeof(a)), 0);
+    replica->stale = EXTENT_STALE;
+    pool->stale_extents++;
+    
+    /* The first chunk is copied by the time the writes come */
+    resync_vol = vol;
+    resync_base = m1->ops;
+    resync_at = replica->device_offset + 64 * KB;
+    resync_writes = 0;
+    ops = *m1->ops;
+    ops.submit = resync_submit;
+    m1->ops = &ops;
+    
+    TEST_ASSERT_EQ(volume_resync(vol), 0);
+    m1->ops = resync_base;
+    TEST_ASSERT_EQ(replica->stale, EXTENT_IN_SYNC);
+    TEST_ASSERT_EQ(pool->stale_extents, 0);
+    
+    /* The copied chunk took its write; the overtaken one was copied again */
+    TEST_ASSERT_EQ(resync_writes, 3);
+    memset(a, 0xB1, 8 * KB);
+    memset(a + 64 * KB, 0xB2, 8 * KB);
+    TEST_ASSERT_EQ(block_read(m1, replica->device_offset, b, sizeof(b)), 0);
+    TEST_ASSERT_MEM_EQ(b, a, sizeof(a));
+    TEST_ASSERT_EQ(block_read(m0, primary->device_offset, b, sizeof(b)), 0);
+    TEST_ASSERT_MEM_EQ(b, a, sizeof(a));
+    
+    pool_destroy(pool);
+    block_unregister(m0);
+    block_unregister(m1);
+    mem_block_destroy(m0);
+    mem_block_destroy(m1);
+    return TEST_PASS;
+}
+
+static test_result_t test_pool_replica_reads(void)
+{
+    static uint8_t a[64 * KB], b[4 * KB];
+    block_stats_t st;
+    uint64_t reads0, reads1;
+    
+    TEST_ASSERT_EQ(block_init(), 0);
+    block_device_t *m0 = mem_block_create("reads0", 4 * POOL_EXTENT_SIZE);
+    block_device_t *m1 = mem_block_create("reads1", 4 * POOL_EXTENT_SIZE);
+    TEST_ASSERT_NOT_NULL(m0);
+    TEST_ASSERT_NOT_NULL(m1);
+    
+    storage_pool_t *pool = pool_create("reads");
+    TEST_ASSERT_NOT_NULL(pool);
+    TEST_ASSERT_EQ(pool_add_device(pool, m0), 0);
+    TEST_ASSERT_EQ(pool_add_device(pool, m1), 0);
+    
+    storage_volume_t *vol = volume_create(pool, "vol", POOL_EXTENT_SIZE, POOL_REPL_MIRROR, false);
+    TEST_ASSERT_NOT_NULL(vol);
+    extent_info_t *primary = &pool->extents[vol->extent_map[0]];
+    extent_info_t *replica = &pool->extents[primary->replica_extents[0]];
+    TEST_ASSERT_EQ(primary->device_id, 0);
+    TEST_ASSERT_EQ(replica->device_id, 1);
+    
+    for (uint32_t i = 0; i < sizeof(a); i++) {
+        a[i] = (uint8_t)(i * 11 + 3);
+    }
+    TEST_ASSERT_EQ(block_write(&vol->blkdev, 0, a, sizeof(a)), 0);
+    
+    /* Balanced: idle copies take turns */
+    block_get_stats(m0, &st);
+    reads0 = st.read_ops;
+    block_get_stats(m1, &st);
+    reads1 = st.read_ops;
+    for (int i = 0; i < 8; i++) {
+        TEST_ASSERT_EQ(block_read(&vol->blkdev, i * sizeof(b), b, sizeof(b)), 0);
+        TEST_ASSERT_MEM_EQ(b, a + i * sizeof(b), sizeof(b));
+    }
+    block_get_stats(m0, &st);
+    TEST_ASSERT_GT(st.read_ops, reads0);
+    reads0 = st.read_ops;
+    block_get_stats(m1, &st);
+    TEST_ASSERT_GT(st.read_ops, reads1);
+    reads1 = st.read_ops;
+    
+    /* A slow device is avoided; a stale copy is never read */
+    pool->device_read_us[0] = 100000;
+    TEST_ASSERT_EQ(block_read(&vol->blkdev, 0, b, sizeof(b)), 0);
+    block_get_stats(m0, &st);
+    TEST_ASSERT_EQ(st.read_ops, reads0);
+    pool->device_read_us[0] = 0;
+    
+    replica->stale = 1;
+    block_get_stats(m1, &st);
+    reads1 = st.read_ops;
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQ(block_read(&vol->blkdev, 0, b, sizeof(b)), 0);
+    }
+    block_get_stats(m1, &st);
+    TEST_ASSERT_EQ(st.read_ops, reads1);
+    replica->stale = 0;
+    
+    /* Hedged: the primary holds the read, the replica answers it */
+    TEST_ASSERT_EQ(volume_set_read_policy(vol, POOL_READ_PRIMARY, 1), 0);
+    const block_ops_t *m0_ops = m0->ops;
+    m0->ops = &held_ops;
+    held_count = 0;
+    async_done = 0;
+    quorum_status = -1;
+    
+    memset(b, 0, sizeof(b));
+    block_request_t r = { .op = BLOCK_OP_READ, .offset = 8 * KB, .length = sizeof(b),
+                          .buffer = b, .completion = quorum_done };
+    TEST_ASSERT_EQ(block_submit_async(&vol->blkdev, &r), 0);
+    TEST_ASSERT_EQ(held_count, 1);
+    TEST_ASSERT_EQ(async_done, 0);
+    
+    uint64_t start = rdtsc_us();
+    while (rdtsc_us() < start + 3) {
+        pause();
+    }
+    ktimer_run();
+    TEST_ASSERT_EQ(async_done, 1);
+    TEST_ASSERT_EQ(quorum_status, 0);
+    TEST_ASSERT_MEM_EQ(b, a + 8 * KB, sizeof(b));
+    TEST_ASSERT_EQ(vol->hedged, 1);
+    TEST_ASSERT_EQ(vol->hedge_wins, 1);
+    
+    /* The loser lands in its own buffer */
+    block_request_t *late = held[0];
+    held[0] = NULL;
+    memset(late->iov[0].base, 0xEE, sizeof(b));
+    block_complete(late, 0);
+    TEST_ASSERT_EQ(async_done, 1);
+    TEST_ASSERT_MEM_EQ(b, a + 8 * KB, sizeof(b));
+    
+    /* Unhedged, a failed read is retried on the other copy */
+    TEST_ASSERT_EQ(volume_set_read_policy(vol, POOL_READ_PRIMARY, 0), 0);
+    memset(b, 0, sizeof(b));
+    r.offset = 12 * KB;
+    TEST_ASSERT_EQ(block_submit_async(&vol->blkdev, &r), 0);
+    TEST_ASSERT_EQ(held_count, 2);
+    late = held[1];
+    held[1] = NULL;
+    block_complete(late, -1);
+    TEST_ASSERT_EQ(async_done, 2);
+    TEST_ASSERT_EQ(quorum_status, 0);
+    TEST_ASSERT_MEM_EQ(b, a + 12 * KB, sizeof(b));
+    m0->ops = m0_ops;
+    
+    pool_destroy(pool);
+    block_unregister(m0);
+    block_unregister(m1);
+    mem_block_destroy(m0);
+    mem_block_destroy(m1);
+    return TEST_PASS;
+}
+
 static test_case_t pool_tests[] = {
     {"pool_extent_size", test_pool_extent_size},
     {"pool_replication_types", test_pool_replication_types},
     {"pool_states", test_pool_states},
+    {"pool_volume_split", test_pool_volume_split},
+    {"pool_extent_alloc", test_pool_extent_alloc},
+    {"pool_volume_stripe", test_pool_volume_stripe},
+    {"pool_replica_quorum", test_pool_replica_quorum},
+    {"pool_replica_lagging_read", test_pool_replica_lagging_read},
+    {"pool_replica_early_fail", test_pool_replica_early_fail},
+    {"pool_resync_writes", test_pool_resync_writes},
+    {"pool_replica_reads", test_pool_replica_reads},
 };
 
 static test_suite_t pool_suite = {
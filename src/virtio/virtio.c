@@ -7,9 +7,11 @@
 #include <lib/types.h>
 #include <lib/string.h>
 #include <virtio/virtio.h>
+#include <vmm/mmio.h>
 #include <mm/pmm.h>
 #include <mm/heap.h>
 #include <kernel/console.h>
+#include <arch/x86_64/cpu.h>
 
 /* ============================================================================
  * Virtqueue Operations
@@ -87,26 +89,53 @@ int virtq_get_desc(virtqueue_t *vq, uint16_t index, virtq_desc_t *desc)
     return 0;
 }
 
-void virtq_push(virtqueue_t *vq, uint16_t head, uint32_t len)
+void virtq_unpop(virtqueue_t *vq, uint16_t count)
+{
+    vq->last_avail_idx -= count;
+}
+
+void virtq_fill(virtqueue_t *vq, uint16_t head, uint32_t len, uint16_t offset)
 {
     if (!vq->enabled || !vq->used) {
         return;
     }
     
-    uint16_t ring_idx = vq->used->idx % vq->num;
+    uint16_t ring_idx = (uint16_t)(vq->used->idx + offset) % vq->num;
     vq->used->ring[ring_idx].id = head;
     vq->used->ring[ring_idx].len = len;
+}
+
+void virtq_flush(virtqueue_t *vq, uint16_t count)
+{
+    if (!vq->enabled || !vq->used) {
+        return;
+    }
     
     /* Memory barrier before updating index */
     __asm__ volatile("mfence" ::: "memory");
     
-    vq->used->idx++;
-    vq->last_used_idx++;
+    vq->used->idx += count;
+    vq->last_used_idx += count;
+}
+
+void virtq_push(virtqueue_t *vq, uint16_t head, uint32_t len)
+{
+    virtq_fill(vq, head, len, 0);
+    virtq_flush(vq, 1);
 }
 
 bool virtq_should_notify(virtqueue_t *vq)
 {
-    if (!vq->enabled || !vq->avail) {
+    if (!vq->enabled || !vq->avail || !vq->used) {
+        return false;
+    }
+    
+    /* Everything since the last check is covered by this decision */
+    uint16_t new_idx = vq->used->idx;
+    uint16_t old_idx = vq->signalled_used;
+    vq->signalled_used = new_idx;
+    
+    if (new_idx == old_idx) {
         return false;
     }
     
@@ -119,15 +148,100 @@ bool virtq_should_notify(virtqueue_t *vq)
         /* Calculate used_event address manually to avoid alignment warning */
         uintptr_t addr = (uintptr_t)&vq->avail->ring[vq->num];
         uint16_t used_event = *(uint16_t *)addr;
-        uint16_t new_idx = vq->used->idx;
-        uint16_t old_idx = vq->last_used_idx - 1;
         
-        return (new_idx - used_event - 1) < (new_idx - old_idx);
+        return (uint16_t)(new_idx - used_event - 1) < (uint16_t)(new_idx - old_idx);
     }
     
     return true;
 }
 
+/* ============================================================================
+ * Interrupt Coalescing
+ * ============================================================================ */
+
+/* Adaptive profiles, by completions per second */
+static const struct {
+    uint32_t rate;
+    uint32_t max_frames;
+    uint32_t max_usecs;
+} coalesce_profiles[] = {
+    {  20000,     0,   0 },     /* Light load: latency first */
+    { 100000,     8,  50 },
+    { 400000,    32, 100 },
+    { UINT32_MAX, 64, 200 },
+};
+
+static void virtq_signal(virtqueue_t *vq)
+{
+    virtio_device_t *dev = vq->dev;
+    
+    vq->coalesce.pending = 0;
+    if (vq->coalesce.timer.armed) {
+        ktimer_cancel(&vq->coalesce.timer);
+    }
+    
+    if (dev && virtq_should_notify(vq)) {
+        dev->isr_status |= 1;
+        /* Interrupt injection: ISR status set for guest polling.
+         * For VMX guests, inject via vmx_inject_interrupt() when
+         * the guest VCPU is scheduled. */
+        dev->pci.interrupt_pending = true;
+        vq->coalesce.interrupts++;
+    }
+}
+
+static void virtq_coalesce_timer(void *ctx)
+{
+    virtq_signal(ctx);
+}
+
+static void virtq_coalesce_adapt(virtq_coalesce_t *c, uint32_t count)
+{
+    uint64_t now = rdtsc_us();
+    uint64_t elapsed = now - c->window_start;
+    
+    c->window_count += count;
+    if (elapsed < VIRTQ_COALESCE_WINDOW_US) return;
+    
+    uint64_t rate = c->window_count * 1000000ULL / elapsed;
+    uint32_t i = 0;
+    while (i + 1 < ARRAY_SIZE(coalesce_profiles) && rate >= coalesce_profiles[i].rate) {
+        i++;
+    }
+    c->max_frames = coalesce_profiles[i].max_frames;
+    c->max_usecs = coalesce_profiles[i].max_usecs;
+    
+    c->window_start = now;
+    c->window_count = 0;
+}
+
+void virtq_interrupt(virtqueue_t *vq, uint32_t count)
+{
+    virtq_coalesce_t *c = &vq->coalesce;
+    
+    if (count == 0) return;
+    
+    c->completions += count;
+    if (c->adaptive) {
+        virtq_coalesce_adapt(c, count);
+    }
+    
+    c->pending += count;
+    if (c->max_usecs == 0 || (c->max_frames && c->pending >= c->max_frames)) {
+        virtq_signal(vq);
+    } else if (!c->timer.armed) {
+        /* Armed by the oldest pending completion only */
+        ktimer_arm(&c->timer, c->max_usecs);
+    }
+}
+
+static void virtq_coalesce_reset(virtqueue_t *vq)
+{
+    ktimer_cancel(&vq->coalesce.timer);
+    vq->coalesce.pending = 0;
+    vq->signalled_used = 0;
+}
+
 void virtq_enable_notify(virtqueue_t *vq)
 {
     if (vq->used) {
@@ -146,14 +260,109 @@ void virtq_disable_notify(virtqueue_t *vq)
  * Virtio PCI Device
  * ============================================================================ */
 
+static uint64_t virtio_mmio_slots;      /* Bitmap of VIRTIO_PCI_MMIO_SLOTS */
+
+static int virtio_mmio_alloc(void)
+{
+    for (int i = 0; i < VIRTIO_PCI_MMIO_SLOTS; i++) {
+        if (!(virtio_mmio_slots & BIT(i))) {
+            virtio_mmio_slots |= BIT(i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void virtio_build_caps(virtio_device_t *dev)
+{
+    static const struct {
+        uint8_t type;
+        uint32_t offset;
+    } regions[] = {
+        { VIRTIO_PCI_CAP_COMMON_CFG, VIRTIO_PCI_COMMON_OFFSET },
+        { VIRTIO_PCI_CAP_ISR_CFG,    VIRTIO_PCI_ISR_OFFSET },
+        { VIRTIO_PCI_CAP_DEVICE_CFG, VIRTIO_PCI_DEVICE_OFFSET },
+    };
+    uint8_t pos = 0;
+    
+    for (uint32_t i = 0; i < ARRAY_SIZE(regions); i++) {
+        virtio_pci_cap_t *cap = (virtio_pci_cap_t *)&dev->caps[pos];
+        pos += sizeof(*cap);
+        cap->cap_vndr = PCI_CAP_VENDOR;
+        cap->cap_next = VIRTIO_PCI_CAP_BASE + pos;
+        cap->cap_len = sizeof(*cap);
+        cap->cfg_type = regions[i].type;
+        cap->bar = VIRTIO_PCI_MODERN_BAR;
+        cap->offset = regions[i].offset;
+        cap->length = VIRTIO_PCI_REGION_SIZE;
+    }
+    
+    virtio_pci_notify_cap_t *notify = (virtio_pci_notify_cap_t *)&dev->caps[pos];
+    notify->cap.cap_vndr = PCI_CAP_VENDOR;
+    notify->cap.cap_next = 0;
+    notify->cap.cap_len = sizeof(*notify);
+    notify->cap.cfg_type = VIRTIO_PCI_CAP_NOTIFY_CFG;
+    notify->cap.bar = VIRTIO_PCI_MODERN_BAR;
+    notify->cap.offset = VIRTIO_PCI_NOTIFY_OFFSET;
+    notify->cap.length = VIRTIO_PCI_REGION_SIZE;
+    notify->notify_off_multiplier = VIRTIO_PCI_NOTIFY_MULTIPLIER;
+}
+
+static void virtio_doorbell(void *ctx, uint64_t offset)
+{
+    virtio_pci_notify(ctx, offset);
+}
+
+/* Keep the trapped notify page in step with the guest-programmed BAR */
+static void virtio_doorbell_update(virtio_device_t *dev)
+{
+    pci_bar_t *bar = &dev->pci.bars[VIRTIO_PCI_MODERN_BAR];
+    phys_addr_t notify = 0;
+    
+    if (dev->mmio_slot >= 0 && dev->guest && bar->base) {
+        notify = bar->base + VIRTIO_PCI_NOTIFY_OFFSET;
+    }
+    if (notify == dev->doorbell) return;
+    
+    if (dev->doorbell) {
+        mmio_doorbell_unregister(dev->guest, dev->doorbell);
+        dev->doorbell = 0;
+    }
+    if (notify && mmio_doorbell_register(dev->guest, notify, VIRTIO_PCI_REGION_SIZE,
+                                         virtio_doorbell, dev) == 0) {
+        dev->doorbell = notify;
+    }
+}
+
+static uint8_t virtio_config_byte(virtio_device_t *dev, uint8_t offset)
+{
+    /*
+     * The capability list is synthesized: registration clears config[].
+     * A guest could reach only the notify page of the regions it lists.
+     */
+    if (dev->mmio_slot >= 0 && !dev->guest) {
+        if (offset == PCI_CAPABILITIES) {
+            return VIRTIO_PCI_CAP_BASE;
+        }
+        if (offset >= VIRTIO_PCI_CAP_BASE &&
+            offset < VIRTIO_PCI_CAP_BASE + VIRTIO_PCI_CAPS_SIZE) {
+            return dev->caps[offset - VIRTIO_PCI_CAP_BASE];
+        }
+    }
+    return dev->pci.config[offset];
+}
+
 /* PCI config space callback */
 static int virtio_pci_config_read(pci_device_t *pci, uint8_t offset,
                                    int size, uint32_t *value)
 {
-    /* Default read from config space */
+    virtio_device_t *dev = (virtio_device_t *)pci;
+    
     *value = 0;
     if (offset + size <= PCI_CONFIG_SPACE_SIZE) {
-        memcpy(value, &pci->config[offset], size);
+        for (int i = 0; i < size; i++) {
+            *value |= (uint32_t)virtio_config_byte(dev, offset + i) << (8 * i);
+        }
     }
     return 0;
 }
@@ -161,13 +370,22 @@ static int virtio_pci_config_read(pci_device_t *pci, uint8_t offset,
 static int virtio_pci_config_write(pci_device_t *pci, uint8_t offset,
                                     int size, uint32_t value)
 {
-    if (offset + size <= PCI_CONFIG_SPACE_SIZE) {
-        memcpy(&pci->config[offset], &value, size);
+    virtio_device_t *dev = (virtio_device_t *)pci;
+    
+    /* Capabilities are read-only */
+    if (offset >= VIRTIO_PCI_CAP_BASE) {
+        return 0;
+    }
+    
+    pci_config_write_default(pci, offset, size, value);
+    
+    if (offset == PCI_BAR0 + 4 * VIRTIO_PCI_MODERN_BAR) {
+        virtio_doorbell_update(dev);
     }
     return 0;
 }
 
-/* BAR0 read (I/O space - legacy) */
+/* BAR read (BAR0 legacy I/O, BAR4 modern memory) */
 static int virtio_bar_read(pci_device_t *pci, int bar, uint64_t offset,
                            int size, uint64_t *value)
 {
@@ -175,7 +393,7 @@ static int virtio_bar_read(pci_device_t *pci, int bar, uint64_t offset,
     return virtio_pci_read(dev, bar, offset, size, value);
 }
 
-/* BAR0 write (I/O space - legacy) */
+/* BAR write (BAR0 legacy I/O, BAR4 modern memory) */
 static int virtio_bar_write(pci_device_t *pci, int bar, uint64_t offset,
                             int size, uint64_t value)
 {
@@ -218,6 +436,19 @@ int virtio_pci_init(virtio_device_t *dev, uint16_t type)
     /* Setup I/O BAR for legacy interface */
     pci_setup_bar(&dev->pci, 0, 0xC000, 256, true, false, false);
     
+    /* Memory BAR and capabilities for the modern interface */
+    dev->mmio_slot = virtio_mmio_alloc();
+    if (dev->mmio_slot >= 0) {
+        pci_setup_bar(&dev->pci, VIRTIO_PCI_MODERN_BAR,
+                      VIRTIO_PCI_MMIO_BASE +
+                      (uint64_t)dev->mmio_slot * VIRTIO_PCI_MODERN_SIZE,
+                      VIRTIO_PCI_MODERN_SIZE, false, false, false);
+        virtio_build_caps(dev);
+        virtio_doorbell_update(dev);
+    } else {
+        pr_warn("Virtio: No MMIO window left, legacy interface only");
+    }
+    
     /* Setup callbacks */
     dev->pci.config_read = virtio_pci_config_read;
     dev->pci.config_write = virtio_pci_config_write;
@@ -234,6 +465,26 @@ int virtio_pci_init(virtio_device_t *dev, uint16_t type)
     return 0;
 }
 
+void virtio_pci_attach(virtio_device_t *dev, ept_context_t *guest)
+{
+    if (dev->doorbell) {
+        mmio_doorbell_unregister(dev->guest, dev->doorbell);
+        dev->doorbell = 0;
+    }
+    dev->guest = guest;
+    virtio_doorbell_update(dev);
+}
+
+void virtio_pci_destroy(virtio_device_t *dev)
+{
+    virtio_pci_attach(dev, NULL);
+    if (dev->mmio_slot >= 0) {
+        virtio_mmio_slots &= ~BIT(dev->mmio_slot);
+        dev->mmio_slot = -1;
+    }
+    pci_unregister_device(&dev->pci);
+}
+
 virtqueue_t *virtio_add_queue(virtio_device_t *dev, uint16_t size)
 {
     if (dev->num_queues >= VIRTIO_MAX_QUEUES) {
@@ -243,10 +494,44 @@ virtqueue_t *virtio_add_queue(virtio_device_t *dev, uint16_t size)
     uint16_t idx = dev->num_queues++;
     virtqueue_t *vq = &dev->queues[idx];
     virtq_init(vq, idx, size);
+    vq->notify_offset = idx;
+    vq->dev = dev;
+    ktimer_init(&vq->coalesce.timer, virtq_coalesce_timer, vq);
     
     return vq;
 }
 
+void virtio_set_coalesce(virtio_device_t *dev, uint16_t queue,
+                         uint32_t max_frames, uint32_t max_usecs, bool adaptive)
+{
+    if (queue >= dev->num_queues) return;
+    
+    virtqueue_t *vq = &dev->queues[queue];
+    virtq_coalesce_t *c = &vq->coalesce;
+    
+    c->adaptive = adaptive;
+    c->max_frames = adaptive ? 0 : max_frames;
+    c->max_usecs = adaptive ? 0 : max_usecs;
+    c->window_start = rdtsc_us();
+    c->window_count = 0;
+    
+    /* Completions held under the old parameters go out now */
+    if (c->pending) {
+        virtq_signal(vq);
+    }
+}
+
+void virtio_flush_interrupts(virtio_device_t *dev)
+{
+    for (uint16_t i = 0; i < dev->num_queues; i++) {
+        virtqueue_t *vq = &dev->queues[i];
+        if (vq->coalesce.pending) {
+            virtq_signal(vq);
+        }
+        ktimer_cancel(&vq->coalesce.timer);
+    }
+}
+
 void virtio_set_config(virtio_device_t *dev, void *config, size_t size)
 {
     dev->config = (uint8_t *)config;
@@ -271,6 +556,225 @@ void virtio_notify_config(virtio_device_t *dev)
     }
 }
 
+/* ============================================================================
+ * Transport-Independent Registers
+ * ============================================================================ */
+
+static void virtio_set_status(virtio_device_t *dev, uint8_t status)
+{
+    if (status == 0) {
+        /* Device reset */
+        dev->status = 0;
+        dev->guest_features = 0;
+        dev->isr_status = 0;
+        dev->host_features_sel = 0;
+        dev->guest_features_sel = 0;
+        for (int i = 0; i < dev->num_queues; i++) {
+            dev->queues[i].enabled = false;
+            dev->queues[i].last_avail_idx = 0;
+            dev->queues[i].last_used_idx = 0;
+            virtq_coalesce_reset(&dev->queues[i]);
+        }
+        if (dev->reset) {
+            dev->reset(dev);
+        }
+    } else {
+        dev->status = status;
+        
+        /* Check FEATURES_OK transition */
+        if ((dev->status & VIRTIO_STATUS_FEATURES_OK) && !dev->features_ok) {
+            /* Validate feature negotiation */
+            dev->features_ok = true;
+        }
+    }
+}
+
+void virtio_pci_notify(virtio_device_t *dev, uint64_t offset)
+{
+    uint64_t queue = offset / VIRTIO_PCI_NOTIFY_MULTIPLIER;
+    
+    /* notify_offset equals the queue index, so no lookup is needed */
+    if (queue < dev->num_queues && dev->queue_notify) {
+        dev->queue_notify(dev, (uint16_t)queue);
+    }
+}
+
+/* ============================================================================
+ * Modern Memory Space Access
+ * ============================================================================ */
+
+static uint32_t virtio_common_read(virtio_device_t *dev, uint64_t offset)
+{
+    virtqueue_t *vq = dev->queue_sel < dev->num_queues ?
+                      &dev->queues[dev->queue_sel] : NULL;
+    
+    switch (offset) {
+        case VIRTIO_PCI_COMMON_DFSELECT:
+            return dev->host_features_sel;
+        case VIRTIO_PCI_COMMON_DF:
+            return dev->host_features_sel < 2 ?
+                   (uint32_t)(dev->host_features >> (32 * dev->host_features_sel)) : 0;
+        case VIRTIO_PCI_COMMON_GFSELECT:
+            return dev->guest_features_sel;
+        case VIRTIO_PCI_COMMON_GF:
+            return dev->guest_features_sel < 2 ?
+                   (uint32_t)(dev->guest_features >> (32 * dev->guest_features_sel)) : 0;
+        case VIRTIO_PCI_COMMON_MSIX:
+        case VIRTIO_PCI_COMMON_Q_MSIX:
+            return VIRTIO_MSI_NO_VECTOR;    /* INTx only */
+        case VIRTIO_PCI_COMMON_NUMQ:
+            return dev->num_queues;
+        case VIRTIO_PCI_COMMON_STATUS:
+            return dev->status;
+        case VIRTIO_PCI_COMMON_CFGGEN:
+            return 0;
+        case VIRTIO_PCI_COMMON_Q_SELECT:
+            return dev->queue_sel;
+    }
+    
+    if (!vq) return 0;
+    
+    switch (offset) {
+        case VIRTIO_PCI_COMMON_Q_SIZE:    return vq->num;
+        case VIRTIO_PCI_COMMON_Q_ENABLE:  return vq->enabled;
+        case VIRTIO_PCI_COMMON_Q_NOFF:    return vq->notify_offset;
+        case VIRTIO_PCI_COMMON_Q_DESCLO:  return (uint32_t)vq->desc_addr;
+        case VIRTIO_PCI_COMMON_Q_DESCHI:  return (uint32_t)(vq->desc_addr >> 32);
+        case VIRTIO_PCI_COMMON_Q_AVAILLO: return (uint32_t)vq->avail_addr;
+        case VIRTIO_PCI_COMMON_Q_AVAILHI: return (uint32_t)(vq->avail_addr >> 32);
+        case VIRTIO_PCI_COMMON_Q_USEDLO:  return (uint32_t)vq->used_addr;
+        case VIRTIO_PCI_COMMON_Q_USEDHI:  return (uint32_t)(vq->used_addr >> 32);
+    }
+    return 0;
+}
+
+static void set_low32(uint64_t *reg, uint64_t value)
+{
+    *reg = (*reg & ~0xFFFFFFFFULL) | (uint32_t)value;
+}
+
+static void set_high32(uint64_t *reg, uint64_t value)
+{
+    *reg = (*reg & 0xFFFFFFFFULL) | ((uint64_t)(uint32_t)value << 32);
+}
+
+static void virtio_common_write(virtio_device_t *dev, uint64_t offset,
+                                int size, uint64_t value)
+{
+    virtqueue_t *vq = dev->queue_sel < dev->num_queues ?
+                      &dev->queues[dev->queue_sel] : NULL;
+    
+    switch (offset) {
+        case VIRTIO_PCI_COMMON_DFSELECT:
+            dev->host_features_sel = (uint32_t)value;
+            return;
+        case VIRTIO_PCI_COMMON_GFSELECT:
+            dev->guest_features_sel = (uint32_t)value;
+            return;
+        case VIRTIO_PCI_COMMON_GF:
+            if (dev->guest_features_sel == 0) {
+                set_low32(&dev->guest_features, value);
+            } else if (dev->guest_features_sel == 1) {
+                set_high32(&dev->guest_features, value);
+            }
+            return;
+        case VIRTIO_PCI_COMMON_STATUS:
+            virtio_set_status(dev, (uint8_t)value);
+            return;
+        case VIRTIO_PCI_COMMON_Q_SELECT:
+            dev->queue_sel = (uint16_t)value;
+            return;
+    }
+    
+    /* Ring addresses may only change while the queue is disabled */
+    if (!vq || vq->enabled) return;
+    
+    switch (offset) {
+        case VIRTIO_PCI_COMMON_Q_ENABLE:
+            if ((uint16_t)value == 1) {
+                virtq_set_addr(vq, vq->desc_addr, vq->avail_addr, vq->used_addr);
+                vq->event_idx = (dev->guest_features & BIT(VIRTIO_F_RING_EVENT_IDX)) != 0;
+            }
+            break;
+        case VIRTIO_PCI_COMMON_Q_DESCLO:
+            if (size == 8) vq->desc_addr = value;
+            else set_low32(&vq->desc_addr, value);
+            break;
+        case VIRTIO_PCI_COMMON_Q_DESCHI:
+            set_high32(&vq->desc_addr, value);
+            break;
+        case VIRTIO_PCI_COMMON_Q_AVAILLO:
+            if (size == 8) vq->avail_addr = value;
+            else set_low32(&vq->avail_addr, value);
+            break;
+        case VIRTIO_PCI_COMMON_Q_AVAILHI:
+            set_high32(&vq->avail_addr, value);
+            break;
+        case VIRTIO_PCI_COMMON_Q_USEDLO:
+            if (size == 8) vq->used_addr = value;
+            else set_low32(&vq->used_addr, value);
+            break;
+        case VIRTIO_PCI_COMMON_Q_USEDHI:
+            set_high32(&vq->used_addr, value);
+            break;
+        default:
+            /* Queue sizes are fixed by the device model */
+            break;
+    }
+}
+
+static int virtio_modern_read(virtio_device_t *dev, uint64_t offset,
+                              int size, uint64_t *value)
+{
+    uint64_t reg = offset % VIRTIO_PCI_REGION_SIZE;
+    
+    *value = 0;
+    
+    switch (offset - reg) {
+        case VIRTIO_PCI_COMMON_OFFSET:
+            *value = virtio_common_read(dev, reg);
+            break;
+        
+        case VIRTIO_PCI_ISR_OFFSET:
+            *value = dev->isr_status;
+            dev->isr_status = 0;  /* Clear on read */
+            break;
+        
+        case VIRTIO_PCI_DEVICE_OFFSET:
+            if (dev->config && reg + size <= dev->config_size) {
+                memcpy(value, &dev->config[reg], size);
+            }
+            break;
+    }
+    
+    return 0;
+}
+
+static int virtio_modern_write(virtio_device_t *dev, uint64_t offset,
+                               int size, uint64_t value)
+{
+    uint64_t reg = offset % VIRTIO_PCI_REGION_SIZE;
+    
+    switch (offset - reg) {
+        case VIRTIO_PCI_COMMON_OFFSET:
+            virtio_common_write(dev, reg, size, value);
+            break;
+        
+        case VIRTIO_PCI_DEVICE_OFFSET:
+            if (dev->config && dev->config_write) {
+                dev->config_write(dev, reg, size, value);
+            }
+            break;
+        
+        case VIRTIO_PCI_NOTIFY_OFFSET:
+            /* Only reached when the doorbell page is not trapped */
+            virtio_pci_notify(dev, reg);
+            break;
+    }
+    
+    return 0;
+}
+
 /* ============================================================================
  * Legacy I/O Space Access
  * ============================================================================ */
@@ -278,6 +782,10 @@ void virtio_notify_config(virtio_device_t *dev)
 int virtio_pci_read(virtio_device_t *dev, int bar, uint64_t offset,
                     int size, uint64_t *value)
 {
+    if (bar == VIRTIO_PCI_MODERN_BAR) {
+        return virtio_modern_read(dev, offset, size, value);
+    }
+    
     if (bar != 0) {
         *value = 0;
         return 0;
@@ -336,6 +844,10 @@ int virtio_pci_read(virtio_device_t *dev, int bar, uint64_t offset,
 int virtio_pci_write(virtio_device_t *dev, int bar, uint64_t offset,
                      int size, uint64_t value)
 {
+    if (bar == VIRTIO_PCI_MODERN_BAR) {
+        return virtio_modern_write(dev, offset, size, value);
+    }
+    
     if (bar != 0) {
         return 0;
     }
@@ -362,6 +874,7 @@ int virtio_pci_write(virtio_device_t *dev, int bar, uint64_t offset,
                     uint64_t used_addr = (avail_addr + 4 + vq->num * 2 + 4095) & ~4095ULL;
                     
                     virtq_set_addr(vq, desc_addr, avail_addr, used_addr);
+                    vq->event_idx = (dev->guest_features & BIT(VIRTIO_F_RING_EVENT_IDX)) != 0;
                 }
             }
             break;
@@ -377,28 +890,7 @@ int virtio_pci_write(virtio_device_t *dev, int bar, uint64_t offset,
             break;
             
         case VIRTIO_PCI_STATUS:
-            if ((uint8_t)value == 0) {
-                /* Device reset */
-                dev->status = 0;
-                dev->guest_features = 0;
-                dev->isr_status = 0;
-                for (int i = 0; i < dev->num_queues; i++) {
-                    dev->queues[i].enabled = false;
-                    dev->queues[i].last_avail_idx = 0;
-                    dev->queues[i].last_used_idx = 0;
-                }
-                if (dev->reset) {
-                    dev->reset(dev);
-                }
-            } else {
-                dev->status = (uint8_t)value;
-                
-                /* Check FEATURES_OK transition */
-                if ((dev->status & VIRTIO_STATUS_FEATURES_OK) && !dev->features_ok) {
-                    /* Validate feature negotiation */
-                    dev->features_ok = true;
-                }
-            }
+            virtio_set_status(dev, (uint8_t)value);
             break;
             
         default:
@@ -80,6 +80,60 @@ blk_backend_t *blk_backend_create_memory(uint64_t size)
     return be;
 }
 
+/* ============================================================================
+ * Block Device Backend
+ * ============================================================================ */
+
+static int device_read(blk_backend_t *be, uint64_t offset, void *buf, size_t len)
+{
+    return block_read(be->data, offset, buf, len);
+}
+
+static int device_write(blk_backend_t *be, uint64_t offset,
+                        const void *buf, size_t len)
+{
+    return block_write(be->data, offset, buf, len);
+}
+
+static int device_flush(blk_backend_t *be)
+{
+    return block_flush(be->data);
+}
+
+static int device_rw_iov(blk_backend_t *be, bool write, uint64_t offset,
+                         const block_iovec_t *iov, uint32_t count)
+{
+    if (write) {
+        return block_writev(be->data, offset, iov, count);
+    }
+    return block_readv(be->data, offset, iov, count);
+}
+
+blk_backend_t *blk_backend_create_device(block_device_t *dev)
+{
+    if (!dev) return NULL;
+    
+    blk_backend_t *be = kmalloc(sizeof(blk_backend_t), GFP_KERNEL | GFP_ZERO);
+    if (!be) return NULL;
+    
+    be->type = BLK_BACKEND_DEVICE;
+    be->size = dev->size;
+    be->sector_size = 512;
+    be->readonly = dev->readonly;
+    be->data = dev;
+    strncpy(be->id, dev->name, sizeof(be->id));
+    
+    be->read = device_read;
+    be->write = device_write;
+    be->flush = device_flush;
+    be->rw_iov = device_rw_iov;
+    __sync_fetch_and_add(&dev->users, 1);
+    
+    pr_info("Block: Backend on device '%s', size=%llu KB", dev->name, be->size / 1024);
+    
+    return be;
+}
+
 void blk_backend_destroy(blk_backend_t *be)
 {
     if (!be) return;
@@ -89,6 +143,9 @@ void blk_backend_destroy(blk_backend_t *be)
         uint64_t pages = (be->size + PAGE_SIZE - 1) / PAGE_SIZE;
         pmm_free_pages(phys, pages > 10 ? 10 : pages);
     }
+    if (be->type == BLK_BACKEND_DEVICE && be->data) {
+        __sync_fetch_and_sub(&((block_device_t *)be->data)->users, 1);
+    }
     
     kfree(be);
 }
@@ -97,6 +154,76 @@ void blk_backend_destroy(blk_backend_t *be)
  * Request Processing
  * ============================================================================ */
 
+/* Issue a request's data segments to the backend, in one call if it can */
+static int backend_rw(blk_backend_t *be, bool write, uint64_t offset,
+                      const block_iovec_t *iov, uint32_t count)
+{
+    if (be->rw_iov) {
+        return be->rw_iov(be, write, offset, iov, count);
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        int ret = write ? be->write(be, offset, iov[i].base, iov[i].len) :
+                          be->read(be, offset, iov[i].base, iov[i].len);
+        if (ret != 0) return ret;
+        offset += iov[i].len;
+    }
+    return 0;
+}
+
+/*
+ * Read or write: the descriptors after the header are data segments,
+ * the last one holds the status byte. Returns the bytes written to the
+ * guest.
+ */
+static uint32_t process_rw(virtio_blk_t *blk, virtqueue_t *vq, virtq_desc_t *desc,
+                           const virtio_blk_req_hdr_t *hdr)
+{
+    bool write = hdr->type == VIRTIO_BLK_T_OUT;
+    uint8_t status = VIRTIO_BLK_S_OK;
+    uint8_t *status_byte = NULL;
+    uint32_t count = 0;
+    uint64_t len = 0;
+    
+    while (desc->flags & VIRTQ_DESC_F_NEXT) {
+        if (virtq_get_desc(vq, desc->next, desc) != 0) {
+            status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+        
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            if ((desc->flags & VIRTQ_DESC_F_WRITE) && desc->len >= 1) {
+                status_byte = (uint8_t *)phys_to_virt(desc->addr) + desc->len - 1;
+            }
+            break;
+        }
+        
+        /* Data must flow in the direction of the request */
+        bool to_guest = desc->flags & VIRTQ_DESC_F_WRITE;
+        if (to_guest == write || count == VIRTIO_BLK_SEG_MAX) {
+            status = VIRTIO_BLK_S_IOERR;
+            continue;
+        }
+        blk->iov[count].base = phys_to_virt(desc->addr);
+        blk->iov[count].len = desc->len;
+        len += desc->len;
+        count++;
+    }
+    
+    if (!status_byte) return 0;
+    
+    uint64_t offset = hdr->sector * 512;
+    if (status == VIRTIO_BLK_S_OK && count) {
+        if (offset + len > blk->backend->size ||
+            backend_rw(blk->backend, write, offset, blk->iov, count) != 0) {
+            status = VIRTIO_BLK_S_IOERR;
+        }
+    }
+    
+    *status_byte = status;
+    return (write || status != VIRTIO_BLK_S_OK ? 0 : (uint32_t)len) + 1;
+}
+
 static void process_request(virtio_blk_t *blk, virtqueue_t *vq, uint16_t head)
 {
     blk_backend_t *be = blk->backend;
@@ -114,68 +241,11 @@ static void process_request(virtio_blk_t *blk, virtqueue_t *vq, uint16_t head)
     bool has_next = desc.flags & VIRTQ_DESC_F_NEXT;
     
     switch (hdr->type) {
-        case VIRTIO_BLK_T_IN: {
-            /* Read request */
-            uint64_t sector = hdr->sector;
-            
-            while (has_next) {
-                if (virtq_get_desc(vq, next, &desc) != 0) break;
-                
-                if (desc.flags & VIRTQ_DESC_F_WRITE) {
-                    /* This is a writable buffer - data or status */
-                    if (desc.len == 1) {
-                        /* Status byte */
-                        *(uint8_t *)phys_to_virt(desc.addr) = status;
-                        written = 1;
-                    } else {
-                        /* Data buffer */
-                        void *buf = phys_to_virt(desc.addr);
-                        uint64_t offset = sector * 512;
-                        
-                        if (be->read(be, offset, buf, desc.len) != 0) {
-                            status = VIRTIO_BLK_S_IOERR;
-                        }
-                        
-                        sector += desc.len / 512;
-                        written += desc.len;
-                    }
-                }
-                
-                has_next = desc.flags & VIRTQ_DESC_F_NEXT;
-                next = desc.next;
-            }
+        case VIRTIO_BLK_T_IN:
+        case VIRTIO_BLK_T_OUT:
+            written = process_rw(blk, vq, &desc, hdr);
             break;
-        }
-        
-        case VIRTIO_BLK_T_OUT: {
-            /* Write request */
-            uint64_t sector = hdr->sector;
             
-            while (has_next) {
-                if (virtq_get_desc(vq, next, &desc) != 0) break;
-                
-                if (desc.flags & VIRTQ_DESC_F_WRITE) {
-                    /* Status byte */
-                    *(uint8_t *)phys_to_virt(desc.addr) = status;
-                    written = 1;
-                } else if (desc.len > 1) {
-                    /* Data to write */
-                    void *buf = phys_to_virt(desc.addr);
-                    uint64_t offset = sector * 512;
-                    
-                    if (be->write(be, offset, buf, desc.len) != 0) {
-                        status = VIRTIO_BLK_S_IOERR;
-                    }
-                    
-                    sector += desc.len / 512;
-                }
-                
-                has_next = desc.flags & VIRTQ_DESC_F_NEXT;
-                next = desc.next;
-            }
-            break;
-        }
-        
         case VIRTIO_BLK_T_FLUSH:
             if (be->flush(be) != 0) {
                 status = VIRTIO_BLK_S_IOERR;
@@ -244,21 +314,17 @@ static int blk_queue_notify(virtio_device_t *dev, uint16_t queue)
     }
     
     virtqueue_t *vq = &dev->queues[queue];
+    uint32_t completed = 0;
     uint16_t head;
     
     /* Process all available requests */
     while (virtq_pop(vq, &head) > 0) {
         process_request(blk, vq, head);
+        completed++;
     }
     
-    /* Signal completion */
-    if (virtq_should_notify(vq)) {
-        dev->isr_status |= 1;
-        /* Interrupt injection: ISR status set for guest polling.
-         * For VMX guests, inject via vmx_inject_interrupt() when
-         * the guest VCPU is scheduled. */
-        dev->pci.interrupt_pending = true;
-    }
+    /* Signal completion, possibly coalesced with later batches */
+    virtq_interrupt(vq, completed);
     
     return 0;
 }
@@ -304,6 +370,7 @@ virtio_blk_t *virtio_blk_create(blk_backend_t *backend)
     
     /* Add request queue */
     virtio_add_queue(&blk->dev, VIRTQ_MAX_SIZE);
+    virtio_set_coalesce(&blk->dev, 0, 0, 0, true);
     
     /* Set callbacks */
     blk->dev.queue_notify = blk_queue_notify;
@@ -319,6 +386,7 @@ void virtio_blk_destroy(virtio_blk_t *blk)
 {
     if (!blk) return;
     
-    pci_unregister_device(&blk->dev.pci);
+    virtio_flush_interrupts(&blk->dev);
+    virtio_pci_destroy(&blk->dev);
     kfree(blk);
 }
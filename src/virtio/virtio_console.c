@@ -234,6 +234,6 @@ virtio_console_t *virtio_console_create(void)
 void virtio_console_destroy(virtio_console_t *con)
 {
     if (!con) return;
-    pci_unregister_device(&con->dev.pci);
+    virtio_pci_destroy(&con->dev);
     kfree(con);
 }
@@ -8,6 +8,8 @@
 #include <lib/string.h>
 #include <virtio/virtio.h>
 #include <virtio/virtio_net.h>
+#include <net/flow.h>
+#include <net/offload.h>
 #include <mm/pmm.h>
 #include <mm/heap.h>
 #include <kernel/console.h>
@@ -30,28 +32,96 @@ void net_generate_mac(uint8_t mac[6])
 }
 
 /* ============================================================================
- * Loopback Backend
+ * Backend RX Queue
  * ============================================================================ */
 
-static int loopback_transmit(net_backend_t *be, const void *data, size_t len)
+int net_backend_rx_enqueue(net_backend_t *be, pktbuf_t *pb)
 {
-    if (len > NET_PACKET_MAX_SIZE) return -1;
+    if (be->rx_queue.count >= NET_RX_RING_SIZE) {
+        pktbuf_free(pb);
+        return -1;
+    }
     
-    net_packet_t *pkt = kmalloc(sizeof(net_packet_t), GFP_KERNEL);
-    if (!pkt) return -1;
+    pktq_push(&be->rx_queue, pb);
     
-    memcpy(pkt->data, data, len);
-    pkt->len = len;
-    pkt->next = NULL;
+    if (be->rx_notify) {
+        be->rx_notify(be);
+    }
+    return 0;
+}
+
+int net_backend_rx_enqueue_burst(net_backend_t *be, pktbuf_queue_t *q)
+{
+    pktbuf_t *pb;
+    int dropped = 0;
     
-    if (be->rx_tail) {
-        be->rx_tail->next = pkt;
-        be->rx_tail = pkt;
-    } else {
-        be->rx_head = be->rx_tail = pkt;
+    while ((pb = pktq_pop(q)) != NULL) {
+        if (be->rx_queue.count >= NET_RX_RING_SIZE) {
+            pktbuf_free(pb);
+            dropped++;
+            continue;
+        }
+        pktq_push(&be->rx_queue, pb);
+    }
+    
+    if (be->rx_notify) {
+        be->rx_notify(be);
+    }
+    return dropped;
+}
+
+pktbuf_t *net_backend_attach_sg(const net_sg_t *sg, uint32_t nsg,
+                                const pktbuf_offload_t *ol,
+                                net_tx_done_t done, void *ctx)
+{
+    if (nsg == 0 || nsg > NET_SG_MAX) return NULL;
+    
+    pktbuf_t *head = pktbuf_alloc_ext(sg[0].addr, sg[0].len);
+    if (!head) return NULL;
+    
+    for (uint32_t i = 1; i < nsg; i++) {
+        pktbuf_t *seg = pktbuf_alloc_ext(sg[i].addr, sg[i].len);
+        if (!seg) {
+            pktbuf_free(head);
+            return NULL;
+        }
+        pktbuf_cat(head, seg);
+    }
+    
+    if (ol) {
+        head->ol = *ol;
+    }
+    
+    /* Installed last so a failed build never completes the TX chain */
+    pktbuf_set_destructor(head, done, ctx);
+    return head;
+}
+
+static void net_backend_purge(net_backend_t *be)
+{
+    pktbuf_t *pb;
+    while ((pb = pktq_pop(&be->rx_queue)) != NULL) {
+        pktbuf_free(pb);
     }
-    be->rx_count++;
+}
+
+/* ============================================================================
+ * Loopback Backend
+ * ============================================================================ */
+
+/*
+ * The frame is queued by reference: the sender's TX buffers stay owned
+ * by the backend until the receiver has copied them into its RX ring.
+ */
+static int loopback_transmit(net_backend_t *be, const net_sg_t *sg, uint32_t nsg,
+                             const pktbuf_offload_t *ol, net_tx_done_t done, void *ctx)
+{
+    if (be->rx_queue.count >= NET_RX_RING_SIZE) return -1;
+    
+    pktbuf_t *pb = net_backend_attach_sg(sg, nsg, ol, done, ctx);
+    if (!pb) return -1;
     
+    net_backend_rx_enqueue(be, pb);
     return 0;
 }
 
@@ -60,7 +130,13 @@ net_backend_t *net_backend_create_loopback(void)
     net_backend_t *be = kmalloc(sizeof(net_backend_t), GFP_KERNEL | GFP_ZERO);
     if (!be) return NULL;
     
+    if (pktbuf_init() != 0) {
+        kfree(be);
+        return NULL;
+    }
+    
     be->type = NET_BACKEND_LOOPBACK;
+    pktq_init(&be->rx_queue);
     net_generate_mac(be->mac);
     be->transmit = loopback_transmit;
     
@@ -75,51 +151,268 @@ void net_backend_destroy(net_backend_t *be)
 {
     if (!be) return;
     
-    net_packet_t *pkt = be->rx_head;
-    while (pkt) {
-        net_packet_t *next = pkt->next;
-        kfree(pkt);
-        pkt = next;
+    if (be->release) {
+        be->release(be);
+    }
+    net_backend_purge(be);
+    
+    if (be->frontend) {
+        ((virtio_net_t *)be->frontend)->backend = NULL;
     }
     kfree(be);
 }
 
+/* ============================================================================
+ * Receive Steering
+ * ============================================================================ */
+
+static void rss_set_default(virtio_net_t *net)
+{
+    net->rss.guest_configured = false;
+    net->rss.hash_types = NET_RSS_HASH_ALL;
+    net->rss.indir_mask = NET_RSS_INDIR_SIZE - 1;
+    net->rss.unclassified = 0;
+    memcpy(net->rss.key, net_rss_default_key, NET_RSS_KEY_SIZE);
+    
+    for (uint32_t i = 0; i < NET_RSS_INDIR_SIZE; i++) {
+        net->rss.indir[i] = i % net->curr_queue_pairs;
+    }
+}
+
+/* Copy the leading bytes of a fragmented frame */
+static size_t sg_copy_head(const net_sg_t *sg, uint32_t nsg, uint8_t *dst, size_t len)
+{
+    size_t copied = 0;
+    
+    for (uint32_t i = 0; i < nsg && copied < len; i++) {
+        size_t chunk = sg[i].len;
+        if (chunk > len - copied) chunk = len - copied;
+        memcpy(dst + copied, sg[i].addr, chunk);
+        copied += chunk;
+    }
+    return copied;
+}
+
+static uint32_t frame_hash(virtio_net_t *net, const uint8_t *frame, size_t len,
+                           bool transmit)
+{
+    net_flow_keys_t keys;
+    
+    if (!net_flow_dissect(frame, len, &keys)) return 0;
+    
+    /* Key transmitted frames by the direction their replies arrive in */
+    if (transmit) {
+        net_flow_reverse(&keys);
+    }
+    return net_flow_hash(&keys, net->rss.key, net->rss.hash_types);
+}
+
+/* Remember which queue (and therefore which vCPU) sends on a flow */
+static void flow_learn(virtio_net_t *net, const net_sg_t *sg, uint32_t nsg,
+                       uint16_t queue)
+{
+    if (net->curr_queue_pairs <= 1 || net->rss.guest_configured) return;
+    
+    uint8_t hdr[NET_FLOW_PARSE_LEN];
+    size_t len = sg_copy_head(sg, nsg, hdr, sizeof(hdr));
+    uint32_t hash = frame_hash(net, hdr, len, true);
+    if (hash == 0) return;
+    
+    uint32_t slot = hash % NET_FLOW_TABLE_SIZE;
+    net->flows[slot].hash = hash;
+    net->flows[slot].queue = queue + 1;
+}
+
+static uint16_t rx_select_queue(virtio_net_t *net, const pktbuf_t *pb)
+{
+    if (net->curr_queue_pairs <= 1 && !net->rss.guest_configured) return 0;
+    
+    uint8_t hdr[NET_FLOW_PARSE_LEN];
+    size_t len = pktbuf_copy_out(pb, 0, hdr, sizeof(hdr));
+    uint32_t hash = frame_hash(net, hdr, len, false);
+    uint16_t queue;
+    
+    if (hash == 0) {
+        queue = net->rss.unclassified;
+    } else {
+        uint32_t slot = hash % NET_FLOW_TABLE_SIZE;
+        if (!net->rss.guest_configured && net->flows[slot].hash == hash &&
+            net->flows[slot].queue != 0 &&
+            net->flows[slot].queue <= net->curr_queue_pairs) {
+            queue = net->flows[slot].queue - 1;
+        } else {
+            queue = net->rss.indir[hash & net->rss.indir_mask];
+        }
+    }
+    
+    return queue < net->max_queue_pairs ? queue : 0;
+}
+
+static void net_queue_purge(virtio_net_queue_t *nq)
+{
+    pktbuf_t *pb;
+    while ((pb = pktq_pop(&nq->backlog)) != NULL) {
+        pktbuf_free(pb);
+    }
+}
+
+static virtio_net_tx_slots_t *net_alloc_tx_slots(virtio_net_t *net, uint16_t queue)
+{
+    virtio_net_tx_slots_t *slots = kmalloc(sizeof(virtio_net_tx_slots_t),
+                                           GFP_KERNEL | GFP_ZERO);
+    if (slots) {
+        slots->net = net;
+        slots->queue = queue;
+    }
+    return slots;
+}
+
+/*
+ * Leave the chains still out to their frames. A peer may hold them for
+ * as long as its guest posts no buffers, so they are not waited for.
+ */
+static void net_orphan_tx(virtio_net_queue_t *nq)
+{
+    virtio_net_tx_slots_t *slots = nq->tx_slots;
+    
+    nq->tx_slots = NULL;
+    if (!slots) return;
+    
+    if (nq->tx_inflight == 0) {
+        kfree(slots);
+        return;
+    }
+    slots->orphaned = nq->tx_inflight;
+    nq->tx_inflight = 0;
+}
+
 /* ============================================================================
  * TX/RX Processing
  * ============================================================================ */
 
-static void process_tx(virtio_net_t *net, virtqueue_t *vq, uint16_t head)
+static bool net_has_feature(virtio_net_t *net, uint32_t bit)
+{
+    return (net->dev.guest_features & BIT(bit)) != 0;
+}
+
+/* num_buffers is only part of the header with mergeable buffers or 1.0 */
+static size_t net_hdr_len(virtio_net_t *net)
+{
+    if (net_has_feature(net, VIRTIO_NET_F_MRG_RXBUF) ||
+        net_has_feature(net, VIRTIO_F_VERSION_1)) {
+        return sizeof(virtio_net_hdr_t);
+    }
+    return VIRTIO_NET_HDR_LEGACY_LEN;
+}
+
+/* Offloads the guest may leave to us, as far as it negotiated them */
+static int tx_parse_offload(virtio_net_t *net, const virtio_net_hdr_t *hdr,
+                            size_t len, pktbuf_offload_t *ol)
+{
+    memset(ol, 0, sizeof(*ol));
+    
+    if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        if (!net_has_feature(net, VIRTIO_NET_F_CSUM) ||
+            (size_t)hdr->csum_start + hdr->csum_offset + 2 > len) {
+            return -1;
+        }
+        ol->flags |= PKTBUF_OL_CSUM_PARTIAL;
+        ol->csum_start = hdr->csum_start;
+        ol->csum_offset = hdr->csum_offset;
+    }
+    
+    switch (hdr->gso_type) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+        return 0;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+        if (!net_has_feature(net, VIRTIO_NET_F_HOST_TSO4)) return -1;
+        ol->gso_type = PKTBUF_GSO_TCPV4;
+        break;
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        if (!net_has_feature(net, VIRTIO_NET_F_HOST_TSO6)) return -1;
+        ol->gso_type = PKTBUF_GSO_TCPV6;
+        break;
+    default:
+        return -1;      /* UFO and ECN are not offered */
+    }
+    
+    if (hdr->gso_size == 0) return -1;
+    ol->gso_size = hdr->gso_size;
+    ol->hdr_len = hdr->hdr_len;
+    return 0;
+}
+
+/* Backend is done with a TX chain: hand it back to the guest */
+static void tx_complete(void *ctx, int status)
+{
+    struct virtio_net_tx_slot *slot = ctx;
+    virtio_net_tx_slots_t *slots = slot->owner;
+    
+    if (slots->orphaned) {
+        if (--slots->orphaned == 0) {
+            kfree(slots);
+        }
+        return;
+    }
+    
+    virtio_net_t *net = slots->net;
+    virtio_net_queue_t *nq = &net->queues[slots->queue];
+    
+    nq->tx_inflight--;
+    if (status == 0) {
+        nq->tx_packets++;
+        net->tx_packets++;
+        net->tx_bytes += slot->len;
+    }
+    
+    virtq_push(nq->tx_vq, slot->head, 0);
+    virtq_interrupt(nq->tx_vq, 1);
+}
+
+/* Returns the bytes handed to the backend, 0 if the chain was dropped */
+static size_t process_tx(virtio_net_t *net, uint16_t queue, uint16_t head)
 {
     net_backend_t *be = net->backend;
+    virtio_net_queue_t *nq = &net->queues[queue];
+    virtqueue_t *vq = nq->tx_vq;
     virtq_desc_t desc;
-    uint8_t packet[NET_PACKET_MAX_SIZE];
+    net_sg_t sg[NET_SG_MAX];
+    uint32_t nsg = 0;
     size_t packet_len = 0;
-    bool first = true;
+    size_t hdr_len = net_hdr_len(net);
+    size_t hdr_skip = hdr_len;
+    virtio_net_hdr_t vhdr;
+    pktbuf_offload_t ol;
+    bool truncated = false;
     uint16_t idx = head;
     
+    /* Build an SG list over the guest buffers; nothing is copied */
     while (1) {
         if (virtq_get_desc(vq, idx, &desc) != 0) break;
         
         if (!(desc.flags & VIRTQ_DESC_F_WRITE)) {
-            void *src = phys_to_virt(desc.addr);
-            size_t copy_len = desc.len;
+            uint8_t *src = phys_to_virt(desc.addr);
+            uint32_t len = desc.len;
             
-            if (first) {
-                first = false;
-                if (desc.len > sizeof(virtio_net_hdr_t)) {
-                    src = (uint8_t *)src + sizeof(virtio_net_hdr_t);
-                    copy_len -= sizeof(virtio_net_hdr_t);
-                } else {
-                    copy_len = 0;
-                }
+            /* The header may share a descriptor with data or span several */
+            if (hdr_skip > 0) {
+                uint32_t skip = len < hdr_skip ? len : hdr_skip;
+                memcpy((uint8_t *)&vhdr + (hdr_len - hdr_skip), src, skip);
+                src += skip;
+                len -= skip;
+                hdr_skip -= skip;
             }
             
-            if (packet_len + copy_len > NET_PACKET_MAX_SIZE) {
-                copy_len = NET_PACKET_MAX_SIZE - packet_len;
-            }
-            if (copy_len > 0) {
-                memcpy(packet + packet_len, src, copy_len);
-                packet_len += copy_len;
+            if (len > 0) {
+                if (nsg >= NET_SG_MAX ||
+                    packet_len + len > NET_PACKET_MAX_SIZE) {
+                    truncated = true;
+                    break;
+                }
+                sg[nsg].addr = src;
+                sg[nsg].len = len;
+                nsg++;
+                packet_len += len;
             }
         }
         
@@ -127,67 +420,544 @@ static void process_tx(virtio_net_t *net, virtqueue_t *vq, uint16_t head)
         idx = desc.next;
     }
     
-    if (packet_len > 0 && be->transmit) {
-        be->transmit(be, packet, packet_len);
-        net->tx_packets++;
-        net->tx_bytes += packet_len;
+    if (packet_len > 0 && !truncated && hdr_skip == 0 && be->transmit &&
+        nq->tx_slots && tx_parse_offload(net, &vhdr, packet_len, &ol) == 0) {
+        struct virtio_net_tx_slot *slot = &nq->tx_slots->slot[head % VIRTQ_MAX_SIZE];
+        slot->owner = nq->tx_slots;
+        slot->head = head;
+        slot->len = packet_len;
+        
+        /* Learn before sending: loopback peers may answer synchronously */
+        flow_learn(net, sg, nsg, queue);
+        
+        nq->tx_inflight++;
+        if (be->transmit(be, sg, nsg, &ol, tx_complete, slot) == 0) {
+            return packet_len;  /* Used entry is returned by tx_complete() */
+        }
+        nq->tx_inflight--;
     }
     
+    /* Dropped: return the chain immediately */
     virtq_push(vq, head, 0);
+    return 0;
 }
 
-static void process_rx(virtio_net_t *net)
+/*
+ * Drain a TX ring as far as the rate limit allows. Chains over the limit
+ * stay in the ring, so a throttled guest sees a full queue and backs off.
+ */
+static void process_tx_queue(virtio_net_t *net, uint16_t queue)
 {
-    net_backend_t *be = net->backend;
-    virtqueue_t *vq = net->rx_vq;
+    virtio_net_queue_t *nq = &net->queues[queue];
+    virtqueue_t *vq = nq->tx_vq;
+    bool limited = net_ratelimit_enabled(&nq->tx_limit);
+    uint32_t popped = 0;
+    uint32_t dropped = 0;
+    uint16_t head;
     
-    while (be->rx_head) {
-        uint16_t head;
+    while (1) {
+        if (limited) {
+            uint64_t wait = net_ratelimit_wait(&nq->tx_limit, rdtsc_us());
+            if (wait) {
+                ktimer_arm(&nq->tx_timer, wait);
+                break;
+            }
+        }
         if (virtq_pop(vq, &head) <= 0) break;
+        popped++;
         
-        net_packet_t *pkt = be->rx_head;
-        be->rx_head = pkt->next;
-        if (!be->rx_head) be->rx_tail = NULL;
-        be->rx_count--;
+        size_t len = process_tx(net, queue, head);
+        if (!len) {
+            dropped++;
+        } else if (limited) {
+            net_ratelimit_charge(&nq->tx_limit, len);
+        }
+    }
+    
+    if (!popped) return;
+    
+    if (net->backend->tx_flush) {
+        net->backend->tx_flush(net->backend);
+    }
+    
+    /* Sent chains are signalled as the backend completes them */
+    virtq_interrupt(vq, dropped);
+}
+
+static void net_tx_timer(void *ctx)
+{
+    virtio_net_queue_t *nq = ctx;
+    process_tx_queue(nq->net, nq->index);
+}
+
+/* Map the device-writable descriptors of an RX chain */
+static uint32_t rx_map_chain(virtqueue_t *vq, uint16_t head, net_sg_t *iov,
+                             size_t *size)
+{
+    virtq_desc_t desc;
+    uint32_t niov = 0;
+    uint16_t idx = head;
+    
+    *size = 0;
+    while (niov < NET_SG_MAX && virtq_get_desc(vq, idx, &desc) == 0) {
+        if (desc.flags & VIRTQ_DESC_F_WRITE) {
+            iov[niov].addr = phys_to_virt(desc.addr);
+            iov[niov].len = desc.len;
+            *size += desc.len;
+            niov++;
+        }
         
-        virtq_desc_t desc;
-        if (virtq_get_desc(vq, head, &desc) == 0 && (desc.flags & VIRTQ_DESC_F_WRITE)) {
-            void *buf = phys_to_virt(desc.addr);
-            virtio_net_hdr_t *hdr = (virtio_net_hdr_t *)buf;
-            memset(hdr, 0, sizeof(*hdr));
-            
-            size_t hdr_len = sizeof(virtio_net_hdr_t);
-            size_t copy_len = pkt->len;
-            if (hdr_len + copy_len > desc.len) copy_len = desc.len - hdr_len;
-            memcpy((uint8_t *)buf + hdr_len, pkt->data, copy_len);
-            
-            virtq_push(vq, head, hdr_len + copy_len);
-            net->rx_packets++;
-            net->rx_bytes += copy_len;
+        if (!(desc.flags & VIRTQ_DESC_F_NEXT)) break;
+        idx = desc.next;
+    }
+    return niov;
+}
+
+/* Copy @len packet bytes starting at @pkt_off into @iov at @iov_off */
+static void rx_copy_to_iov(const net_sg_t *iov, uint32_t niov, size_t iov_off,
+                           const pktbuf_t *pb, size_t pkt_off, size_t len)
+{
+    for (uint32_t i = 0; i < niov && len > 0; i++) {
+        if (iov_off >= iov[i].len) {
+            iov_off -= iov[i].len;
+            continue;
         }
-        kfree(pkt);
+        
+        size_t chunk = MIN(iov[i].len - iov_off, len);
+        pktbuf_copy_out(pb, pkt_off, (uint8_t *)iov[i].addr + iov_off, chunk);
+        pkt_off += chunk;
+        len -= chunk;
+        iov_off = 0;
     }
+}
+
+static void rx_write_hdr(const net_sg_t *iov, uint32_t niov,
+                         const virtio_net_hdr_t *hdr, size_t hdr_len)
+{
+    const uint8_t *src = (const uint8_t *)hdr;
     
-    if (virtq_should_notify(vq)) {
-        net->dev.isr_status |= 1;
+    for (uint32_t i = 0; i < niov && hdr_len > 0; i++) {
+        size_t chunk = MIN(iov[i].len, hdr_len);
+        memcpy(iov[i].addr, src, chunk);
+        src += chunk;
+        hdr_len -= chunk;
     }
 }
 
-static int net_queue_notify(virtio_device_t *dev, uint16_t queue)
+/* Describe a frame's remaining offloads to the guest */
+static void rx_build_hdr(virtio_net_t *net, const pktbuf_offload_t *ol,
+                         virtio_net_hdr_t *hdr)
 {
-    virtio_net_t *net = (virtio_net_t *)dev;
+    memset(hdr, 0, sizeof(*hdr));
+    
+    if (ol->flags & PKTBUF_OL_CSUM_PARTIAL) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = ol->csum_start;
+        hdr->csum_offset = ol->csum_offset;
+    } else if ((ol->flags & PKTBUF_OL_CSUM_VALID) &&
+               net_has_feature(net, VIRTIO_NET_F_GUEST_CSUM)) {
+        hdr->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    }
     
-    if (queue == 0) {
-        process_rx(net);
-    } else if (queue == 1) {
-        virtqueue_t *vq = net->tx_vq;
+    if (ol->gso_type != PKTBUF_GSO_NONE) {
+        hdr->gso_type = ol->gso_type == PKTBUF_GSO_TCPV4 ?
+                        VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+        hdr->gso_size = ol->gso_size;
+        hdr->hdr_len = ol->hdr_len;
+    }
+}
+
+typedef enum {
+    RX_DELIVERED,
+    RX_DROPPED,
+    RX_NO_BUFFERS,
+} rx_result_t;
+
+/*
+ * Place one frame into guest buffers. Without mergeable buffers the
+ * frame must fit one chain; with them it is spread over as many posted
+ * buffers as needed and num_buffers tells the guest how many. Used
+ * entries are published together so the guest never sees a partial
+ * frame, and buffers are given back if the ring runs dry midway.
+ */
+static rx_result_t rx_deliver(virtio_net_t *net, virtio_net_queue_t *nq,
+                              pktbuf_t *pb)
+{
+    virtqueue_t *vq = nq->rx_vq;
+    bool mergeable = net_has_feature(net, VIRTIO_NET_F_MRG_RXBUF);
+    size_t hdr_len = net_hdr_len(net);
+    size_t total = hdr_len + pb->pkt_len;
+    size_t done = 0;
+    uint16_t nbufs = 0;
+    net_sg_t first[NET_SG_MAX];
+    uint32_t nfirst = 0;
+    
+    while (done < total) {
+        net_sg_t iov[NET_SG_MAX];
+        net_sg_t *map = nbufs == 0 ? first : iov;
+        size_t size;
         uint16_t head;
-        while (virtq_pop(vq, &head) > 0) {
-            process_tx(net, vq, head);
+        
+        if (nbufs >= vq->num) {
+            virtq_unpop(vq, nbufs);
+            return RX_DROPPED;
         }
-        if (virtq_should_notify(vq)) {
-            dev->isr_status |= 1;
+        if (virtq_pop(vq, &head) <= 0) {
+            virtq_unpop(vq, nbufs);
+            return RX_NO_BUFFERS;
         }
+        
+        uint32_t niov = rx_map_chain(vq, head, map, &size);
+        size_t off = 0;
+        
+        if (nbufs == 0) {
+            nfirst = niov;
+            if (size < hdr_len || (!mergeable && size < total)) {
+                /* Unusable for this frame; the buffer stays posted */
+                virtq_unpop(vq, 1);
+                return RX_DROPPED;
+            }
+            off = hdr_len;
+            done = hdr_len;
+        }
+        
+        size_t chunk = MIN(size - off, total - done);
+        rx_copy_to_iov(map, niov, off, pb, done - hdr_len, chunk);
+        virtq_fill(vq, head, off + chunk, nbufs);
+        
+        done += chunk;
+        nbufs++;
+    }
+    
+    virtio_net_hdr_t hdr;
+    rx_build_hdr(net, &pb->ol, &hdr);
+    hdr.num_buffers = nbufs;
+    rx_write_hdr(first, nfirst, &hdr, hdr_len);
+    
+    virtq_flush(vq, nbufs);
+    
+    nq->rx_packets++;
+    net->rx_packets++;
+    net->rx_bytes += pb->pkt_len;
+    pb->status = 0;
+    return RX_DELIVERED;
+}
+
+static void process_rx(virtio_net_t *net, uint16_t queue)
+{
+    virtio_net_queue_t *nq = &net->queues[queue];
+    bool limited = net_ratelimit_enabled(&nq->rx_limit);
+    uint32_t delivered = 0;
+    
+    while (nq->backlog.head) {
+        if (limited) {
+            uint64_t wait = net_ratelimit_wait(&nq->rx_limit, rdtsc_us());
+            if (wait) {
+                ktimer_arm(&nq->rx_timer, wait);
+                break;
+            }
+        }
+        
+        rx_result_t res = rx_deliver(net, nq, nq->backlog.head);
+        if (res == RX_NO_BUFFERS) break;
+        
+        if (res == RX_DROPPED) {
+            nq->rx_dropped++;
+        } else {
+            delivered++;
+            if (limited) {
+                net_ratelimit_charge(&nq->rx_limit, nq->backlog.head->pkt_len);
+            }
+        }
+        pktbuf_free(pktq_pop(&nq->backlog));
+    }
+    
+    virtq_interrupt(nq->rx_vq, delivered);
+}
+
+static void net_rx_timer(void *ctx)
+{
+    virtio_net_queue_t *nq = ctx;
+    process_rx(nq->net, nq->index);
+}
+
+/* Offloads the guest accepts on receive */
+static uint32_t net_rx_caps(virtio_net_t *net)
+{
+    uint32_t caps = 0;
+    
+    if (net_has_feature(net, VIRTIO_NET_F_GUEST_CSUM)) caps |= NET_CAP_CSUM;
+    if (net_has_feature(net, VIRTIO_NET_F_GUEST_TSO4)) caps |= NET_CAP_TSO4;
+    if (net_has_feature(net, VIRTIO_NET_F_GUEST_TSO6)) caps |= NET_CAP_TSO6;
+    return caps;
+}
+
+/*
+ * Distribute backend frames over the per-queue backlogs. Super-frames
+ * and partial checksums are resolved here, and only if the guest did
+ * not negotiate the matching receive offload.
+ */
+static void net_rx_notify(net_backend_t *be)
+{
+    virtio_net_t *net = be->frontend;
+    uint32_t caps = net_rx_caps(net);
+    uint32_t pending = 0;
+    pktbuf_t *pb;
+    
+    while ((pb = pktq_pop(&be->rx_queue)) != NULL) {
+        uint16_t queue = rx_select_queue(net, pb);
+        virtio_net_queue_t *nq = &net->queues[queue];
+        pktbuf_queue_t frames;
+        
+        pktq_init(&frames);
+        if (net_offload_resolve(pb, caps, &frames) < 0) {
+            nq->rx_dropped++;
+            continue;
+        }
+        
+        while ((pb = pktq_pop(&frames)) != NULL) {
+            if (nq->backlog.count >= NET_RX_RING_SIZE) {
+                nq->rx_dropped++;
+                pktbuf_free(pb);
+                continue;
+            }
+            pktq_push(&nq->backlog, pb);
+        }
+        pending |= 1U << queue;
+    }
+    
+    for (uint16_t q = 0; q < net->max_queue_pairs; q++) {
+        if (pending & (1U << q)) {
+            process_rx(net, q);
+        }
+    }
+}
+
+/* ============================================================================
+ * Rate Limiting
+ * ============================================================================ */
+
+/* Split the device limits over the active pairs; buckets restart full */
+static void net_apply_rate_limits(virtio_net_t *net)
+{
+    for (uint16_t q = 0; q < net->max_queue_pairs; q++) {
+        virtio_net_queue_t *nq = &net->queues[q];
+        net_ratelimit_init(&nq->tx_limit, &net->tx_rate, net->curr_queue_pairs);
+        net_ratelimit_init(&nq->rx_limit, &net->rx_rate, net->curr_queue_pairs);
+    }
+}
+
+static void net_cancel_timers(virtio_net_t *net)
+{
+    for (uint16_t q = 0; q < net->max_queue_pairs; q++) {
+        ktimer_cancel(&net->queues[q].tx_timer);
+        ktimer_cancel(&net->queues[q].rx_timer);
+    }
+}
+
+/* ============================================================================
+ * Control Queue
+ * ============================================================================ */
+
+#define NET_CTRL_BUF_SIZE   512     /* Largest command: RSS_CONFIG */
+
+/* The control queue follows the last pair only once MQ is negotiated */
+static uint16_t net_ctrl_queue_index(virtio_net_t *net)
+{
+    return net_has_feature(net, VIRTIO_NET_F_MQ) ? 2 * net->max_queue_pairs : 2;
+}
+
+/*
+ * After the active set shrinks, frames parked on queues past it would
+ * never drain: steer them again under the new configuration. Frames the
+ * guest's own RSS table still maps to their queue stay where they are.
+ */
+static void net_resteer_backlogs(virtio_net_t *net)
+{
+    uint32_t pending = 0;
+    
+    for (uint16_t q = net->curr_queue_pairs; q < net->max_queue_pairs; q++) {
+        virtio_net_queue_t *nq = &net->queues[q];
+        pktbuf_queue_t frames = nq->backlog;
+        pktbuf_t *pb;
+        
+        pktq_init(&nq->backlog);
+        while ((pb = pktq_pop(&frames)) != NULL) {
+            uint16_t queue = rx_select_queue(net, pb);
+            virtio_net_queue_t *dst = &net->queues[queue];
+            
+            if (queue != q && dst->backlog.count >= NET_RX_RING_SIZE) {
+                dst->rx_dropped++;
+                pktbuf_free(pb);
+                continue;
+            }
+            pktq_push(&dst->backlog, pb);
+            pending |= 1U << queue;
+        }
+    }
+    
+    for (uint16_t q = 0; q < net->max_queue_pairs; q++) {
+        if (pending & (1U << q)) {
+            process_rx(net, q);
+        }
+    }
+}
+
+static uint8_t ctrl_set_queue_pairs(virtio_net_t *net, uint16_t pairs)
+{
+    if (pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || pairs > net->max_queue_pairs) {
+        return VIRTIO_NET_ERR;
+    }
+    
+    net->curr_queue_pairs = pairs;
+    net_apply_rate_limits(net);
+    
+    if (!net->rss.guest_configured) {
+        rss_set_default(net);
+    }
+    net_resteer_backlogs(net);
+    return VIRTIO_NET_OK;
+}
+
+static uint8_t ctrl_rss_config(virtio_net_t *net, const uint8_t *data, size_t len)
+{
+    virtio_net_rss_config_t cfg;
+    
+    if (!net_has_feature(net, VIRTIO_NET_F_RSS) || len < sizeof(cfg)) {
+        return VIRTIO_NET_ERR;
+    }
+    memcpy(&cfg, data, sizeof(cfg));
+    
+    size_t entries = (size_t)cfg.indirection_table_mask + 1;
+    if (entries > NET_RSS_INDIR_SIZE || (entries & (entries - 1))) {
+        return VIRTIO_NET_ERR;
+    }
+    
+    /* Trailer: max_tx_vq, hash_key_length, hash_key_data[] */
+    const uint8_t *table = data + sizeof(cfg);
+    size_t off = sizeof(cfg) + entries * sizeof(uint16_t);
+    if (off + 3 > len) return VIRTIO_NET_ERR;
+    
+    uint16_t max_tx_vq;
+    memcpy(&max_tx_vq, data + off, sizeof(max_tx_vq));
+    uint8_t key_len = data[off + 2];
+    
+    if (max_tx_vq < 1 || max_tx_vq > net->max_queue_pairs ||
+        cfg.unclassified_queue >= net->max_queue_pairs ||
+        key_len != NET_RSS_KEY_SIZE || off + 3 + key_len > len) {
+        return VIRTIO_NET_ERR;
+    }
+    
+    uint16_t indir[NET_RSS_INDIR_SIZE];
+    for (size_t i = 0; i < entries; i++) {
+        memcpy(&indir[i], table + i * sizeof(uint16_t), sizeof(uint16_t));
+        if (indir[i] >= net->max_queue_pairs) return VIRTIO_NET_ERR;
+    }
+    
+    net->rss.guest_configured = true;
+    net->rss.hash_types = cfg.hash_types & NET_RSS_HASH_ALL;
+    net->rss.indir_mask = cfg.indirection_table_mask;
+    net->rss.unclassified = cfg.unclassified_queue;
+    memcpy(net->rss.indir, indir, entries * sizeof(uint16_t));
+    memcpy(net->rss.key, data + off + 3, NET_RSS_KEY_SIZE);
+    net->curr_queue_pairs = max_tx_vq;
+    net_apply_rate_limits(net);
+    net_resteer_backlogs(net);
+    
+    return VIRTIO_NET_OK;
+}
+
+static uint8_t net_ctrl_command(virtio_net_t *net, const uint8_t *buf, size_t len)
+{
+    virtio_net_ctrl_hdr_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    
+    const uint8_t *data = buf + sizeof(hdr);
+    len -= sizeof(hdr);
+    
+    if (hdr.class != VIRTIO_NET_CTRL_MQ) return VIRTIO_NET_ERR;
+    
+    switch (hdr.cmd) {
+    case VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET: {
+        uint16_t pairs;
+        if (!net_has_feature(net, VIRTIO_NET_F_MQ) || len < sizeof(pairs)) {
+            return VIRTIO_NET_ERR;
+        }
+        memcpy(&pairs, data, sizeof(pairs));
+        return ctrl_set_queue_pairs(net, pairs);
+    }
+    case VIRTIO_NET_CTRL_MQ_RSS_CONFIG:
+        return ctrl_rss_config(net, data, len);
+    default:
+        return VIRTIO_NET_ERR;
+    }
+}
+
+static void process_ctrl(virtio_net_t *net, virtqueue_t *vq)
+{
+    uint32_t done = 0;
+    uint16_t head;
+    
+    while (virtq_pop(vq, &head) > 0) {
+        uint8_t buf[NET_CTRL_BUF_SIZE];
+        size_t len = 0;
+        uint8_t *ack = NULL;
+        bool overflow = false;
+        virtq_desc_t desc;
+        uint16_t idx = head;
+        
+        /* Gather the driver-readable command, then find the ack byte */
+        while (virtq_get_desc(vq, idx, &desc) == 0) {
+            if (desc.flags & VIRTQ_DESC_F_WRITE) {
+                if (!ack && desc.len >= 1) {
+                    ack = phys_to_virt(desc.addr);
+                }
+            } else if (len + desc.len <= sizeof(buf)) {
+                memcpy(buf + len, phys_to_virt(desc.addr), desc.len);
+                len += desc.len;
+            } else {
+                overflow = true;
+            }
+            
+            if (!(desc.flags & VIRTQ_DESC_F_NEXT)) break;
+            idx = desc.next;
+        }
+        
+        uint8_t status = VIRTIO_NET_ERR;
+        if (!overflow && len >= sizeof(virtio_net_ctrl_hdr_t)) {
+            status = net_ctrl_command(net, buf, len);
+        }
+        
+        if (ack) {
+            *ack = status;
+        }
+        virtq_push(vq, head, ack ? 1 : 0);
+        done++;
+    }
+    
+    virtq_interrupt(vq, done);
+}
+
+/* ============================================================================
+ * Device Callbacks
+ * ============================================================================ */
+
+static int net_queue_notify(virtio_device_t *dev, uint16_t queue)
+{
+    virtio_net_t *net = (virtio_net_t *)dev;
+    
+    if (queue == net_ctrl_queue_index(net)) {
+        process_ctrl(net, &dev->queues[queue]);
+        return 0;
+    }
+    
+    uint16_t pair = queue / 2;
+    if (pair >= net->max_queue_pairs) return 0;
+    
+    if (queue & 1) {
+        process_tx_queue(net, pair);
+    } else {
+        process_rx(net, pair);
     }
     return 0;
 }
@@ -195,6 +965,25 @@ static int net_queue_notify(virtio_device_t *dev, uint16_t queue)
 static void net_reset(virtio_device_t *dev)
 {
     virtio_net_t *net = (virtio_net_t *)dev;
+    
+    net_cancel_timers(net);
+    for (uint16_t q = 0; q < net->max_queue_pairs; q++) {
+        virtio_net_queue_t *nq = &net->queues[q];
+        net_queue_purge(nq);
+        nq->rx_packets = nq->tx_packets = nq->rx_dropped = 0;
+        
+        /* Chains still out must not land in the new rings */
+        if (nq->tx_inflight) {
+            net_orphan_tx(nq);
+            nq->tx_slots = net_alloc_tx_slots(net, q);
+        }
+    }
+    
+    net->curr_queue_pairs = 1;
+    net_apply_rate_limits(net);
+    rss_set_default(net);
+    memset(net->flows, 0, sizeof(net->flows));
+    
     net->rx_packets = net->tx_packets = 0;
     net->rx_bytes = net->tx_bytes = 0;
 }
@@ -203,61 +992,128 @@ static void net_reset(virtio_device_t *dev)
  * Public API
  * ============================================================================ */
 
+void virtio_net_set_rate_limit(virtio_net_t *net, const net_rate_config_t *tx,
+                               const net_rate_config_t *rx)
+{
+    memset(&net->tx_rate, 0, sizeof(net->tx_rate));
+    memset(&net->rx_rate, 0, sizeof(net->rx_rate));
+    if (tx) net->tx_rate = *tx;
+    if (rx) net->rx_rate = *rx;
+    
+    net_apply_rate_limits(net);
+    
+    /* Held-back traffic is re-evaluated against the new limits */
+    for (uint16_t q = 0; q < net->curr_queue_pairs; q++) {
+        process_tx_queue(net, q);
+        process_rx(net, q);
+    }
+}
+
 int virtio_net_receive(virtio_net_t *net, const void *data, size_t len)
 {
     if (!net || !net->backend) return -1;
     
-    net_backend_t *be = net->backend;
-    net_packet_t *pkt = kmalloc(sizeof(net_packet_t), GFP_KERNEL);
-    if (!pkt) return -1;
-    
+    /* External frame: copied once into pool buffers */
     size_t copy_len = len > NET_PACKET_MAX_SIZE ? NET_PACKET_MAX_SIZE : len;
-    memcpy(pkt->data, data, copy_len);
-    pkt->len = copy_len;
-    pkt->next = NULL;
+    pktbuf_t *pb = pktbuf_alloc_copy(data, copy_len);
+    if (!pb) return -1;
     
-    if (be->rx_tail) {
-        be->rx_tail->next = pkt;
-        be->rx_tail = pkt;
-    } else {
-        be->rx_head = be->rx_tail = pkt;
+    return net_backend_rx_enqueue(net->backend, pb);
+}
+
+static void net_free_queues(virtio_net_t *net)
+{
+    for (uint16_t q = 0; q < VIRTIO_NET_MAX_QUEUE_PAIRS; q++) {
+        net_queue_purge(&net->queues[q]);
+        net_orphan_tx(&net->queues[q]);
     }
-    be->rx_count++;
-    
-    process_rx(net);
-    return 0;
 }
 
 virtio_net_t *virtio_net_create(net_backend_t *backend)
 {
-    if (!backend) return NULL;
+    return virtio_net_create_mq(backend, 1);
+}
+
+virtio_net_t *virtio_net_create_mq(net_backend_t *backend, uint16_t queue_pairs)
+{
+    if (!backend || queue_pairs == 0 || queue_pairs > VIRTIO_NET_MAX_QUEUE_PAIRS) {
+        return NULL;
+    }
     
     virtio_net_t *net = kmalloc(sizeof(virtio_net_t), GFP_KERNEL | GFP_ZERO);
     if (!net) return NULL;
     
+    if (pktbuf_init() != 0) {
+        kfree(net);
+        return NULL;
+    }
+    
+    for (uint16_t q = 0; q < queue_pairs; q++) {
+        net->queues[q].tx_slots = net_alloc_tx_slots(net, q);
+        if (!net->queues[q].tx_slots) {
+            net_free_queues(net);
+            kfree(net);
+            return NULL;
+        }
+        pktq_init(&net->queues[q].backlog);
+        net->queues[q].net = net;
+        net->queues[q].index = q;
+        ktimer_init(&net->queues[q].tx_timer, net_tx_timer, &net->queues[q]);
+        ktimer_init(&net->queues[q].rx_timer, net_rx_timer, &net->queues[q]);
+    }
+    
     virtio_pci_init(&net->dev, VIRTIO_SUBSYS_NET);
     net->backend = backend;
+    net->max_queue_pairs = queue_pairs;
+    net->curr_queue_pairs = 1;
+    net_apply_rate_limits(net);
+    rss_set_default(net);
     
     net->dev.host_features |= BIT(VIRTIO_NET_F_MAC) |
                                BIT(VIRTIO_NET_F_STATUS) |
-                               BIT(VIRTIO_NET_F_MRG_RXBUF);
+                               BIT(VIRTIO_NET_F_MRG_RXBUF) |
+                               BIT(VIRTIO_NET_F_CTRL_VQ) |
+                               BIT(VIRTIO_NET_F_CSUM) |
+                               BIT(VIRTIO_NET_F_GUEST_CSUM) |
+                               BIT(VIRTIO_NET_F_HOST_TSO4) |
+                               BIT(VIRTIO_NET_F_HOST_TSO6) |
+                               BIT(VIRTIO_NET_F_GUEST_TSO4) |
+                               BIT(VIRTIO_NET_F_GUEST_TSO6);
+    if (queue_pairs > 1) {
+        net->dev.host_features |= BIT(VIRTIO_NET_F_MQ) | BIT(VIRTIO_NET_F_RSS);
+    }
     
     memcpy(net->config.mac, backend->mac, 6);
     net->config.status = VIRTIO_NET_S_LINK_UP;
-    net->config.max_virtqueue_pairs = 1;
+    net->config.max_virtqueue_pairs = queue_pairs;
     net->config.mtu = 1500;
+    net->config.rss_max_key_size = NET_RSS_KEY_SIZE;
+    net->config.rss_max_indirection_table_length = NET_RSS_INDIR_SIZE;
+    net->config.supported_hash_types = NET_RSS_HASH_ALL;
     
     virtio_set_config(&net->dev, &net->config, sizeof(net->config));
     
-    net->rx_vq = virtio_add_queue(&net->dev, VIRTQ_MAX_SIZE);
-    net->tx_vq = virtio_add_queue(&net->dev, VIRTQ_MAX_SIZE);
+    for (uint16_t q = 0; q < queue_pairs; q++) {
+        net->queues[q].rx_vq = virtio_add_queue(&net->dev, VIRTQ_MAX_SIZE);
+        net->queues[q].tx_vq = virtio_add_queue(&net->dev, VIRTQ_MAX_SIZE);
+    }
+    virtio_add_queue(&net->dev, VIRTQ_MAX_SIZE);    /* Control queue */
+    
+    /* Data queues batch interrupts once traffic picks up */
+    for (uint16_t q = 0; q < 2 * queue_pairs; q++) {
+        virtio_set_coalesce(&net->dev, q, 0, 0, true);
+    }
     
     net->dev.queue_notify = net_queue_notify;
     net->dev.reset = net_reset;
     
-    pr_info("Virtio-net: MAC=%02x:%02x:%02x:%02x:%02x:%02x",
+    backend->frontend = net;
+    backend->rx_notify = net_rx_notify;
+    
+    pr_info("Virtio-net: MAC=%02x:%02x:%02x:%02x:%02x:%02x, %u queue pairs",
             net->config.mac[0], net->config.mac[1], net->config.mac[2],
-            net->config.mac[3], net->config.mac[4], net->config.mac[5]);
+            net->config.mac[3], net->config.mac[4], net->config.mac[5],
+            queue_pairs);
     
     return net;
 }
@@ -265,6 +1121,18 @@ virtio_net_t *virtio_net_create(net_backend_t *backend)
 void virtio_net_destroy(virtio_net_t *net)
 {
     if (!net) return;
-    pci_unregister_device(&net->dev.pci);
+    
+    net_cancel_timers(net);
+    
+    /* Frames still queued may reference our TX chains */
+    if (net->backend) {
+        net->backend->rx_notify = NULL;
+        net->backend->frontend = NULL;
+        net_backend_purge(net->backend);
+    }
+    net_free_queues(net);
+    virtio_flush_interrupts(&net->dev);
+    
+    virtio_pci_destroy(&net->dev);
     kfree(net);
 }
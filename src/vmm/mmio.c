@@ -0,0 +1,214 @@
+/*
+ * PureVisor - Fast MMIO Doorbell Implementation
+ * 
+ * Doorbell pages are mapped read-only onto a shared zero page. Guest reads
+ * complete without an exit; stores exit with an EPT violation whose
+ * qualification marks them as writes. The faulting GPA alone names the
+ * doorbell: the handler runs without fetching or decoding the guest
+ * instruction.
+ */
+
+#include <lib/types.h>
+#include <lib/string.h>
+#include <vmm/mmio.h>
+#include <mm/pmm.h>
+#include <kernel/smp.h>
+#include <kernel/console.h>
+
+/* ============================================================================
+ * Global State
+ * ============================================================================ */
+
+static mmio_doorbell_t doorbells[MMIO_DOORBELL_MAX];
+static uint32_t doorbell_count;
+static uint32_t doorbell_last;          /* Most recent hit; doorbells are bursty */
+static ept_context_t *spaces[MMIO_SPACE_MAX];
+static phys_addr_t zero_page;           /* Backs reads of every doorbell */
+static spinlock_t doorbell_lock = SPINLOCK_INIT;
+
+/* Caller holds doorbell_lock */
+static bool space_attached(ept_context_t *ept)
+{
+    for (uint32_t i = 0; i < MMIO_SPACE_MAX; i++) {
+        if (ept && spaces[i] == ept) return true;
+    }
+    return false;
+}
+
+/* Caller holds doorbell_lock */
+static void doorbell_map(const mmio_doorbell_t *db)
+{
+    for (uint64_t off = 0; off < db->size; off += PAGE_SIZE) {
+        ept_map_page(db->space, db->base + off, zero_page, EPT_PERM_READ,
+                     EPT_MEMTYPE_WB);
+    }
+}
+
+/* Caller holds doorbell_lock */
+static void doorbell_unmap(const mmio_doorbell_t *db)
+{
+    for (uint64_t off = 0; off < db->size; off += PAGE_SIZE) {
+        ept_unmap_page(db->space, db->base + off);
+    }
+    ept_invalidate(db->space);
+}
+
+/* Caller holds doorbell_lock */
+static void doorbell_remove(uint32_t i)
+{
+    doorbells[i] = doorbells[--doorbell_count];
+    doorbell_last = 0;
+}
+
+/* ============================================================================
+ * API Functions
+ * ============================================================================ */
+
+int mmio_doorbell_register(ept_context_t *space, phys_addr_t base, uint64_t size,
+                           mmio_doorbell_fn_t fn, void *ctx)
+{
+    if (!space || !fn || !size || (base | size) & (PAGE_SIZE - 1)) {
+        return -1;
+    }
+    
+    spinlock_acquire(&doorbell_lock);
+    
+    if (!space_attached(space)) {
+        spinlock_release(&doorbell_lock);
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < doorbell_count; i++) {
+        mmio_doorbell_t *db = &doorbells[i];
+        if (db->space == space &&
+            base < db->base + db->size && db->base < base + size) {
+            spinlock_release(&doorbell_lock);
+            pr_warn("MMIO: Doorbell 0x%llx overlaps 0x%llx", base, db->base);
+            return -1;
+        }
+    }
+    
+    if (doorbell_count >= MMIO_DOORBELL_MAX) {
+        spinlock_release(&doorbell_lock);
+        return -1;
+    }
+    
+    mmio_doorbell_t *db = &doorbells[doorbell_count++];
+    db->space = space;
+    db->base = base;
+    db->size = size;
+    db->fn = fn;
+    db->ctx = ctx;
+    db->hits = 0;
+    doorbell_map(db);
+    
+    spinlock_release(&doorbell_lock);
+    return 0;
+}
+
+void mmio_doorbell_unregister(ept_context_t *space, phys_addr_t base)
+{
+    spinlock_acquire(&doorbell_lock);
+    
+    for (uint32_t i = 0; i < doorbell_count; i++) {
+        if (doorbells[i].space != space || doorbells[i].base != base) continue;
+        
+        doorbell_unmap(&doorbells[i]);
+        doorbell_remove(i);
+        break;
+    }
+    
+    spinlock_release(&doorbell_lock);
+}
+
+int mmio_doorbell_attach(ept_context_t *ept)
+{
+    int ret = -1;
+    
+    if (!ept) return -1;
+    
+    /* Allocated with the first guest; never freed */
+    if (!zero_page) {
+        phys_addr_t page = pmm_alloc_pages(0);
+        if (!page) return -1;
+        memset(phys_to_virt(page), 0, PAGE_SIZE);
+        if (!__sync_bool_compare_and_swap(&zero_page, 0, page)) {
+            pmm_free_pages(page, 0);
+        }
+    }
+    
+    spinlock_acquire(&doorbell_lock);
+    
+    if (space_attached(ept)) {
+        ret = 0;
+    } else {
+        for (uint32_t i = 0; i < MMIO_SPACE_MAX; i++) {
+            if (!spaces[i]) {
+                spaces[i] = ept;
+                ret = 0;
+                break;
+            }
+        }
+    }
+    
+    spinlock_release(&doorbell_lock);
+    return ret;
+}
+
+void mmio_doorbell_detach(ept_context_t *ept)
+{
+    spinlock_acquire(&doorbell_lock);
+    
+    for (uint32_t i = 0; i < MMIO_SPACE_MAX; i++) {
+        if (spaces[i] == ept) {
+            spaces[i] = NULL;
+        }
+    }
+    
+    /* The tables go with the space; only the registry needs clearing */
+    for (uint32_t i = 0; i < doorbell_count; ) {
+        if (doorbells[i].space == ept) {
+            doorbell_remove(i);
+        } else {
+            i++;
+        }
+    }
+    
+    spinlock_release(&doorbell_lock);
+}
+
+bool mmio_doorbell_dispatch(uint64_t eptp, phys_addr_t gpa)
+{
+    mmio_doorbell_fn_t fn = NULL;
+    void *ctx = NULL;
+    uint64_t offset = 0;
+    
+    spinlock_acquire(&doorbell_lock);
+    
+    /* Another guest's doorbell at the same address is not this one's */
+    uint32_t i = doorbell_last;
+    if (i >= doorbell_count || doorbells[i].space->eptp != eptp ||
+        gpa - doorbells[i].base >= doorbells[i].size) {
+        for (i = 0; i < doorbell_count; i++) {
+            if (doorbells[i].space->eptp == eptp &&
+                gpa - doorbells[i].base < doorbells[i].size) break;
+        }
+    }
+    
+    if (i < doorbell_count) {
+        mmio_doorbell_t *db = &doorbells[i];
+        db->hits++;
+        fn = db->fn;
+        ctx = db->ctx;
+        offset = gpa - db->base;
+        doorbell_last = i;
+    }
+    
+    spinlock_release(&doorbell_lock);
+    
+    /* Device code may re-enter the registry, e.g. on reset */
+    if (fn) {
+        fn(ctx, offset);
+    }
+    return fn != NULL;
+}
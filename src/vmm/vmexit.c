@@ -9,7 +9,9 @@
 #include <vmm/vmx.h>
 #include <vmm/vcpu.h>
 #include <vmm/ept.h>
+#include <vmm/mmio.h>
 #include <kernel/console.h>
+#include <kernel/timer.h>
 #include <arch/x86_64/cpu.h>
 
 /* ============================================================================
@@ -381,6 +383,22 @@ static int handle_ept_violation(vcpu_t *vcpu)
     bool write = (qual >> 1) & 1;
     bool execute = (qual >> 2) & 1;
     
+    /*
+     * Doorbell pages are mapped read-only, so only stores to them exit.
+     * The instruction length field is not architecturally defined for
+     * this exit, but processors fill it in; without it there is no way
+     * to skip the store short of decoding it, which is what the doorbell
+     * path exists to avoid.
+     */
+    if (write && !execute) {
+        uint64_t instr_len = 0;
+        vmcs_read(VMCS_EXIT_INSTR_LENGTH, &instr_len);
+        if (instr_len != 0 && mmio_doorbell_dispatch(vcpu->eptp, guest_phys)) {
+            advance_guest_rip(vcpu);
+            return 0;
+        }
+    }
+    
     pr_error("EPT Violation: GPA=0x%llx R=%d W=%d X=%d",
              guest_phys, read, write, execute);
     
@@ -393,6 +411,17 @@ static int handle_ept_violation(vcpu_t *vcpu)
     return -1;  /* Fatal for now */
 }
 
+/* ============================================================================
+ * EPT Misconfiguration Handler
+ * ============================================================================ */
+
+static int handle_ept_misconfig(vcpu_t *vcpu)
+{
+    /* No entry is built misconfigured on purpose */
+    pr_error("EPT Misconfiguration: GPA=0x%llx", vcpu->guest_phys_addr);
+    return -1;
+}
+
 /* ============================================================================
  * VMCALL (Hypercall) Handler
  * ============================================================================ */
@@ -437,6 +466,9 @@ int vmexit_handler(vcpu_t *vcpu)
     uint32_t reason = vcpu->exit_reason & 0xFFFF;
     int ret = 0;
     
+    /* Deferred device work (rate limiting, coalescing) */
+    ktimer_run();
+    
     switch (reason) {
         case EXIT_REASON_CPUID:
             ret = handle_cpuid(vcpu);
@@ -466,6 +498,10 @@ int vmexit_handler(vcpu_t *vcpu)
             ret = handle_ept_violation(vcpu);
             break;
             
+        case EXIT_REASON_EPT_MISCONFIG:
+            ret = handle_ept_misconfig(vcpu);
+            break;
+        
         case EXIT_REASON_VMCALL:
             ret = handle_vmcall(vcpu);
             break;